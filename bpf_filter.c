@@ -70,7 +70,8 @@
  * buflen is the amount of data present
  * aux_data is auxiliary data, currently used only when interpreting
  * filters intended for the Linux kernel in cases where the kernel
- * rejects the filter; it contains VLAN tag information
+ * rejects the filter; it contains VLAN tag information and a random
+ * number
  * For the kernel, p is assumed to be a pointer to an mbuf if buflen is 0,
  * in all other cases, p is a pointer to a buffer and buflen is its size.
  *
@@ -111,11 +112,31 @@ pcapint_filter_with_aux_data(const struct bpf_insn *pc, const u_char *p,
 			return (u_int)A;
 
 		case BPF_LD|BPF_W|BPF_ABS:
-			k = pc->k;
-			if (k > buflen || sizeof(int32_t) > buflen - k) {
-				return 0;
+			/*
+			 * As with BPF_LD|BPF_B|BPF_ABS, this switch
+			 * doesn't do anything unless we're building
+			 * for a Linux kernel with the random number
+			 * extension.
+			 */
+DIAG_OFF_DEFAULT_ONLY_SWITCH
+			switch (pc->k) {
+
+#if defined(SKF_AD_RANDOM)
+			case SKF_AD_OFF + SKF_AD_RANDOM:
+				if (!aux_data)
+					return 0;
+				A = aux_data->random;
+				break;
+#endif
+			default:
+				k = pc->k;
+				if (k > buflen || sizeof(int32_t) > buflen - k) {
+					return 0;
+				}
+				A = EXTRACT_LONG(&p[k]);
+				break;
 			}
-			A = EXTRACT_LONG(&p[k]);
+DIAG_ON_DEFAULT_ONLY_SWITCH
 			continue;
 
 		case BPF_LD|BPF_H|BPF_ABS:
@@ -160,10 +160,30 @@ struct addrinfo {
 #ifndef IPPROTO_SCTP
 #define IPPROTO_SCTP     132
 #endif
+#ifndef IPPROTO_IPIP
+#define IPPROTO_IPIP     4
+#endif
+#ifndef IPPROTO_IPV6
+#define IPPROTO_IPV6     41
+#endif
+#ifndef IPPROTO_GRE
+#define IPPROTO_GRE      47
+#endif
 
 #define GENEVE_PORT 6081
 #define VXLAN_PORT  4789
 
+/*
+ * Bits in the first octet of a GRE header (RFC 2784, RFC 2890), and
+ * the mask for the routing-present bit and version number in its first
+ * 16 bits (RFC 1701 routing and version 1, as used by PPTP, aren't
+ * handled).
+ */
+#define GRE_CSUM_PRESENT	0x80
+#define GRE_KEY_PRESENT		0x20
+#define GRE_SEQ_PRESENT		0x10
+#define GRE_ROUTING_VERSION	0x4007
+
 
 /*
  * from: NetBSD: if_arc.h,v 1.13 1999/11/19 20:41:19 thorpej Exp
@@ -322,6 +342,12 @@ struct addrinfo {
 // IPv6 mandatory outer header (Version, ..., Destination Address) length.
 #define IP6_HDRLEN 40
 
+/*
+ * The maximum number of IPv6 extension headers gen_ip6_walk() skips before
+ * giving up; every extension header costs about a dozen instructions.
+ */
+#define IP6_EXTHDR_WALK_MAX 4
+
 // RFC 3032 Section 2.1, the "Label Stack Entry" 32-bit structure.
 #define MPLS_STACKENTRY_LEN 4
 // Ibid., the "Label" 20-bit field.
@@ -365,6 +391,12 @@ struct addrinfo {
  */
 #define OFFSET_NOT_SET	0xffffffffU
 
+/*
+ * Value of llprefixlen in the compiler state if the length of the
+ * link-layer prefix is to be loaded from each packet.
+ */
+#define LLPREFIXLEN_VARIABLE	0xffffffffU
+
 /*
  * Absolute offsets, which are offsets from the beginning of the raw
  * packet data, are, in the general case, the sum of a variable value
@@ -388,6 +420,24 @@ typedef struct {
 	int	reg;
 } bpf_abs_offset;
 
+/*
+ * The link-layer header type and the header offsets that the code for a
+ * primitive depends on, and that "vlan", "mpls", "pppoes", "geneve" and
+ * the like change for the primitives that follow them.
+ */
+typedef struct {
+	int	linktype;
+	bpf_abs_offset off_linkhdr;
+	bpf_abs_offset off_linkpl;
+	bpf_abs_offset off_linktype;
+	u_int	off_nl;
+	u_int	off_nl_nosnap;
+	int	is_encap;
+	int	is_vlan_vloffset;
+	u_int	label_stack_depth;
+	u_int	vlan_stack_depth;
+} hdr_ctx;
+
 /*
  * Value passed to gen_load_a() to indicate what the offset argument
  * is relative to the beginning of.
@@ -460,6 +510,23 @@ struct _compiler_state {
 	bpf_u_int32 netmask;
 	int no_optimize;
 
+	/*
+	 * If not LLPREFIXLEN_VARIABLE, the length of the variable-length
+	 * prefix preceding the link-layer header (radiotap, PPI, AVS) or
+	 * of the pflog header, which the generated code may assume rather
+	 * than loading it from the packet; see
+	 * pcapint_compile_llprefix_guarded().
+	 */
+	bpf_u_int32 llprefixlen;
+
+	/*
+	 * If "slice headers" was specified, accepted packets are cut off
+	 * after their transport-layer header plus slice_extra bytes,
+	 * rather than at the snapshot length.
+	 */
+	int slice_headers;
+	bpf_u_int32 slice_extra;
+
 	/* Hack for handling VLAN and MPLS stacks. */
 	u_int label_stack_depth;
 	u_int vlan_stack_depth;
@@ -612,6 +679,23 @@ struct _compiler_state {
 	int regused[BPF_MEMWORDS];
 	int curreg;
 
+	/*
+	 * Registers into which gen_ip6_walk() puts the Next Header value
+	 * that ends the IPv6 extension header chain and the offset of the
+	 * header it describes; -1 until allocated.
+	 */
+	int ip6_nxt_reg;
+	int ip6_l4_reg;
+
+	/*
+	 * The header offsets as init_linktype() set them up, and the walk
+	 * over the IPv6 extension headers, if any, that is done with those
+	 * offsets once at the start of the program; see
+	 * gen_ip6_walk_at_start().
+	 */
+	hdr_ctx init_ctx;
+	struct block *ip6_walk_start;
+
 	/*
 	 * Memory chunks.
 	 */
@@ -765,6 +849,12 @@ static struct block *gen_gateway(compiler_state_t *, const char *, const u_char)
 static struct block *gen_ip_proto(compiler_state_t *, const uint8_t);
 static struct block *gen_ip6_proto(compiler_state_t *, const uint8_t);
 static struct block *gen_ipfrag(compiler_state_t *);
+static struct block *gen_ip6_walk(compiler_state_t *);
+static struct block *gen_ip6_walk_proto(compiler_state_t *, const uint8_t);
+static struct slist *gen_loadx_ip6l4off(compiler_state_t *);
+static void alloc_ip6_walk_regs(compiler_state_t *);
+static int gen_ip6_walk_at_start(compiler_state_t *);
+static void get_hdr_ctx(compiler_state_t *, hdr_ctx *);
 static struct block *gen_portatom(compiler_state_t *, int, uint16_t);
 static struct block *gen_portrangeatom(compiler_state_t *, u_int, uint16_t,
     uint16_t);
@@ -1298,9 +1388,10 @@ pq_to_nlpid(compiler_state_t *cstate, const uint8_t pqual)
 	bpf_error(cstate, "Proto qualifier '%s' has no NLPID", pqkw(pqual));
 }
 
-int
-pcap_compile(pcap_t *p, struct bpf_program *program,
-	     const char *buf, int optimize, bpf_u_int32 mask)
+static int
+compile_filter(pcap_t *p, struct bpf_program *program,
+	     const char *buf, int optimize, bpf_u_int32 mask,
+	     bpf_u_int32 llprefixlen)
 {
 #ifdef _WIN32
 	int err;
@@ -1364,6 +1455,9 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 	cstate.bpf_pcap = p;
 	cstate.error_set = 0;
 	init_regs(&cstate);
+	cstate.ip6_nxt_reg = -1;
+	cstate.ip6_l4_reg = -1;
+	cstate.ip6_walk_start = NULL;
 
 	// cstate.error_set must have been initialized first.
 	if (! initchunks_ok(&cstate)) {
@@ -1373,6 +1467,9 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 	}
 
 	cstate.netmask = mask;
+	cstate.llprefixlen = llprefixlen;
+	cstate.slice_headers = 0;
+	cstate.slice_extra = 0;
 
 	cstate.snaplen = pcap_snapshot(p);
 	if (cstate.snaplen == 0) {
@@ -1400,6 +1497,7 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 		rc = PCAP_ERROR;
 		goto quit;
 	}
+	get_hdr_ctx(&cstate, &cstate.init_ctx);
 	if (pcap_parse(scanner, &cstate) != 0) {
 		if (cstate.ai != NULL)
 			freeaddrinfo(cstate.ai);
@@ -1465,6 +1563,147 @@ quit:
 	return (rc);
 }
 
+int
+pcap_compile(pcap_t *p, struct bpf_program *program,
+	     const char *buf, int optimize, bpf_u_int32 mask)
+{
+	return (compile_filter(p, program, buf, optimize, mask,
+	    LLPREFIXLEN_VARIABLE));
+}
+
+/*
+ * Largest guarded program we'll generate; this is BPF_MAXINSNS on
+ * the BSDs and macOS, and well under the Linux limit, so that the
+ * guarded program can go into the kernel wherever the generic one
+ * could.
+ */
+#define LLPREFIX_GUARDED_MAXINSNS	512
+
+/*
+ * Compile "buf" twice: once as pcap_compile() would, and once on the
+ * assumption that the variable-length prefix preceding the link-layer
+ * header (radiotap, PPI or AVS) or the pflog header is "llprefixlen"
+ * bytes long, so that the second program uses constant offsets rather
+ * than loading the prefix length from the packet and doing indexed
+ * loads.
+ *
+ * The two are combined into a single program that checks the prefix
+ * length field of the packet and runs the specialized program if it
+ * matches and the generic program otherwise, so the result is correct
+ * for every packet.
+ */
+int
+pcapint_compile_llprefix_guarded(pcap_t *p, struct bpf_program *program,
+    const char *buf, int optimize, bpf_u_int32 mask,
+    bpf_u_int32 llprefixlen)
+{
+	struct bpf_insn guard[6];
+	u_int nguard;
+	struct bpf_program generic, specialized;
+	struct bpf_insn *insns;
+	u_int len;
+
+	nguard = 0;
+	switch (pcap_datalink(p)) {
+
+	case DLT_IEEE802_11_RADIO:
+	case DLT_PPI:
+		/*
+		 * The length is a little-endian 16-bit value at an
+		 * offset of 2; a halfword load gets it byte-swapped,
+		 * so compare it with the byte-swapped value.
+		 */
+		if (llprefixlen > 0xffff)
+			goto not_possible;
+		guard[nguard++] = (struct bpf_insn)BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 2);
+		guard[nguard++] = (struct bpf_insn)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+		    ((llprefixlen & 0xff) << 8) | (llprefixlen >> 8), 1, 0);
+		break;
+
+	case DLT_IEEE802_11_RADIO_AVS:
+		/*
+		 * The length is a big-endian 32-bit value at an
+		 * offset of 4.
+		 */
+		guard[nguard++] = (struct bpf_insn)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 4);
+		guard[nguard++] = (struct bpf_insn)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+		    llprefixlen, 1, 0);
+		break;
+
+	case DLT_PFLOG:
+		/*
+		 * The length is the first byte of the header, rounded
+		 * up to a multiple of 4, as gen_load_pflog_llprefixlen()
+		 * computes it.
+		 */
+		if ((llprefixlen & 3) != 0)
+			goto not_possible;
+		guard[nguard++] = (struct bpf_insn)BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 0);
+		guard[nguard++] = (struct bpf_insn)BPF_STMT(BPF_ALU|BPF_ADD|BPF_K, 3);
+		guard[nguard++] = (struct bpf_insn)BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xfffffffc);
+		guard[nguard++] = (struct bpf_insn)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+		    llprefixlen, 1, 0);
+		break;
+
+	default:
+		goto not_possible;
+	}
+
+	if (compile_filter(p, &generic, buf, optimize, mask,
+	    LLPREFIXLEN_VARIABLE) == -1)
+		return (PCAP_ERROR);
+	if (compile_filter(p, &specialized, buf, optimize, mask,
+	    llprefixlen) == -1) {
+		pcap_freecode(&generic);
+		return (PCAP_ERROR);
+	}
+
+	/*
+	 * If the prefix doesn't match, jump over the specialized
+	 * program to the generic one.
+	 */
+	guard[nguard++] = (struct bpf_insn)BPF_JUMP(BPF_JMP|BPF_JA,
+	    specialized.bf_len, 0, 0);
+
+	len = nguard + specialized.bf_len + generic.bf_len;
+	if (len > LLPREFIX_GUARDED_MAXINSNS) {
+		pcap_freecode(&generic);
+		pcap_freecode(&specialized);
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "guarded filter would be %u instructions long", len);
+		return (PCAP_ERROR);
+	}
+	insns = (struct bpf_insn *)malloc(len * sizeof(*insns));
+	if (insns == NULL) {
+		pcap_freecode(&generic);
+		pcap_freecode(&specialized);
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (PCAP_ERROR);
+	}
+	/*
+	 * Both programs only use relative jumps, so they can just be
+	 * concatenated.
+	 */
+	memcpy(insns, guard, nguard * sizeof(*insns));
+	memcpy(insns + nguard, specialized.bf_insns,
+	    specialized.bf_len * sizeof(*insns));
+	memcpy(insns + nguard + specialized.bf_len, generic.bf_insns,
+	    generic.bf_len * sizeof(*insns));
+	pcap_freecode(&generic);
+	pcap_freecode(&specialized);
+
+	program->bf_insns = insns;
+	program->bf_len = len;
+	return (0);
+
+not_possible:
+	snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+	    "link-layer prefix length %u can't be assumed for %s",
+	    llprefixlen, pcap_datalink_val_to_name(pcap_datalink(p)));
+	return (PCAP_ERROR);
+}
+
 /*
  * entry point for using the compiler with no pcap open
  * pass in all the stuff that is needed explicitly instead.
@@ -1539,6 +1778,208 @@ merge(struct block *b0, struct block *b1)
 	*p = b1;
 }
 
+/*
+ * Handle "slice headers[+N]".
+ */
+#define SLICE_EXTRA_MAX	65535
+
+int
+set_slice_headers(compiler_state_t *cstate, bpf_u_int32 extra)
+{
+	/*
+	 * Catch errors reported by us and routines below us, and return -1
+	 * on an error.
+	 */
+	if (setjmp(cstate->top_ctx))
+		return (-1);
+
+	if (cstate->off_linkpl.constant_part == OFFSET_NOT_SET ||
+	    cstate->off_nl == OFFSET_NOT_SET)
+		fail_kw_on_dlt(cstate, "slice headers");
+	assert_maxval(cstate, "slice headers", extra, SLICE_EXTRA_MAX);
+	cstate->slice_headers = 1;
+	cstate->slice_extra = extra;
+	return (0);
+}
+
+/*
+ * Make a block that branches to "t" if "b" is true and to "f" otherwise,
+ * and return its head.
+ */
+static struct block *
+gen_slice_branch(struct block *b, struct block *t, struct block *f)
+{
+	backpatch(b, t);
+	b->sense = !b->sense;
+	backpatch(b, f);
+	b->sense = !b->sense;
+	return b->head;
+}
+
+/*
+ * Make a block that runs the statements in "s", which leave the length
+ * of the headers in the A register, and then returns that length or the
+ * snapshot length, whichever is smaller.
+ */
+static struct block *
+gen_slice_leaf(compiler_state_t *cstate, struct slist *s,
+    struct block *ret_snaplen, struct block *ret_a)
+{
+	struct block *b;
+
+	b = new_block(cstate, JMP(BPF_JGT, BPF_K));
+	b->stmts = s;
+	b->s.k = cstate->snaplen;
+	JT(b) = ret_snaplen;
+	JF(b) = ret_a;
+	return b;
+}
+
+/*
+ * Add "k" to the A register.
+ */
+static void
+gen_slice_add(compiler_state_t *cstate, struct slist *s, bpf_u_int32 k)
+{
+	struct slist *s2;
+
+	s2 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+	s2->s.k = k;
+	sappend(s, s2);
+}
+
+/*
+ * Generate code to load into the A register the offset of the end of the
+ * IPv4 header plus "k".
+ */
+static struct slist *
+gen_slice_len_ipv4(compiler_state_t *cstate, bpf_u_int32 k)
+{
+	struct slist *s;
+
+	s = gen_loadx_iphdrlen(cstate);
+	sappend(s, new_stmt(cstate, BPF_MISC|BPF_TXA));
+	gen_slice_add(cstate, s, cstate->off_linkpl.constant_part +
+	    cstate->off_nl + k);
+	return s;
+}
+
+/*
+ * Generate code to load into the A register the offset of the end of the
+ * TCP header that follows an IPv4 or IPv6 header, plus "k".
+ */
+static struct slist *
+gen_slice_len_tcp(compiler_state_t *cstate, enum e_offrel offrel,
+    bpf_u_int32 k)
+{
+	struct slist *s, *s2;
+
+	/*
+	 * Load the data offset field; this leaves the offset of the
+	 * transport-layer header, less its constant part, in the X
+	 * register.
+	 */
+	s = gen_load_a(cstate, offrel, 12, BPF_B);
+	s2 = new_stmt(cstate, BPF_ALU|BPF_AND|BPF_K);
+	s2->s.k = 0xf0;
+	sappend(s, s2);
+	s2 = new_stmt(cstate, BPF_ALU|BPF_RSH|BPF_K);
+	s2->s.k = 2;
+	sappend(s, s2);
+	sappend(s, new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_X));
+	gen_slice_add(cstate, s, cstate->off_linkpl.constant_part +
+	    cstate->off_nl + k);
+	return s;
+}
+
+/*
+ * Generate code to load into the A register the offset of the header
+ * found by gen_ip6_walk() plus "k".
+ */
+static struct slist *
+gen_slice_len_ipv6(compiler_state_t *cstate, bpf_u_int32 k)
+{
+	struct slist *s;
+
+	alloc_ip6_walk_regs(cstate);
+	s = new_stmt(cstate, BPF_LD|BPF_MEM);
+	s->s.k = cstate->ip6_l4_reg;
+	gen_slice_add(cstate, s, cstate->off_linkpl.constant_part +
+	    cstate->off_nl + k);
+	return s;
+}
+
+/*
+ * Generate the code that computes the accept length for "slice headers".
+ *
+ * For IPv4 and IPv6 packets, that's the offset of the end of the TCP,
+ * UDP, ICMP, ICMPv6 or SCTP header, or, for other protocols and IPv4
+ * fragments other than the first, the offset of the end of the IP header
+ * (including the IPv6 extension headers gen_ip6_walk() got past), plus
+ * the number of extra bytes asked for.  Other packets are cut off at the
+ * snapshot length.
+ */
+static struct block *
+gen_slice_headers(compiler_state_t *cstate)
+{
+	const bpf_u_int32 extra = cstate->slice_extra;
+	struct block *ret_snaplen, *ret_a;
+	struct block *b_ip, *b_ip6, *next;
+	struct block *b;
+
+	ret_snaplen = gen_retblk_internal(cstate, cstate->snaplen);
+	ret_a = new_block(cstate, BPF_RET|BPF_A);
+
+	/*
+	 * IPv6; build the checks from the last one back.  If the walk
+	 * over the extension headers gives up, or the protocol isn't
+	 * one of those, cut off at the header where the walk stopped.
+	 */
+	next = gen_slice_leaf(cstate, gen_slice_len_ipv6(cstate, extra),
+	    ret_snaplen, ret_a);
+	b = gen_ip6_walk_proto(cstate, IPPROTO_SCTP);
+	next = gen_slice_branch(b, gen_slice_leaf(cstate,
+	    gen_slice_len_ipv6(cstate, 12 + extra), ret_snaplen, ret_a), next);
+	b = gen_or(gen_ip6_walk_proto(cstate, IPPROTO_UDP),
+	    gen_ip6_walk_proto(cstate, IPPROTO_ICMPV6));
+	next = gen_slice_branch(b, gen_slice_leaf(cstate,
+	    gen_slice_len_ipv6(cstate, 8 + extra), ret_snaplen, ret_a), next);
+	b = gen_ip6_walk_proto(cstate, IPPROTO_TCP);
+	next = gen_slice_branch(b, gen_slice_leaf(cstate,
+	    gen_slice_len_tcp(cstate, OR_TRAN_IPV6, extra),
+	    ret_snaplen, ret_a), next);
+	if (!gen_ip6_walk_at_start(cstate))
+		next = gen_slice_branch(gen_ip6_walk(cstate), next,
+		    gen_slice_leaf(cstate, gen_slice_len_ipv6(cstate, extra),
+		    ret_snaplen, ret_a));
+	b_ip6 = gen_slice_branch(gen_linktype(cstate, ETHERTYPE_IPV6), next,
+	    ret_snaplen);
+
+	/*
+	 * IPv4.
+	 */
+	next = gen_slice_leaf(cstate, gen_slice_len_ipv4(cstate, extra),
+	    ret_snaplen, ret_a);
+	b = gen_and(gen_ipfrag(cstate),
+	    gen_cmp(cstate, OR_LINKPL, 9, BPF_B, IPPROTO_SCTP));
+	next = gen_slice_branch(b, gen_slice_leaf(cstate,
+	    gen_slice_len_ipv4(cstate, 12 + extra), ret_snaplen, ret_a), next);
+	b = gen_and(gen_ipfrag(cstate),
+	    gen_or(gen_cmp(cstate, OR_LINKPL, 9, BPF_B, IPPROTO_UDP),
+	    gen_cmp(cstate, OR_LINKPL, 9, BPF_B, IPPROTO_ICMP)));
+	next = gen_slice_branch(b, gen_slice_leaf(cstate,
+	    gen_slice_len_ipv4(cstate, 8 + extra), ret_snaplen, ret_a), next);
+	b = gen_and(gen_ipfrag(cstate),
+	    gen_cmp(cstate, OR_LINKPL, 9, BPF_B, IPPROTO_TCP));
+	next = gen_slice_branch(b, gen_slice_leaf(cstate,
+	    gen_slice_len_tcp(cstate, OR_TRAN_IPV4, extra),
+	    ret_snaplen, ret_a), next);
+	b_ip = gen_slice_branch(gen_linktype(cstate, ETHERTYPE_IP), next,
+	    b_ip6);
+
+	return b_ip;
+}
+
 int
 finish_parse(compiler_state_t *cstate, struct block *p_arg)
 {
@@ -1550,6 +1991,42 @@ finish_parse(compiler_state_t *cstate, struct block *p_arg)
 		return (-1);
 
 	struct block *p = p_arg; // "might be clobbered by longjmp()"
+	struct block *accept;
+
+	/*
+	 * An empty filter expression accepts everything; unless the
+	 * accept length has to be computed, leave it to our caller to
+	 * generate the one-instruction program for that.
+	 */
+	if (p == NULL) {
+		if (!cstate->slice_headers)
+			return (0);
+		p = gen_true(cstate);
+	}
+
+	/*
+	 * Generate the code for the accept length now, as it can use
+	 * variable-length header offsets, so it has to be done before
+	 * the code to compute those is inserted.
+	 */
+	if (cstate->slice_headers)
+		accept = gen_slice_headers(cstate);
+	else
+		accept = gen_retblk_internal(cstate, cstate->snaplen);
+
+	/*
+	 * If any primitive needs the walk over the IPv6 extension headers
+	 * that gen_ip6_walk_at_start() arranged for, do it first; whatever
+	 * its result, go on with the filter expression.
+	 */
+	if (cstate->ip6_walk_start != NULL) {
+		struct block *w = cstate->ip6_walk_start;
+
+		backpatch(w, p->head);
+		w->sense = !w->sense;
+		backpatch(w, p->head);
+		p->head = w->head;
+	}
 
 	/*
 	 * Insert before the statements of the first (root) block any
@@ -1591,7 +2068,7 @@ finish_parse(compiler_state_t *cstate, struct block *p_arg)
 		p = gen_and(ppi_dlt_check, p);
 	}
 
-	backpatch(p, gen_retblk_internal(cstate, cstate->snaplen));
+	backpatch(p, accept);
 	p->sense = !p->sense;
 	backpatch(p, gen_retblk_internal(cstate, 0));
 	cstate->ic.root = p->head;
@@ -2470,6 +2947,28 @@ init_linktype(compiler_state_t *cstate, pcap_t *p)
 		break;
 	}
 
+	/*
+	 * If we've been told how long the variable-length prefix is,
+	 * use that as a constant offset rather than loading it from
+	 * the packet.
+	 */
+	if (cstate->llprefixlen != LLPREFIXLEN_VARIABLE) {
+		switch (cstate->linktype) {
+
+		case DLT_IEEE802_11_RADIO_AVS:
+		case DLT_IEEE802_11_RADIO:
+		case DLT_PPI:
+			cstate->off_linkhdr.is_variable = 0;
+			cstate->off_linkhdr.constant_part = cstate->llprefixlen;
+			break;
+
+		case DLT_PFLOG:
+			cstate->off_linkpl.is_variable = 0;
+			cstate->off_linkpl.constant_part = cstate->llprefixlen;
+			break;
+		}
+	}
+
 	cstate->off_outermostlinkhdr = cstate->off_prevlinkhdr = cstate->off_linkhdr;
 	return (0);
 }
@@ -2648,9 +3147,15 @@ gen_load_a(compiler_state_t *cstate, const enum e_offrel offrel, u_int offset,
 		break;
 
 	case OR_TRAN_IPV6:
-		s = gen_abs_offset_varpart(cstate, &cstate->off_linkpl);
-		offset += cstate->off_linkpl.constant_part + cstate->off_nl +
-		    IP6_HDRLEN;
+		/*
+		 * Load the X register with the offset of the header that
+		 * follows the IPv6 header and its extension headers, as
+		 * computed by gen_ip6_walk(), which must have been done
+		 * on every path to here; that offset includes the variable
+		 * part of the offset of the link-layer payload, if any.
+		 */
+		s = gen_loadx_ip6l4off(cstate);
+		offset += cstate->off_linkpl.constant_part + cstate->off_nl;
 		break;
 	}
 	return gen_load_absoffsetrel(cstate, s, offset, size);
@@ -6134,56 +6639,305 @@ gen_ip6_proto(compiler_state_t *cstate, const uint8_t proto)
 	return gen_cmp(cstate, OR_LINKPL, IPV6_PROTO_OFFSET, BPF_B, proto);
 }
 
-static struct block *
-gen_ipfrag(compiler_state_t *cstate)
+/*
+ * Allocate the registers gen_ip6_walk() leaves its results in, if that
+ * hasn't been done yet; code using them can be generated before the walk.
+ */
+static void
+alloc_ip6_walk_regs(compiler_state_t *cstate)
 {
-	struct slist *s;
-
-	/* not IPv4 frag other than the first frag */
-	s = gen_load_a(cstate, OR_LINKPL, 6, BPF_H);
-	return gen_unset(cstate, 0x1fff, s);
+	if (cstate->ip6_nxt_reg == -1) {
+		cstate->ip6_nxt_reg = alloc_reg(cstate);
+		cstate->ip6_l4_reg = alloc_reg(cstate);
+	}
 }
 
 /*
- * Generate a comparison to a port value in the transport-layer header
- * at the specified offset from the beginning of that header.
- *
- * XXX - this handles a variable-length prefix preceding the link-layer
- * header, such as the radiotap or AVS radio prefix, but doesn't handle
- * variable-length link-layer headers (such as Token Ring or 802.11
- * headers).
+ * Get the link-layer header type and header offsets currently in effect.
  */
-static struct block *
-gen_portatom(compiler_state_t *cstate, int off, uint16_t v)
+static void
+get_hdr_ctx(compiler_state_t *cstate, hdr_ctx *ctx)
 {
-	return gen_cmp(cstate, OR_TRAN_IPV4, off, BPF_H, v);
+	ctx->linktype = cstate->linktype;
+	ctx->off_linkhdr = cstate->off_linkhdr;
+	ctx->off_linkpl = cstate->off_linkpl;
+	ctx->off_linktype = cstate->off_linktype;
+	ctx->off_nl = cstate->off_nl;
+	ctx->off_nl_nosnap = cstate->off_nl_nosnap;
+	ctx->is_encap = cstate->is_encap;
+	ctx->is_vlan_vloffset = cstate->is_vlan_vloffset;
+	ctx->label_stack_depth = cstate->label_stack_depth;
+	ctx->vlan_stack_depth = cstate->vlan_stack_depth;
 }
 
-static struct block *
-gen_portatom6(compiler_state_t *cstate, int off, uint16_t v)
+/*
+ * Compare two absolute offsets.  The register for the variable part of
+ * an offset is only allocated when code first uses it, so it doesn't
+ * count.
+ */
+static int
+abs_offset_eq(const bpf_abs_offset *a, const bpf_abs_offset *b)
 {
-	return gen_cmp(cstate, OR_TRAN_IPV6, off, BPF_H, v);
+	return a->is_variable == b->is_variable &&
+	    a->constant_part == b->constant_part;
 }
 
-static struct block *
-gen_port(compiler_state_t *cstate, const uint16_t port, const int proto,
-    const u_char dir, const u_char addr)
+/*
+ * If the header offsets are still those init_linktype() set up, which is
+ * by far the most common case, arrange for gen_ip6_walk() to be done once
+ * for the whole filter, before anything else, and return 1; finish_parse()
+ * puts it there.  Otherwise return 0, and the caller has to generate the
+ * walk itself.
+ *
+ * The walk done at the start leaves IPPROTO_NONE in the ip6_nxt_reg
+ * register for a packet that isn't an IPv6 packet, and the Next Header
+ * value of an extension header if it gave up, so a check of that register
+ * for a transport-layer protocol number also checks that the packet is
+ * an IPv6 packet and that the walk got past its extension headers.
+ */
+static int
+gen_ip6_walk_at_start(compiler_state_t *cstate)
 {
-	struct block *b1, *tmp;
+	const hdr_ctx *ctx = &cstate->init_ctx;
+	struct block *b;
+	struct slist *s, *s2;
 
-	switch (dir) {
-	case Q_SRC:
-		b1 = gen_portatom(cstate, TRAN_SRCPORT_OFFSET, port);
-		break;
+	if (cstate->linktype != ctx->linktype ||
+	    !abs_offset_eq(&cstate->off_linkhdr, &ctx->off_linkhdr) ||
+	    !abs_offset_eq(&cstate->off_linkpl, &ctx->off_linkpl) ||
+	    !abs_offset_eq(&cstate->off_linktype, &ctx->off_linktype) ||
+	    cstate->off_nl != ctx->off_nl ||
+	    cstate->off_nl_nosnap != ctx->off_nl_nosnap ||
+	    cstate->is_encap != ctx->is_encap ||
+	    cstate->is_vlan_vloffset != ctx->is_vlan_vloffset ||
+	    cstate->label_stack_depth != ctx->label_stack_depth ||
+	    cstate->vlan_stack_depth != ctx->vlan_stack_depth)
+		return 0;
 
-	case Q_DST:
-		b1 = gen_portatom(cstate, TRAN_DSTPORT_OFFSET, port);
-		break;
+	if (cstate->ip6_walk_start == NULL) {
+		b = gen_and(gen_linktype(cstate, ETHERTYPE_IPV6),
+		    gen_ip6_walk(cstate));
 
-	case Q_AND:
-		tmp = gen_portatom(cstate, TRAN_SRCPORT_OFFSET, port);
-		b1 = gen_portatom(cstate, TRAN_DSTPORT_OFFSET, port);
-		b1 = gen_and(tmp, b1);
+		/* MEM[ip6_nxt_reg] = MEM[ip6_l4_reg] = IPPROTO_NONE */
+		s = new_stmt(cstate, BPF_LD|BPF_IMM);
+		s->s.k = IPPROTO_NONE;
+		s2 = new_stmt(cstate, BPF_ST);
+		s2->s.k = cstate->ip6_nxt_reg;
+		sappend(s, s2);
+		s2 = new_stmt(cstate, BPF_ST);
+		s2->s.k = cstate->ip6_l4_reg;
+		sappend(s, s2);
+		sprepend_to_block(s, b->head);
+		cstate->ip6_walk_start = b;
+	}
+	return 1;
+}
+
+/*
+ * Generate code to load into the X register the offset, computed by
+ * gen_ip6_walk(), of the header that follows the IPv6 header and its
+ * extension headers, relative to the network-layer header, plus the
+ * variable part of the offset of the link-layer payload.
+ */
+static struct slist *
+gen_loadx_ip6l4off(compiler_state_t *cstate)
+{
+	struct slist *s;
+
+	alloc_ip6_walk_regs(cstate);
+	s = new_stmt(cstate, BPF_LDX|BPF_MEM);
+	s->s.k = cstate->ip6_l4_reg;
+	return s;
+}
+
+/*
+ * Compare the Next Header value found by gen_ip6_walk() with "proto".
+ */
+static struct block *
+gen_ip6_walk_proto(compiler_state_t *cstate, const uint8_t proto)
+{
+	struct slist *s;
+
+	alloc_ip6_walk_regs(cstate);
+	s = new_stmt(cstate, BPF_LD|BPF_MEM);
+	s->s.k = cstate->ip6_nxt_reg;
+	return gen_jmp_k(cstate, BPF_JEQ, proto, s);
+}
+
+/*
+ * True if the Next Header value found so far is not that of an extension
+ * header gen_ip6_walk() can skip.
+ */
+static struct block *
+gen_ip6_walk_done(compiler_state_t *cstate)
+{
+	struct block *b;
+
+	b = gen_ip6_walk_proto(cstate, IPPROTO_HOPOPTS);
+	b = gen_or(gen_ip6_walk_proto(cstate, IPPROTO_DSTOPTS), b);
+	b = gen_or(gen_ip6_walk_proto(cstate, IPPROTO_ROUTING), b);
+	b = gen_or(gen_ip6_walk_proto(cstate, IPPROTO_FRAGMENT), b);
+	return gen_not(b);
+}
+
+/*
+ * Generate the statements that step over the extension header at the
+ * offset in the ip6_l4_reg register.  The Hop-by-Hop Options, Destination
+ * Options and Routing headers have their length in 8-octet units, not
+ * including the first 8 octets, in their second octet; the Fragment header
+ * has a reserved 0 there, which gives its length of 8 octets.
+ */
+static struct slist *
+gen_ip6_walk_step(compiler_state_t *cstate)
+{
+	struct slist *s, *s2;
+
+	/* MEM[ip6_nxt_reg] = P[X + 0] */
+	s = gen_load_a(cstate, OR_TRAN_IPV6, 0, BPF_B);
+	s2 = new_stmt(cstate, BPF_ST);
+	s2->s.k = cstate->ip6_nxt_reg;
+	sappend(s, s2);
+	/* MEM[ip6_l4_reg] = X + (P[X + 1] + 1) * 8 */
+	sappend(s, gen_load_a(cstate, OR_TRAN_IPV6, 1, BPF_B));
+	s2 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+	s2->s.k = 1;
+	sappend(s, s2);
+	s2 = new_stmt(cstate, BPF_ALU|BPF_LSH|BPF_K);
+	s2->s.k = 3;
+	sappend(s, s2);
+	sappend(s, new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_X));
+	s2 = new_stmt(cstate, BPF_ST);
+	s2->s.k = cstate->ip6_l4_reg;
+	sappend(s, s2);
+	return s;
+}
+
+/*
+ * Generate code that skips over up to IP6_EXTHDR_WALK_MAX Hop-by-Hop
+ * Options, Destination Options, Routing and Fragment headers following an
+ * IPv6 header, and leaves the Next Header value that ends the chain in the
+ * ip6_nxt_reg register and the offset of the header it describes in the
+ * ip6_l4_reg register, for gen_ip6_walk_proto() and OR_TRAN_IPV6 to use.
+ *
+ * Unlike "ip6 protochain", this doesn't loop, so the optimizer can handle
+ * it and kernel BPF interpreters accept it.  The result is true unless
+ * the walk gave up: there were more extension headers than that, or there
+ * was a Fragment header for a fragment other than the first, so there is
+ * no transport-layer header in the packet.  In that case the registers
+ * describe the header at which the walk stopped.
+ *
+ * The caller must check that the packet is an IPv6 packet.
+ */
+static struct block *
+gen_ip6_walk(compiler_state_t *cstate)
+{
+	struct block *b, *b0;
+	struct slist *s, *s2;
+	int i;
+
+	alloc_ip6_walk_regs(cstate);
+
+	/*
+	 * Build the chain from the last extension header back; having
+	 * skipped the last one we can skip, we're done only if the next
+	 * header isn't another extension header.
+	 */
+	b = gen_ip6_walk_done(cstate);
+	for (i = 0; i < IP6_EXTHDR_WALK_MAX; i++) {
+		/*
+		 * Step over this extension header before looking at the
+		 * next one.
+		 */
+		s = gen_ip6_walk_step(cstate);
+		sappend(s, b->head->stmts);
+		b->head->stmts = s;
+
+		/* Not a fragment other than the first fragment. */
+		b0 = gen_unset(cstate, 0xfff8,
+		    gen_load_a(cstate, OR_TRAN_IPV6, 2, BPF_H));
+		b0 = gen_or(gen_not(gen_ip6_walk_proto(cstate,
+		    IPPROTO_FRAGMENT)), b0);
+		b = gen_and(b0, b);
+		b = gen_or(gen_ip6_walk_done(cstate), b);
+	}
+
+	/*
+	 * Start with the Next Header field of the IPv6 header, which
+	 * describes the header that follows it.
+	 */
+	s = gen_abs_offset_varpart(cstate, &cstate->off_linkpl);
+	if (s != NULL) {
+		sappend(s, new_stmt(cstate, BPF_MISC|BPF_TXA));
+		s2 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+		s2->s.k = IP6_HDRLEN;
+		sappend(s, s2);
+	} else {
+		s = new_stmt(cstate, BPF_LD|BPF_IMM);
+		s->s.k = IP6_HDRLEN;
+	}
+	s2 = new_stmt(cstate, BPF_ST);
+	s2->s.k = cstate->ip6_l4_reg;
+	sappend(s, s2);
+	sappend(s, gen_load_a(cstate, OR_LINKPL, IPV6_PROTO_OFFSET, BPF_B));
+	s2 = new_stmt(cstate, BPF_ST);
+	s2->s.k = cstate->ip6_nxt_reg;
+	sappend(s, s2);
+	sappend(s, b->head->stmts);
+	b->head->stmts = s;
+
+	return b;
+}
+
+static struct block *
+gen_ipfrag(compiler_state_t *cstate)
+{
+	struct slist *s;
+
+	/* not IPv4 frag other than the first frag */
+	s = gen_load_a(cstate, OR_LINKPL, 6, BPF_H);
+	return gen_unset(cstate, 0x1fff, s);
+}
+
+/*
+ * Generate a comparison to a port value in the transport-layer header
+ * at the specified offset from the beginning of that header.
+ *
+ * XXX - this handles a variable-length prefix preceding the link-layer
+ * header, such as the radiotap or AVS radio prefix, but doesn't handle
+ * variable-length link-layer headers (such as Token Ring or 802.11
+ * headers).
+ */
+static struct block *
+gen_portatom(compiler_state_t *cstate, int off, uint16_t v)
+{
+	return gen_cmp(cstate, OR_TRAN_IPV4, off, BPF_H, v);
+}
+
+static struct block *
+gen_portatom6(compiler_state_t *cstate, int off, uint16_t v)
+{
+	return gen_cmp(cstate, OR_TRAN_IPV6, off, BPF_H, v);
+}
+
+static struct block *
+gen_port(compiler_state_t *cstate, const uint16_t port, const int proto,
+    const u_char dir, const u_char addr)
+{
+	struct block *b1, *tmp;
+
+	switch (dir) {
+	case Q_SRC:
+		b1 = gen_portatom(cstate, TRAN_SRCPORT_OFFSET, port);
+		break;
+
+	case Q_DST:
+		b1 = gen_portatom(cstate, TRAN_DSTPORT_OFFSET, port);
+		break;
+
+	case Q_AND:
+		tmp = gen_portatom(cstate, TRAN_SRCPORT_OFFSET, port);
+		b1 = gen_portatom(cstate, TRAN_DSTPORT_OFFSET, port);
+		b1 = gen_and(tmp, b1);
 		break;
 
 	case Q_DEFAULT:
@@ -6299,26 +7053,29 @@ gen_port6_common(compiler_state_t *cstate, int proto, struct block *b1)
 {
 	struct block *tmp;
 
-	// "ip6 proto 'ip_proto'"
+	// The header after any extension headers is 'ip_proto'.
 	switch (proto) {
 	case IPPROTO_UDP:
 	case IPPROTO_TCP:
 	case IPPROTO_SCTP:
-		tmp = gen_ip6_proto(cstate, (uint8_t)proto);
+		tmp = gen_ip6_walk_proto(cstate, (uint8_t)proto);
 		break;
 
 	case PROTO_UNDEF:
 		// Same as in gen_port_common().
-		tmp = gen_ip6_proto(cstate, IPPROTO_SCTP);
-		tmp = gen_or(gen_ip6_proto(cstate, IPPROTO_UDP), tmp);
-		tmp = gen_or(gen_ip6_proto(cstate, IPPROTO_TCP), tmp);
+		tmp = gen_ip6_walk_proto(cstate, IPPROTO_SCTP);
+		tmp = gen_or(gen_ip6_walk_proto(cstate, IPPROTO_UDP), tmp);
+		tmp = gen_or(gen_ip6_walk_proto(cstate, IPPROTO_TCP), tmp);
 		break;
 
 	default:
 		bpf_error(cstate, ERRSTR_FUNC_VAR_INT, __func__, "proto", proto);
 	}
-	// XXX - catch the first fragment of a fragmented packet?
 	b1 = gen_and(tmp, b1);
+	if (gen_ip6_walk_at_start(cstate))
+		return b1;
+	// Not a fragment other than the first fragment.
+	b1 = gen_and(gen_ip6_walk(cstate), b1);
 	// "link proto \ip6"
 	return gen_and(gen_linktype(cstate, ETHERTYPE_IPV6), b1);
 }
@@ -6450,7 +7207,15 @@ lookup_proto(compiler_state_t *cstate, const char *name, const struct qual q)
 	case Q_DEFAULT:
 	case Q_IP:
 	case Q_IPV6:
-		v = pcap_nametoproto(name);
+		/*
+		 * "ipip" means IP in IP, as it does for the "ipip"
+		 * primitive, not the obsolete IP protocol 94 that some
+		 * protocols databases give that name.
+		 */
+		if (strcmp(name, "ipip") == 0)
+			v = IPPROTO_IPIP;
+		else
+			v = pcap_nametoproto(name);
 		break;
 
 	case Q_LINK:
@@ -7885,7 +8650,10 @@ gen_load_internal(compiler_state_t *cstate, int proto, struct arth *inst,
 		break;
 	case Q_ICMPV6:
 		/*
-		 * This corresponds to OR_TRAN_IPV6 in gen_load_a().
+		 * The ICMPv6 header is taken to follow the fixed IPv6
+		 * header directly; unlike OR_TRAN_IPV6 in gen_load_a(),
+		 * this doesn't skip extension headers, as the Next Header
+		 * check below only matches packets that have none.
 		 *
 		 * Do the computation only if the packet contains
 		 * the protocol in question.
@@ -8549,6 +9317,103 @@ gen_ifindex(compiler_state_t *cstate, int ifindex)
 	}
 }
 
+/*
+ * Accept a packet with probability threshold/2^32, by comparing the
+ * threshold with a 32-bit random number.  The kernel supplies that
+ * number; if the filter has to be run in userland, the Linux capture
+ * code supplies one instead.
+ */
+static struct block *
+gen_sample_threshold(compiler_state_t *cstate, const char *keyword,
+    uint64_t threshold)
+{
+#if defined(__linux__) && defined(SKF_AD_RANDOM)
+	require_basic_bpf_extensions(cstate, keyword);
+	if (threshold == 0)
+		return gen_false(cstate);
+	if (threshold > UINT32_MAX)
+		return gen_true(cstate);
+	return gen_cmp_lt(cstate, OR_PACKET, SKF_AD_OFF + SKF_AD_RANDOM,
+	    BPF_W, (bpf_u_int32)threshold);
+#else /* defined(__linux__) && defined(SKF_AD_RANDOM) */
+	(void)threshold;
+	fail_kw_on_dlt(cstate, keyword);
+	/*NOTREACHED*/
+#endif /* defined(__linux__) && defined(SKF_AD_RANDOM) */
+}
+
+/*
+ * True for, on average, one packet out of every n packets.
+ */
+struct block *
+gen_sample(compiler_state_t *cstate, bpf_u_int32 n)
+{
+	/*
+	 * Catch errors reported by us and routines below us, and return NULL
+	 * on an error.
+	 */
+	if (setjmp(cstate->top_ctx))
+		return (NULL);
+
+	if (n == 0)
+		bpf_error(cstate, "'sample' requires a nonzero number of packets");
+	return gen_sample_threshold(cstate, "sample",
+	    (UINT64_C(1) << 32) / n);
+}
+
+/*
+ * True for each packet with the given probability, which is a decimal
+ * fraction between 0 and 1 such as "0.01".
+ */
+#define SAMPLE_RATE_MAXDIGITS	9
+
+struct block *
+gen_sample_rate(compiler_state_t *cstate, const char *s)
+{
+	const char *cp;
+	uint64_t intpart, frac, scale;
+	u_int ndigits;
+
+	/*
+	 * Catch errors reported by us and routines below us, and return NULL
+	 * on an error.
+	 */
+	if (setjmp(cstate->top_ctx))
+		return (NULL);
+
+	/*
+	 * The scanner hands us anything that looks like a dotted number,
+	 * so check that this is plain decimal with a single dot.
+	 */
+	intpart = 0;
+	for (cp = s; *cp >= '0' && *cp <= '9'; cp++) {
+		intpart = intpart * 10 + (uint64_t)(*cp - '0');
+		if (intpart > 1)
+			break;
+	}
+	if (cp == s || *cp != '.')
+		bpf_error(cstate, "invalid sample rate %s", s);
+	frac = 0;
+	scale = 1;
+	ndigits = 0;
+	for (cp++; *cp >= '0' && *cp <= '9'; cp++) {
+		if (++ndigits > SAMPLE_RATE_MAXDIGITS)
+			bpf_error(cstate, "sample rate %s has too many digits", s);
+		frac = frac * 10 + (uint64_t)(*cp - '0');
+		scale *= 10;
+	}
+	if (ndigits == 0 || *cp != '\0')
+		bpf_error(cstate, "invalid sample rate %s", s);
+	if (intpart == 1 && frac != 0)
+		bpf_error(cstate, "sample rate %s is greater than 1", s);
+
+	/*
+	 * frac is less than 10^9, so this can't overflow.
+	 */
+	return gen_sample_threshold(cstate, "sample",
+	    intpart == 1 ? UINT64_C(1) << 32 : (frac << 32) / scale);
+}
+
 /*
  * Filter on inbound (outbound == 0) or outbound (outbound == 1) traffic.
  * Outbound traffic is sent by this machine, while inbound traffic is
@@ -9376,21 +10241,11 @@ gen_geneve6(compiler_state_t *cstate, bpf_u_int32 vni, int has_vni)
 
 	b0 = gen_geneve_check(cstate, gen_port6, OR_TRAN_IPV6, vni, has_vni);
 
-	/* Load the IP header length. We need to account for a
-	 * variable length link prefix if there is one. */
-	s = gen_abs_offset_varpart(cstate, &cstate->off_linkpl);
-	if (s) {
-		s1 = new_stmt(cstate, BPF_LD|BPF_IMM);
-		s1->s.k = IP6_HDRLEN;
-		sappend(s, s1);
-
-		s1 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_X);
-		s1->s.k = 0;
-		sappend(s, s1);
-	} else {
-		s = new_stmt(cstate, BPF_LD|BPF_IMM);
-		s->s.k = IP6_HDRLEN;
-	}
+	/* Load the length of the IP header and its extension headers,
+	 * as found for the port check. That accounts for a variable
+	 * length link prefix if there is one. */
+	s = new_stmt(cstate, BPF_LD|BPF_MEM);
+	s->s.k = cstate->ip6_l4_reg;
 
 	/* Forcibly append these statements to the true condition
 	 * of the protocol check by creating a new block that is
@@ -9629,21 +10484,11 @@ gen_vxlan6(compiler_state_t *cstate, bpf_u_int32 vni, int has_vni)
 
 	b0 = gen_vxlan_check(cstate, gen_port6, OR_TRAN_IPV6, vni, has_vni);
 
-	/* Load the IP header length. We need to account for a
-	 * variable length link prefix if there is one. */
-	s = gen_abs_offset_varpart(cstate, &cstate->off_linkpl);
-	if (s) {
-		s1 = new_stmt(cstate, BPF_LD|BPF_IMM);
-		s1->s.k = IP6_HDRLEN;
-		sappend(s, s1);
-
-		s1 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_X);
-		s1->s.k = 0;
-		sappend(s, s1);
-	} else {
-		s = new_stmt(cstate, BPF_LD|BPF_IMM);
-		s->s.k = IP6_HDRLEN;
-	}
+	/* Load the length of the IP header and its extension headers,
+	 * as found for the port check. That accounts for a variable
+	 * length link prefix if there is one. */
+	s = new_stmt(cstate, BPF_LD|BPF_MEM);
+	s->s.k = cstate->ip6_l4_reg;
 
 	/* Forcibly append these statements to the true condition
 	 * of the protocol check by creating a new block that is
@@ -9750,6 +10595,345 @@ gen_vxlan(compiler_state_t *cstate, bpf_u_int32 vni, int has_vni)
 	return gen_and(gen_or(b0, b1), offsets);
 }
 
+/* Check that this is an IPv4 packet, other than a non-first fragment,
+ * or an IPv6 packet, after up to IP6_EXTHDR_WALK_MAX extension headers,
+ * that carries one of the "nprotos" IP protocols in "protos", and store
+ * the absolute offset of the header that follows the IP header in the
+ * scratch register "reg".  This is the part of the tunnel checks that
+ * the GRE and IP-in-IP primitives share. */
+static struct block *
+gen_ip_encap_check(compiler_state_t *cstate, const uint8_t *protos,
+    const size_t nprotos, const int reg)
+{
+	struct block *b0, *b1, *b4, *b6;
+	struct slist *s, *s1;
+	size_t i;
+
+	/* IPv4: the header length is in the header itself.  Each path
+	 * stores its own offset, with statements attached to a check
+	 * only that path makes. */
+	s = gen_loadx_iphdrlen(cstate);
+	sappend(s, new_stmt(cstate, BPF_MISC|BPF_TXA));
+	s1 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+	s1->s.k = cstate->off_linkpl.constant_part + cstate->off_nl;
+	sappend(s, s1);
+	s1 = new_stmt(cstate, BPF_ST);
+	s1->s.k = reg;
+	sappend(s, s1);
+	b1 = gen_ip_proto(cstate, protos[0]);
+	for (i = 1; i < nprotos; i++)
+		b1 = gen_or(gen_ip_proto(cstate, protos[i]), b1);
+	b0 = gen_and(b1, sprepend_to_block(s, gen_ipfrag(cstate)));
+	b4 = gen_and(gen_linktype(cstate, ETHERTYPE_IP), b0);
+
+	/* IPv6: the extension header walk finds the offset. */
+	b1 = gen_ip6_walk_proto(cstate, protos[0]);
+	for (i = 1; i < nprotos; i++)
+		b1 = gen_or(gen_ip6_walk_proto(cstate, protos[i]), b1);
+	s = new_stmt(cstate, BPF_LD|BPF_MEM);
+	s->s.k = cstate->ip6_l4_reg;
+	s1 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+	s1->s.k = cstate->off_linkpl.constant_part + cstate->off_nl;
+	sappend(s, s1);
+	s1 = new_stmt(cstate, BPF_ST);
+	s1->s.k = reg;
+	sappend(s, s1);
+	sprepend_to_block(s, b1->head);
+	if (gen_ip6_walk_at_start(cstate))
+		b6 = b1;
+	else {
+		b0 = gen_and(gen_ip6_walk(cstate), b1);
+		b6 = gen_and(gen_linktype(cstate, ETHERTYPE_IPV6), b0);
+	}
+
+	return gen_or(b4, b6);
+}
+
+/* Generate code to load the field of the given size at the given offset
+ * from the start of the GRE header, whose absolute offset is in the
+ * given register. */
+static struct slist *
+gen_load_gre(compiler_state_t *cstate, const int reg, const u_int offset,
+    const u_int size)
+{
+	struct slist *s, *s1;
+
+	s = new_stmt(cstate, BPF_LDX|BPF_MEM);
+	s->s.k = reg;
+
+	s1 = new_stmt(cstate, BPF_LD|BPF_IND|size);
+	s1->s.k = offset;
+	sappend(s, s1);
+
+	return s;
+}
+
+/* Generate code to add to A the number of bytes (0 or 4) that the
+ * optional GRE field flagged by "bit" occupies, using the given scratch
+ * register; "shift" is the right shift that turns "bit" into 4. */
+static struct slist *
+gen_gre_optlen(compiler_state_t *cstate, const int reg, const int scratch,
+    const u_int bit, const u_int shift)
+{
+	struct slist *s, *s1;
+
+	s = new_stmt(cstate, BPF_ST);
+	s->s.k = scratch;
+
+	sappend(s, gen_load_gre(cstate, reg, 0, BPF_B));
+
+	s1 = new_stmt(cstate, BPF_ALU|BPF_AND|BPF_K);
+	s1->s.k = bit;
+	sappend(s, s1);
+
+	s1 = new_stmt(cstate, BPF_ALU|BPF_RSH|BPF_K);
+	s1->s.k = shift;
+	sappend(s, s1);
+
+	s1 = new_stmt(cstate, BPF_LDX|BPF_MEM);
+	s1->s.k = scratch;
+	sappend(s, s1);
+
+	sappend(s, new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_X));
+
+	return s;
+}
+
+/* We need to store three values based on the GRE header, whose offset
+ * is in register "reg":
+ * - The offset of the end of the GRE header.
+ * - The offset of the linktype.
+ * - The offset of the end of the encapsulated MAC header.
+ *
+ * As with Geneve, the encapsulated type is set to Ethernet, as the GRE
+ * protocol type is an EtherType: if it is Transparent Ethernet Bridging
+ * (which NVGRE uses as well), there is an inner Ethernet header,
+ * otherwise the payload follows the GRE header and the linktype is the
+ * GRE protocol type itself.  Unlike with Geneve, that choice is made
+ * without jumps, so the optimizer can still be used. */
+static struct slist *
+gen_gre_offsets(compiler_state_t *cstate, const int reg)
+{
+	struct slist *s, *s1;
+
+	PUSH_LINKHDR(cstate, DLT_EN10MB, 1, 0, alloc_reg(cstate));
+
+	cstate->off_linktype.reg = alloc_reg(cstate);
+	cstate->off_linktype.is_variable = 1;
+	cstate->off_linktype.constant_part = 0;
+
+	cstate->off_linkpl.reg = alloc_reg(cstate);
+	cstate->off_linkpl.is_variable = 1;
+	cstate->off_linkpl.constant_part = 0;
+
+	/* The GRE header is 4 bytes, plus 4 bytes for each of the
+	 * checksum (with the reserved field), key and sequence number
+	 * fields that is present.  Use the linkpl register, which is
+	 * set last, as scratch space. */
+	s = new_stmt(cstate, BPF_LD|BPF_IMM);
+	s->s.k = 4;
+	sappend(s, gen_gre_optlen(cstate, reg, cstate->off_linkpl.reg,
+	    GRE_CSUM_PRESENT, 5));
+	sappend(s, gen_gre_optlen(cstate, reg, cstate->off_linkpl.reg,
+	    GRE_KEY_PRESENT, 3));
+	sappend(s, gen_gre_optlen(cstate, reg, cstate->off_linkpl.reg,
+	    GRE_SEQ_PRESENT, 2));
+
+	/* Add the GRE header length to its offset and store. */
+	s1 = new_stmt(cstate, BPF_LDX|BPF_MEM);
+	s1->s.k = reg;
+	sappend(s, s1);
+
+	sappend(s, new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_X));
+
+	s1 = new_stmt(cstate, BPF_ST);
+	s1->s.k = cstate->off_linkhdr.reg;
+	sappend(s, s1);
+
+	/* Compute 0 if the protocol type is Transparent Ethernet Bridging
+	 * and 1 otherwise, as (type ^ ETHERTYPE_TEB) + 0xffff has bit 16
+	 * set if and only if the XOR is non-zero; keep it in the linktype
+	 * register for now. */
+	sappend(s, gen_load_gre(cstate, reg, 2, BPF_H));
+
+	s1 = new_stmt(cstate, BPF_ALU|BPF_XOR|BPF_K);
+	s1->s.k = ETHERTYPE_TEB;
+	sappend(s, s1);
+
+	s1 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+	s1->s.k = 0xffff;
+	sappend(s, s1);
+
+	s1 = new_stmt(cstate, BPF_ALU|BPF_RSH|BPF_K);
+	s1->s.k = 16;
+	sappend(s, s1);
+
+	s1 = new_stmt(cstate, BPF_ST);
+	s1->s.k = cstate->off_linktype.reg;
+	sappend(s, s1);
+
+	/* The network-layer header is 14 bytes after the end of the GRE
+	 * header with an inner Ethernet header, and right after it
+	 * otherwise. */
+	s1 = new_stmt(cstate, BPF_ALU|BPF_MUL|BPF_K);
+	s1->s.k = 14;
+	sappend(s, s1);
+
+	sappend(s, new_stmt(cstate, BPF_MISC|BPF_TAX));
+
+	s1 = new_stmt(cstate, BPF_LD|BPF_MEM);
+	s1->s.k = cstate->off_linkhdr.reg;
+	sappend(s, s1);
+
+	s1 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+	s1->s.k = 14;
+	sappend(s, s1);
+
+	sappend(s, new_stmt(cstate, BPF_ALU|BPF_SUB|BPF_X));
+
+	s1 = new_stmt(cstate, BPF_ST);
+	s1->s.k = cstate->off_linkpl.reg;
+	sappend(s, s1);
+
+	/* The linktype is the EtherType of the inner Ethernet header, 12
+	 * bytes after the end of the GRE header, or the protocol type, 2
+	 * bytes into the GRE header: subtract the distance between the
+	 * two if there's no inner Ethernet header. */
+	s1 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+	s1->s.k = 10;
+	sappend(s, s1);
+
+	s1 = new_stmt(cstate, BPF_LDX|BPF_MEM);
+	s1->s.k = reg;
+	sappend(s, s1);
+
+	sappend(s, new_stmt(cstate, BPF_ALU|BPF_SUB|BPF_X));
+
+	s1 = new_stmt(cstate, BPF_LDX|BPF_MEM);
+	s1->s.k = cstate->off_linktype.reg;
+	sappend(s, s1);
+
+	sappend(s, new_stmt(cstate, BPF_ALU|BPF_MUL|BPF_X));
+	sappend(s, new_stmt(cstate, BPF_MISC|BPF_TAX));
+
+	s1 = new_stmt(cstate, BPF_LD|BPF_MEM);
+	s1->s.k = cstate->off_linkhdr.reg;
+	sappend(s, s1);
+
+	s1 = new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_K);
+	s1->s.k = 12;
+	sappend(s, s1);
+
+	sappend(s, new_stmt(cstate, BPF_ALU|BPF_SUB|BPF_X));
+
+	s1 = new_stmt(cstate, BPF_ST);
+	s1->s.k = cstate->off_linktype.reg;
+	sappend(s, s1);
+
+	cstate->off_nl = 0;
+
+	return s;
+}
+
+/* Check to see if this is a GRE packet, with the given key if
+ * specified. */
+struct block *
+gen_gre(compiler_state_t *cstate, bpf_u_int32 key, int has_key)
+{
+	static const uint8_t protos[] = { IPPROTO_GRE };
+	struct block *b0, *b1;
+	struct slist *s, *s1;
+	int reg;
+
+	/*
+	 * Catch errors reported by us and routines below us, and return NULL
+	 * on an error.
+	 */
+	if (setjmp(cstate->top_ctx))
+		return (NULL);
+
+	/* Keep the offset of the GRE header. */
+	reg = alloc_reg(cstate);
+	b0 = gen_ip_encap_check(cstate, protos, sizeof(protos), reg);
+
+	/* Check for version 0 without RFC 1701 routing. */
+	b1 = gen_unset(cstate, GRE_ROUTING_VERSION,
+	    gen_load_gre(cstate, reg, 0, BPF_H));
+
+	/* Later filters should act on the payload of the GRE packet,
+	 * update all of the header pointers.  Attach this code to the
+	 * version check, rather than to an always-true block, so that the
+	 * optimizer can't skip it as it does with a block of stores
+	 * whose branches both go to the same place. */
+	b1 = sprepend_to_block(gen_gre_offsets(cstate, reg), b1);
+	b0 = gen_and(b0, b1);
+
+	if (has_key) {
+		/* The key follows the checksum field, if there is one. */
+		b1 = gen_set(cstate, GRE_KEY_PRESENT,
+		    gen_load_gre(cstate, reg, 0, BPF_B));
+		b0 = gen_and(b0, b1);
+
+		s = gen_load_gre(cstate, reg, 0, BPF_B);
+		s1 = new_stmt(cstate, BPF_ALU|BPF_AND|BPF_K);
+		s1->s.k = GRE_CSUM_PRESENT;
+		sappend(s, s1);
+		s1 = new_stmt(cstate, BPF_ALU|BPF_RSH|BPF_K);
+		s1->s.k = 5;
+		sappend(s, s1);
+		sappend(s, new_stmt(cstate, BPF_ALU|BPF_ADD|BPF_X));
+		sappend(s, new_stmt(cstate, BPF_MISC|BPF_TAX));
+		s1 = new_stmt(cstate, BPF_LD|BPF_IND|BPF_W);
+		s1->s.k = 4;
+		sappend(s, s1);
+		b1 = gen_jmp_k(cstate, BPF_JEQ, key, s);
+		b0 = gen_and(b0, b1);
+	}
+
+	cstate->is_encap = 1;
+
+	return b0;
+}
+
+/* Check to see if this is an IPv4 or IPv6 packet carrying an IPv4 or
+ * IPv6 packet (IP protocol 4 or 41), and make later filters act on the
+ * inner packet. */
+struct block *
+gen_ipip(compiler_state_t *cstate)
+{
+	static const uint8_t protos[] = { IPPROTO_IPIP, IPPROTO_IPV6 };
+	struct block *b0, *b1;
+	int reg;
+
+	/*
+	 * Catch errors reported by us and routines below us, and return NULL
+	 * on an error.
+	 */
+	if (setjmp(cstate->top_ctx))
+		return (NULL);
+
+	reg = alloc_reg(cstate);
+	b0 = gen_ip_encap_check(cstate, protos, sizeof(protos), reg);
+
+	/* The inner packet is a raw IP packet with no link-layer header,
+	 * so its link-layer header and payload start at the same place,
+	 * the offset the check above stored. */
+	PUSH_LINKHDR(cstate, DLT_RAW, 1, 0, reg);
+	cstate->off_linkpl = cstate->off_linkhdr;
+	cstate->off_linktype.constant_part = OFFSET_NOT_SET;
+	cstate->off_linktype.is_variable = 0;
+	cstate->off_linktype.reg = -1;
+
+	cstate->off_nl = 0;
+	cstate->off_nl_nosnap = 0;
+
+	/* Check that there is an IPv4 or IPv6 header there. */
+	b1 = gen_or(gen_ip_version(cstate, OR_LINKHDR, 4),
+	    gen_ip_version(cstate, OR_LINKHDR, 6));
+
+	return gen_and(b0, b1);
+}
+
 /* Check that the encapsulated frame has a link layer header
  * for Ethernet filters. */
 static struct block *
@@ -366,6 +366,8 @@ struct block *gen_byteop(compiler_state_t *, int, int, bpf_u_int32);
 struct block *gen_broadcast(compiler_state_t *, int);
 struct block *gen_multicast(compiler_state_t *, int);
 struct block *gen_ifindex(compiler_state_t *, int);
+struct block *gen_sample(compiler_state_t *, bpf_u_int32);
+struct block *gen_sample_rate(compiler_state_t *, const char *);
 struct block *gen_inbound_outbound(compiler_state_t *, const int);
 
 struct block *gen_llc(compiler_state_t *);
@@ -383,6 +385,8 @@ struct block *gen_pppoes(compiler_state_t *, bpf_u_int32, int);
 
 struct block *gen_geneve(compiler_state_t *, bpf_u_int32, int);
 struct block *gen_vxlan(compiler_state_t *, bpf_u_int32, int);
+struct block *gen_gre(compiler_state_t *, bpf_u_int32, int);
+struct block *gen_ipip(compiler_state_t *);
 
 struct block *gen_atmfield_code(compiler_state_t *, int, bpf_u_int32,
     int, int);
@@ -423,6 +427,7 @@ void bpf_set_error(compiler_state_t *, const char *, ...)
     PCAP_PRINTFLIKE(2, 3);
 
 int finish_parse(compiler_state_t *, struct block *);
+int set_slice_headers(compiler_state_t *, bpf_u_int32);
 char *sdup(compiler_state_t *, const char *);
 
 struct bpf_insn *icode_to_fcode(struct icode *, struct block *, u_int *,
@@ -614,9 +614,10 @@ compute_local_ud(struct block *b)
 			def |= ATOMMASK(atom);
 		}
 	}
-	if (BPF_CLASS(b->s.code) == BPF_JMP) {
+	if (BPF_CLASS(b->s.code) == BPF_JMP ||
+	    BPF_CLASS(b->s.code) == BPF_RET) {
 		/*
-		 * XXX - what about RET?
+		 * A "ret a" uses the A register.
 		 */
 		atom = atomuse(&b->s);
 		if (atom >= 0) {
@@ -1582,6 +1583,16 @@ use_conflict(struct block *b, struct block *succ)
 	int atom;
 	atomset use = succ->out_use;
 
+	/*
+	 * A leaf uses nothing on exit but, if it's a "ret a", the A
+	 * register, in which case the value must be known to be the
+	 * same; a value of 0 means "unknown", not "the same unknown".
+	 */
+	if (BPF_CLASS(succ->s.code) == BPF_RET)
+		return ATOMELEM(succ->in_use, A_ATOM) &&
+		    (b->val[A_ATOM] == 0 ||
+		     b->val[A_ATOM] != succ->val[A_ATOM]);
+
 	if (use == 0)
 		return 0;
 
@@ -2941,6 +2952,7 @@ int
 pcapint_install_bpf_program(pcap_t *p, struct bpf_program *fp)
 {
 	size_t prog_size;
+	u_int i;
 
 	/*
 	 * Validate the program.
@@ -2965,6 +2977,18 @@ pcapint_install_bpf_program(pcap_t *p, struct bpf_program *fp)
 		return (-1);
 	}
 	memcpy(p->fcode.bf_insns, fp->bf_insns, prog_size);
+
+	/*
+	 * The only programs we generate that return the A register
+	 * are the ones for "slice headers".
+	 */
+	p->fcode_slices = 0;
+	for (i = 0; i < fp->bf_len; i++) {
+		if (fp->bf_insns[i].code == (BPF_RET|BPF_A)) {
+			p->fcode_slices = 1;
+			break;
+		}
+	}
 	return (0);
 }
 
@@ -196,12 +196,28 @@ struct pcap_opt {
 	int	nonblock;	/* non-blocking mode - don't wait for packets to be delivered, return "no packets available" */
 	int	tstamp_type;
 	int	tstamp_precision;
+	int	queues;		/* number of queues to capture on */
 
 	/*
 	 * Platform-dependent options.
 	 */
 #ifdef __linux__
 	int	protocol;	/* protocol to use when creating PF_PACKET socket */
+	int	fanout_group;	/* PACKET_FANOUT group ID, or -1 if none */
+	int	fanout_type;	/* PACKET_FANOUT mode and flags */
+	int	tx_buffer_size;	/* size of PACKET_TX_RING, or 0 for none */
+	int	qdisc_bypass;	/* set PACKET_QDISC_BYPASS */
+	int	busy_poll_usec;	/* SO_BUSY_POLL time, and ring spin time */
+	int	busy_poll_budget; /* SO_BUSY_POLL_BUDGET, or 0 for default */
+	int	block_size;	/* TPACKET_V3 block size, or 0 for default */
+	int	block_count;	/* TPACKET_V3 block count, or 0 to fit buffer_size */
+	int	block_timeout_min; /* TPACKET_V3 block retire timeout, in ms, or 0 for the buffer timeout */
+	int	block_timeout_max; /* longest to wait for a block, in ms, if adaptive */
+	int	buffer_duration; /* ms of line-rate traffic to size the ring for, or 0 */
+	int	numa_node;	/* NUMA node for the ring, or PCAP_NUMA_NODE_ value */
+	int	cpu;		/* CPU for the reading thread, or PCAP_CPU_ value */
+	int	ring_stats;	/* gather ring statistics */
+	int	offload_flags;	/* PCAP_OFFLOAD_ flags */
 #endif
 #ifdef _WIN32
 	int	nocapture_local;/* disable NPF loopback */
@@ -212,6 +228,10 @@ typedef int	(*activate_op_t)(pcap_t *);
 typedef int	(*can_set_rfmon_op_t)(pcap_t *);
 typedef int	(*read_op_t)(pcap_t *, int cnt, pcap_handler, u_char *);
 typedef int	(*next_packet_op_t)(pcap_t *, struct pcap_pkthdr *, u_char **);
+typedef int	(*next_batch_op_t)(pcap_t *, struct pcap_pkt_vec *, int);
+typedef void	(*release_batch_op_t)(pcap_t *, struct pcap_pkt_vec *);
+typedef int	(*hold_packet_op_t)(pcap_t *, const u_char *);
+typedef int	(*release_packet_op_t)(pcap_t *, const u_char *);
 typedef int	(*inject_op_t)(pcap_t *, const void *, int);
 typedef void	(*save_current_filter_op_t)(pcap_t *, const char *);
 typedef int	(*setfilter_op_t)(pcap_t *, struct bpf_program *);
@@ -221,6 +241,7 @@ typedef int	(*getnonblock_op_t)(pcap_t *);
 typedef int	(*setnonblock_op_t)(pcap_t *, int);
 typedef int	(*stats_op_t)(pcap_t *, struct pcap_stat *);
 typedef void	(*breakloop_op_t)(pcap_t *);
+typedef u_int	(*sendqueue_transmit_op_t)(pcap_t *, pcap_send_queue *, int);
 #ifdef _WIN32
 typedef struct pcap_stat *(*stats_ex_op_t)(pcap_t *, int *);
 typedef int	(*setbuff_op_t)(pcap_t *, int);
@@ -229,7 +250,6 @@ typedef int	(*setmintocopy_op_t)(pcap_t *, int);
 typedef HANDLE	(*getevent_op_t)(pcap_t *);
 typedef int	(*oid_get_request_op_t)(pcap_t *, bpf_u_int32, void *, size_t *);
 typedef int	(*oid_set_request_op_t)(pcap_t *, bpf_u_int32, const void *, size_t *);
-typedef u_int	(*sendqueue_transmit_op_t)(pcap_t *, pcap_send_queue *, int);
 typedef int	(*setuserbuffer_op_t)(pcap_t *, int);
 typedef int	(*live_dump_op_t)(pcap_t *, char *, int, int);
 typedef int	(*live_dump_ended_op_t)(pcap_t *, int);
@@ -275,6 +295,7 @@ struct pcap {
 
 	int swapped;
 	FILE *rfile;		/* null if live capture, non-null if savefile */
+	long rfile_rewind;	/* offset of a savefile's packets, or -1 */
 	u_int fddipad;
 	struct pcap *next;	/* list of open pcaps that need stuff cleared on close */
 
@@ -335,6 +356,25 @@ struct pcap {
 	 */
 	struct bpf_program fcode;
 
+	/*
+	 * Non-zero if that code computes the length to which to cut off
+	 * the packets it accepts, as "slice headers" programs do, rather
+	 * than just returning the snapshot length it was compiled for.
+	 */
+	int fcode_slices;
+
+	/*
+	 * State for pcap_setfilter_adaptive(); null if not in use.
+	 */
+	struct pcap_adaptive_filter *adaptive;
+
+	/*
+	 * Handles for queues 1 through nqueues of a multi-queue handle,
+	 * which is itself queue 0; null if there's only one queue.
+	 */
+	struct pcap **queues;
+	int nqueues;
+
 	char errbuf[PCAP_ERRBUF_SIZE + 1];
 #ifdef _WIN32
 	char acp_errbuf[PCAP_ERRBUF_SIZE + 1];	/* buffer for local code page error strings */
@@ -368,6 +408,34 @@ struct pcap {
 	 */
 	pcap_handler oneshot_callback;
 
+	/*
+	 * While pcap_dispatch_ex() is reading packets, its flags plus
+	 * DISPATCH_EX_ACTIVE; otherwise 0.  If pkthdr_ex_supported is
+	 * set, the read routine then hands its callback a pointer to the
+	 * hdr member of a filled-in struct pcap_pkthdr_ex.
+	 */
+	u_int dispatch_ex;
+	int pkthdr_ex_supported;
+
+	/*
+	 * Methods for pcap_next_batch()/pcap_release_batch(); null if
+	 * the capture mechanism can't hand out batches of packets.
+	 */
+	next_batch_op_t next_batch_op;
+	release_batch_op_t release_batch_op;
+
+	/*
+	 * Methods for pcap_hold_packet()/pcap_release_packet(); null if
+	 * packet data can't be kept past the next read.
+	 */
+	hold_packet_op_t hold_packet_op;
+	release_packet_op_t release_packet_op;
+
+	/*
+	 * Method for pcap_sendqueue_transmit().
+	 */
+	sendqueue_transmit_op_t sendqueue_transmit_op;
+
 #ifdef _WIN32
 	/*
 	 * These are, at least currently, specific to the Win32 NPF
@@ -380,7 +448,6 @@ struct pcap {
 	getevent_op_t getevent_op;
 	oid_get_request_op_t oid_get_request_op;
 	oid_set_request_op_t oid_set_request_op;
-	sendqueue_transmit_op_t sendqueue_transmit_op;
 	setuserbuffer_op_t setuserbuffer_op;
 	live_dump_op_t live_dump_op;
 	live_dump_ended_op_t live_dump_ended_op;
@@ -415,6 +482,11 @@ struct oneshot_userdata {
 	pcap_t *pd;
 };
 
+/*
+ * Set in dispatch_ex while pcap_dispatch_ex() is reading packets.
+ */
+#define DISPATCH_EX_ACTIVE	0x80000000U
+
 #ifndef min
 #define min(a, b) ((a) > (b) ? (b) : (a))
 #endif
@@ -423,6 +495,7 @@ struct oneshot_userdata {
 #endif
 
 int	pcapint_offline_read(pcap_t *, int, pcap_handler, u_char *);
+int	pcapint_offline_rewind(pcap_t *);
 
 /*
  * Does the packet count argument to a module's read routine say
@@ -477,6 +550,11 @@ void	pcapint_remove_from_pcaps_to_close(pcap_t *);
 void	pcapint_cleanup_live_common(pcap_t *);
 int	pcapint_check_activated(pcap_t *);
 void	pcapint_breakloop_common(pcap_t *);
+#ifndef _WIN32
+uint64_t pcapint_sendqueue_due(pcap_t *, const struct pcap_pkthdr *,
+	    const struct pcap_pkthdr *);
+int	pcapint_sendqueue_wait(const struct timespec *, uint64_t, int);
+#endif
 
 /*
  * Internal interfaces for "pcap_findalldevs()".
@@ -500,6 +578,17 @@ void	pcapint_breakloop_common(pcap_t *);
  *
  * "pcapint_find_or_add_dev()" checks whether a device is already in a
  * pcap_if_list_t and, if not, adds an entry for it.
+ *
+ * "pcapint_clear_devlist()" removes and frees all the entries in a
+ * pcap_if_list_t, so that a platform can start over with another
+ * mechanism if its preferred one fails partway through.
+ *
+ * A platform that keeps a list of its own, such as a cache that it
+ * updates as interfaces come and go, can use "pcapint_alloc_devlist()"
+ * and "pcapint_free_devlist()" to create and destroy it,
+ * "pcapint_first_dev()" to walk it, "pcapint_unlink_dev()" to
+ * remove an entry without freeing it, and "pcapint_append_devs()"
+ * to hand a chain of entries, already in order, to another list.
  */
 struct pcap_if_list;
 typedef struct pcap_if_list pcap_if_list_t;
@@ -515,6 +604,12 @@ pcap_if_t *pcapint_find_dev(pcap_if_list_t *, const char *);
 pcap_if_t *pcapint_add_dev(pcap_if_list_t *, const char *, bpf_u_int32,
 	    const char *, char *);
 pcap_if_t *pcapint_add_any_dev(pcap_if_list_t *, char *);
+void	pcapint_clear_devlist(pcap_if_list_t *);
+pcap_if_list_t *pcapint_alloc_devlist(char *);
+void	pcapint_free_devlist(pcap_if_list_t *);
+pcap_if_t *pcapint_first_dev(pcap_if_list_t *);
+void	pcapint_unlink_dev(pcap_if_list_t *, pcap_if_t *);
+void	pcapint_append_devs(pcap_if_list_t *, pcap_if_t *);
 int	pcapint_add_addr_to_dev(pcap_if_t *, struct sockaddr *, size_t,
 	    struct sockaddr *, size_t, struct sockaddr *, size_t,
 	    struct sockaddr *dstaddr, size_t, char *errbuf);
@@ -587,11 +682,13 @@ void			*pcapint_find_function(pcap_code_handle_t, const char *);
 /*
  * Auxiliary data, for use when interpreting a filter intended for the
  * Linux kernel when the kernel rejects the filter (requiring us to
- * run it in userland).  It contains VLAN tag information.
+ * run it in userland).  It contains VLAN tag information and the
+ * random number to use for SKF_AD_RANDOM loads.
  */
 struct pcap_bpf_aux_data {
 	u_short vlan_tag_present;
 	u_short vlan_tag;
+	bpf_u_int32 random;
 };
 
 /*
@@ -611,6 +708,14 @@ u_int	pcapint_filter(const struct bpf_insn *, const u_char *, u_int, u_int);
  */
 int	pcapint_validate_filter(const struct bpf_insn *, int);
 
+/*
+ * Routine to compile a filter specialized for a given length of the
+ * variable-length prefix before the link-layer header, guarded by a
+ * check of that length that falls back on the generic filter.
+ */
+int	pcapint_compile_llprefix_guarded(pcap_t *, struct bpf_program *,
+    const char *, int, bpf_u_int32, bpf_u_int32);
+
 /*
  * Internal interfaces for both "pcap_create()" and routines that
  * open savefiles.
@@ -81,6 +81,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #include <endian.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -89,11 +90,19 @@
 #include <sys/mman.h>
 #include <linux/if.h>
 #include <linux/if_packet.h>
+#if defined(PACKET_FANOUT) && !defined(PACKET_FANOUT_FLAG_UNIQUEID)
+  // Linux before 4.4
+  #define PACKET_FANOUT_FLAG_UNIQUEID 0x2000
+#endif
+#ifdef PACKET_VNET_HDR
+  #include <linux/virtio_net.h>
+#endif
 #include <linux/sockios.h>
 #include <linux/ethtool.h>
 #include <netinet/in.h>
 #include <linux/if_ether.h>
 #include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include <linux/if_arp.h>
 #ifndef ARPHRD_IEEE802154
@@ -126,7 +135,12 @@
 
 #include <poll.h>
 #include <dirent.h>
+#include <sched.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "pcap-int.h"
 #include "pcap-util.h"
@@ -163,6 +177,16 @@
 #ifndef HAVE___ATOMIC_STORE_N
 #define __atomic_store_n(ptr, val, memory_model)	*(ptr) = (val)
 #endif
+#ifndef HAVE___ATOMIC_LOAD_N
+/*
+ * Assume that a compiler without __atomic_load_n() doesn't have the
+ * other __atomic builtins either, and fall back on the older __sync
+ * builtins, which GCC has had since 4.1.
+ */
+#define __atomic_fetch_or(ptr, val, memory_model)	__sync_fetch_and_or(ptr, val)
+#define __atomic_add_fetch(ptr, val, memory_model)	__sync_add_and_fetch(ptr, val)
+#define __atomic_sub_fetch(ptr, val, memory_model)	__sync_sub_and_fetch(ptr, val)
+#endif
 
 #define packet_mmap_acquire(pkt) \
 	(__atomic_load_n(&pkt->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_KERNEL)
@@ -215,12 +239,21 @@ typedef int		socklen_t;
  * Private data for capturing on Linux PF_PACKET sockets.
  */
 struct pcap_linux {
-	long long sysfs_dropped; /* packets reported dropped by /sys/class/net/{if_name}/statistics/rx_{missed,fifo}_errors */
+	long long if_drops_start; /* rx_{missed,fifo}_errors count for the interface when we were activated */
+	int	stats_fd;	/* routing netlink socket for RTM_GETSTATS; -1 if we use sysfs */
+	uint32_t stats_seq;	/* sequence number of the last RTM_GETSTATS request */
 	struct pcap_stat stat;
+	uint64_t recv64;	/* 64-bit running totals of the kernel's counts */
+	uint64_t drop64;
+	uint64_t freeze_q64;
+	uint64_t filtered64;	/* packets rejected by the filter in userland */
 
 	char	*device;	/* device name */
 	int	filter_in_userland; /* must filter in userland */
 	u_int	blocks_to_filter_in_userland;
+	int	filter_cut_pending; /* packets before filter_cut must be filtered in userland */
+	uint64_t filter_cut;	/* time stamp, in ns, at which the current kernel filter took effect */
+	uint64_t filter_cut_end; /* time stamp, in ns, after which no packet can predate filter_cut */
 	int	must_do_on_close; /* stuff we must do when we close */
 	int	timeout;	/* timeout for buffering */
 	int	cooked;		/* using SOCK_DGRAM rather than SOCK_RAW */
@@ -232,15 +265,43 @@ struct pcap_linux {
 	u_char	*mmapbuf;	/* memory-mapped region pointer */
 	size_t	mmapbuflen;	/* size of region */
 	int	vlan_offset;	/* offset at which to insert vlan tags; if -1, don't insert */
+	int	fill_rxhash;	/* kernel puts the flow hash into the ring */
 	u_int	tp_version;	/* version of tpacket_hdr for mmaped ring */
 	u_int	tp_hdrlen;	/* hdrlen of tpacket_hdr for mmaped ring */
-	u_char	*oneshot_buffer; /* buffer for copy of packet */
+	const u_char *oneshot_held; /* packet held for pcap_next()/pcap_next_ex() */
 	int	poll_timeout;	/* timeout to use in poll() */
 #ifdef HAVE_TPACKET3
 	unsigned char *current_packet; /* Current packet within the TPACKET_V3 block. Move to next block if NULL. */
 	int packets_left; /* Unhandled packets left within the block from previous call to pcap_read_linux_mmap_v3 in case of TPACKET_V3. */
 #endif
+	u_int	batch_frames;	/* frames handed out by pcap_next_batch() and not yet released */
+	u_int	tp_block_size;	/* size of a block of the mmapped ring */
+	u_int	link_speed;	/* link speed the ring was sized for, in Mb/s; 0 if not */
+	int	device_node;	/* NUMA node the device is attached to, or -1 */
+	int	numa_node;	/* NUMA node the ring is allocated on, or -1 */
+	int	cpu;		/* CPU, or PCAP_CPU_ value, to pin the reader to */
+	int	pin_pending;	/* pin the next thread that reads */
+	cpu_set_t cpu_set;	/* the CPUs to pin it to */
+	u_int	*frame_holds;	/* per-frame count of pcap_hold_packet() holds, plus FRAME_RELEASE_DEFERRED */
+	u_char	*tx_ring;	/* PACKET_TX_RING, mapped right after the rx ring; NULL if none */
+	size_t	tx_ring_len;	/* size of the tx ring */
+	u_int	tx_frame_size;	/* size of a tx ring frame; a power of 2 */
+	u_int	tx_frame_nr;	/* number of frames in the tx ring */
+	u_int	tx_head;	/* next tx ring frame to fill in */
 	int poll_breakloop_fd; /* fd to an eventfd to break from blocking operations */
+	uint64_t spin_ns;	/* how long to spin on the ring before poll(); 0 if not at all */
+	struct pcap_busy_poll_stat bp_stats; /* spin/sleep statistics */
+	struct pcap_ring_stat *ring_stats; /* ring instrumentation; NULL if not enabled */
+	u_int	vnet_hdr_len;	/* size of the virtio_net header before each packet; 0 if PACKET_VNET_HDR is off */
+	int	block_wait;	/* ms to wait before collecting TPACKET_V3 blocks */
+	int	block_wait_max;	/* the most that can be; 0 if not adapting it */
+	u_int	blocks_seen;	/* blocks collected since we last waited */
+	u_int	blocks_full;	/* how many of them weren't retired early */
+	uint32_t random_state;	/* state of the random number generator used when filtering or sampling in userland */
+#ifdef ENABLE_REMOTE
+	bpf_u_int32 samp_threshold; /* PCAP_SAMP_1_EVERY_N threshold in the kernel filter; 0 if none */
+	bpf_u_int32 samp_requested; /* threshold requested when the kernel filter was last set up */
+#endif
 };
 
 /*
@@ -248,6 +309,20 @@ struct pcap_linux {
  */
 #define MUST_DELETE_MONIF	0x00000001	/* delete monitor-mode interface */
 
+/*
+ * Set in a frame's entry in frame_holds if we've finished reading the
+ * frame while it was held; whoever releases the last hold hands the
+ * frame back to the kernel.  Until then, the frame isn't ready to be
+ * read again, even though the kernel doesn't own it.
+ *
+ * The frame is handed back to the kernel before it's marked as no
+ * longer held, so check whether it's held before checking whether
+ * the kernel owns it.
+ */
+#define FRAME_RELEASE_DEFERRED	0x80000000U
+#define RING_FRAME_HELD(handlep, offset) \
+	(__atomic_load_n(&(handlep)->frame_holds[(offset)], __ATOMIC_ACQUIRE) & FRAME_RELEASE_DEFERRED)
+
 /*
  * Prototypes for internal functions and methods.
  */
@@ -257,10 +332,23 @@ static int setup_socket(pcap_t *, int);
 static int setup_mmapped(pcap_t *);
 static int pcap_can_set_rfmon_linux(pcap_t *);
 static int pcap_inject_linux(pcap_t *, const void *, int);
+static u_int pcap_sendqueue_transmit_linux(pcap_t *, pcap_send_queue *, int);
 static int pcap_stats_linux(pcap_t *, struct pcap_stat *);
 static int pcap_setfilter_linux(pcap_t *, struct bpf_program *);
+static int install_kernel_filter(pcap_t *);
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+static int update_kernel_sampling(pcap_t *);
+#endif
 static int pcap_setdirection_linux(pcap_t *, pcap_direction_t);
 static int pcap_set_datalink_linux(pcap_t *, int);
+static int setup_fanout(pcap_t *);
+static int setup_queues(pcap_t *);
+static int setup_busy_poll(pcap_t *);
+static int setup_placement(pcap_t *);
+static bpf_u_int32 linux_random(struct pcap_linux *);
+#ifdef ENABLE_REMOTE
+static bpf_u_int32 linux_samp_threshold(pcap_t *);
+#endif
 
 union thdr {
 	struct tpacket2_hdr		*h2;
@@ -273,12 +361,27 @@ union thdr {
 #define RING_GET_FRAME_AT(h, offset) (((u_char **)h->buffer)[(offset)])
 #define RING_GET_CURRENT_FRAME(h) RING_GET_FRAME_AT(h, h->offset)
 
+/*
+ * A time stamp from the ring, in nanoseconds since the Epoch; the
+ * ring's seconds are unsigned 32-bit.
+ */
+#define TP_TS_NS(sec, nsec) \
+	((uint64_t)(u_int)(sec) * 1000000000 + (uint64_t)(nsec))
+
 static void destroy_ring(pcap_t *handle);
 static int create_ring(pcap_t *handle);
+static int setup_vnet_hdr(pcap_t *handle);
+static int create_tx_ring(pcap_t *handle);
 static int prepare_tpacket_socket(pcap_t *handle);
 static int pcap_read_linux_mmap_v2(pcap_t *, int, pcap_handler , u_char *);
+static int pcap_next_batch_linux_mmap_v2(pcap_t *, struct pcap_pkt_vec *, int);
+static void pcap_release_batch_linux_mmap_v2(pcap_t *, struct pcap_pkt_vec *);
+static int pcap_hold_packet_linux(pcap_t *, const u_char *);
+static int pcap_release_packet_linux(pcap_t *, const u_char *);
 #ifdef HAVE_TPACKET3
 static int pcap_read_linux_mmap_v3(pcap_t *, int, pcap_handler , u_char *);
+static int pcap_next_batch_linux_mmap_v3(pcap_t *, struct pcap_pkt_vec *, int);
+static void pcap_release_batch_linux_mmap_v3(pcap_t *, struct pcap_pkt_vec *);
 #endif
 static int pcap_setnonblock_linux(pcap_t *p, int nonblock);
 static int pcap_getnonblock_linux(pcap_t *p);
@@ -351,11 +454,17 @@ static int	enter_rfmon_mode(pcap_t *handle, int sock_fd,
 static int	iface_get_ts_types(const char *device, pcap_t *handle,
     char *ebuf);
 static int	iface_get_offload(pcap_t *handle);
+static int	iface_get_link_speed(pcap_t *handle);
 
 static int	fix_program(pcap_t *handle, struct sock_fprog *fcode);
+static int	fix_ret_a(pcap_t *handle, struct sock_fprog *fcode);
 static int	fix_offset(pcap_t *handle, struct bpf_insn *p);
 static int	set_kernel_filter(pcap_t *handle, struct sock_fprog *fcode);
 static int	reset_kernel_filter(pcap_t *handle);
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+static int	add_sampling_prologue(pcap_t *handle, struct sock_fprog *fcode,
+    bpf_u_int32 threshold);
+#endif
 
 static struct sock_filter	total_insn
 	= BPF_STMT(BPF_RET | BPF_K, 0);
@@ -409,6 +518,7 @@ pcapint_create_interface(const char *device, char *ebuf)
 	 */
 	struct pcap_linux *handlep = handle->priv;
 	handlep->poll_breakloop_fd = -1;
+	handlep->stats_fd = -1;
 
 	return handle;
 }
@@ -936,11 +1046,124 @@ linux_get_stat(const char * if_name, const char * stat_name) {
 	return strtoll(buffer, NULL, 10);
 }
 
+#ifdef RTM_GETSTATS
+/*
+ * Ask the kernel for the interface's 64-bit statistics with an
+ * RTM_GETSTATS request on the handle's routing netlink socket, and
+ * get the number of packets the interface dropped from them.
+ */
+static int
+linux_if_drops_netlink(struct pcap_linux *handlep, long long int *drops)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct if_stats_msg ifsm;
+	} req;
+	union {
+		struct nlmsghdr nlh;
+		char buf[1024];
+	} reply;
+	ssize_t len;
+	struct nlmsghdr *nlh;
+	struct rtattr *rta;
+	unsigned int rtalen;
+	struct rtnl_link_stats64 stats64;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifsm));
+	req.nlh.nlmsg_type = RTM_GETSTATS;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = ++handlep->stats_seq;
+	req.ifsm.ifindex = (uint32_t)handlep->ifindex;
+	req.ifsm.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+	if (send(handlep->stats_fd, &req, req.nlh.nlmsg_len, 0) == -1)
+		return -1;
+
+	for (;;) {
+		len = recv(handlep->stats_fd, reply.buf, sizeof(reply.buf),
+		    MSG_TRUNC);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if ((size_t)len > sizeof(reply.buf)) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		for (nlh = &reply.nlh; NLMSG_OK(nlh, len);
+		    nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != handlep->stats_seq)
+				continue;	/* reply to an earlier request */
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+				errno = -err->error;
+				return -1;
+			}
+			if (nlh->nlmsg_type != RTM_NEWSTATS)
+				continue;
+
+			rta = (struct rtattr *)((char *)NLMSG_DATA(nlh) +
+			    NLMSG_ALIGN(sizeof(struct if_stats_msg)));
+			rtalen = NLMSG_PAYLOAD(nlh, sizeof(struct if_stats_msg));
+			for (; RTA_OK(rta, rtalen); rta = RTA_NEXT(rta, rtalen)) {
+				if (rta->rta_type != IFLA_STATS_LINK_64)
+					continue;
+				/*
+				 * Older kernels have a shorter structure;
+				 * the counts we want have always been in it.
+				 */
+				memset(&stats64, 0, sizeof(stats64));
+				memcpy(&stats64, RTA_DATA(rta),
+				    RTA_PAYLOAD(rta) < sizeof(stats64) ?
+				    RTA_PAYLOAD(rta) : sizeof(stats64));
+				*drops = (long long int)(stats64.rx_missed_errors +
+				    stats64.rx_fifo_errors);
+				return 0;
+			}
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+	}
+}
+#endif /* RTM_GETSTATS */
+
+/*
+ * Get the number of packets the interface dropped, as the sum of its
+ * rx_missed_errors and rx_fifo_errors counts.
+ *
+ * That's one round trip to the kernel over netlink, rather than
+ * opening and reading two files in sysfs, so it's cheap enough to do
+ * on every pcap_stats() call; if the kernel doesn't support
+ * RTM_GETSTATS (it was added in 4.7), fall back on sysfs.
+ */
 static long long int
-linux_if_drops(const char * if_name)
+linux_if_drops(pcap_t *handle)
 {
-	long long int missed = linux_get_stat(if_name, "rx_missed_errors");
-	long long int fifo = linux_get_stat(if_name, "rx_fifo_errors");
+	struct pcap_linux *handlep = handle->priv;
+	long long int missed, fifo;
+
+	if (handlep->ifindex == -1)
+		return 0;	/* the "any" device; nothing to report */
+
+#ifdef RTM_GETSTATS
+	if (handlep->stats_fd != -1) {
+		long long int drops;
+
+		if (linux_if_drops_netlink(handlep, &drops) == 0)
+			return drops;
+
+		/*
+		 * Don't try again; use sysfs from now on.
+		 */
+		close(handlep->stats_fd);
+		handlep->stats_fd = -1;
+	}
+#endif /* RTM_GETSTATS */
+
+	missed = linux_get_stat(handlep->device, "rx_missed_errors");
+	fifo = linux_get_stat(handlep->device, "rx_fifo_errors");
 	return missed + fifo;
 }
 
@@ -1000,11 +1223,6 @@ static void	pcap_cleanup_linux( pcap_t *handle )
 		destroy_ring(handle);
 	}
 
-	if (handlep->oneshot_buffer != NULL) {
-		munmap(handlep->oneshot_buffer, handle->snapshot);
-		handlep->oneshot_buffer = NULL;
-	}
-
 	if (handlep->mondevice != NULL) {
 		free(handlep->mondevice);
 		handlep->mondevice = NULL;
@@ -1018,6 +1236,14 @@ static void	pcap_cleanup_linux( pcap_t *handle )
 		close(handlep->poll_breakloop_fd);
 		handlep->poll_breakloop_fd = -1;
 	}
+	if (handlep->stats_fd != -1) {
+		close(handlep->stats_fd);
+		handlep->stats_fd = -1;
+	}
+	if (handlep->ring_stats != NULL) {
+		free(handlep->ring_stats);
+		handlep->ring_stats = NULL;
+	}
 	pcapint_cleanup_live_common(handle);
 }
 
@@ -1217,6 +1443,20 @@ pcap_activate_linux(pcap_t *handle)
 		goto fail;
 	}
 
+	/*
+	 * Seed the generator used for random numbers in userland; it
+	 * must never be in the all-zeroes state.
+	 */
+	{
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		handlep->random_state = ((uint32_t)getpid() << 16) ^
+		    (uint32_t)now.tv_sec ^ (uint32_t)now.tv_usec;
+		if (handlep->random_state == 0)
+			handlep->random_state = 1;
+	}
+
 	/*
 	 * The "any" device is a special device which causes us not
 	 * to bind to a particular device and thus to look at all
@@ -1236,15 +1476,6 @@ pcap_activate_linux(pcap_t *handle)
 	/* copy timeout value */
 	handlep->timeout = handle->opt.timeout;
 
-	/*
-	 * If we're in promiscuous mode, then we probably want
-	 * to see when the interface drops packets too, so get an
-	 * initial count from
-	 * /sys/class/net/{if_name}/statistics/rx_{missed,fifo}_errors
-	 */
-	if (handle->opt.promisc)
-		handlep->sysfs_dropped = linux_if_drops(handlep->device);
-
 	/*
 	 * If the "any" device is specified, try to open a SOCK_DGRAM.
 	 * Otherwise, open a SOCK_RAW.
@@ -1286,6 +1517,29 @@ pcap_activate_linux(pcap_t *handle)
 		}
 	}
 
+	/*
+	 * Get an initial count of the packets the interface dropped,
+	 * so that we can report how many it's dropped since then.
+	 * Keep a routing netlink socket open for fetching the counts;
+	 * if we can't open one, we'll use sysfs instead.
+	 */
+#ifdef RTM_GETSTATS
+	if (handlep->ifindex != -1)
+		handlep->stats_fd = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC,
+		    NETLINK_ROUTE);
+#endif
+	handlep->if_drops_start = linux_if_drops(handle);
+
+	/*
+	 * Work out where the ring and the reading thread go, if we
+	 * were asked to put them anywhere in particular.
+	 */
+	ret = setup_placement(handle);
+	if (ret < 0) {
+		status = ret;
+		goto fail;
+	}
+
 	/*
 	 * Succeeded.
 	 * Try to set up memory-mapped access.
@@ -1325,7 +1579,69 @@ pcap_activate_linux(pcap_t *handle)
 		goto fail;
 	}
 
+	/*
+	 * The socket has to be bound before it can join a fanout
+	 * group, so do that now, if asked to or if there will be
+	 * more than one queue.
+	 */
+	if (handle->opt.fanout_group != -1 || handle->opt.queues > 1) {
+		if ((ret = setup_fanout(handle)) != 0) {
+			status = ret;
+			goto fail;
+		}
+	}
+
+	/*
+	 * Have packets we send go straight to the driver, bypassing
+	 * the qdisc layer, if asked to.
+	 */
+	if (handle->opt.qdisc_bypass) {
+#ifdef PACKET_QDISC_BYPASS
+		int val = 1;
+
+		if (setsockopt(handle->fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+		    &val, sizeof(val)) == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "setsockopt (PACKET_QDISC_BYPASS)");
+			status = PCAP_ERROR;
+			goto fail;
+		}
+#else
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "Bypassing the qdisc layer isn't supported by the kernel headers libpcap was built with");
+		status = PCAP_ERROR;
+		goto fail;
+#endif
+	}
+
+	/*
+	 * Set up busy polling, if asked to.
+	 */
+	if (handle->opt.busy_poll_usec != 0) {
+		if ((ret = setup_busy_poll(handle)) != 0) {
+			status = ret;
+			goto fail;
+		}
+	}
+
+	/*
+	 * Allocate the ring statistics, if asked to; the read paths
+	 * only gather them if they're allocated.
+	 */
+	if (handle->opt.ring_stats) {
+		handlep->ring_stats = calloc(1, sizeof(*handlep->ring_stats));
+		if (handlep->ring_stats == NULL) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "malloc");
+			status = PCAP_ERROR;
+			goto fail;
+		}
+	}
+
 	handle->inject_op = pcap_inject_linux;
+	if (handlep->tx_ring != NULL)
+		handle->sendqueue_transmit_op = pcap_sendqueue_transmit_linux;
 	handle->setfilter_op = pcap_setfilter_linux;
 	handle->setdirection_op = pcap_setdirection_linux;
 	handle->set_datalink_op = pcap_set_datalink_linux;
@@ -1339,16 +1655,34 @@ pcap_activate_linux(pcap_t *handle)
 
 	case TPACKET_V2:
 		handle->read_op = pcap_read_linux_mmap_v2;
+		handle->next_batch_op = pcap_next_batch_linux_mmap_v2;
+		handle->release_batch_op = pcap_release_batch_linux_mmap_v2;
 		break;
 #ifdef HAVE_TPACKET3
 	case TPACKET_V3:
 		handle->read_op = pcap_read_linux_mmap_v3;
+		handle->next_batch_op = pcap_next_batch_linux_mmap_v3;
+		handle->release_batch_op = pcap_release_batch_linux_mmap_v3;
 		break;
 #endif
 	}
+	handle->hold_packet_op = pcap_hold_packet_linux;
+	handle->release_packet_op = pcap_release_packet_linux;
 	handle->oneshot_callback = pcapint_oneshot_linux;
+	handle->pkthdr_ex_supported = 1;
 	handle->selectable_fd = handle->fd;
 
+	/*
+	 * This handle is queue 0; open the others, if any.
+	 */
+	if (handle->opt.queues > 1) {
+		ret = setup_queues(handle);
+		if (ret < 0) {
+			status = ret;
+			goto fail;
+		}
+	}
+
 	return status;
 
 fail:
@@ -1356,4886 +1690,9722 @@ fail:
 	return status;
 }
 
+/*
+ * Return 1 if the socket will be in a PACKET_FANOUT group that spreads
+ * packets by flow hash, 0 otherwise.
+ */
 static int
-pcap_set_datalink_linux(pcap_t *handle, int dlt)
+fanout_by_hash(pcap_t *handle)
 {
-	handle->linktype = dlt;
-
-	/*
-	 * Update the offset at which to insert VLAN tags for the
-	 * new link-layer type.
-	 */
-	set_vlan_offset(handle);
-
-	return 0;
+#ifdef PACKET_FANOUT
+	if (handle->opt.fanout_group == -1)
+		return (handle->opt.queues > 1);
+	return ((handle->opt.fanout_type & 0xff) == PACKET_FANOUT_HASH);
+#else
+	(void)handle;
+	return (0);
+#endif
 }
 
 /*
- * linux_check_direction()
- *
- * Do checks based on packet direction.
+ * Join the PACKET_FANOUT group requested with pcap_set_fanout().
  */
-static inline int
-linux_check_direction(const pcap_t *handle, const struct sockaddr_ll *sll)
+static int
+setup_fanout(pcap_t *handle)
 {
-	struct pcap_linux	*handlep = handle->priv;
-
-	if (sll->sll_pkttype == PACKET_OUTGOING) {
-		/*
-		 * Outgoing packet.
-		 * If this is from the loopback device, reject it;
-		 * we'll see the packet as an incoming packet as well,
-		 * and we don't want to see it twice.
-		 */
-		if (sll->sll_ifindex == handlep->lo_ifindex)
-			return 0;
-
-		/*
-		 * If this is an outgoing CAN frame, and the user doesn't
-		 * want only outgoing packets, reject it; CAN devices
-		 * and drivers, and the CAN stack, always arrange to
-		 * loop back transmitted packets, so they also appear
-		 * as incoming packets.  We don't want duplicate packets,
-		 * and we can't easily distinguish packets looped back
-		 * by the CAN layer than those received by the CAN layer,
-		 * so we eliminate this packet instead.
-		 *
-		 * We check whether this is a CAN frame by checking whether
-		 * the device's hardware type is ARPHRD_CAN.
-		 */
-		if (sll->sll_hatype == ARPHRD_CAN &&
-		     handle->direction != PCAP_D_OUT)
-			return 0;
+#ifdef PACKET_FANOUT
+	int group, type, val;
+	socklen_t len;
 
+	group = handle->opt.fanout_group;
+	type = handle->opt.fanout_type;
+	if (group == -1) {
 		/*
-		 * If the user only wants incoming packets, reject it.
+		 * A multi-queue handle for which no group was given;
+		 * have the kernel pick an unused group ID, and spread
+		 * the packets over the queues by flow.
 		 */
-		if (handle->direction == PCAP_D_IN)
-			return 0;
-	} else {
+		group = 0;
+		type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG |
+		    PACKET_FANOUT_FLAG_UNIQUEID;
+	}
+	val = group | (type << 16);
+	if (setsockopt(handle->fd, SOL_PACKET, PACKET_FANOUT, &val,
+	    sizeof(val)) == -1) {
+		if (errno == EINVAL) {
+			/*
+			 * An unknown mode or flag, or a group that
+			 * already has sockets with a different mode,
+			 * device or protocol.
+			 */
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Can't join fanout group %d with mode %d and flags 0x%x",
+			    group, type & 0xff, type & 0xff00);
+		} else {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "setsockopt (PACKET_FANOUT)");
+		}
+		return PCAP_ERROR;
+	}
+	if (handle->opt.fanout_group == -1) {
 		/*
-		 * Incoming packet.
-		 * If the user only wants outgoing packets, reject it.
+		 * Find out which group ID the kernel picked, so that
+		 * the other queues can join the group.
 		 */
-		if (handle->direction == PCAP_D_OUT)
-			return 0;
+		len = sizeof(val);
+		if (getsockopt(handle->fd, SOL_PACKET, PACKET_FANOUT, &val,
+		    &len) == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "getsockopt (PACKET_FANOUT)");
+			return PCAP_ERROR;
+		}
+		handle->opt.fanout_group = val & 0xffff;
+		handle->opt.fanout_type = type & ~PACKET_FANOUT_FLAG_UNIQUEID;
 	}
-	return 1;
+	return 0;
+#else
+	snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+	    "Packet fanout is not supported by this version of libpcap");
+	return PCAP_ERROR;
+#endif
 }
 
 /*
- * Check whether the device to which the pcap_t is bound still exists.
- * We do so by asking what address the socket is bound to, and checking
- * whether the ifindex in the address is -1, meaning "that device is gone",
- * or some other value, meaning "that device still exists".
+ * Open the handles for queues 1 and up of a multi-queue handle; each
+ * gets its own socket and ring, in this handle's fanout group, and the
+ * same options as this handle.
  */
 static int
-device_still_exists(pcap_t *handle)
+setup_queues(pcap_t *handle)
 {
 	struct pcap_linux *handlep = handle->priv;
-	struct sockaddr_ll addr;
-	socklen_t addr_len;
+	const char *device;
+	pcap_t *qp;
+	char *qdevice;
+	int nqueues;
+	int status;
 
 	/*
-	 * If handlep->ifindex is -1, the socket isn't bound, meaning
-	 * we're capturing on the "any" device; that device never
-	 * disappears.  (It should also never be configured down, so
-	 * we shouldn't even get here, but let's make sure.)
+	 * If we created a monitor-mode device, the other queues capture
+	 * on it as well.
 	 */
-	if (handlep->ifindex == -1)
-		return (1);	/* it's still here */
+	device = handlep->mondevice != NULL ? handlep->mondevice :
+	    handle->opt.device;
 
-	/*
-	 * OK, now try to get the address for the socket.
-	 */
-	addr_len = sizeof (addr);
-	if (getsockname(handle->fd, (struct sockaddr *) &addr, &addr_len) == -1) {
-		/*
-		 * Error - report an error and return -1.
-		 */
+	nqueues = handle->opt.queues - 1;
+	handle->queues = calloc(nqueues, sizeof(*handle->queues));
+	if (handle->queues == NULL) {
 		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "getsockname failed");
-		return (-1);
+		    errno, "malloc");
+		return PCAP_ERROR;
 	}
-	if (addr.sll_ifindex == -1) {
-		/*
-		 * This means the device went away.
-		 */
-		return (0);
+	while (handle->nqueues < nqueues) {
+		qdevice = strdup(device);
+		if (qdevice == NULL) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "strdup");
+			return PCAP_ERROR;
+		}
+		qp = pcapint_create_interface(qdevice, handle->errbuf);
+		if (qp == NULL) {
+			free(qdevice);
+			return PCAP_ERROR;
+		}
+		qp->snapshot = handle->snapshot;
+		qp->opt = handle->opt;
+		qp->opt.device = qdevice;
+		qp->opt.rfmon = 0;
+		qp->opt.queues = 1;
+		qp->opt.tx_buffer_size = 0;	/* packets are sent on queue 0 */
+		status = pcap_activate(qp);
+		if (status < 0) {
+			pcapint_strlcpy(handle->errbuf, qp->errbuf,
+			    PCAP_ERRBUF_SIZE);
+			pcap_close(qp);
+			return status;
+		}
+		handle->queues[handle->nqueues++] = qp;
 	}
-
-	/*
-	 * The device presumably just went down.
-	 */
-	return (1);
+	return 0;
 }
 
+/*
+ * Have the kernel busy-poll the device's receive queue when we wait
+ * for packets, rather than waiting for an interrupt, and spin on the
+ * ring for the same length of time before sleeping.
+ */
 static int
-pcap_inject_linux(pcap_t *handle, const void *buf, int size)
+setup_busy_poll(pcap_t *handle)
 {
+#ifdef SO_BUSY_POLL
 	struct pcap_linux *handlep = handle->priv;
-	int ret;
+	int val;
 
-	if (handlep->ifindex == -1) {
-		/*
-		 * We don't support sending on the "any" device.
-		 */
-		pcapint_strlcpy(handle->errbuf,
-		    "Sending packets isn't supported on the \"any\" device",
-		    PCAP_ERRBUF_SIZE);
-		return (-1);
-	}
-
-	if (handlep->cooked) {
-		/*
-		 * We don't support sending on cooked-mode sockets.
-		 *
-		 * XXX - how do you send on a bound cooked-mode
-		 * socket?
-		 * Is a "sendto()" required there?
-		 */
-		pcapint_strlcpy(handle->errbuf,
-		    "Sending packets isn't supported in cooked mode",
-		    PCAP_ERRBUF_SIZE);
-		return (-1);
+	val = handle->opt.busy_poll_usec;
+	if (setsockopt(handle->fd, SOL_SOCKET, SO_BUSY_POLL, &val,
+	    sizeof(val)) == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "setsockopt (SO_BUSY_POLL)");
+		return PCAP_ERROR;
 	}
-
-	ret = (int)send(handle->fd, buf, size, 0);
-	if (ret == -1) {
+#ifdef SO_PREFER_BUSY_POLL
+	/*
+	 * This is only a hint, so don't fail if the kernel is too
+	 * old to support it.
+	 */
+	val = 1;
+	if (setsockopt(handle->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val,
+	    sizeof(val)) == -1 && errno != ENOPROTOOPT) {
 		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "send");
-		return (-1);
+		    errno, "setsockopt (SO_PREFER_BUSY_POLL)");
+		return PCAP_ERROR;
 	}
-	return (ret);
+#endif
+	if (handle->opt.busy_poll_budget != 0) {
+#ifdef SO_BUSY_POLL_BUDGET
+		val = handle->opt.busy_poll_budget;
+		if (setsockopt(handle->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+		    &val, sizeof(val)) == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "setsockopt (SO_BUSY_POLL_BUDGET)");
+			return PCAP_ERROR;
+		}
+#else
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "Setting a busy-poll budget isn't supported by the kernel headers libpcap was built with");
+		return PCAP_ERROR;
+#endif
+	}
+	handlep->spin_ns = (uint64_t)handle->opt.busy_poll_usec * 1000;
+	return 0;
+#else
+	snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+	    "Busy polling isn't supported by the kernel headers libpcap was built with");
+	return PCAP_ERROR;
+#endif
 }
 
 /*
- *  Get the statistics for the given packet capture handle.
+ * Get the NUMA node the device is attached to, from
+ * /sys/class/net/{if_name}/device/numa_node, or -1 if it isn't
+ * attached to a particular node, or isn't a device with a bus
+ * attachment at all (the "any" device, virtual devices, etc.).
  */
 static int
-pcap_stats_linux(pcap_t *handle, struct pcap_stat *stats)
+iface_get_numa_node(const char *device)
 {
-	struct pcap_linux *handlep = handle->priv;
-#ifdef HAVE_TPACKET3
-	/*
-	 * For sockets using TPACKET_V2, the extra stuff at the end
-	 * of a struct tpacket_stats_v3 will not be filled in, and
-	 * we don't look at it so this is OK even for those sockets.
-	 * In addition, the PF_PACKET socket code in the kernel only
-	 * uses the length parameter to compute how much data to
-	 * copy out and to indicate how much data was copied out, so
-	 * it's OK to base it on the size of a struct tpacket_stats.
-	 *
-	 * XXX - it's probably OK, in fact, to just use a
-	 * struct tpacket_stats for V3 sockets, as we don't
-	 * care about the tp_freeze_q_cnt stat.
-	 */
-	struct tpacket_stats_v3 kstats;
-#else /* HAVE_TPACKET3 */
-	struct tpacket_stats kstats;
-#endif /* HAVE_TPACKET3 */
-	socklen_t len = sizeof (struct tpacket_stats);
-
-	long long if_dropped = 0;
+	char buffer[PATH_MAX];
+	ssize_t bytes_read;
+	int fd;
+	long node;
 
-	/*
-	 * To fill in ps_ifdrop, we parse
-	 * /sys/class/net/{if_name}/statistics/rx_{missed,fifo}_errors
-	 * for the numbers
-	 */
-	if (handle->opt.promisc)
-	{
-		/*
-		 * XXX - is there any reason to do this by remembering
-		 * the last counts value, subtracting it from the
-		 * current counts value, and adding that to stat.ps_ifdrop,
-		 * maintaining stat.ps_ifdrop as a count, rather than just
-		 * saving the *initial* counts value and setting
-		 * stat.ps_ifdrop to the difference between the current
-		 * value and the initial value?
-		 *
-		 * One reason might be to handle the count wrapping
-		 * around, on platforms where the count is 32 bits
-		 * and where you might get more than 2^32 dropped
-		 * packets; is there any other reason?
-		 *
-		 * (We maintain the count as a long long int so that,
-		 * if the kernel maintains the counts as 64-bit even
-		 * on 32-bit platforms, we can handle the real count.
-		 *
-		 * Unfortunately, we can't report 64-bit counts; we
-		 * need a better API for reporting statistics, such as
-		 * one that reports them in a style similar to the
-		 * pcapng Interface Statistics Block, so that 1) the
-		 * counts are 64-bit, 2) it's easier to add new statistics
-		 * without breaking the ABI, and 3) it's easier to
-		 * indicate to a caller that wants one particular
-		 * statistic that it's not available by just not supplying
-		 * it.)
-		 */
-		if_dropped = handlep->sysfs_dropped;
-		handlep->sysfs_dropped = linux_if_drops(handlep->device);
-		handlep->stat.ps_ifdrop += (u_int)(handlep->sysfs_dropped - if_dropped);
-	}
+	snprintf(buffer, sizeof(buffer), "/sys/class/net/%s/device/numa_node",
+	    device);
+	fd = open(buffer, O_RDONLY);
+	if (fd == -1)
+		return -1;
 
-	/*
-	 * Try to get the packet counts from the kernel.
-	 */
-	if (getsockopt(handle->fd, SOL_PACKET, PACKET_STATISTICS,
-			&kstats, &len) > -1) {
-		/*
-		 * "ps_recv" counts only packets that *passed* the
-		 * filter, not packets that didn't pass the filter.
-		 * This includes packets later dropped because we
-		 * ran out of buffer space.
-		 *
-		 * "ps_drop" counts packets dropped because we ran
-		 * out of buffer space.  It doesn't count packets
-		 * dropped by the interface driver.  It counts only
-		 * packets that passed the filter.
-		 *
-		 * See above for ps_ifdrop.
-		 *
-		 * Both statistics include packets not yet read from
-		 * the kernel by libpcap, and thus not yet seen by
-		 * the application.
-		 *
-		 * In "linux/net/packet/af_packet.c", at least in 2.6.27
-		 * through 5.6 kernels, "tp_packets" is incremented for
-		 * every packet that passes the packet filter *and* is
-		 * successfully copied to the ring buffer; "tp_drops" is
-		 * incremented for every packet dropped because there's
-		 * not enough free space in the ring buffer.
-		 *
-		 * When the statistics are returned for a PACKET_STATISTICS
-		 * "getsockopt()" call, "tp_drops" is added to "tp_packets",
-		 * so that "tp_packets" counts all packets handed to
-		 * the PF_PACKET socket, including packets dropped because
-		 * there wasn't room on the socket buffer - but not
-		 * including packets that didn't pass the filter.
-		 *
-		 * In the BSD BPF, the count of received packets is
-		 * incremented for every packet handed to BPF, regardless
-		 * of whether it passed the filter.
-		 *
-		 * We can't make "pcap_stats()" work the same on both
-		 * platforms, but the best approximation is to return
-		 * "tp_packets" as the count of packets and "tp_drops"
-		 * as the count of drops.
-		 *
-		 * Keep a running total because each call to
-		 *    getsockopt(handle->fd, SOL_PACKET, PACKET_STATISTICS, ....
-		 * resets the counters to zero.
-		 */
-		handlep->stat.ps_recv += kstats.tp_packets;
-		handlep->stat.ps_drop += kstats.tp_drops;
-		*stats = handlep->stat;
-		return 0;
-	}
+	bytes_read = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (bytes_read <= 0)
+		return -1;
+	buffer[bytes_read] = '\0';
 
-	pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE, errno,
-	    "failed to get statistics from socket");
-	return -1;
+	node = strtol(buffer, NULL, 10);
+	if (node < 0 || node > INT_MAX)
+		return -1;
+	return (int)node;
 }
 
 /*
- * A PF_PACKET socket can be bound to any network interface.
+ * Fill in a CPU set with the CPUs on a NUMA node, from
+ * /sys/devices/system/node/node{node}/cpulist, which is a
+ * comma-separated list of CPU numbers and ranges of CPU numbers.
  */
 static int
-can_be_bound(const char *name _U_)
+numa_node_cpus(pcap_t *handle, int node, cpu_set_t *set)
 {
-	return (1);
+	char buffer[PATH_MAX];
+	ssize_t bytes_read;
+	int fd;
+	char *p, *end;
+	unsigned long first, last, cpu;
+
+	snprintf(buffer, sizeof(buffer),
+	    "/sys/devices/system/node/node%d/cpulist", node);
+	fd = open(buffer, O_RDONLY);
+	if (fd == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't open %s", buffer);
+		return PCAP_ERROR;
+	}
+	bytes_read = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (bytes_read == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't read the CPU list of NUMA node %d", node);
+		return PCAP_ERROR;
+	}
+	buffer[bytes_read] = '\0';
+
+	CPU_ZERO(set);
+	p = buffer;
+	for (;;) {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p)
+				break;
+		}
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+	if (CPU_COUNT(set) == 0) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "NUMA node %d has no CPUs", node);
+		return PCAP_ERROR;
+	}
+	return 0;
 }
 
 /*
- * Get a socket to use with various interface ioctls.
+ * Work out which NUMA node to put the ring on, and which CPUs to pin
+ * the reading thread to, if asked to do either.
  */
 static int
-get_if_ioctl_socket(void)
+setup_placement(pcap_t *handle)
 {
-	int fd;
-
-	/*
-	 * This is a bit ugly.
-	 *
-	 * There isn't a socket type that's guaranteed to work.
-	 *
-	 * AF_NETLINK will work *if* you have Netlink configured into the
-	 * kernel (can it be configured out if you have any networking
-	 * support at all?) *and* if you're running a sufficiently recent
-	 * kernel, but not all the kernels we support are sufficiently
-	 * recent - that feature was introduced in Linux 4.6.
-	 *
-	 * AF_UNIX will work *if* you have UNIX-domain sockets configured
-	 * into the kernel and *if* you're not on a system that doesn't
-	 * allow them - some SELinux systems don't allow you create them.
-	 * Most systems probably have them configured in, but not all systems
-	 * have them configured in and allow them to be created.
-	 *
-	 * AF_INET will work *if* you have IPv4 configured into the kernel,
-	 * but, apparently, some systems have network adapters but have
-	 * kernels without IPv4 support.
-	 *
-	 * AF_INET6 will work *if* you have IPv6 configured into the
-	 * kernel, but if you don't have AF_INET, you might not have
-	 * AF_INET6, either (that is, independently on its own grounds).
-	 *
-	 * AF_PACKET would work, except that some of these calls should
-	 * work even if you *don't* have capture permission (you should be
-	 * able to enumerate interfaces and get information about them
-	 * without capture permission; you shouldn't get a failure until
-	 * you try pcap_activate()).  (If you don't allow programs to
-	 * get as much information as possible about interfaces if you
-	 * don't have permission to capture, you run the risk of users
-	 * asking "why isn't it showing XXX" - or, worse, if you don't
-	 * show interfaces *at all* if you don't have permission to
-	 * capture on them, "why do no interfaces show up?" - when the
-	 * real problem is a permissions problem.  Error reports of that
-	 * type require a lot more back-and-forth to debug, as evidenced
-	 * by many Wireshark bugs/mailing list questions/Q&A questions.)
-	 *
-	 * So:
-	 *
-	 * we first try an AF_NETLINK socket, where "try" includes
-	 * "try to do a device ioctl on it", as, in the future, once
-	 * pre-4.6 kernels are sufficiently rare, that will probably
-	 * be the mechanism most likely to work;
-	 *
-	 * if that fails, we try an AF_UNIX socket, as that's less
-	 * likely to be configured out on a networking-capable system
-	 * than is IP;
-	 *
-	 * if that fails, we try an AF_INET6 socket;
-	 *
-	 * if that fails, we try an AF_INET socket.
-	 */
-	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
-	if (fd != -1) {
-		/*
-		 * OK, let's make sure we can do an SIOCGIFNAME
-		 * ioctl.
-		 */
-		struct ifreq ifr;
+	struct pcap_linux *handlep = handle->priv;
+	char path[PATH_MAX];
+	int node;
 
-		memset(&ifr, 0, sizeof(ifr));
-		if (ioctl(fd, SIOCGIFNAME, &ifr) == 0 ||
-		    errno != EOPNOTSUPP) {
-			/*
-			 * It succeeded, or failed for some reason
-			 * other than "netlink sockets don't support
-			 * device ioctls".  Go with the AF_NETLINK
-			 * socket.
-			 */
-			return (fd);
-		}
+	handlep->device_node = iface_get_numa_node(handle->opt.device);
+	handlep->numa_node = -1;
+	handlep->cpu = PCAP_CPU_NONE;
 
+	if (handle->opt.numa_node == PCAP_NUMA_NODE_DEVICE) {
 		/*
-		 * OK, that didn't work, so it's as bad as "netlink
-		 * sockets aren't available".  Close the socket and
-		 * drive on.
+		 * If the device isn't attached to a particular node,
+		 * there's no better place for the ring than wherever
+		 * the kernel puts it.
 		 */
-		close(fd);
+		handlep->numa_node = handlep->device_node;
+	} else if (handle->opt.numa_node >= 0) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+		    handle->opt.numa_node);
+		if (access(path, F_OK) == -1) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "NUMA node %d doesn't exist",
+			    handle->opt.numa_node);
+			return PCAP_ERROR;
+		}
+		handlep->numa_node = handle->opt.numa_node;
 	}
 
-	/*
-	 * Now try an AF_UNIX socket.
-	 */
-	fd = socket(AF_UNIX, SOCK_RAW, 0);
-	if (fd != -1) {
+	if (handle->opt.cpu == PCAP_CPU_NUMA_NODE) {
 		/*
-		 * OK, we got it!
+		 * Use the CPUs on the node the ring is on or, if we
+		 * didn't put it anywhere in particular, the node the
+		 * device is on.
 		 */
-		return (fd);
-	}
-
-	/*
-	 * Now try an AF_INET6 socket.
-	 */
-	fd = socket(AF_INET6, SOCK_DGRAM, 0);
-	if (fd != -1) {
-		return (fd);
-	}
-
-	/*
-	 * Now try an AF_INET socket.
-	 *
-	 * XXX - if that fails, is there anything else we should try?
-	 * AF_CAN, for embedded systems in vehicles, in case they're
-	 * built without Internet protocol support?  Any other socket
-	 * types popular in non-Internet embedded systems?
-	 */
-	return (socket(AF_INET, SOCK_DGRAM, 0));
+		node = handlep->numa_node != -1 ? handlep->numa_node :
+		    handlep->device_node;
+		if (node == -1)
+			return 0;
+		if (numa_node_cpus(handle, node, &handlep->cpu_set) == -1)
+			return PCAP_ERROR;
+	} else if (handle->opt.cpu >= 0) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d",
+		    handle->opt.cpu);
+		if (access(path, F_OK) == -1) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "CPU %d doesn't exist", handle->opt.cpu);
+			return PCAP_ERROR;
+		}
+		CPU_ZERO(&handlep->cpu_set);
+		CPU_SET(handle->opt.cpu, &handlep->cpu_set);
+	} else
+		return 0;
+	handlep->cpu = handle->opt.cpu;
+	handlep->pin_pending = 1;
+	return 0;
 }
 
 /*
- * Get additional flags for a device, using SIOCETHTOOL.
+ * Pin the calling thread to the CPUs setup_placement() chose.  This is
+ * done on the first read rather than when activating, as the thread
+ * that reads packets isn't necessarily the one that activated the
+ * handle.
  */
 static int
-get_if_flags(const char *name, bpf_u_int32 *flags, char *errbuf)
+pin_reading_thread(pcap_t *handle)
 {
-	int sock;
-	FILE *fh;
-	unsigned int arptype = ARPHRD_VOID;
-	struct ifreq ifr;
-	struct ethtool_value info;
+	struct pcap_linux *handlep = handle->priv;
 
-	if (*flags & PCAP_IF_LOOPBACK) {
-		/*
-		 * Loopback devices aren't wireless, and "connected"/
-		 * "disconnected" doesn't apply to them.
-		 */
-		*flags |= PCAP_IF_CONNECTION_STATUS_NOT_APPLICABLE;
-		return 0;
+	handlep->pin_pending = 0;
+	if (sched_setaffinity(0, sizeof(handlep->cpu_set),
+	    &handlep->cpu_set) == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "sched_setaffinity");
+		return PCAP_ERROR;
 	}
+	return 0;
+}
 
-	sock = get_if_ioctl_socket();
-	if (sock == -1) {
-		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE, errno,
-		    "Can't create socket to get ethtool information for %s",
-		    name);
-		return -1;
-	}
-
-	/*
-	 * OK, what type of network is this?
-	 * In particular, is it wired or wireless?
-	 */
-	if (is_wifi(name)) {
-		/*
-		 * Wi-Fi, hence wireless.
-		 */
-		*flags |= PCAP_IF_WIRELESS;
-	} else {
-		/*
-		 * OK, what does /sys/class/net/{if_name}/type contain?
-		 * (We don't use that for Wi-Fi, as it'll report
-		 * "Ethernet", i.e. ARPHRD_ETHER, for non-monitor-
-		 * mode devices.)
-		 */
-		char *pathstr;
-
-		if (asprintf(&pathstr, "/sys/class/net/%s/type", name) == -1) {
-			snprintf(errbuf, PCAP_ERRBUF_SIZE,
-			    "%s: Can't generate path name string for /sys/class/net device",
-			    name);
-			close(sock);
-			return -1;
-		}
-		fh = fopen(pathstr, "r");
-		if (fh != NULL) {
-			if (fscanf(fh, "%u", &arptype) == 1) {
-				/*
-				 * OK, we got an ARPHRD_ type; what is it?
-				 */
-				switch (arptype) {
-
-				case ARPHRD_LOOPBACK:
-					/*
-					 * These are types to which
-					 * "connected" and "disconnected"
-					 * don't apply, so don't bother
-					 * asking about it.
-					 *
-					 * XXX - add other types?
-					 */
-					close(sock);
-					fclose(fh);
-					free(pathstr);
-					return 0;
-
-				case ARPHRD_IRDA:
-				case ARPHRD_IEEE80211:
-				case ARPHRD_IEEE80211_PRISM:
-				case ARPHRD_IEEE80211_RADIOTAP:
-				case ARPHRD_IEEE802154:
-				case ARPHRD_IEEE802154_MONITOR:
-				case ARPHRD_6LOWPAN:
-					/*
-					 * Various wireless types.
-					 */
-					*flags |= PCAP_IF_WIRELESS;
-					break;
-				}
-			}
-			fclose(fh);
-		}
-		free(pathstr);
-	}
-
-#ifdef ETHTOOL_GLINK
-	memset(&ifr, 0, sizeof(ifr));
-	pcapint_strlcpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
-	info.cmd = ETHTOOL_GLINK;
-	/*
-	 * XXX - while Valgrind handles SIOCETHTOOL and knows that
-	 * the ETHTOOL_GLINK command sets the .data member of the
-	 * structure, Memory Sanitizer doesn't yet do so:
-	 *
-	 *    https://bugs.llvm.org/show_bug.cgi?id=45814
-	 *
-	 * For now, we zero it out to squelch warnings; if the bug
-	 * in question is fixed, we can remove this.
-	 */
-	info.data = 0;
-	ifr.ifr_data = (caddr_t)&info;
-	if (ioctl(sock, SIOCETHTOOL, &ifr) == -1) {
-		int save_errno = errno;
-
-		switch (save_errno) {
+/*
+ * The kernel allocates the memory for the rings when we ask for them,
+ * following the calling thread's memory policy; the pages can't be
+ * moved afterwards.  So, to put the rings on a particular node, we
+ * prefer that node while creating them, and then put back whatever
+ * policy the thread had.
+ *
+ * The node masks are big enough for as many nodes as the kernel
+ * supports.
+ */
+#define NODEMASK_BITS	1024
 
-		case EOPNOTSUPP:
-		case EINVAL:
-			/*
-			 * OK, this OS version or driver doesn't support
-			 * asking for this information.
-			 * XXX - distinguish between "this doesn't
-			 * support ethtool at all because it's not
-			 * that type of device" vs. "this doesn't
-			 * support ethtool even though it's that
-			 * type of device", and return "unknown".
-			 */
-			*flags |= PCAP_IF_CONNECTION_STATUS_NOT_APPLICABLE;
-			close(sock);
-			return 0;
+struct saved_mempolicy {
+	int		mode;	/* -1 if there's nothing to put back */
+	unsigned long	mask[NODEMASK_BITS / (8 * sizeof(unsigned long))];
+};
 
-		case ENODEV:
-			/*
-			 * OK, no such device.
-			 * The user will find that out when they try to
-			 * activate the device; just say "OK" and
-			 * don't set anything.
-			 */
-			close(sock);
-			return 0;
+static int
+prefer_numa_node(pcap_t *handle, int node, struct saved_mempolicy *saved)
+{
+#if defined(SYS_get_mempolicy) && defined(SYS_set_mempolicy)
+	unsigned long mask[NODEMASK_BITS / (8 * sizeof(unsigned long))];
 
-		case EPERM:
+	saved->mode = -1;
+	if (node < 0 || node >= NODEMASK_BITS - 1)
+		return 0;
+	if (syscall(SYS_get_mempolicy, &saved->mode, saved->mask,
+	    NODEMASK_BITS, NULL, 0) == -1) {
+		saved->mode = -1;
+		if (errno == ENOSYS) {
 			/*
-			 * OK, this version of the kernel requires
-			 * CAP_NET_ADMIN privileges for this, and
-			 * we don't have those privileges.
-			 *
-			 * Just leave it as PCAP_IF_CONNECTION_STATUS_UNKNOWN,
-			 * as we can't determine the status; just say "OK" and
-			 * don't set anything.
+			 * The kernel was built without NUMA support,
+			 * so there's only one node.
 			 */
-			close(sock);
 			return 0;
-
-		default:
-			/*
-			 * Other error.
-			 */
-			pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
-			    save_errno,
-			    "%s: SIOCETHTOOL(ETHTOOL_GLINK) ioctl failed",
-			    name);
-			close(sock);
-			return -1;
 		}
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "get_mempolicy");
+		return PCAP_ERROR;
 	}
-
-	/*
-	 * Is it connected?
-	 */
-	if (info.data) {
-		/*
-		 * It's connected.
-		 */
-		*flags |= PCAP_IF_CONNECTION_STATUS_CONNECTED;
-	} else {
-		/*
-		 * It's disconnected.
-		 */
-		*flags |= PCAP_IF_CONNECTION_STATUS_DISCONNECTED;
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] |=
+	    1UL << (node % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+	    NODEMASK_BITS) == -1) {
+		saved->mode = -1;
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "set_mempolicy");
+		return PCAP_ERROR;
 	}
+#else
+	saved->mode = -1;
 #endif
-
-	close(sock);
-
-#ifdef HAVE_SNF_API
-	// For "down" SNF devices the SNF API makes the flags more relevant.
-	if (arptype == ARPHRD_ETHER &&
-	    ! (*flags & PCAP_IF_UP) &&
-	    snf_get_if_flags(name, flags, errbuf) < 0)
-		return PCAP_ERROR;
-#endif // HAVE_SNF_API
-
 	return 0;
 }
 
-int
-pcapint_platform_finddevs(pcap_if_list_t *devlistp, char *errbuf)
-{
-	/*
-	 * Get the list of regular interfaces first.
-	 */
-	if (pcapint_findalldevs_interfaces(devlistp, errbuf, can_be_bound,
-	    get_if_flags) == -1)
-		return (-1);	/* failure */
-
-	/*
-	 * Add the "any" device.
-	 */
-	if (pcapint_add_any_dev(devlistp, errbuf) == NULL)
-		return (-1);
-
-	return (0);
-}
-
-/*
- * Set direction flag: Which packets do we accept on a forwarding
- * single device? IN, OUT or both?
- */
-static int
-pcap_setdirection_linux(pcap_t *handle, pcap_direction_t d)
+static void
+restore_mempolicy(const struct saved_mempolicy *saved)
 {
-	/*
-	 * It's guaranteed, at this point, that d is a valid
-	 * direction value.
-	 */
-	handle->direction = d;
-	return 0;
+#if defined(SYS_get_mempolicy) && defined(SYS_set_mempolicy)
+	if (saved->mode != -1)
+		(void)syscall(SYS_set_mempolicy, saved->mode, saved->mask,
+		    NODEMASK_BITS);
+#endif
 }
 
 static int
-is_wifi(const char *device)
+pcap_set_datalink_linux(pcap_t *handle, int dlt)
 {
-	char *pathstr;
-	struct stat statb;
+	handle->linktype = dlt;
 
 	/*
-	 * See if there's a sysfs wireless directory for it.
-	 * If so, it's a wireless interface.
+	 * Update the offset at which to insert VLAN tags for the
+	 * new link-layer type.
 	 */
-	if (asprintf(&pathstr, "/sys/class/net/%s/wireless", device) == -1) {
-		/*
-		 * Just give up here.
-		 */
-		return 0;
-	}
-	if (stat(pathstr, &statb) == 0) {
-		free(pathstr);
-		return 1;
-	}
-	free(pathstr);
+	set_vlan_offset(handle);
 
 	return 0;
 }
 
 /*
- *  Linux uses the ARP hardware type to identify the type of an
- *  interface. pcap uses the DLT_xxx constants for this. This
- *  function takes a pointer to a "pcap_t", and an ARPHRD_xxx
- *  constant, as arguments, and sets "handle->linktype" to the
- *  appropriate DLT_XXX constant and sets "handle->offset" to
- *  the appropriate value (to make "handle->offset" plus link-layer
- *  header length be a multiple of 4, so that the link-layer payload
- *  will be aligned on a 4-byte boundary when capturing packets).
- *  (If the offset isn't set here, it'll be 0; add code as appropriate
- *  for cases where it shouldn't be 0.)
- *
- *  If "cooked_ok" is non-zero, we can use DLT_LINUX_SLL and capture
- *  in cooked mode; otherwise, we can't use cooked mode, so we have
- *  to pick some type that works in raw mode, or fail.
- *
- *  Sets the link type to -1 if unable to map the type.
+ * linux_check_direction()
  *
- *  Returns 0 on success or a PCAP_ERROR_ value on error.
+ * Do checks based on packet direction.
  */
-static int map_arphrd_to_dlt(pcap_t *handle, int arptype,
-			     const char *device, int cooked_ok)
+static inline int
+linux_check_direction(const pcap_t *handle, const struct sockaddr_ll *sll)
 {
-	static const char cdma_rmnet[] = "cdma_rmnet";
-
-	switch (arptype) {
+	struct pcap_linux	*handlep = handle->priv;
 
-	case ARPHRD_ETHER:
+	if (sll->sll_pkttype == PACKET_OUTGOING) {
 		/*
-		 * For various annoying reasons having to do with DHCP
-		 * software, some versions of Android give the mobile-
-		 * phone-network interface an ARPHRD_ value of
-		 * ARPHRD_ETHER, even though the packets supplied by
-		 * that interface have no link-layer header, and begin
-		 * with an IP header, so that the ARPHRD_ value should
-		 * be ARPHRD_NONE.
-		 *
-		 * Detect those devices by checking the device name, and
-		 * use DLT_RAW for them.
+		 * Outgoing packet.
+		 * If this is from the loopback device, reject it;
+		 * we'll see the packet as an incoming packet as well,
+		 * and we don't want to see it twice.
 		 */
-		if (strncmp(device, cdma_rmnet, sizeof cdma_rmnet - 1) == 0) {
-			handle->linktype = DLT_RAW;
+		if (sll->sll_ifindex == handlep->lo_ifindex)
 			return 0;
-		}
 
 		/*
-		 * Is this a real Ethernet device?  If so, give it a
-		 * link-layer-type list with DLT_EN10MB and DLT_DOCSIS, so
-		 * that an application can let you choose it, in case you're
-		 * capturing DOCSIS traffic that a Cisco Cable Modem
-		 * Termination System is putting out onto an Ethernet (it
-		 * doesn't put an Ethernet header onto the wire, it puts raw
-		 * DOCSIS frames out on the wire inside the low-level
-		 * Ethernet framing).
+		 * If this is an outgoing CAN frame, and the user doesn't
+		 * want only outgoing packets, reject it; CAN devices
+		 * and drivers, and the CAN stack, always arrange to
+		 * loop back transmitted packets, so they also appear
+		 * as incoming packets.  We don't want duplicate packets,
+		 * and we can't easily distinguish packets looped back
+		 * by the CAN layer than those received by the CAN layer,
+		 * so we eliminate this packet instead.
 		 *
-		 * XXX - are there any other sorts of "fake Ethernet" that
-		 * have ARPHRD_ETHER but that shouldn't offer DLT_DOCSIS as
-		 * a Cisco CMTS won't put traffic onto it or get traffic
-		 * bridged onto it?  ISDN is handled in "setup_socket()",
-		 * as we fall back on cooked mode there, and we use
-		 * is_wifi() to check for 802.11 devices; are there any
-		 * others?
+		 * We check whether this is a CAN frame by checking whether
+		 * the device's hardware type is ARPHRD_CAN.
 		 */
-		if (!is_wifi(device)) {
-			int ret;
+		if (sll->sll_hatype == ARPHRD_CAN &&
+		     handle->direction != PCAP_D_OUT)
+			return 0;
 
-			/*
-			 * This is not a Wi-Fi device but it could be
-			 * a DSA master/management network device.
-			 */
-			ret = iface_dsa_get_proto_info(device, handle);
-			if (ret < 0)
-				return ret;
+		/*
+		 * If the user only wants incoming packets, reject it.
+		 */
+		if (handle->direction == PCAP_D_IN)
+			return 0;
+	} else {
+		/*
+		 * Incoming packet.
+		 * If the user only wants outgoing packets, reject it.
+		 */
+		if (handle->direction == PCAP_D_OUT)
+			return 0;
+	}
+	return 1;
+}
 
-			if (ret == 1) {
-				/*
-				 * This is a DSA master/management network
-				 * device, linktype is already set by
-				 * iface_dsa_get_proto_info(), set an
-				 * appropriate offset here.
-				 */
-				handle->offset = 2;
-				break;
-			}
+/*
+ * Check whether the device to which the pcap_t is bound still exists.
+ * We do so by asking what address the socket is bound to, and checking
+ * whether the ifindex in the address is -1, meaning "that device is gone",
+ * or some other value, meaning "that device still exists".
+ */
+static int
+device_still_exists(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct sockaddr_ll addr;
+	socklen_t addr_len;
 
-			/*
-			 * It's not a Wi-Fi device; offer DOCSIS.
-			 */
-			handle->dlt_list = (u_int *) malloc(sizeof(u_int) * 2);
-			if (handle->dlt_list == NULL) {
-				pcapint_fmt_errmsg_for_errno(handle->errbuf,
-				    PCAP_ERRBUF_SIZE, errno, "malloc");
-				return (PCAP_ERROR);
-			}
-			handle->dlt_list[0] = DLT_EN10MB;
-			handle->dlt_list[1] = DLT_DOCSIS;
-			handle->dlt_count = 2;
+	/*
+	 * If handlep->ifindex is -1, the socket isn't bound, meaning
+	 * we're capturing on the "any" device; that device never
+	 * disappears.  (It should also never be configured down, so
+	 * we shouldn't even get here, but let's make sure.)
+	 */
+	if (handlep->ifindex == -1)
+		return (1);	/* it's still here */
+
+	/*
+	 * OK, now try to get the address for the socket.
+	 */
+	addr_len = sizeof (addr);
+	if (getsockname(handle->fd, (struct sockaddr *) &addr, &addr_len) == -1) {
+		/*
+		 * Error - report an error and return -1.
+		 */
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "getsockname failed");
+		return (-1);
+	}
+	if (addr.sll_ifindex == -1) {
+		/*
+		 * This means the device went away.
+		 */
+		return (0);
+	}
+
+	/*
+	 * The device presumably just went down.
+	 */
+	return (1);
+}
+
+static int
+pcap_inject_linux(pcap_t *handle, const void *buf, int size)
+{
+	struct pcap_linux *handlep = handle->priv;
+	int ret;
+
+	if (handlep->ifindex == -1) {
+		/*
+		 * We don't support sending on the "any" device.
+		 */
+		pcapint_strlcpy(handle->errbuf,
+		    "Sending packets isn't supported on the \"any\" device",
+		    PCAP_ERRBUF_SIZE);
+		return (-1);
+	}
+
+	if (handlep->cooked) {
+		/*
+		 * We don't support sending on cooked-mode sockets.
+		 *
+		 * XXX - how do you send on a bound cooked-mode
+		 * socket?
+		 * Is a "sendto()" required there?
+		 */
+		pcapint_strlcpy(handle->errbuf,
+		    "Sending packets isn't supported in cooked mode",
+		    PCAP_ERRBUF_SIZE);
+		return (-1);
+	}
+
+#ifdef PACKET_VNET_HDR
+	if (handlep->vnet_hdr_len != 0) {
+		/*
+		 * With PACKET_VNET_HDR on, the kernel expects each
+		 * packet we send to start with a virtio_net header;
+		 * send an all-zero one, meaning "no offloads".
+		 */
+		struct virtio_net_hdr vnet_hdr;
+		struct iovec iov[2];
+		struct msghdr msg;
+
+		memset(&vnet_hdr, 0, sizeof(vnet_hdr));
+		iov[0].iov_base = &vnet_hdr;
+		iov[0].iov_len = sizeof(vnet_hdr);
+		iov[1].iov_base = (void *)buf;
+		iov[1].iov_len = size;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		ret = (int)sendmsg(handle->fd, &msg, 0);
+		if (ret == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "sendmsg");
+			return (-1);
 		}
-		/* FALLTHROUGH */
+		return (ret - (int)sizeof(vnet_hdr));
+	}
+#endif
 
-	case ARPHRD_METRICOM:
-	case ARPHRD_LOOPBACK:
-		handle->linktype = DLT_EN10MB;
-		handle->offset = 2;
-		break;
+	ret = (int)send(handle->fd, buf, size, 0);
+	if (ret == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "send");
+		return (-1);
+	}
+	return (ret);
+}
 
-	case ARPHRD_EETHER:
-		handle->linktype = DLT_EN3MB;
-		break;
+#define TX_RING_FRAME(handlep, i) \
+	((handlep)->tx_ring + (size_t)(i) * (handlep)->tx_frame_size)
 
-	case ARPHRD_AX25:
-		handle->linktype = DLT_AX25_KISS;
-		break;
+static u_int
+tx_frame_status(struct pcap_linux *handlep, u_char *frame)
+{
+#ifdef HAVE_TPACKET3
+	if (handlep->tp_version == TPACKET_V3)
+		return __atomic_load_n(&((struct tpacket3_hdr *)frame)->tp_status,
+		    __ATOMIC_ACQUIRE);
+#endif
+	return __atomic_load_n(&((struct tpacket2_hdr *)frame)->tp_status,
+	    __ATOMIC_ACQUIRE);
+}
 
-	case ARPHRD_PRONET:
-		handle->linktype = DLT_PRONET;
-		break;
+static void
+tx_frame_set_status(struct pcap_linux *handlep, u_char *frame, u_int status)
+{
+#ifdef HAVE_TPACKET3
+	if (handlep->tp_version == TPACKET_V3) {
+		__atomic_store_n(&((struct tpacket3_hdr *)frame)->tp_status,
+		    status, __ATOMIC_RELEASE);
+		return;
+	}
+#endif
+	__atomic_store_n(&((struct tpacket2_hdr *)frame)->tp_status, status,
+	    __ATOMIC_RELEASE);
+}
 
-	case ARPHRD_CHAOS:
-		handle->linktype = DLT_CHAOS;
-		break;
+/*
+ * Copy a packet into the next frame of the tx ring and mark it as
+ * ready to send.  The caller makes sure the frame is free.
+ */
+static void
+tx_ring_put(struct pcap_linux *handlep, const u_char *pkt, u_int len)
+{
+	u_char *frame = TX_RING_FRAME(handlep, handlep->tx_head);
+	u_char *data = frame + TPACKET_ALIGN(handlep->tp_hdrlen);
 
-	case ARPHRD_CAN:
-		handle->linktype = DLT_CAN_SOCKETCAN;
-		break;
+	/*
+	 * Unless PACKET_TX_HAS_OFF is set, the kernel expects the
+	 * packet right after the (aligned) frame header, preceded,
+	 * if PACKET_VNET_HDR is on, by a virtio_net header; an
+	 * all-zero one means "no offloads".
+	 */
+	memset(data, 0, handlep->vnet_hdr_len);
+	memcpy(data + handlep->vnet_hdr_len, pkt, len);
+	len += handlep->vnet_hdr_len;
+#ifdef HAVE_TPACKET3
+	if (handlep->tp_version == TPACKET_V3) {
+		struct tpacket3_hdr *h3 = (struct tpacket3_hdr *)frame;
 
-	case ARPHRD_IEEE802_TR:
-	case ARPHRD_IEEE802:
-		handle->linktype = DLT_IEEE802;
-		handle->offset = 2;
-		break;
+		h3->tp_next_offset = 0;
+		h3->tp_len = len;
+		h3->tp_snaplen = len;
+	} else
+#endif
+	{
+		struct tpacket2_hdr *h2 = (struct tpacket2_hdr *)frame;
 
-	case ARPHRD_ARCNET:
-		handle->linktype = DLT_ARCNET_LINUX;
-		break;
+		h2->tp_len = len;
+		h2->tp_snaplen = len;
+	}
+	tx_frame_set_status(handlep, frame, TP_STATUS_SEND_REQUEST);
+	if (++handlep->tx_head == handlep->tx_frame_nr)
+		handlep->tx_head = 0;
+}
 
-	case ARPHRD_FDDI:
-		handle->linktype = DLT_FDDI;
-		handle->offset = 3;
-		break;
+/*
+ * Have the kernel send the "n" frames starting at frame "first", and
+ * wait for it to finish with them.  Returns the number of them that
+ * were sent; if that's less than n, handle->errbuf has the error.
+ */
+static u_int
+tx_ring_flush(pcap_t *handle, u_int first, u_int n)
+{
+	struct pcap_linux *handlep = handle->priv;
+	static const struct timespec tick = { 0, 100000 };	/* 100 us */
+	u_char *frame;
+	u_int i, sent;
+	int err;
+
+	/*
+	 * Without MSG_DONTWAIT, send() doesn't return until every
+	 * frame that's been handed to the kernel has been sent.
+	 */
+	while (send(handle->fd, NULL, 0, 0) == -1) {
+		if (errno == EINTR)
+			continue;
+		err = errno;
 
-	case ARPHRD_ATM:
 		/*
-		 * The Classical IP implementation in ATM for Linux
-		 * supports both what RFC 1483 calls "LLC Encapsulation",
-		 * in which each packet has an LLC header, possibly
-		 * with a SNAP header as well, prepended to it, and
-		 * what RFC 1483 calls "VC Based Multiplexing", in which
-		 * different virtual circuits carry different network
-		 * layer protocols, and no header is prepended to packets.
-		 *
-		 * They both have an ARPHRD_ type of ARPHRD_ATM, so
-		 * you can't use the ARPHRD_ type to find out whether
-		 * captured packets will have an LLC header, and,
-		 * while there's a socket ioctl to *set* the encapsulation
-		 * type, there's no ioctl to *get* the encapsulation type.
-		 *
-		 * This means that
-		 *
-		 *	programs that dissect Linux Classical IP frames
-		 *	would have to check for an LLC header and,
-		 *	depending on whether they see one or not, dissect
-		 *	the frame as LLC-encapsulated or as raw IP (I
-		 *	don't know whether there's any traffic other than
-		 *	IP that would show up on the socket, or whether
-		 *	there's any support for IPv6 in the Linux
-		 *	Classical IP code);
-		 *
-		 *	filter expressions would have to compile into
-		 *	code that checks for an LLC header and does
-		 *	the right thing.
-		 *
-		 * Both of those are a nuisance - and, at least on systems
-		 * that support PF_PACKET sockets, we don't have to put
-		 * up with those nuisances; instead, we can just capture
-		 * in cooked mode.  That's what we'll do, if we can.
-		 * Otherwise, we'll just fail.
-		 */
-		if (cooked_ok)
-			handle->linktype = DLT_LINUX_SLL;
-		else
-			handle->linktype = -1;
-		break;
-
-	case ARPHRD_IEEE80211:
-		handle->linktype = DLT_IEEE802_11;
-		break;
-
-	case ARPHRD_IEEE80211_PRISM:
-		handle->linktype = DLT_PRISM_HEADER;
-		break;
-
-	case ARPHRD_IEEE80211_RADIOTAP:
-		handle->linktype = DLT_IEEE802_11_RADIO;
-		break;
-
-	case ARPHRD_PPP:
-		/*
-		 * Some PPP code in the kernel supplies no link-layer
-		 * header whatsoever to PF_PACKET sockets; other PPP
-		 * code supplies PPP link-layer headers ("syncppp.c");
-		 * some PPP code might supply random link-layer
-		 * headers (PPP over ISDN - there's code in Wireshark,
-		 * for example, to cope with PPP-over-ISDN captures
-		 * with which the Wireshark developers have had to cope,
-		 * heuristically trying to determine which of the
-		 * oddball link-layer headers particular packets have).
-		 *
-		 * As such, we just punt, and run all PPP interfaces
-		 * in cooked mode, if we can; otherwise, we just treat
-		 * it as DLT_RAW, for now - if somebody needs to capture,
-		 * on a 2.0[.x] kernel, on PPP devices that supply a
-		 * link-layer header, they'll have to add code here to
-		 * map to the appropriate DLT_ type (possibly adding a
-		 * new DLT_ type, if necessary).
+		 * On an error, send() doesn't wait for the frames it
+		 * did hand to the driver, and those stay the kernel's
+		 * until they've gone out; wait for them, as we can't
+		 * reuse them before then, and they count as sent.
 		 */
-		if (cooked_ok)
-			handle->linktype = DLT_LINUX_SLL;
-		else {
-			/*
-			 * XXX - handle ISDN types here?  We can't fall
-			 * back on cooked sockets, so we'd have to
-			 * figure out from the device name what type of
-			 * link-layer encapsulation it's using, and map
-			 * that to an appropriate DLT_ value, meaning
-			 * we'd map "isdnN" devices to DLT_RAW (they
-			 * supply raw IP packets with no link-layer
-			 * header) and "isdY" devices to a new DLT_I4L_IP
-			 * type that has only an Ethernet packet type as
-			 * a link-layer header.
-			 *
-			 * But sometimes we seem to get random crap
-			 * in the link-layer header when capturing on
-			 * ISDN devices....
-			 */
-			handle->linktype = DLT_RAW;
+		for (i = 0; i < n; i++) {
+			frame = TX_RING_FRAME(handlep,
+			    (first + i) % handlep->tx_frame_nr);
+			while (tx_frame_status(handlep, frame) & TP_STATUS_SENDING)
+				(void)nanosleep(&tick, NULL);
 		}
-		break;
-
-	case ARPHRD_CISCO:
-		handle->linktype = DLT_C_HDLC;
-		break;
-
-	/* Not sure if this is correct for all tunnels, but it
-	 * works for CIPE */
-	case ARPHRD_TUNNEL:
-	case ARPHRD_SIT:
-	case ARPHRD_CSLIP:
-	case ARPHRD_SLIP6:
-	case ARPHRD_CSLIP6:
-	case ARPHRD_ADAPT:
-	case ARPHRD_SLIP:
-	case ARPHRD_RAWHDLC:
-	case ARPHRD_DLCI:
-		/*
-		 * XXX - should some of those be mapped to DLT_LINUX_SLL
-		 * instead?  Should we just map all of them to DLT_LINUX_SLL?
-		 */
-		handle->linktype = DLT_RAW;
-		break;
-
-	case ARPHRD_FRAD:
-		handle->linktype = DLT_FRELAY;
-		break;
-
-	case ARPHRD_LOCALTLK:
-		handle->linktype = DLT_LTALK;
-		break;
-
-	case 18:
-		/*
-		 * RFC 4338 defines an encapsulation for IP and ARP
-		 * packets that's compatible with the RFC 2625
-		 * encapsulation, but that uses a different ARP
-		 * hardware type and hardware addresses.  That
-		 * ARP hardware type is 18; Linux doesn't define
-		 * any ARPHRD_ value as 18, but if it ever officially
-		 * supports RFC 4338-style IP-over-FC, it should define
-		 * one.
-		 *
-		 * For now, we map it to DLT_IP_OVER_FC, in the hopes
-		 * that this will encourage its use in the future,
-		 * should Linux ever officially support RFC 4338-style
-		 * IP-over-FC.
-		 */
-		handle->linktype = DLT_IP_OVER_FC;
-		break;
 
-	case ARPHRD_FCPP:
-	case ARPHRD_FCAL:
-	case ARPHRD_FCPL:
-	case ARPHRD_FCFABRIC:
 		/*
-		 * Back in 2002, Donald Lee at Cray wanted a DLT_ for
-		 * IP-over-FC:
-		 *
-		 *	https://www.mail-archive.com/tcpdump-workers@sandelman.ottawa.on.ca/msg01043.html
-		 *
-		 * and one was assigned.
-		 *
-		 * In a later private discussion (spun off from a message
-		 * on the ethereal-users list) on how to get that DLT_
-		 * value in libpcap on Linux, I ended up deciding that
-		 * the best thing to do would be to have him tweak the
-		 * driver to set the ARPHRD_ value to some ARPHRD_FCxx
-		 * type, and map all those types to DLT_IP_OVER_FC:
-		 *
-		 *	I've checked into the libpcap and tcpdump CVS tree
-		 *	support for DLT_IP_OVER_FC.  In order to use that,
-		 *	you'd have to modify your modified driver to return
-		 *	one of the ARPHRD_FCxxx types, in "fcLINUXfcp.c" -
-		 *	change it to set "dev->type" to ARPHRD_FCFABRIC, for
-		 *	example (the exact value doesn't matter, it can be
-		 *	any of ARPHRD_FCPP, ARPHRD_FCAL, ARPHRD_FCPL, or
-		 *	ARPHRD_FCFABRIC).
-		 *
-		 * 11 years later, Christian Svensson wanted to map
-		 * various ARPHRD_ values to DLT_FC_2 and
-		 * DLT_FC_2_WITH_FRAME_DELIMS for raw Fibre Channel
-		 * frames:
-		 *
-		 *	https://github.com/mcr/libpcap/pull/29
-		 *
-		 * There don't seem to be any network drivers that use
-		 * any of the ARPHRD_FC* values for IP-over-FC, and
-		 * it's not exactly clear what the "Dummy types for non
-		 * ARP hardware" are supposed to mean (link-layer
-		 * header type?  Physical network type?), so it's
-		 * not exactly clear why the ARPHRD_FC* types exist
-		 * in the first place.
-		 *
-		 * For now, we map them to DLT_FC_2, and provide an
-		 * option of DLT_FC_2_WITH_FRAME_DELIMS, as well as
-		 * DLT_IP_OVER_FC just in case there's some old
-		 * driver out there that uses one of those types for
-		 * IP-over-FC on which somebody wants to capture
-		 * packets.
+		 * The kernel stopped at the first frame it didn't send,
+		 * and will start from there next time; take back that
+		 * frame and the ones after it, which it has either left
+		 * alone or marked as having the wrong format, and start
+		 * filling in the ring from there.
 		 */
-		handle->linktype = DLT_FC_2;
-		handle->dlt_list = (u_int *) malloc(sizeof(u_int) * 3);
-		if (handle->dlt_list == NULL) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno, "malloc");
-			return (PCAP_ERROR);
+		for (sent = 0; sent < n; sent++) {
+			frame = TX_RING_FRAME(handlep,
+			    (first + sent) % handlep->tx_frame_nr);
+			if (tx_frame_status(handlep, frame) != TP_STATUS_AVAILABLE)
+				break;
 		}
-		handle->dlt_list[0] = DLT_FC_2;
-		handle->dlt_list[1] = DLT_FC_2_WITH_FRAME_DELIMS;
-		handle->dlt_list[2] = DLT_IP_OVER_FC;
-		handle->dlt_count = 3;
-		break;
-
-	case ARPHRD_IRDA:
-		/* Don't expect IP packet out of this interfaces... */
-		handle->linktype = DLT_LINUX_IRDA;
-		/* We need to save packet direction for IrDA decoding,
-		 * so let's use "Linux-cooked" mode. Jean II
-		 *
-		 * XXX - this is handled in setup_socket(). */
-		/* handlep->cooked = 1; */
-		break;
-
-	case ARPHRD_LAPD:
-		/* Don't expect IP packet out of this interfaces... */
-		handle->linktype = DLT_LINUX_LAPD;
-		break;
-
-	case ARPHRD_NONE:
-		/*
-		 * No link-layer header; packets are just IP
-		 * packets, so use DLT_RAW.
-		 */
-		handle->linktype = DLT_RAW;
-		break;
-
-	case ARPHRD_IEEE802154:
-		handle->linktype = DLT_IEEE802_15_4_NOFCS;
-		break;
-
-	case ARPHRD_NETLINK:
-		handle->linktype = DLT_NETLINK;
-		/*
-		 * We need to use cooked mode, so that in sll_protocol we
-		 * pick up the netlink protocol type such as NETLINK_ROUTE,
-		 * NETLINK_GENERIC, NETLINK_FIB_LOOKUP, etc.
-		 *
-		 * XXX - this is handled in setup_socket().
-		 */
-		/* handlep->cooked = 1; */
-		break;
-
-	case ARPHRD_VSOCKMON:
-		handle->linktype = DLT_VSOCK;
-		break;
-
-	default:
-		handle->linktype = -1;
-		break;
+		for (i = sent; i < n; i++) {
+			frame = TX_RING_FRAME(handlep,
+			    (first + i) % handlep->tx_frame_nr);
+			tx_frame_set_status(handlep, frame, TP_STATUS_AVAILABLE);
+		}
+		handlep->tx_head = (first + sent) % handlep->tx_frame_nr;
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    err, "send");
+		return sent;
 	}
-	return (0);
+	return n;
 }
 
 /*
- * Try to set up a PF_PACKET socket.
- * Returns 0 or a PCAP_WARNING_ value on success and a PCAP_ERROR_ value
- * on failure.
+ * Send the packets in a send queue through the tx ring: copy as many
+ * of them as fit into the ring, or, in sync mode, as many as are due
+ * to go out, hand them all to the kernel with one send(), and repeat.
  */
-static int
-setup_socket(pcap_t *handle, int is_any_device)
+static u_int
+pcap_sendqueue_transmit_linux(pcap_t *handle, pcap_send_queue *queue,
+    int sync)
 {
 	struct pcap_linux *handlep = handle->priv;
-	const char		*device = handle->opt.device;
-	int			status = 0;
-	int			sock_fd, arptype;
-	int			val;
-	int			err = 0;
-	struct packet_mreq	mr;
-
-	/*
-	 * Open a socket with protocol family packet. If cooked is true,
-	 * we open a SOCK_DGRAM socket for the cooked interface, otherwise
-	 * we open a SOCK_RAW socket for the raw interface.
-	 *
-	 * The protocol is set to 0.  This means we will receive no
-	 * packets until we "bind" the socket with a non-zero
-	 * protocol.  This allows us to setup the ring buffers without
-	 * dropping any packets.
-	 */
-	sock_fd = is_any_device ?
-		socket(PF_PACKET, SOCK_DGRAM, 0) :
-		socket(PF_PACKET, SOCK_RAW, 0);
+	struct pcap_pkthdr first, h;
+	struct timespec start;
+	u_int off, round_off, first_frame, n, sent, maxlen;
+	int error = 0;
+
+	maxlen = handlep->tx_frame_size - TPACKET_ALIGN(handlep->tp_hdrlen) -
+	    handlep->vnet_hdr_len;
+	off = 0;
+	while (off < queue->len && !error) {
+		round_off = off;
+		first_frame = handlep->tx_head;
+		for (n = 0; n < handlep->tx_frame_nr && off < queue->len; n++) {
+			if (queue->len - off < sizeof(h)) {
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				    "Packet at offset %u runs past the end of the send queue",
+				    off);
+				error = 1;
+				break;
+			}
+			memcpy(&h, queue->buffer + off, sizeof(h));
+			if (h.caplen > queue->len - off - sizeof(h)) {
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				    "Packet at offset %u runs past the end of the send queue",
+				    off);
+				error = 1;
+				break;
+			}
+			if (h.caplen > maxlen) {
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				    "Packet at offset %u is bigger than the %u bytes that fit in a tx ring frame",
+				    off, maxlen);
+				error = 1;
+				break;
+			}
+			if (sync) {
+				if (off == 0) {
+					first = h;
+					(void)clock_gettime(CLOCK_MONOTONIC,
+					    &start);
+				} else if (!pcapint_sendqueue_wait(&start,
+				    pcapint_sendqueue_due(handle, &first, &h),
+				    n == 0)) {
+					/*
+					 * Not due yet; send what's due now,
+					 * and wait for this one next time.
+					 */
+					break;
+				}
+			}
+			tx_ring_put(handlep,
+			    (const u_char *)queue->buffer + off + sizeof(h),
+			    h.caplen);
+			off += (u_int)sizeof(h) + h.caplen;
+		}
+		if (n == 0)
+			break;
 
-	if (sock_fd == -1) {
-		if (errno == EPERM || errno == EACCES) {
-			/*
-			 * You don't have permission to open the
-			 * socket.
-			 */
-			status = PCAP_ERROR_PERM_DENIED;
-			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-			    "Attempt to create packet socket failed - CAP_NET_RAW may be required");
-		} else if (errno == EAFNOSUPPORT) {
-			/*
-			 * PF_PACKET sockets not supported.
-			 * Perhaps we're running on the WSL1 module
-			 * in the Windows NT kernel rather than on
-			 * a real Linux kernel.
-			 */
-			status = PCAP_ERROR_CAPTURE_NOTSUP;
-			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-			    "PF_PACKET sockets not supported - is this WSL1?");
-		} else {
+		sent = tx_ring_flush(handle, first_frame, n);
+		if (sent < n) {
 			/*
-			 * Other error.
+			 * Return the number of bytes of the queue that
+			 * went out, as NPF does.
 			 */
-			status = PCAP_ERROR;
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno, "socket");
+			off = round_off;
+			while (sent-- != 0) {
+				memcpy(&h, queue->buffer + off, sizeof(h));
+				off += (u_int)sizeof(h) + h.caplen;
+			}
+			break;
 		}
-		return status;
 	}
+	return off;
+}
 
+/*
+ * Fetch the socket's packet counts from the kernel and add them to our
+ * running totals; each call to
+ *    getsockopt(handle->fd, SOL_PACKET, PACKET_STATISTICS, ....
+ * resets the counters to zero.
+ */
+static int
+linux_update_kstats(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+#ifdef HAVE_TPACKET3
 	/*
-	 * Get the interface index of the loopback device.
-	 * If the attempt fails, don't fail, just set the
-	 * "handlep->lo_ifindex" to -1.
-	 *
-	 * XXX - can there be more than one device that loops
-	 * packets back, i.e. devices other than "lo"?  If so,
-	 * we'd need to find them all, and have an array of
-	 * indices for them, and check all of them in
-	 * "pcap_read_packet()".
+	 * For sockets using TPACKET_V2, the extra stuff at the end
+	 * of a struct tpacket_stats_v3 will not be filled in; the
+	 * PF_PACKET socket code in the kernel only copies out a
+	 * struct tpacket_stats for those sockets, and sets len to
+	 * the amount of data it copied out.
 	 */
-	handlep->lo_ifindex = iface_get_id(sock_fd, "lo", handle->errbuf);
+	struct tpacket_stats_v3 kstats;
+#else /* HAVE_TPACKET3 */
+	struct tpacket_stats kstats;
+#endif /* HAVE_TPACKET3 */
+	socklen_t len = sizeof (kstats);
+
+	if (getsockopt(handle->fd, SOL_PACKET, PACKET_STATISTICS,
+			&kstats, &len) == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "failed to get statistics from socket");
+		return -1;
+	}
+	handlep->stat.ps_recv += kstats.tp_packets;
+	handlep->stat.ps_drop += kstats.tp_drops;
+	handlep->recv64 += kstats.tp_packets;
+	handlep->drop64 += kstats.tp_drops;
+#ifdef HAVE_TPACKET3
+	if (len >= sizeof (struct tpacket_stats_v3))
+		handlep->freeze_q64 += kstats.tp_freeze_q_cnt;
+#endif /* HAVE_TPACKET3 */
+	return 0;
+}
+
+/*
+ *  Get the statistics for the given packet capture handle.
+ */
+static int
+pcap_stats_linux(pcap_t *handle, struct pcap_stat *stats)
+{
+	struct pcap_linux *handlep = handle->priv;
 
 	/*
-	 * Default value for offset to align link-layer payload
-	 * on a 4-byte boundary.
+	 * To fill in ps_ifdrop, we get the interface's
+	 * rx_missed_errors and rx_fifo_errors counts, and report
+	 * how much their sum has grown since we were activated.
+	 *
+	 * The counts are 64-bit; pcap_stats64() reports all of them.
 	 */
-	handle->offset	 = 0;
+	if (handle->opt.promisc)
+		handlep->stat.ps_ifdrop =
+		    (u_int)(linux_if_drops(handle) - handlep->if_drops_start);
 
 	/*
-	 * What kind of frames do we have to deal with? Fall back
-	 * to cooked mode if we have an unknown interface type
-	 * or a type we know doesn't work well in raw mode.
+	 * Try to get the packet counts from the kernel.
+	 *
+	 * "ps_recv" counts only packets that *passed* the
+	 * filter, not packets that didn't pass the filter.
+	 * This includes packets later dropped because we
+	 * ran out of buffer space.
+	 *
+	 * "ps_drop" counts packets dropped because we ran
+	 * out of buffer space.  It doesn't count packets
+	 * dropped by the interface driver.  It counts only
+	 * packets that passed the filter.
+	 *
+	 * See above for ps_ifdrop.
+	 *
+	 * Both statistics include packets not yet read from
+	 * the kernel by libpcap, and thus not yet seen by
+	 * the application.
+	 *
+	 * In "linux/net/packet/af_packet.c", at least in 2.6.27
+	 * through 5.6 kernels, "tp_packets" is incremented for
+	 * every packet that passes the packet filter *and* is
+	 * successfully copied to the ring buffer; "tp_drops" is
+	 * incremented for every packet dropped because there's
+	 * not enough free space in the ring buffer.
+	 *
+	 * When the statistics are returned for a PACKET_STATISTICS
+	 * "getsockopt()" call, "tp_drops" is added to "tp_packets",
+	 * so that "tp_packets" counts all packets handed to
+	 * the PF_PACKET socket, including packets dropped because
+	 * there wasn't room on the socket buffer - but not
+	 * including packets that didn't pass the filter.
+	 *
+	 * In the BSD BPF, the count of received packets is
+	 * incremented for every packet handed to BPF, regardless
+	 * of whether it passed the filter.
+	 *
+	 * We can't make "pcap_stats()" work the same on both
+	 * platforms, but the best approximation is to return
+	 * "tp_packets" as the count of packets and "tp_drops"
+	 * as the count of drops.
 	 */
-	if (!is_any_device) {
-		/* Assume for now we don't need cooked mode. */
-		handlep->cooked = 0;
+	if (linux_update_kstats(handle) == -1)
+		return -1;
+	*stats = handlep->stat;
+	return 0;
+}
 
-		if (handle->opt.rfmon) {
-			/*
-			 * We were asked to turn on monitor mode.
-			 * Do so before we get the link-layer type,
-			 * because entering monitor mode could change
-			 * the link-layer type.
-			 */
-			err = enter_rfmon_mode(handle, sock_fd, device);
-			if (err < 0) {
-				/* Hard failure */
-				close(sock_fd);
-				return err;
-			}
-			if (err == 0) {
-				/*
-				 * Nothing worked for turning monitor mode
-				 * on.
-				 */
-				close(sock_fd);
+int
+pcap_stats64(pcap_t *p, struct pcap_stat64 *ps)
+{
+	struct pcap_linux *handlep;
+	pcap_t *qp;
+	int i;
 
-				return PCAP_ERROR_RFMON_NOTSUP;
-			}
+	if (!p->activated) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle hasn't been activated yet");
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (p->inject_op != pcap_inject_linux) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "64-bit statistics are only available when capturing on a network interface");
+		return (PCAP_ERROR);
+	}
+	memset(ps, 0, sizeof(*ps));
+	ps->ps64_flags = PCAP_STAT64_RECV | PCAP_STAT64_DROP |
+	    PCAP_STAT64_FILTERED;
 
-			/*
-			 * Either monitor mode has been turned on for
-			 * the device, or we've been given a different
-			 * device to open for monitor mode.  If we've
-			 * been given a different device, use it.
-			 */
-			if (handlep->mondevice != NULL)
-				device = handlep->mondevice;
-		}
-		arptype	= iface_get_arptype(sock_fd, device, handle->errbuf);
-		if (arptype < 0) {
-			close(sock_fd);
-			return arptype;
-		}
-		status = map_arphrd_to_dlt(handle, arptype, device, 1);
-		if (status < 0) {
-			close(sock_fd);
-			return status;
+	/*
+	 * Add up the counts for all the queues.
+	 */
+	for (i = -1; i < p->nqueues; i++) {
+		qp = i == -1 ? p : p->queues[i];
+		handlep = qp->priv;
+		if (linux_update_kstats(qp) == -1) {
+			if (qp != p)
+				pcapint_strlcpy(p->errbuf, qp->errbuf,
+				    PCAP_ERRBUF_SIZE);
+			return (PCAP_ERROR);
 		}
-		if (handle->linktype == -1 ||
-		    handle->linktype == DLT_LINUX_SLL ||
-		    handle->linktype == DLT_LINUX_IRDA ||
-		    handle->linktype == DLT_LINUX_LAPD ||
-		    handle->linktype == DLT_NETLINK ||
-		    (handle->linktype == DLT_EN10MB &&
-		     (strncmp("isdn", device, 4) == 0 ||
-		      strncmp("isdY", device, 4) == 0))) {
-			/*
-			 * Unknown interface type (-1), or a
-			 * device we explicitly chose to run
-			 * in cooked mode (e.g., PPP devices),
-			 * or an ISDN device (whose link-layer
-			 * type we can only determine by using
-			 * APIs that may be different on different
-			 * kernels) - reopen in cooked mode.
-			 *
-			 * If the type is unknown, return a warning;
-			 * map_arphrd_to_dlt() has already set the
-			 * warning message.
-			 */
-			if (close(sock_fd) == -1) {
-				pcapint_fmt_errmsg_for_errno(handle->errbuf,
-				    PCAP_ERRBUF_SIZE, errno, "close");
-				return PCAP_ERROR;
-			}
-			sock_fd = socket(PF_PACKET, SOCK_DGRAM, 0);
-			if (sock_fd < 0) {
-				/*
-				 * Fatal error.  We treat this as
-				 * a generic error; we already know
-				 * that we were able to open a
-				 * PF_PACKET/SOCK_RAW socket, so
-				 * any failure is a "this shouldn't
-				 * happen" case.
-				 */
-				pcapint_fmt_errmsg_for_errno(handle->errbuf,
-				    PCAP_ERRBUF_SIZE, errno, "socket");
-				return PCAP_ERROR;
-			}
-			handlep->cooked = 1;
-
-			/*
-			 * Get rid of any link-layer type list
-			 * we allocated - this only supports cooked
-			 * capture.
-			 */
-			if (handle->dlt_list != NULL) {
-				free(handle->dlt_list);
-				handle->dlt_list = NULL;
-				handle->dlt_count = 0;
-			}
+		ps->ps64_recv += handlep->recv64;
+		ps->ps64_drop += handlep->drop64;
+		ps->ps64_freeze_q += handlep->freeze_q64;
+		ps->ps64_filtered += handlep->filtered64;
+	}
 
-			if (handle->linktype == -1) {
-				/*
-				 * Warn that we're falling back on
-				 * cooked mode; we may want to
-				 * update "map_arphrd_to_dlt()"
-				 * to handle the new type.
-				 */
-				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-					"arptype %d not "
-					"supported by libpcap - "
-					"falling back to cooked "
-					"socket",
-					arptype);
-				status = PCAP_WARNING;
-			}
+	/*
+	 * The interface's count covers all of them.
+	 */
+	handlep = p->priv;
+	if (handlep->ifindex != -1) {
+		ps->ps64_flags |= PCAP_STAT64_IFDROP;
+		ps->ps64_ifdrop =
+		    (uint64_t)(linux_if_drops(p) - handlep->if_drops_start);
+	}
+#ifdef HAVE_TPACKET3
+	if (handlep->tp_version == TPACKET_V3)
+		ps->ps64_flags |= PCAP_STAT64_FREEZE_Q;
+#endif /* HAVE_TPACKET3 */
+	return (0);
+}
 
-			/*
-			 * IrDA capture is not a real "cooked" capture,
-			 * it's IrLAP frames, not IP packets.  The
-			 * same applies to LAPD capture.
-			 */
-			if (handle->linktype != DLT_LINUX_IRDA &&
-			    handle->linktype != DLT_LINUX_LAPD &&
-			    handle->linktype != DLT_NETLINK)
-				handle->linktype = DLT_LINUX_SLL;
-		}
+/*
+ * A PF_PACKET socket can be bound to any network interface.
+ */
+static int
+can_be_bound(const char *name _U_)
+{
+	return (1);
+}
 
-		handlep->ifindex = iface_get_id(sock_fd, device,
-		    handle->errbuf);
-		if (handlep->ifindex == -1) {
-			close(sock_fd);
-			return PCAP_ERROR;
-		}
+/*
+ * Get a socket to use with various interface ioctls.
+ */
+static int
+get_if_ioctl_socket(void)
+{
+	int fd;
 
-		if ((err = iface_bind(sock_fd, handlep->ifindex,
-		    handle->errbuf, 0)) != 0) {
-			close(sock_fd);
-			return err;
-		}
-	} else {
+	/*
+	 * This is a bit ugly.
+	 *
+	 * There isn't a socket type that's guaranteed to work.
+	 *
+	 * AF_NETLINK will work *if* you have Netlink configured into the
+	 * kernel (can it be configured out if you have any networking
+	 * support at all?) *and* if you're running a sufficiently recent
+	 * kernel, but not all the kernels we support are sufficiently
+	 * recent - that feature was introduced in Linux 4.6.
+	 *
+	 * AF_UNIX will work *if* you have UNIX-domain sockets configured
+	 * into the kernel and *if* you're not on a system that doesn't
+	 * allow them - some SELinux systems don't allow you create them.
+	 * Most systems probably have them configured in, but not all systems
+	 * have them configured in and allow them to be created.
+	 *
+	 * AF_INET will work *if* you have IPv4 configured into the kernel,
+	 * but, apparently, some systems have network adapters but have
+	 * kernels without IPv4 support.
+	 *
+	 * AF_INET6 will work *if* you have IPv6 configured into the
+	 * kernel, but if you don't have AF_INET, you might not have
+	 * AF_INET6, either (that is, independently on its own grounds).
+	 *
+	 * AF_PACKET would work, except that some of these calls should
+	 * work even if you *don't* have capture permission (you should be
+	 * able to enumerate interfaces and get information about them
+	 * without capture permission; you shouldn't get a failure until
+	 * you try pcap_activate()).  (If you don't allow programs to
+	 * get as much information as possible about interfaces if you
+	 * don't have permission to capture, you run the risk of users
+	 * asking "why isn't it showing XXX" - or, worse, if you don't
+	 * show interfaces *at all* if you don't have permission to
+	 * capture on them, "why do no interfaces show up?" - when the
+	 * real problem is a permissions problem.  Error reports of that
+	 * type require a lot more back-and-forth to debug, as evidenced
+	 * by many Wireshark bugs/mailing list questions/Q&A questions.)
+	 *
+	 * So:
+	 *
+	 * we first try an AF_NETLINK socket, where "try" includes
+	 * "try to do a device ioctl on it", as, in the future, once
+	 * pre-4.6 kernels are sufficiently rare, that will probably
+	 * be the mechanism most likely to work;
+	 *
+	 * if that fails, we try an AF_UNIX socket, as that's less
+	 * likely to be configured out on a networking-capable system
+	 * than is IP;
+	 *
+	 * if that fails, we try an AF_INET6 socket;
+	 *
+	 * if that fails, we try an AF_INET socket.
+	 */
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (fd != -1) {
 		/*
-		 * The "any" device.
+		 * OK, let's make sure we can do an SIOCGIFNAME
+		 * ioctl.
 		 */
-		if (handle->opt.rfmon) {
+		struct ifreq ifr;
+
+		memset(&ifr, 0, sizeof(ifr));
+		if (ioctl(fd, SIOCGIFNAME, &ifr) == 0 ||
+		    errno != EOPNOTSUPP) {
 			/*
-			 * It doesn't support monitor mode.
+			 * It succeeded, or failed for some reason
+			 * other than "netlink sockets don't support
+			 * device ioctls".  Go with the AF_NETLINK
+			 * socket.
 			 */
-			close(sock_fd);
-			return PCAP_ERROR_RFMON_NOTSUP;
-		}
-
-		/*
-		 * It uses cooked mode.
-		 * Support both DLT_LINUX_SLL and DLT_LINUX_SLL2.
-		 */
-		handlep->cooked = 1;
-		handle->linktype = DLT_LINUX_SLL;
-		handle->dlt_list = (u_int *) malloc(sizeof(u_int) * 2);
-		if (handle->dlt_list == NULL) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno, "malloc");
-			close(sock_fd);
-			return (PCAP_ERROR);
+			return (fd);
 		}
-		handle->dlt_list[0] = DLT_LINUX_SLL;
-		handle->dlt_list[1] = DLT_LINUX_SLL2;
-		handle->dlt_count = 2;
 
 		/*
-		 * We're not bound to a device.
-		 * For now, we're using this as an indication
-		 * that we can't transmit; stop doing that only
-		 * if we figure out how to transmit in cooked
-		 * mode.
+		 * OK, that didn't work, so it's as bad as "netlink
+		 * sockets aren't available".  Close the socket and
+		 * drive on.
 		 */
-		handlep->ifindex = -1;
+		close(fd);
 	}
 
 	/*
-	 * Select promiscuous mode on if "promisc" is set.
-	 *
-	 * Do not turn allmulti mode on if we don't select
-	 * promiscuous mode - on some devices (e.g., Orinoco
-	 * wireless interfaces), allmulti mode isn't supported
-	 * and the driver implements it by turning promiscuous
-	 * mode on, and that screws up the operation of the
-	 * card as a normal networking interface, and on no
-	 * other platform I know of does starting a non-
-	 * promiscuous capture affect which multicast packets
-	 * are received by the interface.
-	 */
-
-	/*
-	 * Hmm, how can we set promiscuous mode on all interfaces?
-	 * I am not sure if that is possible at all.  For now, we
-	 * silently ignore attempts to turn promiscuous mode on
-	 * for the "any" device (so you don't have to explicitly
-	 * disable it in programs such as tcpdump).
+	 * Now try an AF_UNIX socket.
 	 */
-
-	if (!is_any_device && handle->opt.promisc) {
-		memset(&mr, 0, sizeof(mr));
-		mr.mr_ifindex = handlep->ifindex;
-		mr.mr_type    = PACKET_MR_PROMISC;
-		if (setsockopt(sock_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
-		    &mr, sizeof(mr)) == -1) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno, "setsockopt (PACKET_ADD_MEMBERSHIP)");
-			close(sock_fd);
-			return PCAP_ERROR;
-		}
+	fd = socket(AF_UNIX, SOCK_RAW, 0);
+	if (fd != -1) {
+		/*
+		 * OK, we got it!
+		 */
+		return (fd);
 	}
 
 	/*
-	 * Enable auxiliary data and reserve room for reconstructing
-	 * VLAN headers.
-	 *
-	 * XXX - is enabling auxiliary data necessary, now that we
-	 * only support memory-mapped capture?  The kernel's memory-mapped
-	 * capture code doesn't seem to check whether auxiliary data
-	 * is enabled, it seems to provide it whether it is or not.
+	 * Now try an AF_INET6 socket.
 	 */
-	val = 1;
-	if (setsockopt(sock_fd, SOL_PACKET, PACKET_AUXDATA, &val,
-		       sizeof(val)) == -1 && errno != ENOPROTOOPT) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "setsockopt (PACKET_AUXDATA)");
-		close(sock_fd);
-		return PCAP_ERROR;
+	fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (fd != -1) {
+		return (fd);
 	}
-	handle->offset += VLAN_TAG_LEN;
 
 	/*
-	 * If we're in cooked mode, make the snapshot length
-	 * large enough to hold a "cooked mode" header plus
-	 * 1 byte of packet data (so we don't pass a byte
-	 * count of 0 to "recvfrom()").
-	 * XXX - we don't know whether this will be DLT_LINUX_SLL
-	 * or DLT_LINUX_SLL2, so make sure it's big enough for
-	 * a DLT_LINUX_SLL2 "cooked mode" header; a snapshot length
-	 * that small is silly anyway.
+	 * Now try an AF_INET socket.
+	 *
+	 * XXX - if that fails, is there anything else we should try?
+	 * AF_CAN, for embedded systems in vehicles, in case they're
+	 * built without Internet protocol support?  Any other socket
+	 * types popular in non-Internet embedded systems?
 	 */
-	if (handlep->cooked) {
-		if (handle->snapshot < SLL2_HDR_LEN + 1)
-			handle->snapshot = SLL2_HDR_LEN + 1;
-	}
-	handle->bufsize = handle->snapshot;
+	return (socket(AF_INET, SOCK_DGRAM, 0));
+}
 
-	/*
-	 * Set the offset at which to insert VLAN tags.
-	 */
-	set_vlan_offset(handle);
+/*
+ * Get additional flags for a device, using SIOCETHTOOL.
+ */
+static int
+get_if_flags(const char *name, bpf_u_int32 *flags, char *errbuf)
+{
+	int sock;
+	FILE *fh;
+	unsigned int arptype = ARPHRD_VOID;
+	struct ifreq ifr;
+	struct ethtool_value info;
 
-	if (handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO) {
-		int nsec_tstamps = 1;
+	if (*flags & PCAP_IF_LOOPBACK) {
+		/*
+		 * Loopback devices aren't wireless, and "connected"/
+		 * "disconnected" doesn't apply to them.
+		 */
+		*flags |= PCAP_IF_CONNECTION_STATUS_NOT_APPLICABLE;
+		return 0;
+	}
 
-		if (setsockopt(sock_fd, SOL_SOCKET, SO_TIMESTAMPNS, &nsec_tstamps, sizeof(nsec_tstamps)) < 0) {
-			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE, "setsockopt: unable to set SO_TIMESTAMPNS");
-			close(sock_fd);
-			return PCAP_ERROR;
-		}
+	sock = get_if_ioctl_socket();
+	if (sock == -1) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE, errno,
+		    "Can't create socket to get ethtool information for %s",
+		    name);
+		return -1;
 	}
 
 	/*
-	 * We've succeeded. Save the socket FD in the pcap structure.
+	 * OK, what type of network is this?
+	 * In particular, is it wired or wireless?
 	 */
-	handle->fd = sock_fd;
+	if (is_wifi(name)) {
+		/*
+		 * Wi-Fi, hence wireless.
+		 */
+		*flags |= PCAP_IF_WIRELESS;
+	} else {
+		/*
+		 * OK, what does /sys/class/net/{if_name}/type contain?
+		 * (We don't use that for Wi-Fi, as it'll report
+		 * "Ethernet", i.e. ARPHRD_ETHER, for non-monitor-
+		 * mode devices.)
+		 */
+		char *pathstr;
 
-	/*
-	 * Any supported Linux version implements at least four auxiliary
-	 * data items (SKF_AD_PROTOCOL, SKF_AD_PKTTYPE, SKF_AD_IFINDEX and
-	 * SKF_AD_NLATTR).  Set a flag so the code generator can use these
-	 * items if necessary.
-	 */
-	handle->bpf_codegen_flags |= BPF_SPECIAL_BASIC_HANDLING;
-
-	/*
-	 * Can we generate special code for VLAN checks?
-	 * (XXX - what if we need the special code but it's not supported
-	 * by the OS?  Is that possible?)
-	 *
-	 * This depends on both a runtime condition (the running Linux kernel
-	 * must support at least SKF_AD_VLAN_TAG_PRESENT in the auxiliary data
-	 * and must support SO_BPF_EXTENSIONS in order to tell the userland
-	 * process what it supports) and a compile-time condition (the OS
-	 * headers must define both constants in order to compile libpcap code
-	 * that asks the kernel about the support).
-	 */
-#if defined(SO_BPF_EXTENSIONS) && defined(SKF_AD_VLAN_TAG_PRESENT)
-	int bpf_extensions;
-	socklen_t len = sizeof(bpf_extensions);
-	if (getsockopt(sock_fd, SOL_SOCKET, SO_BPF_EXTENSIONS,
-	    &bpf_extensions, &len) == 0) {
-		if (bpf_extensions >= SKF_AD_VLAN_TAG_PRESENT) {
-			/*
-			 * Yes, we can.  Request that we do so.
-			 */
-			handle->bpf_codegen_flags |= BPF_SPECIAL_VLAN_HANDLING;
+		if (asprintf(&pathstr, "/sys/class/net/%s/type", name) == -1) {
+			snprintf(errbuf, PCAP_ERRBUF_SIZE,
+			    "%s: Can't generate path name string for /sys/class/net device",
+			    name);
+			close(sock);
+			return -1;
 		}
-	}
-#endif // defined(SO_BPF_EXTENSIONS) && defined(SKF_AD_VLAN_TAG_PRESENT)
-
-	return status;
-}
-
-/*
- * Attempt to setup memory-mapped access.
- *
- * On success, returns 0 if there are no warnings or a PCAP_WARNING_ code
- * if there is a warning.
- *
- * On error, returns the appropriate error code; if that is PCAP_ERROR,
- * sets handle->errbuf to the appropriate message.
- */
-static int
-setup_mmapped(pcap_t *handle)
-{
-	struct pcap_linux *handlep = handle->priv;
-	int flags = MAP_ANONYMOUS | MAP_PRIVATE;
-	int status;
+		fh = fopen(pathstr, "r");
+		if (fh != NULL) {
+			if (fscanf(fh, "%u", &arptype) == 1) {
+				/*
+				 * OK, we got an ARPHRD_ type; what is it?
+				 */
+				switch (arptype) {
 
-	/*
-	 * Attempt to allocate a buffer to hold the contents of one
-	 * packet, for use by the oneshot callback.
-	 */
-#ifdef MAP_32BIT
-	if (pcapint_mmap_32bit) flags |= MAP_32BIT;
-#endif
-	handlep->oneshot_buffer = mmap(0, handle->snapshot, PROT_READ | PROT_WRITE, flags, -1, 0);
-	if (handlep->oneshot_buffer == MAP_FAILED) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "can't allocate oneshot buffer");
-		return PCAP_ERROR;
-	}
+				case ARPHRD_LOOPBACK:
+					/*
+					 * These are types to which
+					 * "connected" and "disconnected"
+					 * don't apply, so don't bother
+					 * asking about it.
+					 *
+					 * XXX - add other types?
+					 */
+					close(sock);
+					fclose(fh);
+					free(pathstr);
+					return 0;
 
-	if (handle->opt.buffer_size == 0) {
-		/* by default request 2M for the ring buffer */
-		handle->opt.buffer_size = 2*1024*1024;
-	}
-	status = prepare_tpacket_socket(handle);
-	if (status == -1) {
-		munmap(handlep->oneshot_buffer, handle->snapshot);
-		handlep->oneshot_buffer = NULL;
-		return PCAP_ERROR;
-	}
-	status = create_ring(handle);
-	if (status < 0) {
-		/*
-		 * Error attempting to enable memory-mapped capture;
-		 * fail.  The return value is the status to return.
-		 */
-		munmap(handlep->oneshot_buffer, handle->snapshot);
-		handlep->oneshot_buffer = NULL;
-		return status;
+				case ARPHRD_IRDA:
+				case ARPHRD_IEEE80211:
+				case ARPHRD_IEEE80211_PRISM:
+				case ARPHRD_IEEE80211_RADIOTAP:
+				case ARPHRD_IEEE802154:
+				case ARPHRD_IEEE802154_MONITOR:
+				case ARPHRD_6LOWPAN:
+					/*
+					 * Various wireless types.
+					 */
+					*flags |= PCAP_IF_WIRELESS;
+					break;
+				}
+			}
+			fclose(fh);
+		}
+		free(pathstr);
 	}
 
+#ifdef ETHTOOL_GLINK
+	memset(&ifr, 0, sizeof(ifr));
+	pcapint_strlcpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
+	info.cmd = ETHTOOL_GLINK;
 	/*
-	 * Success.  status has been set either to 0 if there are no
-	 * warnings or to a PCAP_WARNING_ value if there is a warning.
+	 * XXX - while Valgrind handles SIOCETHTOOL and knows that
+	 * the ETHTOOL_GLINK command sets the .data member of the
+	 * structure, Memory Sanitizer doesn't yet do so:
 	 *
-	 * handle->offset is used to get the current position into the rx ring.
-	 * handle->cc is used to store the ring size.
-	 */
-
-	/*
-	 * Set the timeout to use in poll() before returning.
+	 *    https://bugs.llvm.org/show_bug.cgi?id=45814
+	 *
+	 * For now, we zero it out to squelch warnings; if the bug
+	 * in question is fixed, we can remove this.
 	 */
-	set_poll_timeout(handlep);
+	info.data = 0;
+	ifr.ifr_data = (caddr_t)&info;
+	if (ioctl(sock, SIOCETHTOOL, &ifr) == -1) {
+		int save_errno = errno;
 
-	return status;
-}
+		switch (save_errno) {
 
-/*
- * Attempt to set the socket to the specified version of the memory-mapped
- * header.
- *
- * Return 0 if we succeed; return 1 if we fail because that version isn't
- * supported; return -1 on any other error, and set handle->errbuf.
- */
-static int
-init_tpacket(pcap_t *handle, int version, const char *version_str)
-{
-	struct pcap_linux *handlep = handle->priv;
-	int val = version;
-	socklen_t len = sizeof(val);
+		case EOPNOTSUPP:
+		case EINVAL:
+			/*
+			 * OK, this OS version or driver doesn't support
+			 * asking for this information.
+			 * XXX - distinguish between "this doesn't
+			 * support ethtool at all because it's not
+			 * that type of device" vs. "this doesn't
+			 * support ethtool even though it's that
+			 * type of device", and return "unknown".
+			 */
+			*flags |= PCAP_IF_CONNECTION_STATUS_NOT_APPLICABLE;
+			close(sock);
+			return 0;
 
-	/*
-	 * Probe whether kernel supports the specified TPACKET version;
-	 * this also gets the length of the header for that version.
-	 *
-	 * This socket option was introduced in 2.6.27, which was
-	 * also the first release with TPACKET_V2 support.
-	 */
-	if (getsockopt(handle->fd, SOL_PACKET, PACKET_HDRLEN, &val, &len) < 0) {
-		if (errno == EINVAL) {
+		case ENODEV:
 			/*
-			 * EINVAL means this specific version of TPACKET
-			 * is not supported. Tell the caller they can try
-			 * with a different one; if they've run out of
-			 * others to try, let them set the error message
-			 * appropriately.
+			 * OK, no such device.
+			 * The user will find that out when they try to
+			 * activate the device; just say "OK" and
+			 * don't set anything.
 			 */
-			return 1;
-		}
+			close(sock);
+			return 0;
 
-		/*
-		 * All other errors are fatal.
-		 */
-		if (errno == ENOPROTOOPT) {
+		case EPERM:
 			/*
-			 * PACKET_HDRLEN isn't supported, which means
-			 * that memory-mapped capture isn't supported.
-			 * Indicate that in the message.
+			 * OK, this version of the kernel requires
+			 * CAP_NET_ADMIN privileges for this, and
+			 * we don't have those privileges.
+			 *
+			 * Just leave it as PCAP_IF_CONNECTION_STATUS_UNKNOWN,
+			 * as we can't determine the status; just say "OK" and
+			 * don't set anything.
 			 */
-			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-			    "Kernel doesn't support memory-mapped capture; a 2.6.27 or later 2.x kernel is required, with CONFIG_PACKET_MMAP specified for 2.x kernels");
-		} else {
+			close(sock);
+			return 0;
+
+		default:
 			/*
-			 * Some unexpected error.
+			 * Other error.
 			 */
-			pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-			    errno, "can't get %s header len on packet socket",
-			    version_str);
+			pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+			    save_errno,
+			    "%s: SIOCETHTOOL(ETHTOOL_GLINK) ioctl failed",
+			    name);
+			close(sock);
+			return -1;
 		}
-		return -1;
 	}
-	handlep->tp_hdrlen = val;
 
-	val = version;
-	if (setsockopt(handle->fd, SOL_PACKET, PACKET_VERSION, &val,
-			   sizeof(val)) < 0) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "can't activate %s on packet socket", version_str);
-		return -1;
+	/*
+	 * Is it connected?
+	 */
+	if (info.data) {
+		/*
+		 * It's connected.
+		 */
+		*flags |= PCAP_IF_CONNECTION_STATUS_CONNECTED;
+	} else {
+		/*
+		 * It's disconnected.
+		 */
+		*flags |= PCAP_IF_CONNECTION_STATUS_DISCONNECTED;
 	}
-	handlep->tp_version = version;
+#endif
+
+	close(sock);
+
+#ifdef HAVE_SNF_API
+	// For "down" SNF devices the SNF API makes the flags more relevant.
+	if (arptype == ARPHRD_ETHER &&
+	    ! (*flags & PCAP_IF_UP) &&
+	    snf_get_if_flags(name, flags, errbuf) < 0)
+		return PCAP_ERROR;
+#endif // HAVE_SNF_API
 
 	return 0;
 }
 
 /*
- * Attempt to set the socket to version 3 of the memory-mapped header and,
- * if that fails because version 3 isn't supported, attempt to fall
- * back to version 2.  If version 2 isn't supported, just fail.
+ * Interface enumeration with a routing netlink socket.
  *
- * Return 0 if we succeed and -1 on any other error, and set handle->errbuf.
+ * getifaddrs() plus get_if_flags() cost several system calls and
+ * /sys reads per interface, which adds up on hosts with thousands
+ * of veth devices.  Instead, we do one RTM_GETLINK dump, which
+ * supplies the name, IFF_ flags, ARPHRD_ type, operational state
+ * and alias of every interface, and one RTM_GETADDR dump, which
+ * supplies every address; the only per-interface work left is
+ * the /sys/class/net/{if_name}/wireless check for Ethernet devices.
  */
-static int
-prepare_tpacket_socket(pcap_t *handle)
+#define NL_FINDDEVS_BUFSIZE	32768
+
+struct nl_finddevs_link {
+	int		ifindex;
+	u_int		ifi_flags;
+	pcap_if_t	*dev;
+};
+
+struct nl_finddevs {
+	int		fd;
+	uint32_t	seq;
+	u_char		*buf;
+	struct nl_finddevs_link *links;	/* sorted by interface index */
+	size_t		nlinks;
+	size_t		maxlinks;
+	pcap_if_list_t	*devlistp;
+	pcap_devevent_handler callback;	/* reports changes, if set */
+	u_char		*user;
+	int		nevents;
+};
+
+/*
+ * Return a pointer to the string in a string attribute, or NULL if
+ * the attribute isn't null-terminated.
+ */
+static const char *
+nl_finddevs_attr_string(const struct rtattr *rta)
 {
-	int ret;
+	const char *str = (const char *)RTA_DATA(rta);
 
-#ifdef HAVE_TPACKET3
-	/*
-	 * Try setting the version to TPACKET_V3.
-	 *
-	 * The only mode in which buffering is done on PF_PACKET
-	 * sockets, so that packets might not be delivered
-	 * immediately, is TPACKET_V3 mode.
-	 *
-	 * The buffering cannot be disabled in that mode, so
-	 * if the user has requested immediate mode, we don't
-	 * use TPACKET_V3.
-	 */
-	if (!handle->opt.immediate) {
-		ret = init_tpacket(handle, TPACKET_V3, "TPACKET_V3");
-		if (ret == 0) {
-			/*
-			 * Success.
-			 */
-			return 0;
-		}
-		if (ret == -1) {
-			/*
-			 * We failed for some reason other than "the
-			 * kernel doesn't support TPACKET_V3".
-			 */
-			return -1;
-		}
+	if (memchr(str, '\0', RTA_PAYLOAD(rta)) == NULL)
+		return (NULL);
+	return (str);
+}
 
+/*
+ * Get the additional flags for a device from what the RTM_NEWLINK
+ * message told us; this is the netlink equivalent of get_if_flags().
+ */
+static int
+nl_finddevs_get_if_flags(const char *name, unsigned short arptype,
+    int operstate, bpf_u_int32 *flags, char *errbuf _U_)
+{
+	if (*flags & PCAP_IF_LOOPBACK) {
 		/*
-		 * This means it returned 1, which means "the kernel
-		 * doesn't support TPACKET_V3"; try TPACKET_V2.
+		 * Loopback devices aren't wireless, and "connected"/
+		 * "disconnected" doesn't apply to them.
 		 */
+		*flags |= PCAP_IF_CONNECTION_STATUS_NOT_APPLICABLE;
+		return 0;
 	}
-#endif /* HAVE_TPACKET3 */
 
-	/*
-	 * Try setting the version to TPACKET_V2.
-	 */
-	ret = init_tpacket(handle, TPACKET_V2, "TPACKET_V2");
-	if (ret == 0) {
+	switch (arptype) {
+
+	case ARPHRD_ETHER:
 		/*
-		 * Success.
+		 * Wi-Fi devices report "Ethernet" unless they're
+		 * in monitor mode, so check for Wi-Fi.
 		 */
+		if (is_wifi(name))
+			*flags |= PCAP_IF_WIRELESS;
+		break;
+
+	case ARPHRD_LOOPBACK:
+		*flags |= PCAP_IF_CONNECTION_STATUS_NOT_APPLICABLE;
 		return 0;
-	}
 
-	if (ret == 1) {
+	case ARPHRD_IRDA:
+	case ARPHRD_IEEE80211:
+	case ARPHRD_IEEE80211_PRISM:
+	case ARPHRD_IEEE80211_RADIOTAP:
+	case ARPHRD_IEEE802154:
+	case ARPHRD_IEEE802154_MONITOR:
+	case ARPHRD_6LOWPAN:
 		/*
-		 * OK, the kernel supports memory-mapped capture, but
-		 * not TPACKET_V2.  Set the error message appropriately.
+		 * Various wireless types.
 		 */
-		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    "Kernel doesn't support TPACKET_V2; a 2.6.27 or later kernel is required");
+		*flags |= PCAP_IF_WIRELESS;
+		break;
 	}
 
 	/*
-	 * We failed.
+	 * The operational state is derived from the carrier state,
+	 * which is what ETHTOOL_GLINK reports; drivers that don't
+	 * track the carrier state leave it as IF_OPER_UNKNOWN.
 	 */
-	return -1;
+	switch (operstate) {
+
+	case IF_OPER_UP:
+	case IF_OPER_DORMANT:
+		*flags |= PCAP_IF_CONNECTION_STATUS_CONNECTED;
+		break;
+
+	case IF_OPER_DOWN:
+	case IF_OPER_LOWERLAYERDOWN:
+	case IF_OPER_NOTPRESENT:
+		*flags |= PCAP_IF_CONNECTION_STATUS_DISCONNECTED;
+		break;
+
+	case IF_OPER_UNKNOWN:
+		*flags |= PCAP_IF_CONNECTION_STATUS_NOT_APPLICABLE;
+		break;
+
+	default:
+		/*
+		 * IF_OPER_TESTING, or no IFLA_OPERSTATE attribute;
+		 * leave it as PCAP_IF_CONNECTION_STATUS_UNKNOWN.
+		 */
+		break;
+	}
+
+#ifdef HAVE_SNF_API
+	// For "down" SNF devices the SNF API makes the flags more relevant.
+	if (arptype == ARPHRD_ETHER &&
+	    ! (*flags & PCAP_IF_UP) &&
+	    snf_get_if_flags(name, flags, errbuf) < 0)
+		return PCAP_ERROR;
+#endif // HAVE_SNF_API
+
+	return 0;
 }
 
 /*
- * Attempt to set up memory-mapped access.
- *
- * On success, returns 0 if there are no warnings or to a PCAP_WARNING_ code
- * if there is a warning.
+ * Find where an interface index is, or would be, in the sorted
+ * array of interfaces.
+ */
+static size_t
+nl_finddevs_link_slot(const struct nl_finddevs *nl, int ifindex)
+{
+	size_t lo = 0, hi = nl->nlinks, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (nl->links[mid].ifindex < ifindex)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static struct nl_finddevs_link *
+nl_finddevs_find_link(const struct nl_finddevs *nl, int ifindex)
+{
+	size_t slot = nl_finddevs_link_slot(nl, ifindex);
+
+	if (slot < nl->nlinks && nl->links[slot].ifindex == ifindex)
+		return (&nl->links[slot]);
+	return (NULL);
+}
+
+/*
+ * Get the size of a socket address in a device's address list.
+ */
+static size_t
+nl_finddevs_sa_len(const struct sockaddr *sa)
+{
+	switch (sa->sa_family) {
+
+	case AF_INET:
+		return (sizeof(struct sockaddr_in));
+
+	case AF_INET6:
+		return (sizeof(struct sockaddr_in6));
+
+	case AF_PACKET:
+		return (sizeof(struct sockaddr_ll));
+
+	default:
+		return (sizeof(struct sockaddr));
+	}
+}
+
+static int
+nl_finddevs_sa_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (a->sa_family == b->sa_family &&
+	    memcmp(a, b, nl_finddevs_sa_len(a)) == 0);
+}
+
+static int
+nl_finddevs_addr_equal(const pcap_addr_t *a, const pcap_addr_t *b)
+{
+	return (nl_finddevs_sa_equal(a->addr, b->addr) &&
+	    nl_finddevs_sa_equal(a->netmask, b->netmask) &&
+	    nl_finddevs_sa_equal(a->broadaddr, b->broadaddr) &&
+	    nl_finddevs_sa_equal(a->dstaddr, b->dstaddr));
+}
+
+/*
+ * Compare two address lists, looking only at addresses in the given
+ * family, or at all addresses if the family is AF_UNSPEC.
+ */
+static int
+nl_finddevs_addrs_equal(const pcap_addr_t *a, const pcap_addr_t *b,
+    int family)
+{
+	for (;;) {
+		while (a != NULL && family != AF_UNSPEC &&
+		    (a->addr == NULL || a->addr->sa_family != family))
+			a = a->next;
+		while (b != NULL && family != AF_UNSPEC &&
+		    (b->addr == NULL || b->addr->sa_family != family))
+			b = b->next;
+		if (a == NULL || b == NULL)
+			return (a == b);
+		if (!nl_finddevs_addr_equal(a, b))
+			return (0);
+		a = a->next;
+		b = b->next;
+	}
+}
+
+/*
+ * Has anything other than the IPv4 and IPv6 addresses changed
+ * between two entries for a device?
+ */
+static int
+nl_finddevs_dev_changed(const pcap_if_t *a, const pcap_if_t *b)
+{
+	if (strcmp(a->name, b->name) != 0 || a->flags != b->flags)
+		return (1);
+	if (a->description == NULL || b->description == NULL) {
+		if (a->description != b->description)
+			return (1);
+	} else if (strcmp(a->description, b->description) != 0)
+		return (1);
+	return (!nl_finddevs_addrs_equal(a->addresses, b->addresses,
+	    AF_PACKET));
+}
+
+static void
+nl_finddevs_free_addr(pcap_addr_t *addr)
+{
+	free(addr->addr);
+	free(addr->netmask);
+	free(addr->broadaddr);
+	free(addr->dstaddr);
+	free(addr);
+}
+
+/*
+ * Report a change to the handler, if there is one.
+ */
+static void
+nl_finddevs_report(struct nl_finddevs *nl, int event, const pcap_if_t *dev)
+{
+	if (nl->callback != NULL) {
+		nl->callback(nl->user, event, dev);
+		nl->nevents++;
+	}
+}
+
+/*
+ * Add an entry for a device's link-layer address, as getifaddrs()
+ * would report it: as an AF_PACKET address, with the link-layer
+ * broadcast address as its broadcast or destination address.
+ * We do the same, so that the list doesn't depend on which path
+ * built it.
+ */
+static int
+nl_finddevs_add_hwaddr(pcap_if_t *dev, const struct ifinfomsg *ifi,
+    const struct rtattr *hwaddr, const struct rtattr *hwbroadaddr,
+    char *errbuf)
+{
+	struct sockaddr_ll addr, broadaddr;
+	struct sockaddr *broadaddrp = NULL, *dstaddrp = NULL;
+
+	if (hwaddr == NULL)
+		return 0;
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = ifi->ifi_index;
+	addr.sll_hatype = ifi->ifi_type;
+	addr.sll_halen = (u_char)min(RTA_PAYLOAD(hwaddr), sizeof(addr.sll_addr));
+	memcpy(addr.sll_addr, RTA_DATA(hwaddr), addr.sll_halen);
+	if (hwbroadaddr != NULL) {
+		broadaddr = addr;
+		broadaddr.sll_halen = (u_char)min(RTA_PAYLOAD(hwbroadaddr),
+		    sizeof(broadaddr.sll_addr));
+		memset(broadaddr.sll_addr, 0, sizeof(broadaddr.sll_addr));
+		memcpy(broadaddr.sll_addr, RTA_DATA(hwbroadaddr),
+		    broadaddr.sll_halen);
+		if (ifi->ifi_flags & IFF_BROADCAST)
+			broadaddrp = (struct sockaddr *)&broadaddr;
+		if (ifi->ifi_flags & IFF_POINTOPOINT)
+			dstaddrp = (struct sockaddr *)&broadaddr;
+	}
+	return (pcapint_add_addr_to_dev(dev,
+	    (struct sockaddr *)&addr, sizeof(addr),
+	    NULL, 0,
+	    broadaddrp, broadaddrp != NULL ? sizeof(broadaddr) : 0,
+	    dstaddrp, dstaddrp != NULL ? sizeof(broadaddr) : 0,
+	    errbuf));
+}
+
+/*
+ * Handle an RTM_NEWLINK message, by adding the device it describes
+ * or, if we already have that device, replacing its entry, and an
+ * RTM_DELLINK message, by removing the device.
  *
- * On error, returns the appropriate error code; if that is PCAP_ERROR,
- * sets handle->errbuf to the appropriate message.
+ * A device that was replaced or removed is unlinked from the list
+ * and handed back through freep, so that it can be reported before
+ * it's freed.
  */
 static int
-create_ring(pcap_t *handle)
+nl_finddevs_link(struct nl_finddevs *nl, struct nlmsghdr *nlh,
+    pcap_if_t **freep, char *errbuf)
 {
-	struct pcap_linux *handlep = handle->priv;
-	unsigned i, j, frames_per_block;
-	int flags = MAP_SHARED;
-#ifdef HAVE_TPACKET3
-	/*
-	 * For sockets using TPACKET_V2, the extra stuff at the end of a
-	 * struct tpacket_req3 will be ignored, so this is OK even for
-	 * those sockets.
-	 */
-	struct tpacket_req3 req;
-#else
-	struct tpacket_req req;
-#endif
-	socklen_t len;
-	unsigned int sk_type, tp_reserve, maclen, tp_hdrlen, netoff, macoff;
-	unsigned int frame_size;
-	int status;
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	int rtalen;
+	const char *name = NULL;
+	const char *alias = NULL;
+	const struct rtattr *hwaddr = NULL;
+	const struct rtattr *hwbroadaddr = NULL;
+	int operstate = -1;
+	bpf_u_int32 flags;
+	size_t slot;
+	struct nl_finddevs_link *link;
+	pcap_if_t *dev, *olddev;
+	pcap_addr_t **oldp, **newp, *addr;
+	int changed;
+
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return 0;
+	ifi = (struct ifinfomsg *)NLMSG_DATA(nlh);
+	if (ifi->ifi_family != AF_UNSPEC) {
+		/*
+		 * Not about the interface itself; for example,
+		 * AF_BRIDGE messages are about its bridge port, and
+		 * an AF_BRIDGE RTM_DELLINK message means it was
+		 * removed from a bridge, not that it went away.
+		 */
+		return 0;
+	}
+	slot = nl_finddevs_link_slot(nl, ifi->ifi_index);
+	if (slot < nl->nlinks && nl->links[slot].ifindex == ifi->ifi_index)
+		link = &nl->links[slot];
+	else
+		link = NULL;
 
-	/*
-	 * Start out assuming no warnings.
-	 */
-	status = 0;
+	if (nlh->nlmsg_type == RTM_DELLINK) {
+		if (link == NULL)
+			return 0;
+		olddev = link->dev;
+		pcapint_unlink_dev(nl->devlistp, olddev);
+		memmove(&nl->links[slot], &nl->links[slot + 1],
+		    (nl->nlinks - slot - 1) * sizeof(*nl->links));
+		nl->nlinks--;
+		nl_finddevs_report(nl, PCAP_DEVEVENT_REMOVED, olddev);
+		*freep = olddev;
+		return 0;
+	}
 
-	/*
-	 * Reserve space for VLAN tag reconstruction.
-	 */
-	tp_reserve = VLAN_TAG_LEN;
+	rtalen = (int)IFLA_PAYLOAD(nlh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, rtalen);
+	    rta = RTA_NEXT(rta, rtalen)) {
+		switch (rta->rta_type) {
+
+		case IFLA_IFNAME:
+			name = nl_finddevs_attr_string(rta);
+			break;
+
+		case IFLA_IFALIAS:
+			alias = nl_finddevs_attr_string(rta);
+			break;
+
+		case IFLA_OPERSTATE:
+			if (RTA_PAYLOAD(rta) >= 1)
+				operstate = *(const u_char *)RTA_DATA(rta);
+			break;
+
+		case IFLA_ADDRESS:
+			hwaddr = rta;
+			break;
+
+		case IFLA_BROADCAST:
+			hwbroadaddr = rta;
+			break;
+		}
+	}
+	if (name == NULL)
+		return 0;
 
 	/*
-	 * If we're capturing in cooked mode, reserve space for
-	 * a DLT_LINUX_SLL2 header; we don't know yet whether
-	 * we'll be using DLT_LINUX_SLL or DLT_LINUX_SLL2, as
-	 * that can be changed on an open device, so we reserve
-	 * space for the larger of the two.
-	 *
-	 * XXX - we assume that the kernel is still adding
-	 * 16 bytes of extra space, so we subtract 16 from
-	 * SLL2_HDR_LEN to get the additional space needed.
-	 * (Are they doing that for DLT_LINUX_SLL, the link-
-	 * layer header for which is 16 bytes?)
-	 *
-	 * XXX - should we use TPACKET_ALIGN(SLL2_HDR_LEN - 16)?
+	 * Convert IFF_ flags to pcap flags, as pcapint_find_or_add_if()
+	 * does, and add the flags that get_if_flags() would have
+	 * added.
 	 */
-	if (handlep->cooked)
-		tp_reserve += SLL2_HDR_LEN - 16;
+	flags = 0;
+	if (ifi->ifi_flags & IFF_LOOPBACK)
+		flags |= PCAP_IF_LOOPBACK;
+	if (ifi->ifi_flags & IFF_UP)
+		flags |= PCAP_IF_UP;
+	if (ifi->ifi_flags & IFF_RUNNING)
+		flags |= PCAP_IF_RUNNING;
+	if (nl_finddevs_get_if_flags(name, ifi->ifi_type, operstate,
+	    &flags, errbuf) == -1)
+		return -1;
 
 	/*
-	 * Try to request that amount of reserve space.
-	 * This must be done before creating the ring buffer.
+	 * The alias, as set with "ip link set {if_name} alias",
+	 * is the interface description.
 	 */
-	len = sizeof(tp_reserve);
-	if (setsockopt(handle->fd, SOL_PACKET, PACKET_RESERVE,
-	    &tp_reserve, len) < 0) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf,
-		    PCAP_ERRBUF_SIZE, errno,
-		    "setsockopt (PACKET_RESERVE)");
-		return PCAP_ERROR;
+	if (alias != NULL && alias[0] == '\0')
+		alias = NULL;
+	dev = pcapint_add_dev(nl->devlistp, name, flags, alias, errbuf);
+	if (dev == NULL)
+		return -1;
+	if (nl_finddevs_add_hwaddr(dev, ifi, hwaddr, hwbroadaddr,
+	    errbuf) == -1) {
+		pcapint_unlink_dev(nl->devlistp, dev);
+		pcap_freealldevs(dev);
+		return -1;
 	}
 
-	switch (handlep->tp_version) {
+	if (link == NULL) {
+		if (nl->nlinks == nl->maxlinks) {
+			size_t maxlinks = nl->maxlinks == 0 ? 64 :
+			    2 * nl->maxlinks;
+			struct nl_finddevs_link *links;
 
-	case TPACKET_V2:
-		/* Note that with large snapshot length (say 256K, which is
-		 * the default for recent versions of tcpdump, Wireshark,
-		 * TShark, dumpcap or 64K, the value that "-s 0" has given for
-		 * a long time with tcpdump), if we use the snapshot
-		 * length to calculate the frame length, only a few frames
-		 * will be available in the ring even with pretty
-		 * large ring size (and a lot of memory will be unused).
-		 *
-		 * Ideally, we should choose a frame length based on the
-		 * minimum of the specified snapshot length and the maximum
-		 * packet size.  That's not as easy as it sounds; consider,
-		 * for example, an 802.11 interface in monitor mode, where
-		 * the frame would include a radiotap header, where the
-		 * maximum radiotap header length is device-dependent.
-		 *
-		 * So, for now, we just do this for Ethernet devices, where
-		 * there's no metadata header, and the link-layer header is
-		 * fixed length.  We can get the maximum packet size by
-		 * adding 18, the Ethernet header length plus the CRC length
-		 * (just in case we happen to get the CRC in the packet), to
-		 * the MTU of the interface; we fetch the MTU in the hopes
-		 * that it reflects support for jumbo frames.  (Even if the
-		 * interface is just being used for passive snooping, the
-		 * driver might set the size of buffers in the receive ring
-		 * based on the MTU, so that the MTU limits the maximum size
-		 * of packets that we can receive.)
-		 *
-		 * If segmentation/fragmentation or receive offload are
-		 * enabled, we can get reassembled/aggregated packets larger
-		 * than MTU, but bounded to 65535 plus the Ethernet overhead,
-		 * due to kernel and protocol constraints */
-		frame_size = handle->snapshot;
-		if (handle->linktype == DLT_EN10MB) {
-			unsigned int max_frame_len;
-			int mtu;
-			int offload;
-
-			mtu = iface_get_mtu(handle->fd, handle->opt.device,
-			    handle->errbuf);
-			if (mtu == -1)
-				return PCAP_ERROR;
-			offload = iface_get_offload(handle);
-			if (offload == -1)
-				return PCAP_ERROR;
-			if (offload)
-				max_frame_len = max(mtu, 65535);
-			else
-				max_frame_len = mtu;
-			max_frame_len += 18;
-
-			if (frame_size > max_frame_len)
-				frame_size = max_frame_len;
+			links = realloc(nl->links, maxlinks * sizeof(*links));
+			if (links == NULL) {
+				pcapint_fmt_errmsg_for_errno(errbuf,
+				    PCAP_ERRBUF_SIZE, errno, "realloc");
+				pcapint_unlink_dev(nl->devlistp, dev);
+				pcap_freealldevs(dev);
+				return -1;
+			}
+			nl->links = links;
+			nl->maxlinks = maxlinks;
 		}
+		memmove(&nl->links[slot + 1], &nl->links[slot],
+		    (nl->nlinks - slot) * sizeof(*nl->links));
+		nl->nlinks++;
+		nl->links[slot].ifindex = ifi->ifi_index;
+		nl->links[slot].ifi_flags = ifi->ifi_flags;
+		nl->links[slot].dev = dev;
+		nl_finddevs_report(nl, PCAP_DEVEVENT_ADDED, dev);
+		return 0;
+	}
 
-		/* NOTE: calculus matching those in tpacket_rcv()
-		 * in linux-2.6/net/packet/af_packet.c
-		 */
-		len = sizeof(sk_type);
-		if (getsockopt(handle->fd, SOL_SOCKET, SO_TYPE, &sk_type,
-		    &len) < 0) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno, "getsockopt (SO_TYPE)");
-			return PCAP_ERROR;
+	/*
+	 * We already have this device; RTM_NEWLINK messages are sent
+	 * for many changes we don't care about, so only report this
+	 * if the name, flags, description or link-layer address
+	 * changed.  The IPv4 and IPv6 addresses don't come from
+	 * RTM_NEWLINK messages, so move them to the new entry.
+	 */
+	olddev = link->dev;
+	changed = nl_finddevs_dev_changed(olddev, dev);
+	for (newp = &dev->addresses; *newp != NULL; newp = &(*newp)->next)
+		;
+	oldp = &olddev->addresses;
+	while ((addr = *oldp) != NULL) {
+		if (addr->addr != NULL && addr->addr->sa_family == AF_PACKET) {
+			oldp = &addr->next;
+			continue;
 		}
-		maclen = (sk_type == SOCK_DGRAM) ? 0 : MAX_LINKHEADER_SIZE;
-			/* XXX: in the kernel maclen is calculated from
-			 * LL_ALLOCATED_SPACE(dev) and vnet_hdr.hdr_len
-			 * in:  packet_snd()           in linux-2.6/net/packet/af_packet.c
-			 * then packet_alloc_skb()     in linux-2.6/net/packet/af_packet.c
-			 * then sock_alloc_send_pskb() in linux-2.6/net/core/sock.c
-			 * but I see no way to get those sizes in userspace,
-			 * like for instance with an ifreq ioctl();
-			 * the best thing I've found so far is MAX_HEADER in
-			 * the kernel part of linux-2.6/include/linux/netdevice.h
-			 * which goes up to 128+48=176; since pcap-linux.c
-			 * defines a MAX_LINKHEADER_SIZE of 256 which is
-			 * greater than that, let's use it.. maybe is it even
-			 * large enough to directly replace macoff..
-			 */
-		tp_hdrlen = TPACKET_ALIGN(handlep->tp_hdrlen) + sizeof(struct sockaddr_ll) ;
-		netoff = TPACKET_ALIGN(tp_hdrlen + (maclen < 16 ? 16 : maclen)) + tp_reserve;
-			/* NOTE: AFAICS tp_reserve may break the TPACKET_ALIGN
-			 * of netoff, which contradicts
-			 * linux-2.6/Documentation/networking/packet_mmap.txt
-			 * documenting that:
-			 * "- Gap, chosen so that packet data (Start+tp_net)
-			 * aligns to TPACKET_ALIGNMENT=16"
-			 */
-			/* NOTE: in linux-2.6/include/linux/skbuff.h:
-			 * "CPUs often take a performance hit
-			 *  when accessing unaligned memory locations"
-			 */
-		macoff = netoff - maclen;
-		req.tp_frame_size = TPACKET_ALIGN(macoff + frame_size);
-		/*
-		 * Round the buffer size up to a multiple of the
-		 * frame size (rather than rounding down, which
-		 * would give a buffer smaller than our caller asked
-		 * for, and possibly give zero frames if the requested
-		 * buffer size is too small for one frame).
-		 */
-		req.tp_frame_nr = (handle->opt.buffer_size + req.tp_frame_size - 1)/req.tp_frame_size;
-		break;
+		*oldp = addr->next;
+		addr->next = NULL;
+		*newp = addr;
+		newp = &addr->next;
+	}
+	pcapint_unlink_dev(nl->devlistp, olddev);
+	link->ifi_flags = ifi->ifi_flags;
+	link->dev = dev;
+	if (changed)
+		nl_finddevs_report(nl, PCAP_DEVEVENT_CHANGED, dev);
+	*freep = olddev;
+	return 0;
+}
 
-#ifdef HAVE_TPACKET3
-	case TPACKET_V3:
-		/* The "frames" for this are actually buffers that
-		 * contain multiple variable-sized frames.
-		 *
-		 * We pick a "frame" size of MAXIMUM_SNAPLEN to leave
-		 * enough room for at least one reasonably-sized packet
-		 * in the "frame". */
-		req.tp_frame_size = MAXIMUM_SNAPLEN;
-		/*
-		 * Round the buffer size up to a multiple of the
-		 * "frame" size (rather than rounding down, which
-		 * would give a buffer smaller than our caller asked
-		 * for, and possibly give zero "frames" if the requested
-		 * buffer size is too small for one "frame").
-		 */
-		req.tp_frame_nr = (handle->opt.buffer_size + req.tp_frame_size - 1)/req.tp_frame_size;
-		break;
-#endif
-	default:
-		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    "Internal error: unknown TPACKET_ value %u",
-		    handlep->tp_version);
-		return PCAP_ERROR;
+/*
+ * Fill in a sockaddr_in or sockaddr_in6 from an IFA_ attribute.
+ */
+static size_t
+nl_finddevs_sockaddr(struct sockaddr_storage *ss, int family, int ifindex,
+    const struct rtattr *rta)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+		if (RTA_PAYLOAD(rta) != sizeof(sin->sin_addr))
+			return 0;
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, RTA_DATA(rta), sizeof(sin->sin_addr));
+		return (sizeof(*sin));
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+		if (RTA_PAYLOAD(rta) != sizeof(sin6->sin6_addr))
+			return 0;
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, RTA_DATA(rta), sizeof(sin6->sin6_addr));
+		if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr) ||
+		    IN6_IS_ADDR_MC_LINKLOCAL(&sin6->sin6_addr))
+			sin6->sin6_scope_id = (uint32_t)ifindex;
+		return (sizeof(*sin6));
 	}
+}
 
-	/* compute the minimum block size that will handle this frame.
-	 * The block has to be page size aligned.
-	 * The max block size allowed by the kernel is arch-dependent and
-	 * it's not explicitly checked here. */
-	req.tp_block_size = getpagesize();
-	while (req.tp_block_size < req.tp_frame_size)
-		req.tp_block_size <<= 1;
+/*
+ * Handle an RTM_NEWADDR or RTM_DELADDR message, by adding or
+ * removing the IPv4 or IPv6 address it describes.
+ */
+static int
+nl_finddevs_addr(struct nl_finddevs *nl, struct nlmsghdr *nlh,
+    char *errbuf)
+{
+	struct ifaddrmsg *ifa;
+	struct rtattr *rta;
+	int rtalen;
+	const struct rtattr *address = NULL, *local = NULL, *broadcast = NULL;
+	struct nl_finddevs_link *link;
+	struct sockaddr_storage addr, netmask, broadaddr, dstaddr;
+	size_t addr_size, netmask_size, broadaddr_size = 0, dstaddr_size = 0;
+	u_char *maskp;
+	u_int masklen, i;
+	pcap_addr_t **prevp, *oldaddr, *newaddr;
+
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return 0;
+	ifa = (struct ifaddrmsg *)NLMSG_DATA(nlh);
+	if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+		return 0;
+	link = nl_finddevs_find_link(nl, (int)ifa->ifa_index);
+	if (link == NULL)
+		return 0;	/* interface appeared after the link dump */
 
-	frames_per_block = req.tp_block_size/req.tp_frame_size;
+	rtalen = (int)IFA_PAYLOAD(nlh);
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, rtalen);
+	    rta = RTA_NEXT(rta, rtalen)) {
+		switch (rta->rta_type) {
+
+		case IFA_ADDRESS:
+			address = rta;
+			break;
+
+		case IFA_LOCAL:
+			local = rta;
+			break;
+
+		case IFA_BROADCAST:
+			broadcast = rta;
+			break;
+		}
+	}
 
 	/*
-	 * PACKET_TIMESTAMP was added after linux/net_tstamp.h was,
-	 * so we check for PACKET_TIMESTAMP.  We check for
-	 * linux/net_tstamp.h just in case a system somehow has
-	 * PACKET_TIMESTAMP but not linux/net_tstamp.h; that might
-	 * be unnecessary.
-	 *
-	 * SIOCSHWTSTAMP was introduced in the patch that introduced
-	 * linux/net_tstamp.h, so we don't bother checking whether
-	 * SIOCSHWTSTAMP is defined (if your Linux system has
-	 * linux/net_tstamp.h but doesn't define SIOCSHWTSTAMP, your
-	 * Linux system is badly broken).
+	 * If there's an IFA_LOCAL attribute, it's the local address,
+	 * and IFA_ADDRESS is the address of the other end of a
+	 * point-to-point link; otherwise, IFA_ADDRESS is the local
+	 * address.
 	 */
-#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP)
+	if (local == NULL) {
+		local = address;
+		address = NULL;
+	}
+	if (local == NULL)
+		return 0;
+	addr_size = nl_finddevs_sockaddr(&addr, ifa->ifa_family,
+	    (int)ifa->ifa_index, local);
+	if (addr_size == 0)
+		return 0;
+
 	/*
-	 * If we were told to do so, ask the kernel and the driver
-	 * to use hardware timestamps.
-	 *
-	 * Hardware timestamps are only supported with mmapped
-	 * captures.
+	 * Remove any entry we already have for this address; that's
+	 * all there is to do for RTM_DELADDR, and RTM_NEWADDR is also
+	 * sent when an existing address's lifetime or flags change.
 	 */
-	if (handle->opt.tstamp_type == PCAP_TSTAMP_ADAPTER ||
-	    handle->opt.tstamp_type == PCAP_TSTAMP_ADAPTER_UNSYNCED) {
-		struct hwtstamp_config hwconfig;
-		struct ifreq ifr;
-		int timesource;
+	oldaddr = NULL;
+	for (prevp = &link->dev->addresses; *prevp != NULL;
+	    prevp = &(*prevp)->next) {
+		if (nl_finddevs_sa_equal((*prevp)->addr,
+		    (struct sockaddr *)&addr)) {
+			oldaddr = *prevp;
+			*prevp = oldaddr->next;
+			oldaddr->next = NULL;
+			break;
+		}
+	}
+	if (nlh->nlmsg_type == RTM_DELADDR) {
+		if (oldaddr != NULL) {
+			nl_finddevs_report(nl, PCAP_DEVEVENT_CHANGED,
+			    link->dev);
+			nl_finddevs_free_addr(oldaddr);
+		}
+		return 0;
+	}
 
+	if (address != NULL && (link->ifi_flags & IFF_POINTOPOINT))
+		dstaddr_size = nl_finddevs_sockaddr(&dstaddr,
+		    ifa->ifa_family, (int)ifa->ifa_index, address);
+	if (broadcast != NULL && (link->ifi_flags & IFF_BROADCAST))
+		broadaddr_size = nl_finddevs_sockaddr(&broadaddr,
+		    ifa->ifa_family, (int)ifa->ifa_index, broadcast);
+
+	/*
+	 * Construct the netmask from the prefix length.
+	 */
+	netmask = addr;
+	if (ifa->ifa_family == AF_INET) {
+		maskp = (u_char *)&((struct sockaddr_in *)&netmask)->sin_addr;
+		masklen = sizeof(struct in_addr);
+	} else {
+		maskp = (u_char *)&((struct sockaddr_in6 *)&netmask)->sin6_addr;
+		masklen = sizeof(struct in6_addr);
+		((struct sockaddr_in6 *)&netmask)->sin6_scope_id = 0;
+	}
+	netmask_size = addr_size;
+	for (i = 0; i < masklen; i++) {
+		if (ifa->ifa_prefixlen >= (i + 1) * 8)
+			maskp[i] = 0xff;
+		else if (ifa->ifa_prefixlen > i * 8)
+			maskp[i] = (u_char)(0xff << (8 - (ifa->ifa_prefixlen - i * 8)));
+		else
+			maskp[i] = 0;
+	}
+
+	if (pcapint_add_addr_to_dev(link->dev,
+	    (struct sockaddr *)&addr, addr_size,
+	    (struct sockaddr *)&netmask, netmask_size,
+	    broadaddr_size != 0 ? (struct sockaddr *)&broadaddr : NULL,
+	    broadaddr_size,
+	    dstaddr_size != 0 ? (struct sockaddr *)&dstaddr : NULL,
+	    dstaddr_size,
+	    errbuf) == -1) {
+		if (oldaddr != NULL)
+			nl_finddevs_free_addr(oldaddr);
+		return -1;
+	}
+	if (oldaddr != NULL) {
 		/*
-		 * Ask for hardware time stamps on all packets,
-		 * including transmitted packets.
+		 * Only report this if something other than the
+		 * lifetime or flags changed.
 		 */
-		memset(&hwconfig, 0, sizeof(hwconfig));
-		hwconfig.tx_type = HWTSTAMP_TX_ON;
-		hwconfig.rx_filter = HWTSTAMP_FILTER_ALL;
+		for (newaddr = link->dev->addresses; newaddr->next != NULL;
+		    newaddr = newaddr->next)
+			;
+		if (!nl_finddevs_addr_equal(oldaddr, newaddr))
+			nl_finddevs_report(nl, PCAP_DEVEVENT_CHANGED,
+			    link->dev);
+		nl_finddevs_free_addr(oldaddr);
+	} else
+		nl_finddevs_report(nl, PCAP_DEVEVENT_CHANGED, link->dev);
+	return 0;
+}
 
-		memset(&ifr, 0, sizeof(ifr));
-		pcapint_strlcpy(ifr.ifr_name, handle->opt.device, sizeof(ifr.ifr_name));
-		ifr.ifr_data = (void *)&hwconfig;
+/*
+ * Handle one routing netlink message.
+ */
+static int
+nl_finddevs_msg(struct nl_finddevs *nl, struct nlmsghdr *nlh, char *errbuf)
+{
+	pcap_if_t *freedev = NULL;
+	int ret;
 
-		/*
-		 * This may require CAP_NET_ADMIN.
-		 */
-		if (ioctl(handle->fd, SIOCSHWTSTAMP, &ifr) < 0) {
-			switch (errno) {
+	switch (nlh->nlmsg_type) {
 
-			case EPERM:
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		ret = nl_finddevs_link(nl, nlh, &freedev, errbuf);
+		if (freedev != NULL)
+			pcap_freealldevs(freedev);
+		return ret;
+
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		return nl_finddevs_addr(nl, nlh, errbuf);
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Do an RTM_GETLINK or RTM_GETADDR dump, handing each message to
+ * the appropriate handler.
+ *
+ * Returns 0 on success, -1 on an error that should be reported,
+ * and 1 if the dump failed, in which case the caller should fall
+ * back on getifaddrs().
+ */
+static int
+nl_finddevs_dump(struct nl_finddevs *nl, int type, char *errbuf)
+{
+	struct {
+		struct nlmsghdr nlh;
+		union {
+			struct ifinfomsg ifi;
+			struct ifaddrmsg ifa;
+		} u;
+	} req;
+	struct sockaddr_nl sanl;
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t len;
+	struct nlmsghdr *nlh;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = type == RTM_GETLINK ?
+	    NLMSG_LENGTH(sizeof(req.u.ifi)) : NLMSG_LENGTH(sizeof(req.u.ifa));
+	req.nlh.nlmsg_type = (uint16_t)type;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = ++nl->seq;
+	memset(&sanl, 0, sizeof(sanl));
+	sanl.nl_family = AF_NETLINK;
+	if (sendto(nl->fd, &req, req.nlh.nlmsg_len, 0,
+	    (struct sockaddr *)&sanl, sizeof(sanl)) == -1) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't send netlink interface dump request");
+		return 1;
+	}
+
+	for (;;) {
+		iov.iov_base = nl->buf;
+		iov.iov_len = NL_FINDDEVS_BUFSIZE;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &sanl;
+		msg.msg_namelen = sizeof(sanl);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		len = recvmsg(nl->fd, &msg, 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+			    errno, "Can't read netlink interface dump");
+			return 1;
+		}
+		if (msg.msg_flags & MSG_TRUNC) {
+			snprintf(errbuf, PCAP_ERRBUF_SIZE,
+			    "Netlink interface dump message truncated");
+			return 1;
+		}
+		if (sanl.nl_pid != 0)
+			continue;	/* not from the kernel */
+
+		for (nlh = (struct nlmsghdr *)nl->buf; NLMSG_OK(nlh, len);
+		    nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != nl->seq)
+				continue;
+#ifdef NLM_F_DUMP_INTR
+			if (nlh->nlmsg_flags & NLM_F_DUMP_INTR) {
 				/*
-				 * Treat this as an error, as the
-				 * user should try to run this
-				 * with the appropriate privileges -
-				 * and, if they can't, shouldn't
-				 * try requesting hardware time stamps.
+				 * The interfaces changed while the
+				 * kernel was dumping them.
 				 */
-				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-				    "Attempt to set hardware timestamp failed - CAP_NET_ADMIN may be required");
-				return PCAP_ERROR_PERM_DENIED;
+				snprintf(errbuf, PCAP_ERRBUF_SIZE,
+				    "Netlink interface dump was interrupted");
+				return 1;
+			}
+#endif
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+				pcapint_fmt_errmsg_for_errno(errbuf,
+				    PCAP_ERRBUF_SIZE, -err->error,
+				    "Netlink interface dump failed");
+				return 1;
+			}
+			if (nl_finddevs_msg(nl, nlh, errbuf) == -1)
+				return -1;
+		}
+	}
+}
 
-			case EOPNOTSUPP:
-			case ERANGE:
-				/*
-				 * Treat this as a warning, as the
-				 * only way to fix the warning is to
-				 * get an adapter that supports hardware
-				 * time stamps for *all* packets.
-				 * (ERANGE means "we support hardware
-				 * time stamps, but for packets matching
-				 * that particular filter", so it means
-				 * "we don't support hardware time stamps
-				 * for all incoming packets" here.)
-				 *
-				 * We'll just fall back on the standard
-				 * host time stamps.
-				 */
-				status = PCAP_WARNING_TSTAMP_TYPE_NOTSUP;
-				break;
+/*
+ * Fill in the device list with an RTM_GETLINK dump and an RTM_GETADDR
+ * dump.
+ *
+ * Returns 0 on success, -1 on an error that should be reported,
+ * and 1 if routing netlink can't be used or a dump failed.
+ */
+static int
+nl_finddevs_load(struct nl_finddevs *nl, char *errbuf)
+{
+	int ret;
 
-			default:
-				pcapint_fmt_errmsg_for_errno(handle->errbuf,
-				    PCAP_ERRBUF_SIZE, errno,
-				    "SIOCSHWTSTAMP failed");
-				return PCAP_ERROR;
-			}
-		} else {
-			/*
-			 * Well, that worked.  Now specify the type of
-			 * hardware time stamp we want for this
-			 * socket.
-			 */
-			if (handle->opt.tstamp_type == PCAP_TSTAMP_ADAPTER) {
-				/*
-				 * Hardware timestamp, synchronized
-				 * with the system clock.
-				 */
-				timesource = SOF_TIMESTAMPING_SYS_HARDWARE;
-			} else {
-				/*
-				 * PCAP_TSTAMP_ADAPTER_UNSYNCED - hardware
-				 * timestamp, not synchronized with the
-				 * system clock.
-				 */
-				timesource = SOF_TIMESTAMPING_RAW_HARDWARE;
-			}
-			if (setsockopt(handle->fd, SOL_PACKET, PACKET_TIMESTAMP,
-				(void *)&timesource, sizeof(timesource))) {
-				pcapint_fmt_errmsg_for_errno(handle->errbuf,
-				    PCAP_ERRBUF_SIZE, errno,
-				    "can't set PACKET_TIMESTAMP");
-				return PCAP_ERROR;
-			}
-		}
+	nl->fd = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl->fd == -1) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't open routing netlink socket");
+		return 1;
 	}
-#endif /* HAVE_LINUX_NET_TSTAMP_H && PACKET_TIMESTAMP */
-
-	/* ask the kernel to create the ring */
-retry:
-	req.tp_block_nr = req.tp_frame_nr / frames_per_block;
-
-	/* req.tp_frame_nr is requested to match frames_per_block*req.tp_block_nr */
-	req.tp_frame_nr = req.tp_block_nr * frames_per_block;
+	ret = nl_finddevs_dump(nl, RTM_GETLINK, errbuf);
+	if (ret == 0)
+		ret = nl_finddevs_dump(nl, RTM_GETADDR, errbuf);
+	close(nl->fd);
+	nl->fd = -1;
+	return ret;
+}
 
-#ifdef HAVE_TPACKET3
-	/* timeout value to retire block - use the configured buffering timeout, or default if <0. */
-	if (handlep->timeout > 0) {
-		/* Use the user specified timeout as the block timeout */
-		req.tp_retire_blk_tov = handlep->timeout;
-	} else if (handlep->timeout == 0) {
-		/*
-		 * In pcap, this means "infinite timeout"; TPACKET_V3
-		 * doesn't support that, so just set it to UINT_MAX
-		 * milliseconds.  In the TPACKET_V3 loop, if the
-		 * timeout is 0, and we haven't yet seen any packets,
-		 * and we block and still don't have any packets, we
-		 * keep blocking until we do.
-		 */
-		req.tp_retire_blk_tov = UINT_MAX;
-	} else {
-		/*
-		 * XXX - this is not valid; use 0, meaning "have the
-		 * kernel pick a default", for now.
-		 */
-		req.tp_retire_blk_tov = 0;
-	}
-	/* private data not used */
-	req.tp_sizeof_priv = 0;
-	/* Rx ring - feature request bits - none (rxhash will not be filled) */
-	req.tp_feature_req_word = 0;
-#endif
+/*
+ * Get the list of interfaces with routing netlink.
+ *
+ * Returns 0 on success, -1 on an error that should be reported,
+ * and 1 if routing netlink can't be used, in which case the caller
+ * should discard whatever was added to the list and fall back on
+ * getifaddrs().
+ */
+static int
+nl_findalldevs(pcap_if_list_t *devlistp, char *errbuf)
+{
+	struct nl_finddevs nl;
+	int ret;
 
-	if (setsockopt(handle->fd, SOL_PACKET, PACKET_RX_RING,
-					(void *) &req, sizeof(req))) {
-		if ((errno == ENOMEM) && (req.tp_block_nr > 1)) {
-			/*
-			 * Memory failure; try to reduce the requested ring
-			 * size.
-			 *
-			 * We used to reduce this by half -- do 5% instead.
-			 * That may result in more iterations and a longer
-			 * startup, but the user will be much happier with
-			 * the resulting buffer size.
-			 */
-			if (req.tp_frame_nr < 20)
-				req.tp_frame_nr -= 1;
-			else
-				req.tp_frame_nr -= req.tp_frame_nr/20;
-			goto retry;
-		}
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "can't create rx ring on packet socket");
-		return PCAP_ERROR;
+	memset(&nl, 0, sizeof(nl));
+	nl.devlistp = devlistp;
+	nl.buf = malloc(NL_FINDDEVS_BUFSIZE);
+	if (nl.buf == NULL) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return -1;
 	}
+	ret = nl_finddevs_load(&nl, errbuf);
+	free(nl.links);
+	free(nl.buf);
+	return ret;
+}
 
-	/* memory map the rx ring */
-	handlep->mmapbuflen = req.tp_block_nr * req.tp_block_size;
-#ifdef MAP_32BIT
-	if (pcapint_mmap_32bit) flags |= MAP_32BIT;
-#endif
-	handlep->mmapbuf = mmap(0, handlep->mmapbuflen, PROT_READ | PROT_WRITE, flags, handle->fd, 0);
-	if (handlep->mmapbuf == MAP_FAILED) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "can't mmap rx ring");
+/*
+ * The device cache.
+ *
+ * When it's enabled, we keep the list of network interfaces in
+ * memory and subscribe to RTMGRP_LINK, RTMGRP_IPV4_IFADDR and
+ * RTMGRP_IPV6_IFADDR notifications; pcap_findalldevs() then only
+ * has to apply whatever notifications have queued up on the socket
+ * and copy the list.  There's no thread; the notifications are
+ * read by pcap_findalldevs() and pcap_devcache_dispatch(), and the
+ * socket can be handed to select(), poll() or epoll to find out
+ * when to call the latter.
+ */
+struct pcap_devcache {
+	int		fd;		/* notification socket */
+	struct nl_finddevs nl;
+	int		dispatching;
+	int		disable_pending;
+};
 
-		/* clear the allocated ring on error*/
-		destroy_ring(handle);
-		return PCAP_ERROR;
-	}
+/*
+ * There's no lock on this; it's up to the caller not to use the cache
+ * from more than one thread at a time, as pcap_devcache_enable(3PCAP)
+ * and pcap_findalldevs(3PCAP) say.  Without the cache,
+ * pcap_findalldevs() keeps no state between calls, so it's safe to
+ * call it from several threads at once.
+ */
+static struct pcap_devcache *devcache;
 
-	/* allocate a ring for each frame header pointer*/
-	handle->cc = req.tp_frame_nr;
-	handle->buffer = malloc(handle->cc * sizeof(union thdr *));
-	if (!handle->buffer) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "can't allocate ring of frame headers");
+/*
+ * Number of times to retry a dump that was interrupted by changes
+ * to the interfaces.
+ */
+#define DEVCACHE_LOAD_TRIES	4
 
-		destroy_ring(handle);
-		return PCAP_ERROR;
-	}
+static int
+devcache_load(struct nl_finddevs *nl, char *errbuf)
+{
+	int tries, ret;
 
-	/* fill the header ring with proper frame ptr*/
-	handle->offset = 0;
-	for (i=0; i<req.tp_block_nr; ++i) {
-		u_char *base = &handlep->mmapbuf[i*req.tp_block_size];
-		for (j=0; j<frames_per_block; ++j, ++handle->offset) {
-			RING_GET_CURRENT_FRAME(handle) = base;
-			base += req.tp_frame_size;
-		}
+	for (tries = 0; tries < DEVCACHE_LOAD_TRIES; tries++) {
+		pcapint_clear_devlist(nl->devlistp);
+		nl->nlinks = 0;
+		ret = nl_finddevs_load(nl, errbuf);
+		if (ret != 1)
+			return ret;
 	}
-
-	handle->bufsize = req.tp_frame_size;
-	handle->offset = 0;
-	return status;
+	return -1;
 }
 
-/* free all ring related resources*/
 static void
-destroy_ring(pcap_t *handle)
+devcache_free(struct pcap_devcache *dc)
 {
-	struct pcap_linux *handlep = handle->priv;
+	if (dc->fd != -1)
+		close(dc->fd);
+	if (dc->nl.devlistp != NULL)
+		pcapint_free_devlist(dc->nl.devlistp);
+	free(dc->nl.links);
+	free(dc->nl.buf);
+	free(dc);
+}
 
-	/*
-	 * Tell the kernel to destroy the ring.
-	 * We don't check for setsockopt failure, as 1) we can't recover
-	 * from an error and 2) we might not yet have set it up in the
-	 * first place.
-	 */
-	struct tpacket_req req;
-	memset(&req, 0, sizeof(req));
-	(void)setsockopt(handle->fd, SOL_PACKET, PACKET_RX_RING,
-				(void *) &req, sizeof(req));
+/*
+ * We missed some notifications; reload the list, and report the
+ * differences between the old and new lists.
+ */
+static int
+devcache_resync(struct pcap_devcache *dc, char *errbuf)
+{
+	struct nl_finddevs newnl;
+	struct nl_finddevs_link *oldlink, *newlink;
+	size_t i, j;
+
+	memset(&newnl, 0, sizeof(newnl));
+	newnl.buf = dc->nl.buf;
+	newnl.devlistp = pcapint_alloc_devlist(errbuf);
+	if (newnl.devlistp == NULL)
+		return -1;
+	if (devcache_load(&newnl, errbuf) == -1) {
+		pcapint_free_devlist(newnl.devlistp);
+		free(newnl.links);
+		return -1;
+	}
 
-	/* if ring is mapped, unmap it*/
-	if (handlep->mmapbuf) {
-		/* do not test for mmap failure, as we can't recover from any error */
-		(void)munmap(handlep->mmapbuf, handlep->mmapbuflen);
-		handlep->mmapbuf = NULL;
+	/*
+	 * Both arrays are sorted by interface index, so walk them
+	 * together.
+	 */
+	i = j = 0;
+	while (i < dc->nl.nlinks || j < newnl.nlinks) {
+		oldlink = i < dc->nl.nlinks ? &dc->nl.links[i] : NULL;
+		newlink = j < newnl.nlinks ? &newnl.links[j] : NULL;
+		if (newlink == NULL ||
+		    (oldlink != NULL && oldlink->ifindex < newlink->ifindex)) {
+			nl_finddevs_report(&dc->nl, PCAP_DEVEVENT_REMOVED,
+			    oldlink->dev);
+			i++;
+		} else if (oldlink == NULL ||
+		    newlink->ifindex < oldlink->ifindex) {
+			nl_finddevs_report(&dc->nl, PCAP_DEVEVENT_ADDED,
+			    newlink->dev);
+			j++;
+		} else {
+			if (nl_finddevs_dev_changed(oldlink->dev,
+			    newlink->dev) ||
+			    !nl_finddevs_addrs_equal(oldlink->dev->addresses,
+			    newlink->dev->addresses, AF_UNSPEC))
+				nl_finddevs_report(&dc->nl,
+				    PCAP_DEVEVENT_CHANGED, newlink->dev);
+			i++;
+			j++;
+		}
 	}
+
+	pcapint_free_devlist(dc->nl.devlistp);
+	free(dc->nl.links);
+	dc->nl.devlistp = newnl.devlistp;
+	dc->nl.links = newnl.links;
+	dc->nl.nlinks = newnl.nlinks;
+	dc->nl.maxlinks = newnl.maxlinks;
+	return 0;
 }
 
 /*
- * Special one-shot callback, used for pcap_next() and pcap_next_ex(),
- * for Linux mmapped capture.
- *
- * The problem is that pcap_next() and pcap_next_ex() expect the packet
- * data handed to the callback to be valid after the callback returns,
- * but pcap_read_linux_mmap() has to release that packet as soon as
- * the callback returns (otherwise, the kernel thinks there's still
- * at least one unprocessed packet available in the ring, so a select()
- * will immediately return indicating that there's data to process), so,
- * in the callback, we have to make a copy of the packet.
- *
- * Yes, this means that, if the capture is using the ring buffer, using
- * pcap_next() or pcap_next_ex() requires more copies than using
- * pcap_loop() or pcap_dispatch().  If that bothers you, don't use
- * pcap_next() or pcap_next_ex().
+ * Apply all the notifications that have queued up on the socket.
  */
-static void
-pcapint_oneshot_linux(u_char *user, const struct pcap_pkthdr *h,
-    const u_char *bytes)
+static int
+devcache_update(struct pcap_devcache *dc, char *errbuf)
 {
-	struct oneshot_userdata *sp = (struct oneshot_userdata *)user;
-	pcap_t *handle = sp->pd;
-	struct pcap_linux *handlep = handle->priv;
+	struct sockaddr_nl sanl;
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t len;
+	struct nlmsghdr *nlh;
+	int ret = 0;
+
+	dc->dispatching = 1;
+	for (;;) {
+		iov.iov_base = dc->nl.buf;
+		iov.iov_len = NL_FINDDEVS_BUFSIZE;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &sanl;
+		msg.msg_namelen = sizeof(sanl);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		len = recvmsg(dc->fd, &msg, 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;		/* nothing more queued up */
+			if (errno == ENOBUFS) {
+				/*
+				 * The socket buffer overflowed, so we
+				 * lost notifications.
+				 */
+				if (devcache_resync(dc, errbuf) == -1) {
+					ret = -1;
+					break;
+				}
+				continue;
+			}
+			pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+			    errno, "Can't read routing netlink notifications");
+			ret = -1;
+			break;
+		}
+		if (msg.msg_flags & MSG_TRUNC) {
+			/*
+			 * We lost part of a notification; start over.
+			 */
+			if (devcache_resync(dc, errbuf) == -1) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+		if (sanl.nl_pid != 0)
+			continue;	/* not from the kernel */
 
-	*sp->hdr = *h;
-	memcpy(handlep->oneshot_buffer, bytes, h->caplen);
-	*sp->pkt = handlep->oneshot_buffer;
+		for (nlh = (struct nlmsghdr *)dc->nl.buf; NLMSG_OK(nlh, len);
+		    nlh = NLMSG_NEXT(nlh, len)) {
+			if (nl_finddevs_msg(&dc->nl, nlh, errbuf) == -1) {
+				ret = -1;
+				break;
+			}
+			if (dc->disable_pending)
+				break;	/* the handler disabled the cache */
+		}
+		if (ret == -1 || dc->disable_pending)
+			break;
+	}
+	dc->dispatching = 0;
+	return ret;
 }
 
+/*
+ * Append a copy of the cached list to a list of devices.
+ */
 static int
-pcap_getnonblock_linux(pcap_t *handle)
+devcache_copy(struct pcap_devcache *dc, pcap_if_list_t *devlistp,
+    char *errbuf)
 {
-	struct pcap_linux *handlep = handle->priv;
+	pcap_if_t *dev, *copy, *devs = NULL, **lastp = &devs;
+	pcap_addr_t *addr;
 
-	/* use negative value of timeout to indicate non blocking ops */
-	return (handlep->timeout<0);
+	for (dev = pcapint_first_dev(dc->nl.devlistp); dev != NULL;
+	    dev = dev->next) {
+		copy = calloc(1, sizeof(*copy));
+		if (copy == NULL)
+			goto fail;
+		*lastp = copy;
+		lastp = &copy->next;
+		copy->name = strdup(dev->name);
+		if (copy->name == NULL)
+			goto fail;
+		if (dev->description != NULL) {
+			copy->description = strdup(dev->description);
+			if (copy->description == NULL)
+				goto fail;
+		}
+		copy->flags = dev->flags;
+		for (addr = dev->addresses; addr != NULL; addr = addr->next) {
+			if (pcapint_add_addr_to_dev(copy,
+			    addr->addr,
+			    addr->addr != NULL ? nl_finddevs_sa_len(addr->addr) : 0,
+			    addr->netmask,
+			    addr->netmask != NULL ? nl_finddevs_sa_len(addr->netmask) : 0,
+			    addr->broadaddr,
+			    addr->broadaddr != NULL ? nl_finddevs_sa_len(addr->broadaddr) : 0,
+			    addr->dstaddr,
+			    addr->dstaddr != NULL ? nl_finddevs_sa_len(addr->dstaddr) : 0,
+			    errbuf) == -1) {
+				pcap_freealldevs(devs);
+				return -1;
+			}
+		}
+	}
+	pcapint_append_devs(devlistp, devs);
+	return 0;
+
+fail:
+	pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE, errno,
+	    "malloc");
+	pcap_freealldevs(devs);
+	return -1;
 }
 
-static int
-pcap_setnonblock_linux(pcap_t *handle, int nonblock)
+int
+pcap_devcache_enable(pcap_devevent_handler callback, u_char *user,
+    char *errbuf)
 {
-	struct pcap_linux *handlep = handle->priv;
-
-	/*
-	 * Set the file descriptor to the requested mode, as we use
-	 * it for sending packets.
-	 */
-	if (pcapint_setnonblock_fd(handle, nonblock) == -1)
-		return -1;
+	struct pcap_devcache *dc;
+	struct sockaddr_nl sanl;
+	int rcvbuf;
+
+	if (devcache != NULL) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "The device cache is already enabled");
+		return PCAP_ERROR;
+	}
+	dc = calloc(1, sizeof(*dc));
+	if (dc == NULL) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return PCAP_ERROR;
+	}
+	dc->fd = -1;
+	dc->nl.fd = -1;
+	dc->nl.buf = malloc(NL_FINDDEVS_BUFSIZE);
+	if (dc->nl.buf == NULL) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		devcache_free(dc);
+		return PCAP_ERROR;
+	}
+	dc->nl.devlistp = pcapint_alloc_devlist(errbuf);
+	if (dc->nl.devlistp == NULL) {
+		devcache_free(dc);
+		return PCAP_ERROR;
+	}
 
 	/*
-	 * Map each value to their corresponding negation to
-	 * preserve the timeout value provided with pcap_set_timeout.
+	 * Subscribe before loading the list, so that no change made
+	 * between the dumps and the subscription is missed;
+	 * notifications for changes the dumps already saw are
+	 * harmless.
 	 */
-	if (nonblock) {
+	dc->fd = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC|SOCK_NONBLOCK,
+	    NETLINK_ROUTE);
+	if (dc->fd == -1) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't open routing netlink socket");
+		devcache_free(dc);
+		return PCAP_ERROR;
+	}
+	memset(&sanl, 0, sizeof(sanl));
+	sanl.nl_family = AF_NETLINK;
+	sanl.nl_groups = RTMGRP_LINK|RTMGRP_IPV4_IFADDR|RTMGRP_IPV6_IFADDR;
+	if (bind(dc->fd, (struct sockaddr *)&sanl, sizeof(sanl)) == -1) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't subscribe to routing netlink notifications");
+		devcache_free(dc);
+		return PCAP_ERROR;
+	}
+
+	/*
+	 * Creating a container can generate a burst of notifications;
+	 * try for a socket buffer big enough not to overflow, so we
+	 * don't have to reload the list.  This is just a hint.
+	 */
+	rcvbuf = 1024 * 1024;
+	(void)setsockopt(dc->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+	    sizeof(rcvbuf));
+
+	if (devcache_load(&dc->nl, errbuf) == -1) {
+		devcache_free(dc);
+		return PCAP_ERROR;
+	}
+
+	/*
+	 * Don't report the devices we started with.
+	 */
+	dc->nl.callback = callback;
+	dc->nl.user = user;
+	devcache = dc;
+	return 0;
+}
+
+int
+pcap_devcache_get_selectable_fd(void)
+{
+	if (devcache == NULL)
+		return -1;
+	return devcache->fd;
+}
+
+int
+pcap_devcache_dispatch(char *errbuf)
+{
+	struct pcap_devcache *dc = devcache;
+	int ret;
+
+	if (dc == NULL) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "The device cache isn't enabled");
+		return PCAP_ERROR;
+	}
+	if (dc->dispatching) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "pcap_devcache_dispatch() can't be called from the event handler");
+		return PCAP_ERROR;
+	}
+	dc->nl.nevents = 0;
+	ret = devcache_update(dc, errbuf);
+	if (dc->disable_pending) {
+		devcache = NULL;
+		devcache_free(dc);
+	} else if (ret == 0)
+		ret = dc->nl.nevents;
+	return ret == -1 ? PCAP_ERROR : ret;
+}
+
+void
+pcap_devcache_disable(void)
+{
+	if (devcache == NULL)
+		return;
+	if (devcache->dispatching) {
 		/*
-		 * We're setting the mode to non-blocking mode.
+		 * Called from the event handler; we'll free it when
+		 * we're done reading notifications.
 		 */
-		if (handlep->timeout >= 0) {
-			/*
-			 * Indicate that we're switching to
-			 * non-blocking mode.
-			 */
-			handlep->timeout = ~handlep->timeout;
-		}
-		if (handlep->poll_breakloop_fd != -1) {
-			/* Close the eventfd; we do not need it in nonblock mode. */
-			close(handlep->poll_breakloop_fd);
-			handlep->poll_breakloop_fd = -1;
-		}
-	} else {
+		devcache->disable_pending = 1;
+		return;
+	}
+	devcache_free(devcache);
+	devcache = NULL;
+}
+
+int
+pcapint_platform_finddevs(pcap_if_list_t *devlistp, char *errbuf)
+{
+	struct pcap_devcache *dc = devcache;
+	int ret;
+
+	if (dc != NULL && dc->disable_pending)
+		dc = NULL;
+	if (dc != NULL) {
 		/*
-		 * We're setting the mode to blocking mode.
+		 * Bring the cached list up to date and copy it,
+		 * unless we're being called from the event handler,
+		 * in which case it's already being brought up to date.
 		 */
-		if (handlep->poll_breakloop_fd == -1) {
-			/* If we did not have an eventfd, open one now that we are blocking. */
-			if ( ( handlep->poll_breakloop_fd = eventfd(0, EFD_NONBLOCK) ) == -1 ) {
-				pcapint_fmt_errmsg_for_errno(handle->errbuf,
-				    PCAP_ERRBUF_SIZE, errno,
-				    "could not open eventfd");
-				return -1;
+		if (!dc->dispatching) {
+			ret = devcache_update(dc, errbuf);
+			if (dc->disable_pending) {
+				devcache = NULL;
+				devcache_free(dc);
+				dc = NULL;
 			}
+			if (ret == -1)
+				return (-1);	/* failure */
 		}
-		if (handlep->timeout < 0) {
-			handlep->timeout = ~handlep->timeout;
+	}
+	if (dc != NULL) {
+		if (devcache_copy(dc, devlistp, errbuf) == -1)
+			return (-1);	/* failure */
+	} else {
+		/*
+		 * Get the list of regular interfaces first, with
+		 * routing netlink if we can.
+		 */
+		ret = nl_findalldevs(devlistp, errbuf);
+		if (ret == -1)
+			return (-1);	/* failure */
+		if (ret == 1) {
+			/*
+			 * Routing netlink isn't available, or the dump
+			 * failed; discard anything it added, and use
+			 * getifaddrs() instead.
+			 */
+			pcapint_clear_devlist(devlistp);
+			if (pcapint_findalldevs_interfaces(devlistp, errbuf,
+			    can_be_bound, get_if_flags) == -1)
+				return (-1);	/* failure */
 		}
 	}
-	/* Update the timeout to use in poll(). */
-	set_poll_timeout(handlep);
-	return 0;
+
+	/*
+	 * Add the "any" device.
+	 */
+	if (pcapint_add_any_dev(devlistp, errbuf) == NULL)
+		return (-1);
+
+	return (0);
 }
 
 /*
- * Get the status field of the ring buffer frame at a specified offset.
+ * Set direction flag: Which packets do we accept on a forwarding
+ * single device? IN, OUT or both?
  */
-static inline u_int
-pcap_get_ring_frame_status(pcap_t *handle, u_int offset)
+static int
+pcap_setdirection_linux(pcap_t *handle, pcap_direction_t d)
 {
-	struct pcap_linux *handlep = handle->priv;
-	union thdr h;
+	/*
+	 * It's guaranteed, at this point, that d is a valid
+	 * direction value.
+	 */
+	handle->direction = d;
+	return 0;
+}
 
-	h.raw = RING_GET_FRAME_AT(handle, offset);
-	switch (handlep->tp_version) {
-	case TPACKET_V2:
-		return __atomic_load_n(&h.h2->tp_status, __ATOMIC_ACQUIRE);
-#ifdef HAVE_TPACKET3
-	case TPACKET_V3:
-		return __atomic_load_n(&h.h3->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
-#endif
+static int
+is_wifi(const char *device)
+{
+	char *pathstr;
+	struct stat statb;
+
+	/*
+	 * See if there's a sysfs wireless directory for it.
+	 * If so, it's a wireless interface.
+	 */
+	if (asprintf(&pathstr, "/sys/class/net/%s/wireless", device) == -1) {
+		/*
+		 * Just give up here.
+		 */
+		return 0;
 	}
-	/* This should not happen. */
+	if (stat(pathstr, &statb) == 0) {
+		free(pathstr);
+		return 1;
+	}
+	free(pathstr);
+
 	return 0;
 }
 
 /*
- * Block waiting for frames to be available.
+ *  Linux uses the ARP hardware type to identify the type of an
+ *  interface. pcap uses the DLT_xxx constants for this. This
+ *  function takes a pointer to a "pcap_t", and an ARPHRD_xxx
+ *  constant, as arguments, and sets "handle->linktype" to the
+ *  appropriate DLT_XXX constant and sets "handle->offset" to
+ *  the appropriate value (to make "handle->offset" plus link-layer
+ *  header length be a multiple of 4, so that the link-layer payload
+ *  will be aligned on a 4-byte boundary when capturing packets).
+ *  (If the offset isn't set here, it'll be 0; add code as appropriate
+ *  for cases where it shouldn't be 0.)
+ *
+ *  If "cooked_ok" is non-zero, we can use DLT_LINUX_SLL and capture
+ *  in cooked mode; otherwise, we can't use cooked mode, so we have
+ *  to pick some type that works in raw mode, or fail.
+ *
+ *  Sets the link type to -1 if unable to map the type.
+ *
+ *  Returns 0 on success or a PCAP_ERROR_ value on error.
  */
-static int pcap_wait_for_frames_mmap(pcap_t *handle)
+static int map_arphrd_to_dlt(pcap_t *handle, int arptype,
+			     const char *device, int cooked_ok)
 {
-	struct pcap_linux *handlep = handle->priv;
-	int timeout;
-	struct ifreq ifr;
-	int ret;
-	struct pollfd pollinfo[2];
-	int numpollinfo;
-	pollinfo[0].fd = handle->fd;
-	pollinfo[0].events = POLLIN;
-	if ( handlep->poll_breakloop_fd == -1 ) {
-		numpollinfo = 1;
-		pollinfo[1].revents = 0;
-		/*
-		 * We set pollinfo[1].revents to zero, even though
-		 * numpollinfo = 1 meaning that poll() doesn't see
-		 * pollinfo[1], so that we do not have to add a
-		 * conditional of numpollinfo > 1 below when we
-		 * test pollinfo[1].revents.
-		 */
-	} else {
-		pollinfo[1].fd = handlep->poll_breakloop_fd;
-		pollinfo[1].events = POLLIN;
-		numpollinfo = 2;
-	}
+	static const char cdma_rmnet[] = "cdma_rmnet";
 
-	/*
-	 * Keep polling until we either get some packets to read, see
-	 * that we got told to break out of the loop, get a fatal error,
-	 * or discover that the device went away.
-	 *
-	 * In non-blocking mode, we must still do one poll() to catch
-	 * any pending error indications, but the poll() has a timeout
-	 * of 0, so that it doesn't block, and we quit after that one
-	 * poll().
-	 *
-	 * If we've seen an ENETDOWN, it might be the first indication
-	 * that the device went away, or it might just be that it was
-	 * configured down.  Unfortunately, there's no guarantee that
-	 * the device has actually been removed as an interface, because:
-	 *
-	 * 1) if, as appears to be the case at least some of the time,
-	 * the PF_PACKET socket code first gets a NETDEV_DOWN indication
-	 * for the device and then gets a NETDEV_UNREGISTER indication
-	 * for it, the first indication will cause a wakeup with ENETDOWN
-	 * but won't set the packet socket's field for the interface index
-	 * to -1, and the second indication won't cause a wakeup (because
-	 * the first indication also caused the protocol hook to be
-	 * unregistered) but will set the packet socket's field for the
-	 * interface index to -1;
-	 *
-	 * 2) even if just a NETDEV_UNREGISTER indication is registered,
-	 * the packet socket's field for the interface index only gets
-	 * set to -1 after the wakeup, so there's a small but non-zero
-	 * risk that a thread blocked waiting for the wakeup will get
-	 * to the "fetch the socket name" code before the interface index
-	 * gets set to -1, so it'll get the old interface index.
-	 *
-	 * Therefore, if we got an ENETDOWN and haven't seen a packet
-	 * since then, we assume that we might be waiting for the interface
-	 * to disappear, and poll with a timeout to try again in a short
-	 * period of time.  If we *do* see a packet, the interface has
-	 * come back up again, and is *definitely* still there, so we
-	 * don't need to poll.
-	 */
-	for (;;) {
+	switch (arptype) {
+
+	case ARPHRD_ETHER:
 		/*
-		 * Yes, we do this even in non-blocking mode, as it's
-		 * the only way to get error indications from a
-		 * tpacket socket.
+		 * For various annoying reasons having to do with DHCP
+		 * software, some versions of Android give the mobile-
+		 * phone-network interface an ARPHRD_ value of
+		 * ARPHRD_ETHER, even though the packets supplied by
+		 * that interface have no link-layer header, and begin
+		 * with an IP header, so that the ARPHRD_ value should
+		 * be ARPHRD_NONE.
 		 *
-		 * The timeout is 0 in non-blocking mode, so poll()
-		 * returns immediately.
+		 * Detect those devices by checking the device name, and
+		 * use DLT_RAW for them.
 		 */
-		timeout = handlep->poll_timeout;
+		if (strncmp(device, cdma_rmnet, sizeof cdma_rmnet - 1) == 0) {
+			handle->linktype = DLT_RAW;
+			return 0;
+		}
 
 		/*
-		 * If we got an ENETDOWN and haven't gotten an indication
-		 * that the device has gone away or that the device is up,
-		 * we don't yet know for certain whether the device has
-		 * gone away or not, do a poll() with a 1-millisecond timeout,
-		 * as we have to poll indefinitely for "device went away"
-		 * indications until we either get one or see that the
-		 * device is up.
+		 * Is this a real Ethernet device?  If so, give it a
+		 * link-layer-type list with DLT_EN10MB and DLT_DOCSIS, so
+		 * that an application can let you choose it, in case you're
+		 * capturing DOCSIS traffic that a Cisco Cable Modem
+		 * Termination System is putting out onto an Ethernet (it
+		 * doesn't put an Ethernet header onto the wire, it puts raw
+		 * DOCSIS frames out on the wire inside the low-level
+		 * Ethernet framing).
+		 *
+		 * XXX - are there any other sorts of "fake Ethernet" that
+		 * have ARPHRD_ETHER but that shouldn't offer DLT_DOCSIS as
+		 * a Cisco CMTS won't put traffic onto it or get traffic
+		 * bridged onto it?  ISDN is handled in "setup_socket()",
+		 * as we fall back on cooked mode there, and we use
+		 * is_wifi() to check for 802.11 devices; are there any
+		 * others?
 		 */
-		if (handlep->netdown) {
-			if (timeout != 0)
-				timeout = 1;
-		}
-		ret = poll(pollinfo, numpollinfo, timeout);
-		if (ret < 0) {
-			/*
-			 * Error.  If it's not EINTR, report it.
-			 */
-			if (errno != EINTR) {
-				pcapint_fmt_errmsg_for_errno(handle->errbuf,
-				    PCAP_ERRBUF_SIZE, errno,
-				    "can't poll on packet socket");
-				return PCAP_ERROR;
-			}
+		if (!is_wifi(device)) {
+			int ret;
 
 			/*
-			 * It's EINTR; if we were told to break out of
-			 * the loop, do so.
-			 */
-			if (handle->break_loop) {
-				handle->break_loop = 0;
-				return PCAP_ERROR_BREAK;
-			}
-		} else if (ret > 0) {
-			/*
-			 * OK, some descriptor is ready.
-			 * Check the socket descriptor first.
-			 *
-			 * As I read the Linux man page, pollinfo[0].revents
-			 * will either be POLLIN, POLLERR, POLLHUP, or POLLNVAL.
+			 * This is not a Wi-Fi device but it could be
+			 * a DSA master/management network device.
 			 */
-			if (pollinfo[0].revents == POLLIN) {
+			ret = iface_dsa_get_proto_info(device, handle);
+			if (ret < 0)
+				return ret;
+
+			if (ret == 1) {
 				/*
-				 * OK, we may have packets to
-				 * read.
+				 * This is a DSA master/management network
+				 * device, linktype is already set by
+				 * iface_dsa_get_proto_info(), set an
+				 * appropriate offset here.
 				 */
+				handle->offset = 2;
 				break;
 			}
-			if (pollinfo[0].revents != 0) {
-				/*
-				 * There's some indication other than
-				 * "you can read on this descriptor" on
-				 * the descriptor.
-				 */
-				if (pollinfo[0].revents & POLLNVAL) {
-					snprintf(handle->errbuf,
-					    PCAP_ERRBUF_SIZE,
-					    "Invalid polling request on packet socket");
-					return PCAP_ERROR;
-				}
-				if (pollinfo[0].revents & (POLLHUP | POLLRDHUP)) {
-					snprintf(handle->errbuf,
-					    PCAP_ERRBUF_SIZE,
-					    "Hangup on packet socket");
-					return PCAP_ERROR;
-				}
-				if (pollinfo[0].revents & POLLERR) {
-					/*
-					 * Get the error.
-					 */
-					int err;
-					socklen_t errlen;
-
-					errlen = sizeof(err);
-					if (getsockopt(handle->fd, SOL_SOCKET,
-					    SO_ERROR, &err, &errlen) == -1) {
-						/*
-						 * The call *itself* returned
-						 * an error; make *that*
-						 * the error.
-						 */
-						err = errno;
-					}
 
-					/*
-					 * OK, we have the error.
-					 */
-					if (err == ENETDOWN) {
-						/*
-						 * The device on which we're
-						 * capturing went away or the
-						 * interface was taken down.
-						 *
-						 * We don't know for certain
-						 * which happened, and the
-						 * next poll() may indicate
-						 * that there are packets
-						 * to be read, so just set
-						 * a flag to get us to do
-						 * checks later, and set
-						 * the required select
-						 * timeout to 1 millisecond
-						 * so that event loops that
-						 * check our socket descriptor
-						 * also time out so that
-						 * they can call us and we
-						 * can do the checks.
-						 */
-						handlep->netdown = 1;
-						handle->required_select_timeout = &netdown_timeout;
-					} else if (err == 0) {
-						/*
-						 * This shouldn't happen, so
-						 * report a special indication
-						 * that it did.
-						 */
-						snprintf(handle->errbuf,
-						    PCAP_ERRBUF_SIZE,
-						    "Error condition on packet socket: Reported error was 0");
-						return PCAP_ERROR;
-					} else {
-						pcapint_fmt_errmsg_for_errno(handle->errbuf,
-						    PCAP_ERRBUF_SIZE,
-						    err,
-						    "Error condition on packet socket");
-						return PCAP_ERROR;
-					}
-				}
-			}
 			/*
-			 * Now check the event device.
+			 * It's not a Wi-Fi device; offer DOCSIS.
 			 */
-			if (pollinfo[1].revents & POLLIN) {
-				ssize_t nread;
-				uint64_t value;
+			handle->dlt_list = (u_int *) malloc(sizeof(u_int) * 2);
+			if (handle->dlt_list == NULL) {
+				pcapint_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno, "malloc");
+				return (PCAP_ERROR);
+			}
+			handle->dlt_list[0] = DLT_EN10MB;
+			handle->dlt_list[1] = DLT_DOCSIS;
+			handle->dlt_count = 2;
+		}
+		/* FALLTHROUGH */
 
-				/*
-				 * This should never fail, but, just
-				 * in case....
-				 */
-				nread = read(handlep->poll_breakloop_fd, &value,
-				    sizeof(value));
-				if (nread == -1) {
-					pcapint_fmt_errmsg_for_errno(handle->errbuf,
-					    PCAP_ERRBUF_SIZE,
-					    errno,
-					    "Error reading from event FD");
-					return PCAP_ERROR;
-				}
+	case ARPHRD_METRICOM:
+	case ARPHRD_LOOPBACK:
+		handle->linktype = DLT_EN10MB;
+		handle->offset = 2;
+		break;
 
-				/*
-				 * According to the Linux read(2) man
-				 * page, read() will transfer at most
-				 * 2^31-1 bytes, so the return value is
-				 * either -1 or a value between 0
-				 * and 2^31-1, so it's non-negative.
-				 *
-				 * Cast it to size_t to squelch
-				 * warnings from the compiler; add this
-				 * comment to squelch warnings from
-				 * humans reading the code. :-)
-				 *
-				 * Don't treat an EOF as an error, but
-				 * *do* treat a short read as an error;
-				 * that "shouldn't happen", but....
-				 */
-				if (nread != 0 &&
-				    (size_t)nread < sizeof(value)) {
-					snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-					    "Short read from event FD: expected %zu, got %zd",
-					    sizeof(value), nread);
-					return PCAP_ERROR;
-				}
+	case ARPHRD_EETHER:
+		handle->linktype = DLT_EN3MB;
+		break;
 
-				/*
-				 * This event gets signaled by a
-				 * pcap_breakloop() call; if we were told
-				 * to break out of the loop, do so.
-				 */
-				if (handle->break_loop) {
-					handle->break_loop = 0;
-					return PCAP_ERROR_BREAK;
-				}
-			}
-		}
+	case ARPHRD_AX25:
+		handle->linktype = DLT_AX25_KISS;
+		break;
+
+	case ARPHRD_PRONET:
+		handle->linktype = DLT_PRONET;
+		break;
+
+	case ARPHRD_CHAOS:
+		handle->linktype = DLT_CHAOS;
+		break;
+
+	case ARPHRD_CAN:
+		handle->linktype = DLT_CAN_SOCKETCAN;
+		break;
+
+	case ARPHRD_IEEE802_TR:
+	case ARPHRD_IEEE802:
+		handle->linktype = DLT_IEEE802;
+		handle->offset = 2;
+		break;
+
+	case ARPHRD_ARCNET:
+		handle->linktype = DLT_ARCNET_LINUX;
+		break;
+
+	case ARPHRD_FDDI:
+		handle->linktype = DLT_FDDI;
+		handle->offset = 3;
+		break;
 
+	case ARPHRD_ATM:
 		/*
-		 * Either:
+		 * The Classical IP implementation in ATM for Linux
+		 * supports both what RFC 1483 calls "LLC Encapsulation",
+		 * in which each packet has an LLC header, possibly
+		 * with a SNAP header as well, prepended to it, and
+		 * what RFC 1483 calls "VC Based Multiplexing", in which
+		 * different virtual circuits carry different network
+		 * layer protocols, and no header is prepended to packets.
 		 *
-		 *   1) we got neither an error from poll() nor any
-		 *      readable descriptors, in which case there
-		 *      are no packets waiting to read
+		 * They both have an ARPHRD_ type of ARPHRD_ATM, so
+		 * you can't use the ARPHRD_ type to find out whether
+		 * captured packets will have an LLC header, and,
+		 * while there's a socket ioctl to *set* the encapsulation
+		 * type, there's no ioctl to *get* the encapsulation type.
 		 *
-		 * or
+		 * This means that
 		 *
-		 *   2) We got readable descriptors but the PF_PACKET
-		 *      socket wasn't one of them, in which case there
-		 *      are no packets waiting to read
+		 *	programs that dissect Linux Classical IP frames
+		 *	would have to check for an LLC header and,
+		 *	depending on whether they see one or not, dissect
+		 *	the frame as LLC-encapsulated or as raw IP (I
+		 *	don't know whether there's any traffic other than
+		 *	IP that would show up on the socket, or whether
+		 *	there's any support for IPv6 in the Linux
+		 *	Classical IP code);
 		 *
-		 * so, if we got an ENETDOWN, we've drained whatever
-		 * packets were available to read at the point of the
-		 * ENETDOWN.
+		 *	filter expressions would have to compile into
+		 *	code that checks for an LLC header and does
+		 *	the right thing.
 		 *
-		 * So, if we got an ENETDOWN and haven't gotten an indication
-		 * that the device has gone away or that the device is up,
-		 * we don't yet know for certain whether the device has
-		 * gone away or not, check whether the device exists and is
-		 * up.
+		 * Both of those are a nuisance - and, at least on systems
+		 * that support PF_PACKET sockets, we don't have to put
+		 * up with those nuisances; instead, we can just capture
+		 * in cooked mode.  That's what we'll do, if we can.
+		 * Otherwise, we'll just fail.
 		 */
-		if (handlep->netdown) {
-			if (!device_still_exists(handle)) {
-				/*
-				 * The device doesn't exist any more;
-				 * report that.
-				 *
-				 * XXX - we should really return an
-				 * appropriate error for that, but
-				 * pcap_dispatch() etc. aren't documented
-				 * as having error returns other than
-				 * PCAP_ERROR or PCAP_ERROR_BREAK.
-				 */
-				snprintf(handle->errbuf,  PCAP_ERRBUF_SIZE,
-				    "The interface disappeared");
-				return PCAP_ERROR;
-			}
+		if (cooked_ok)
+			handle->linktype = DLT_LINUX_SLL;
+		else
+			handle->linktype = -1;
+		break;
+
+	case ARPHRD_IEEE80211:
+		handle->linktype = DLT_IEEE802_11;
+		break;
+
+	case ARPHRD_IEEE80211_PRISM:
+		handle->linktype = DLT_PRISM_HEADER;
+		break;
+
+	case ARPHRD_IEEE80211_RADIOTAP:
+		handle->linktype = DLT_IEEE802_11_RADIO;
+		break;
 
+	case ARPHRD_PPP:
+		/*
+		 * Some PPP code in the kernel supplies no link-layer
+		 * header whatsoever to PF_PACKET sockets; other PPP
+		 * code supplies PPP link-layer headers ("syncppp.c");
+		 * some PPP code might supply random link-layer
+		 * headers (PPP over ISDN - there's code in Wireshark,
+		 * for example, to cope with PPP-over-ISDN captures
+		 * with which the Wireshark developers have had to cope,
+		 * heuristically trying to determine which of the
+		 * oddball link-layer headers particular packets have).
+		 *
+		 * As such, we just punt, and run all PPP interfaces
+		 * in cooked mode, if we can; otherwise, we just treat
+		 * it as DLT_RAW, for now - if somebody needs to capture,
+		 * on a 2.0[.x] kernel, on PPP devices that supply a
+		 * link-layer header, they'll have to add code here to
+		 * map to the appropriate DLT_ type (possibly adding a
+		 * new DLT_ type, if necessary).
+		 */
+		if (cooked_ok)
+			handle->linktype = DLT_LINUX_SLL;
+		else {
 			/*
-			 * The device still exists; try to see if it's up.
+			 * XXX - handle ISDN types here?  We can't fall
+			 * back on cooked sockets, so we'd have to
+			 * figure out from the device name what type of
+			 * link-layer encapsulation it's using, and map
+			 * that to an appropriate DLT_ value, meaning
+			 * we'd map "isdnN" devices to DLT_RAW (they
+			 * supply raw IP packets with no link-layer
+			 * header) and "isdY" devices to a new DLT_I4L_IP
+			 * type that has only an Ethernet packet type as
+			 * a link-layer header.
+			 *
+			 * But sometimes we seem to get random crap
+			 * in the link-layer header when capturing on
+			 * ISDN devices....
 			 */
-			memset(&ifr, 0, sizeof(ifr));
-			pcapint_strlcpy(ifr.ifr_name, handlep->device,
-			    sizeof(ifr.ifr_name));
-			if (ioctl(handle->fd, SIOCGIFFLAGS, &ifr) == -1) {
-				if (errno == ENXIO || errno == ENODEV) {
-					/*
-					 * OK, *now* it's gone.
-					 *
-					 * XXX - see above comment.
-					 */
-					snprintf(handle->errbuf,
-					    PCAP_ERRBUF_SIZE,
-					    "The interface disappeared");
-					return PCAP_ERROR;
-				} else {
-					pcapint_fmt_errmsg_for_errno(handle->errbuf,
-					    PCAP_ERRBUF_SIZE, errno,
-					    "%s: Can't get flags",
-					    handlep->device);
-					return PCAP_ERROR;
-				}
-			}
-			if (ifr.ifr_flags & IFF_UP) {
-				/*
-				 * It's up, so it definitely still exists.
-				 * Cancel the ENETDOWN indication - we
-				 * presumably got it due to the interface
-				 * going down rather than the device going
-				 * away - and revert to "no required select
-				 * timeout.
-				 */
-				handlep->netdown = 0;
-				handle->required_select_timeout = NULL;
-			}
+			handle->linktype = DLT_RAW;
+		}
+		break;
+
+	case ARPHRD_CISCO:
+		handle->linktype = DLT_C_HDLC;
+		break;
+
+	/* Not sure if this is correct for all tunnels, but it
+	 * works for CIPE */
+	case ARPHRD_TUNNEL:
+	case ARPHRD_SIT:
+	case ARPHRD_CSLIP:
+	case ARPHRD_SLIP6:
+	case ARPHRD_CSLIP6:
+	case ARPHRD_ADAPT:
+	case ARPHRD_SLIP:
+	case ARPHRD_RAWHDLC:
+	case ARPHRD_DLCI:
+		/*
+		 * XXX - should some of those be mapped to DLT_LINUX_SLL
+		 * instead?  Should we just map all of them to DLT_LINUX_SLL?
+		 */
+		handle->linktype = DLT_RAW;
+		break;
+
+	case ARPHRD_FRAD:
+		handle->linktype = DLT_FRELAY;
+		break;
+
+	case ARPHRD_LOCALTLK:
+		handle->linktype = DLT_LTALK;
+		break;
+
+	case 18:
+		/*
+		 * RFC 4338 defines an encapsulation for IP and ARP
+		 * packets that's compatible with the RFC 2625
+		 * encapsulation, but that uses a different ARP
+		 * hardware type and hardware addresses.  That
+		 * ARP hardware type is 18; Linux doesn't define
+		 * any ARPHRD_ value as 18, but if it ever officially
+		 * supports RFC 4338-style IP-over-FC, it should define
+		 * one.
+		 *
+		 * For now, we map it to DLT_IP_OVER_FC, in the hopes
+		 * that this will encourage its use in the future,
+		 * should Linux ever officially support RFC 4338-style
+		 * IP-over-FC.
+		 */
+		handle->linktype = DLT_IP_OVER_FC;
+		break;
+
+	case ARPHRD_FCPP:
+	case ARPHRD_FCAL:
+	case ARPHRD_FCPL:
+	case ARPHRD_FCFABRIC:
+		/*
+		 * Back in 2002, Donald Lee at Cray wanted a DLT_ for
+		 * IP-over-FC:
+		 *
+		 *	https://www.mail-archive.com/tcpdump-workers@sandelman.ottawa.on.ca/msg01043.html
+		 *
+		 * and one was assigned.
+		 *
+		 * In a later private discussion (spun off from a message
+		 * on the ethereal-users list) on how to get that DLT_
+		 * value in libpcap on Linux, I ended up deciding that
+		 * the best thing to do would be to have him tweak the
+		 * driver to set the ARPHRD_ value to some ARPHRD_FCxx
+		 * type, and map all those types to DLT_IP_OVER_FC:
+		 *
+		 *	I've checked into the libpcap and tcpdump CVS tree
+		 *	support for DLT_IP_OVER_FC.  In order to use that,
+		 *	you'd have to modify your modified driver to return
+		 *	one of the ARPHRD_FCxxx types, in "fcLINUXfcp.c" -
+		 *	change it to set "dev->type" to ARPHRD_FCFABRIC, for
+		 *	example (the exact value doesn't matter, it can be
+		 *	any of ARPHRD_FCPP, ARPHRD_FCAL, ARPHRD_FCPL, or
+		 *	ARPHRD_FCFABRIC).
+		 *
+		 * 11 years later, Christian Svensson wanted to map
+		 * various ARPHRD_ values to DLT_FC_2 and
+		 * DLT_FC_2_WITH_FRAME_DELIMS for raw Fibre Channel
+		 * frames:
+		 *
+		 *	https://github.com/mcr/libpcap/pull/29
+		 *
+		 * There don't seem to be any network drivers that use
+		 * any of the ARPHRD_FC* values for IP-over-FC, and
+		 * it's not exactly clear what the "Dummy types for non
+		 * ARP hardware" are supposed to mean (link-layer
+		 * header type?  Physical network type?), so it's
+		 * not exactly clear why the ARPHRD_FC* types exist
+		 * in the first place.
+		 *
+		 * For now, we map them to DLT_FC_2, and provide an
+		 * option of DLT_FC_2_WITH_FRAME_DELIMS, as well as
+		 * DLT_IP_OVER_FC just in case there's some old
+		 * driver out there that uses one of those types for
+		 * IP-over-FC on which somebody wants to capture
+		 * packets.
+		 */
+		handle->linktype = DLT_FC_2;
+		handle->dlt_list = (u_int *) malloc(sizeof(u_int) * 3);
+		if (handle->dlt_list == NULL) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "malloc");
+			return (PCAP_ERROR);
+		}
+		handle->dlt_list[0] = DLT_FC_2;
+		handle->dlt_list[1] = DLT_FC_2_WITH_FRAME_DELIMS;
+		handle->dlt_list[2] = DLT_IP_OVER_FC;
+		handle->dlt_count = 3;
+		break;
+
+	case ARPHRD_IRDA:
+		/* Don't expect IP packet out of this interfaces... */
+		handle->linktype = DLT_LINUX_IRDA;
+		/* We need to save packet direction for IrDA decoding,
+		 * so let's use "Linux-cooked" mode. Jean II
+		 *
+		 * XXX - this is handled in setup_socket(). */
+		/* handlep->cooked = 1; */
+		break;
+
+	case ARPHRD_LAPD:
+		/* Don't expect IP packet out of this interfaces... */
+		handle->linktype = DLT_LINUX_LAPD;
+		break;
+
+	case ARPHRD_NONE:
+		/*
+		 * No link-layer header; packets are just IP
+		 * packets, so use DLT_RAW.
+		 */
+		handle->linktype = DLT_RAW;
+		break;
+
+	case ARPHRD_IEEE802154:
+		handle->linktype = DLT_IEEE802_15_4_NOFCS;
+		break;
+
+	case ARPHRD_NETLINK:
+		handle->linktype = DLT_NETLINK;
+		/*
+		 * We need to use cooked mode, so that in sll_protocol we
+		 * pick up the netlink protocol type such as NETLINK_ROUTE,
+		 * NETLINK_GENERIC, NETLINK_FIB_LOOKUP, etc.
+		 *
+		 * XXX - this is handled in setup_socket().
+		 */
+		/* handlep->cooked = 1; */
+		break;
+
+	case ARPHRD_VSOCKMON:
+		handle->linktype = DLT_VSOCK;
+		break;
+
+	default:
+		handle->linktype = -1;
+		break;
+	}
+	return (0);
+}
+
+/*
+ * Try to set up a PF_PACKET socket.
+ * Returns 0 or a PCAP_WARNING_ value on success and a PCAP_ERROR_ value
+ * on failure.
+ */
+static int
+setup_socket(pcap_t *handle, int is_any_device)
+{
+	struct pcap_linux *handlep = handle->priv;
+	const char		*device = handle->opt.device;
+	int			status = 0;
+	int			sock_fd, arptype;
+	int			val;
+	int			err = 0;
+	struct packet_mreq	mr;
+
+	/*
+	 * Open a socket with protocol family packet. If cooked is true,
+	 * we open a SOCK_DGRAM socket for the cooked interface, otherwise
+	 * we open a SOCK_RAW socket for the raw interface.
+	 *
+	 * The protocol is set to 0.  This means we will receive no
+	 * packets until we "bind" the socket with a non-zero
+	 * protocol.  This allows us to setup the ring buffers without
+	 * dropping any packets.
+	 */
+	sock_fd = is_any_device ?
+		socket(PF_PACKET, SOCK_DGRAM, 0) :
+		socket(PF_PACKET, SOCK_RAW, 0);
+
+	if (sock_fd == -1) {
+		if (errno == EPERM || errno == EACCES) {
+			/*
+			 * You don't have permission to open the
+			 * socket.
+			 */
+			status = PCAP_ERROR_PERM_DENIED;
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Attempt to create packet socket failed - CAP_NET_RAW may be required");
+		} else if (errno == EAFNOSUPPORT) {
+			/*
+			 * PF_PACKET sockets not supported.
+			 * Perhaps we're running on the WSL1 module
+			 * in the Windows NT kernel rather than on
+			 * a real Linux kernel.
+			 */
+			status = PCAP_ERROR_CAPTURE_NOTSUP;
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "PF_PACKET sockets not supported - is this WSL1?");
+		} else {
+			/*
+			 * Other error.
+			 */
+			status = PCAP_ERROR;
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "socket");
+		}
+		return status;
+	}
+
+	/*
+	 * Get the interface index of the loopback device.
+	 * If the attempt fails, don't fail, just set the
+	 * "handlep->lo_ifindex" to -1.
+	 *
+	 * XXX - can there be more than one device that loops
+	 * packets back, i.e. devices other than "lo"?  If so,
+	 * we'd need to find them all, and have an array of
+	 * indices for them, and check all of them in
+	 * "pcap_read_packet()".
+	 */
+	handlep->lo_ifindex = iface_get_id(sock_fd, "lo", handle->errbuf);
+
+	/*
+	 * Default value for offset to align link-layer payload
+	 * on a 4-byte boundary.
+	 */
+	handle->offset	 = 0;
+
+	/*
+	 * What kind of frames do we have to deal with? Fall back
+	 * to cooked mode if we have an unknown interface type
+	 * or a type we know doesn't work well in raw mode.
+	 */
+	if (!is_any_device) {
+		/* Assume for now we don't need cooked mode. */
+		handlep->cooked = 0;
+
+		if (handle->opt.rfmon) {
+			/*
+			 * We were asked to turn on monitor mode.
+			 * Do so before we get the link-layer type,
+			 * because entering monitor mode could change
+			 * the link-layer type.
+			 */
+			err = enter_rfmon_mode(handle, sock_fd, device);
+			if (err < 0) {
+				/* Hard failure */
+				close(sock_fd);
+				return err;
+			}
+			if (err == 0) {
+				/*
+				 * Nothing worked for turning monitor mode
+				 * on.
+				 */
+				close(sock_fd);
+
+				return PCAP_ERROR_RFMON_NOTSUP;
+			}
+
+			/*
+			 * Either monitor mode has been turned on for
+			 * the device, or we've been given a different
+			 * device to open for monitor mode.  If we've
+			 * been given a different device, use it.
+			 */
+			if (handlep->mondevice != NULL)
+				device = handlep->mondevice;
+		}
+		arptype	= iface_get_arptype(sock_fd, device, handle->errbuf);
+		if (arptype < 0) {
+			close(sock_fd);
+			return arptype;
+		}
+		status = map_arphrd_to_dlt(handle, arptype, device, 1);
+		if (status < 0) {
+			close(sock_fd);
+			return status;
+		}
+		if (handle->linktype == -1 ||
+		    handle->linktype == DLT_LINUX_SLL ||
+		    handle->linktype == DLT_LINUX_IRDA ||
+		    handle->linktype == DLT_LINUX_LAPD ||
+		    handle->linktype == DLT_NETLINK ||
+		    (handle->linktype == DLT_EN10MB &&
+		     (strncmp("isdn", device, 4) == 0 ||
+		      strncmp("isdY", device, 4) == 0))) {
+			/*
+			 * Unknown interface type (-1), or a
+			 * device we explicitly chose to run
+			 * in cooked mode (e.g., PPP devices),
+			 * or an ISDN device (whose link-layer
+			 * type we can only determine by using
+			 * APIs that may be different on different
+			 * kernels) - reopen in cooked mode.
+			 *
+			 * If the type is unknown, return a warning;
+			 * map_arphrd_to_dlt() has already set the
+			 * warning message.
+			 */
+			if (close(sock_fd) == -1) {
+				pcapint_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno, "close");
+				return PCAP_ERROR;
+			}
+			sock_fd = socket(PF_PACKET, SOCK_DGRAM, 0);
+			if (sock_fd < 0) {
+				/*
+				 * Fatal error.  We treat this as
+				 * a generic error; we already know
+				 * that we were able to open a
+				 * PF_PACKET/SOCK_RAW socket, so
+				 * any failure is a "this shouldn't
+				 * happen" case.
+				 */
+				pcapint_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno, "socket");
+				return PCAP_ERROR;
+			}
+			handlep->cooked = 1;
+
+			/*
+			 * Get rid of any link-layer type list
+			 * we allocated - this only supports cooked
+			 * capture.
+			 */
+			if (handle->dlt_list != NULL) {
+				free(handle->dlt_list);
+				handle->dlt_list = NULL;
+				handle->dlt_count = 0;
+			}
+
+			if (handle->linktype == -1) {
+				/*
+				 * Warn that we're falling back on
+				 * cooked mode; we may want to
+				 * update "map_arphrd_to_dlt()"
+				 * to handle the new type.
+				 */
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+					"arptype %d not "
+					"supported by libpcap - "
+					"falling back to cooked "
+					"socket",
+					arptype);
+				status = PCAP_WARNING;
+			}
+
+			/*
+			 * IrDA capture is not a real "cooked" capture,
+			 * it's IrLAP frames, not IP packets.  The
+			 * same applies to LAPD capture.
+			 */
+			if (handle->linktype != DLT_LINUX_IRDA &&
+			    handle->linktype != DLT_LINUX_LAPD &&
+			    handle->linktype != DLT_NETLINK)
+				handle->linktype = DLT_LINUX_SLL;
+		}
+
+		handlep->ifindex = iface_get_id(sock_fd, device,
+		    handle->errbuf);
+		if (handlep->ifindex == -1) {
+			close(sock_fd);
+			return PCAP_ERROR;
+		}
+
+		if ((err = iface_bind(sock_fd, handlep->ifindex,
+		    handle->errbuf, 0)) != 0) {
+			close(sock_fd);
+			return err;
+		}
+	} else {
+		/*
+		 * The "any" device.
+		 */
+		if (handle->opt.rfmon) {
+			/*
+			 * It doesn't support monitor mode.
+			 */
+			close(sock_fd);
+			return PCAP_ERROR_RFMON_NOTSUP;
+		}
+
+		/*
+		 * It uses cooked mode.
+		 * Support both DLT_LINUX_SLL and DLT_LINUX_SLL2.
+		 */
+		handlep->cooked = 1;
+		handle->linktype = DLT_LINUX_SLL;
+		handle->dlt_list = (u_int *) malloc(sizeof(u_int) * 2);
+		if (handle->dlt_list == NULL) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "malloc");
+			close(sock_fd);
+			return (PCAP_ERROR);
+		}
+		handle->dlt_list[0] = DLT_LINUX_SLL;
+		handle->dlt_list[1] = DLT_LINUX_SLL2;
+		handle->dlt_count = 2;
+
+		/*
+		 * We're not bound to a device.
+		 * For now, we're using this as an indication
+		 * that we can't transmit; stop doing that only
+		 * if we figure out how to transmit in cooked
+		 * mode.
+		 */
+		handlep->ifindex = -1;
+	}
+
+	/*
+	 * Select promiscuous mode on if "promisc" is set.
+	 *
+	 * Do not turn allmulti mode on if we don't select
+	 * promiscuous mode - on some devices (e.g., Orinoco
+	 * wireless interfaces), allmulti mode isn't supported
+	 * and the driver implements it by turning promiscuous
+	 * mode on, and that screws up the operation of the
+	 * card as a normal networking interface, and on no
+	 * other platform I know of does starting a non-
+	 * promiscuous capture affect which multicast packets
+	 * are received by the interface.
+	 */
+
+	/*
+	 * Hmm, how can we set promiscuous mode on all interfaces?
+	 * I am not sure if that is possible at all.  For now, we
+	 * silently ignore attempts to turn promiscuous mode on
+	 * for the "any" device (so you don't have to explicitly
+	 * disable it in programs such as tcpdump).
+	 */
+
+	if (!is_any_device && handle->opt.promisc) {
+		memset(&mr, 0, sizeof(mr));
+		mr.mr_ifindex = handlep->ifindex;
+		mr.mr_type    = PACKET_MR_PROMISC;
+		if (setsockopt(sock_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+		    &mr, sizeof(mr)) == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "setsockopt (PACKET_ADD_MEMBERSHIP)");
+			close(sock_fd);
+			return PCAP_ERROR;
+		}
+	}
+
+	/*
+	 * Enable auxiliary data and reserve room for reconstructing
+	 * VLAN headers.
+	 *
+	 * XXX - is enabling auxiliary data necessary, now that we
+	 * only support memory-mapped capture?  The kernel's memory-mapped
+	 * capture code doesn't seem to check whether auxiliary data
+	 * is enabled, it seems to provide it whether it is or not.
+	 */
+	val = 1;
+	if (setsockopt(sock_fd, SOL_PACKET, PACKET_AUXDATA, &val,
+		       sizeof(val)) == -1 && errno != ENOPROTOOPT) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "setsockopt (PACKET_AUXDATA)");
+		close(sock_fd);
+		return PCAP_ERROR;
+	}
+	handle->offset += VLAN_TAG_LEN;
+
+	/*
+	 * If we're in cooked mode, make the snapshot length
+	 * large enough to hold a "cooked mode" header plus
+	 * 1 byte of packet data (so we don't pass a byte
+	 * count of 0 to "recvfrom()").
+	 * XXX - we don't know whether this will be DLT_LINUX_SLL
+	 * or DLT_LINUX_SLL2, so make sure it's big enough for
+	 * a DLT_LINUX_SLL2 "cooked mode" header; a snapshot length
+	 * that small is silly anyway.
+	 */
+	if (handlep->cooked) {
+		if (handle->snapshot < SLL2_HDR_LEN + 1)
+			handle->snapshot = SLL2_HDR_LEN + 1;
+	}
+	handle->bufsize = handle->snapshot;
+
+	/*
+	 * Set the offset at which to insert VLAN tags.
+	 */
+	set_vlan_offset(handle);
+
+	if (handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO) {
+		int nsec_tstamps = 1;
+
+		if (setsockopt(sock_fd, SOL_SOCKET, SO_TIMESTAMPNS, &nsec_tstamps, sizeof(nsec_tstamps)) < 0) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE, "setsockopt: unable to set SO_TIMESTAMPNS");
+			close(sock_fd);
+			return PCAP_ERROR;
+		}
+	}
+
+	/*
+	 * We've succeeded. Save the socket FD in the pcap structure.
+	 */
+	handle->fd = sock_fd;
+
+	/*
+	 * Any supported Linux version implements at least four auxiliary
+	 * data items (SKF_AD_PROTOCOL, SKF_AD_PKTTYPE, SKF_AD_IFINDEX and
+	 * SKF_AD_NLATTR).  Set a flag so the code generator can use these
+	 * items if necessary.
+	 */
+	handle->bpf_codegen_flags |= BPF_SPECIAL_BASIC_HANDLING;
+
+	/*
+	 * Can we generate special code for VLAN checks?
+	 * (XXX - what if we need the special code but it's not supported
+	 * by the OS?  Is that possible?)
+	 *
+	 * This depends on both a runtime condition (the running Linux kernel
+	 * must support at least SKF_AD_VLAN_TAG_PRESENT in the auxiliary data
+	 * and must support SO_BPF_EXTENSIONS in order to tell the userland
+	 * process what it supports) and a compile-time condition (the OS
+	 * headers must define both constants in order to compile libpcap code
+	 * that asks the kernel about the support).
+	 */
+#if defined(SO_BPF_EXTENSIONS) && defined(SKF_AD_VLAN_TAG_PRESENT)
+	int bpf_extensions;
+	socklen_t len = sizeof(bpf_extensions);
+	if (getsockopt(sock_fd, SOL_SOCKET, SO_BPF_EXTENSIONS,
+	    &bpf_extensions, &len) == 0) {
+		if (bpf_extensions >= SKF_AD_VLAN_TAG_PRESENT) {
+			/*
+			 * Yes, we can.  Request that we do so.
+			 */
+			handle->bpf_codegen_flags |= BPF_SPECIAL_VLAN_HANDLING;
+		}
+	}
+#endif // defined(SO_BPF_EXTENSIONS) && defined(SKF_AD_VLAN_TAG_PRESENT)
+
+	return status;
+}
+
+/*
+ * Attempt to setup memory-mapped access.
+ *
+ * On success, returns 0 if there are no warnings or a PCAP_WARNING_ code
+ * if there is a warning.
+ *
+ * On error, returns the appropriate error code; if that is PCAP_ERROR,
+ * sets handle->errbuf to the appropriate message.
+ */
+static int
+setup_mmapped(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct saved_mempolicy saved;
+	int status;
+
+	if (handle->opt.buffer_size == 0) {
+		/* by default request 2M for the ring buffer */
+		handle->opt.buffer_size = 2*1024*1024;
+	}
+	status = prepare_tpacket_socket(handle);
+	if (status == -1)
+		return PCAP_ERROR;
+	if (prefer_numa_node(handle, handlep->numa_node, &saved) == -1)
+		return PCAP_ERROR;
+	status = create_ring(handle);
+	restore_mempolicy(&saved);
+	if (status < 0) {
+		/*
+		 * Error attempting to enable memory-mapped capture;
+		 * fail.  The return value is the status to return.
+		 */
+		return status;
+	}
+
+	/*
+	 * Success.  status has been set either to 0 if there are no
+	 * warnings or to a PCAP_WARNING_ value if there is a warning.
+	 *
+	 * handle->offset is used to get the current position into the rx ring.
+	 * handle->cc is used to store the ring size.
+	 */
+
+	/*
+	 * Set the timeout to use in poll() before returning.
+	 */
+	set_poll_timeout(handlep);
+
+	return status;
+}
+
+/*
+ * Attempt to set the socket to the specified version of the memory-mapped
+ * header.
+ *
+ * Return 0 if we succeed; return 1 if we fail because that version isn't
+ * supported; return -1 on any other error, and set handle->errbuf.
+ */
+static int
+init_tpacket(pcap_t *handle, int version, const char *version_str)
+{
+	struct pcap_linux *handlep = handle->priv;
+	int val = version;
+	socklen_t len = sizeof(val);
+
+	/*
+	 * Probe whether kernel supports the specified TPACKET version;
+	 * this also gets the length of the header for that version.
+	 *
+	 * This socket option was introduced in 2.6.27, which was
+	 * also the first release with TPACKET_V2 support.
+	 */
+	if (getsockopt(handle->fd, SOL_PACKET, PACKET_HDRLEN, &val, &len) < 0) {
+		if (errno == EINVAL) {
+			/*
+			 * EINVAL means this specific version of TPACKET
+			 * is not supported. Tell the caller they can try
+			 * with a different one; if they've run out of
+			 * others to try, let them set the error message
+			 * appropriately.
+			 */
+			return 1;
+		}
+
+		/*
+		 * All other errors are fatal.
+		 */
+		if (errno == ENOPROTOOPT) {
+			/*
+			 * PACKET_HDRLEN isn't supported, which means
+			 * that memory-mapped capture isn't supported.
+			 * Indicate that in the message.
+			 */
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Kernel doesn't support memory-mapped capture; a 2.6.27 or later 2.x kernel is required, with CONFIG_PACKET_MMAP specified for 2.x kernels");
+		} else {
+			/*
+			 * Some unexpected error.
+			 */
+			pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    errno, "can't get %s header len on packet socket",
+			    version_str);
+		}
+		return -1;
+	}
+	handlep->tp_hdrlen = val;
+
+	val = version;
+	if (setsockopt(handle->fd, SOL_PACKET, PACKET_VERSION, &val,
+			   sizeof(val)) < 0) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "can't activate %s on packet socket", version_str);
+		return -1;
+	}
+	handlep->tp_version = version;
+
+	return 0;
+}
+
+/*
+ * Attempt to set the socket to version 3 of the memory-mapped header and,
+ * if that fails because version 3 isn't supported, attempt to fall
+ * back to version 2.  If version 2 isn't supported, just fail.
+ *
+ * Return 0 if we succeed and -1 on any other error, and set handle->errbuf.
+ */
+static int
+prepare_tpacket_socket(pcap_t *handle)
+{
+	int ret;
+
+#ifdef HAVE_TPACKET3
+	/*
+	 * Try setting the version to TPACKET_V3.
+	 *
+	 * The only mode in which buffering is done on PF_PACKET
+	 * sockets, so that packets might not be delivered
+	 * immediately, is TPACKET_V3 mode.
+	 *
+	 * The buffering cannot be disabled in that mode, so
+	 * if the user has requested immediate mode, we don't
+	 * use TPACKET_V3.
+	 */
+	if (!handle->opt.immediate) {
+		ret = init_tpacket(handle, TPACKET_V3, "TPACKET_V3");
+		if (ret == 0) {
+			/*
+			 * Success.
+			 */
+			return 0;
+		}
+		if (ret == -1) {
+			/*
+			 * We failed for some reason other than "the
+			 * kernel doesn't support TPACKET_V3".
+			 */
+			return -1;
+		}
+
+		/*
+		 * This means it returned 1, which means "the kernel
+		 * doesn't support TPACKET_V3"; try TPACKET_V2.
+		 */
+	}
+#endif /* HAVE_TPACKET3 */
+
+	/*
+	 * Try setting the version to TPACKET_V2.
+	 */
+	ret = init_tpacket(handle, TPACKET_V2, "TPACKET_V2");
+	if (ret == 0) {
+		/*
+		 * Success.
+		 */
+		return 0;
+	}
+
+	if (ret == 1) {
+		/*
+		 * OK, the kernel supports memory-mapped capture, but
+		 * not TPACKET_V2.  Set the error message appropriately.
+		 */
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "Kernel doesn't support TPACKET_V2; a 2.6.27 or later kernel is required");
+	}
+
+	/*
+	 * We failed.
+	 */
+	return -1;
+}
+
+/*
+ * If pcap_set_buffer_duration() was called, and we know the speed of
+ * the link, work out how big the ring must be to hold that many
+ * milliseconds of traffic arriving at line rate in packets as big as
+ * the MTU allows.  Each packet takes up a frame of frame_size bytes
+ * or, if frame_size is 0 (TPACKET_V3, where packets are packed into
+ * blocks), hdr_len bytes plus the part of the packet we capture.
+ *
+ * The result is limited to an eighth of physical memory; if that's
+ * still more than the kernel will give us, create_ring() shrinks the
+ * ring until it gets one.
+ *
+ * Sets *sizep to the size, or to 0 if the ring isn't to be sized this
+ * way; returns 0 on success and -1 on error.
+ */
+static int
+buffer_size_for_duration(pcap_t *handle, u_int frame_size, u_int hdr_len,
+    uint64_t *sizep)
+{
+	struct pcap_linux *handlep = handle->priv;
+	int speed, mtu;
+	uint64_t npkts, pktlen, size, limit;
+	long pages;
+
+	*sizep = 0;
+	if (handle->opt.buffer_duration == 0)
+		return 0;
+	speed = iface_get_link_speed(handle);
+	if (speed == -1)
+		return -1;
+	if (speed == 0)
+		return 0;	/* unknown; use the buffer size */
+	mtu = iface_get_mtu(handle->fd, handle->opt.device, handle->errbuf);
+	if (mtu == -1)
+		return -1;
+
+	/*
+	 * A link of speed Mb/s carries speed * 125 bytes per
+	 * millisecond; on Ethernet, each packet takes up the MTU plus
+	 * 38 bytes on the wire (the MAC header, the CRC, the preamble
+	 * and the inter-frame gap).
+	 */
+	npkts = ((uint64_t)speed * 125 * (uint64_t)handle->opt.buffer_duration) /
+	    ((uint64_t)mtu + 38) + 1;
+	if (frame_size != 0)
+		pktlen = frame_size;
+	else
+		pktlen = TPACKET_ALIGN(hdr_len +
+		    min((u_int)handle->snapshot, (u_int)mtu + 18));
+	size = npkts * pktlen;
+
+	limit = INT_MAX;
+	pages = sysconf(_SC_PHYS_PAGES);
+	if (pages > 0 &&
+	    (uint64_t)pages * (uint64_t)getpagesize() / 8 < limit)
+		limit = (uint64_t)pages * (uint64_t)getpagesize() / 8;
+	if (size > limit)
+		size = limit;
+
+	handlep->link_speed = (u_int)speed;
+	*sizep = size;
+	return 0;
+}
+
+/*
+ * Attempt to set up memory-mapped access.
+ *
+ * On success, returns 0 if there are no warnings or to a PCAP_WARNING_ code
+ * if there is a warning.
+ *
+ * On error, returns the appropriate error code; if that is PCAP_ERROR,
+ * sets handle->errbuf to the appropriate message.
+ */
+static int
+create_ring(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	unsigned i, j, frames_per_block;
+	int flags = MAP_SHARED;
+#ifdef HAVE_TPACKET3
+	/*
+	 * For sockets using TPACKET_V2, the extra stuff at the end of a
+	 * struct tpacket_req3 will be ignored, so this is OK even for
+	 * those sockets.
+	 */
+	struct tpacket_req3 req;
+#else
+	struct tpacket_req req;
+#endif
+	socklen_t len;
+	unsigned int sk_type, tp_reserve, maclen, tp_hdrlen, netoff, macoff;
+	unsigned int frame_size;
+	int status;
+
+	/*
+	 * Start out assuming no warnings.
+	 */
+	status = 0;
+
+	/*
+	 * Reserve space for VLAN tag reconstruction.
+	 */
+	tp_reserve = VLAN_TAG_LEN;
+
+	/*
+	 * If we're capturing in cooked mode, reserve space for
+	 * a DLT_LINUX_SLL2 header; we don't know yet whether
+	 * we'll be using DLT_LINUX_SLL or DLT_LINUX_SLL2, as
+	 * that can be changed on an open device, so we reserve
+	 * space for the larger of the two.
+	 *
+	 * XXX - we assume that the kernel is still adding
+	 * 16 bytes of extra space, so we subtract 16 from
+	 * SLL2_HDR_LEN to get the additional space needed.
+	 * (Are they doing that for DLT_LINUX_SLL, the link-
+	 * layer header for which is 16 bytes?)
+	 *
+	 * XXX - should we use TPACKET_ALIGN(SLL2_HDR_LEN - 16)?
+	 */
+	if (handlep->cooked)
+		tp_reserve += SLL2_HDR_LEN - 16;
+
+	/*
+	 * Try to request that amount of reserve space.
+	 * This must be done before creating the ring buffer.
+	 */
+	len = sizeof(tp_reserve);
+	if (setsockopt(handle->fd, SOL_PACKET, PACKET_RESERVE,
+	    &tp_reserve, len) < 0) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf,
+		    PCAP_ERRBUF_SIZE, errno,
+		    "setsockopt (PACKET_RESERVE)");
+		return PCAP_ERROR;
+	}
+
+	/*
+	 * If we were asked for segment information, turn on
+	 * PACKET_VNET_HDR; that, too, must be done before creating
+	 * the ring buffer.
+	 */
+	if (handle->opt.offload_flags & PCAP_OFFLOAD_GSO_INFO) {
+		if (setup_vnet_hdr(handle) == -1)
+			return PCAP_ERROR;
+	}
+
+	switch (handlep->tp_version) {
+
+	case TPACKET_V2:
+		/* Note that with large snapshot length (say 256K, which is
+		 * the default for recent versions of tcpdump, Wireshark,
+		 * TShark, dumpcap or 64K, the value that "-s 0" has given for
+		 * a long time with tcpdump), if we use the snapshot
+		 * length to calculate the frame length, only a few frames
+		 * will be available in the ring even with pretty
+		 * large ring size (and a lot of memory will be unused).
+		 *
+		 * Ideally, we should choose a frame length based on the
+		 * minimum of the specified snapshot length and the maximum
+		 * packet size.  That's not as easy as it sounds; consider,
+		 * for example, an 802.11 interface in monitor mode, where
+		 * the frame would include a radiotap header, where the
+		 * maximum radiotap header length is device-dependent.
+		 *
+		 * So, for now, we just do this for Ethernet devices, where
+		 * there's no metadata header, and the link-layer header is
+		 * fixed length.  We can get the maximum packet size by
+		 * adding 18, the Ethernet header length plus the CRC length
+		 * (just in case we happen to get the CRC in the packet), to
+		 * the MTU of the interface; we fetch the MTU in the hopes
+		 * that it reflects support for jumbo frames.  (Even if the
+		 * interface is just being used for passive snooping, the
+		 * driver might set the size of buffers in the receive ring
+		 * based on the MTU, so that the MTU limits the maximum size
+		 * of packets that we can receive.)
+		 *
+		 * If segmentation/fragmentation or receive offload are
+		 * enabled, we can get reassembled/aggregated packets larger
+		 * than MTU, but bounded to 65535 plus the Ethernet overhead,
+		 * due to kernel and protocol constraints; unless we were
+		 * asked, with PCAP_OFFLOAD_MTU_FRAMES, to size the frames
+		 * for the MTU anyway, and cut those packets short, which,
+		 * if only the headers are wanted, makes the ring hold many
+		 * times as many packets. */
+		frame_size = handle->snapshot;
+		if (handle->linktype == DLT_EN10MB) {
+			unsigned int max_frame_len;
+			int mtu;
+			int offload;
+
+			mtu = iface_get_mtu(handle->fd, handle->opt.device,
+			    handle->errbuf);
+			if (mtu == -1)
+				return PCAP_ERROR;
+			offload = iface_get_offload(handle);
+			if (offload == -1)
+				return PCAP_ERROR;
+			if (offload &&
+			    !(handle->opt.offload_flags & PCAP_OFFLOAD_MTU_FRAMES))
+				max_frame_len = max(mtu, 65535);
+			else
+				max_frame_len = mtu;
+			max_frame_len += 18;
+
+			if (frame_size > max_frame_len)
+				frame_size = max_frame_len;
+		}
+
+		/* NOTE: calculus matching those in tpacket_rcv()
+		 * in linux-2.6/net/packet/af_packet.c
+		 */
+		len = sizeof(sk_type);
+		if (getsockopt(handle->fd, SOL_SOCKET, SO_TYPE, &sk_type,
+		    &len) < 0) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "getsockopt (SO_TYPE)");
+			return PCAP_ERROR;
+		}
+		maclen = (sk_type == SOCK_DGRAM) ? 0 : MAX_LINKHEADER_SIZE;
+			/* XXX: in the kernel maclen is calculated from
+			 * LL_ALLOCATED_SPACE(dev) and vnet_hdr.hdr_len
+			 * in:  packet_snd()           in linux-2.6/net/packet/af_packet.c
+			 * then packet_alloc_skb()     in linux-2.6/net/packet/af_packet.c
+			 * then sock_alloc_send_pskb() in linux-2.6/net/core/sock.c
+			 * but I see no way to get those sizes in userspace,
+			 * like for instance with an ifreq ioctl();
+			 * the best thing I've found so far is MAX_HEADER in
+			 * the kernel part of linux-2.6/include/linux/netdevice.h
+			 * which goes up to 128+48=176; since pcap-linux.c
+			 * defines a MAX_LINKHEADER_SIZE of 256 which is
+			 * greater than that, let's use it.. maybe is it even
+			 * large enough to directly replace macoff..
+			 */
+		tp_hdrlen = TPACKET_ALIGN(handlep->tp_hdrlen) + sizeof(struct sockaddr_ll) ;
+		netoff = TPACKET_ALIGN(tp_hdrlen + (maclen < 16 ? 16 : maclen)) +
+		    tp_reserve + handlep->vnet_hdr_len;
+			/* NOTE: AFAICS tp_reserve may break the TPACKET_ALIGN
+			 * of netoff, which contradicts
+			 * linux-2.6/Documentation/networking/packet_mmap.txt
+			 * documenting that:
+			 * "- Gap, chosen so that packet data (Start+tp_net)
+			 * aligns to TPACKET_ALIGNMENT=16"
+			 */
+			/* NOTE: in linux-2.6/include/linux/skbuff.h:
+			 * "CPUs often take a performance hit
+			 *  when accessing unaligned memory locations"
+			 */
+		macoff = netoff - maclen;
+		req.tp_frame_size = TPACKET_ALIGN(macoff + frame_size);
+		/*
+		 * Round the buffer size up to a multiple of the
+		 * frame size (rather than rounding down, which
+		 * would give a buffer smaller than our caller asked
+		 * for, and possibly give zero frames if the requested
+		 * buffer size is too small for one frame).
+		 */
+		req.tp_frame_nr = (handle->opt.buffer_size + req.tp_frame_size - 1)/req.tp_frame_size;
+		break;
+
+#ifdef HAVE_TPACKET3
+	case TPACKET_V3:
+		/* The "frames" for this are actually buffers that
+		 * contain multiple variable-sized frames.
+		 *
+		 * Unless pcap_set_ring_geometry() gave a block size,
+		 * we pick a "frame" size of MAXIMUM_SNAPLEN to leave
+		 * enough room for at least one reasonably-sized packet
+		 * in the "frame".  pcap_set_ring_geometry() only
+		 * accepts powers of 2 that are at least a page, so
+		 * each block is one "frame". */
+		if (handle->opt.block_size != 0)
+			req.tp_frame_size = handle->opt.block_size;
+		else
+			req.tp_frame_size = MAXIMUM_SNAPLEN;
+		/*
+		 * Unless pcap_set_ring_geometry() gave a block count,
+		 * round the buffer size up to a multiple of the
+		 * "frame" size (rather than rounding down, which
+		 * would give a buffer smaller than our caller asked
+		 * for, and possibly give zero "frames" if the requested
+		 * buffer size is too small for one "frame").
+		 */
+		if (handle->opt.block_count != 0)
+			req.tp_frame_nr = handle->opt.block_count;
+		else
+			req.tp_frame_nr = (handle->opt.buffer_size + req.tp_frame_size - 1)/req.tp_frame_size;
+		break;
+#endif
+	default:
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "Internal error: unknown TPACKET_ value %u",
+		    handlep->tp_version);
+		return PCAP_ERROR;
+	}
+
+	/*
+	 * If we were asked to size the ring to hold a burst of traffic
+	 * at line rate, make it big enough for that, unless we were
+	 * given an explicit TPACKET_V3 block count; the buffer size
+	 * is still the least we use.
+	 */
+	if (handle->opt.buffer_duration != 0 &&
+	    (handlep->tp_version == TPACKET_V2 || handle->opt.block_count == 0)) {
+		uint64_t ring_size;
+
+		if (buffer_size_for_duration(handle,
+		    handlep->tp_version == TPACKET_V2 ? req.tp_frame_size : 0,
+		    TPACKET_ALIGN(TPACKET_ALIGN(handlep->tp_hdrlen) +
+		      sizeof(struct sockaddr_ll) + 16) + tp_reserve +
+		      handlep->vnet_hdr_len,
+		    &ring_size) == -1)
+			return PCAP_ERROR;
+		if (ring_size / req.tp_frame_size >= req.tp_frame_nr)
+			req.tp_frame_nr = (u_int)((ring_size +
+			    req.tp_frame_size - 1) / req.tp_frame_size);
+	}
+
+	/* compute the minimum block size that will handle this frame.
+	 * The block has to be page size aligned.
+	 * The max block size allowed by the kernel is arch-dependent and
+	 * it's not explicitly checked here. */
+	req.tp_block_size = getpagesize();
+	while (req.tp_block_size < req.tp_frame_size)
+		req.tp_block_size <<= 1;
+
+	frames_per_block = req.tp_block_size/req.tp_frame_size;
+
+	/*
+	 * PACKET_TIMESTAMP was added after linux/net_tstamp.h was,
+	 * so we check for PACKET_TIMESTAMP.  We check for
+	 * linux/net_tstamp.h just in case a system somehow has
+	 * PACKET_TIMESTAMP but not linux/net_tstamp.h; that might
+	 * be unnecessary.
+	 *
+	 * SIOCSHWTSTAMP was introduced in the patch that introduced
+	 * linux/net_tstamp.h, so we don't bother checking whether
+	 * SIOCSHWTSTAMP is defined (if your Linux system has
+	 * linux/net_tstamp.h but doesn't define SIOCSHWTSTAMP, your
+	 * Linux system is badly broken).
+	 */
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP)
+	/*
+	 * If we were told to do so, ask the kernel and the driver
+	 * to use hardware timestamps.
+	 *
+	 * Hardware timestamps are only supported with mmapped
+	 * captures.
+	 */
+	if (handle->opt.tstamp_type == PCAP_TSTAMP_ADAPTER ||
+	    handle->opt.tstamp_type == PCAP_TSTAMP_ADAPTER_UNSYNCED) {
+		struct hwtstamp_config hwconfig;
+		struct ifreq ifr;
+		int timesource;
+
+		/*
+		 * Ask for hardware time stamps on all packets,
+		 * including transmitted packets.
+		 */
+		memset(&hwconfig, 0, sizeof(hwconfig));
+		hwconfig.tx_type = HWTSTAMP_TX_ON;
+		hwconfig.rx_filter = HWTSTAMP_FILTER_ALL;
+
+		memset(&ifr, 0, sizeof(ifr));
+		pcapint_strlcpy(ifr.ifr_name, handle->opt.device, sizeof(ifr.ifr_name));
+		ifr.ifr_data = (void *)&hwconfig;
+
+		/*
+		 * This may require CAP_NET_ADMIN.
+		 */
+		if (ioctl(handle->fd, SIOCSHWTSTAMP, &ifr) < 0) {
+			switch (errno) {
+
+			case EPERM:
+				/*
+				 * Treat this as an error, as the
+				 * user should try to run this
+				 * with the appropriate privileges -
+				 * and, if they can't, shouldn't
+				 * try requesting hardware time stamps.
+				 */
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				    "Attempt to set hardware timestamp failed - CAP_NET_ADMIN may be required");
+				return PCAP_ERROR_PERM_DENIED;
+
+			case EOPNOTSUPP:
+			case ERANGE:
+				/*
+				 * Treat this as a warning, as the
+				 * only way to fix the warning is to
+				 * get an adapter that supports hardware
+				 * time stamps for *all* packets.
+				 * (ERANGE means "we support hardware
+				 * time stamps, but for packets matching
+				 * that particular filter", so it means
+				 * "we don't support hardware time stamps
+				 * for all incoming packets" here.)
+				 *
+				 * We'll just fall back on the standard
+				 * host time stamps.
+				 */
+				status = PCAP_WARNING_TSTAMP_TYPE_NOTSUP;
+				break;
+
+			default:
+				pcapint_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno,
+				    "SIOCSHWTSTAMP failed");
+				return PCAP_ERROR;
+			}
+		} else {
+			/*
+			 * Well, that worked.  Now specify the type of
+			 * hardware time stamp we want for this
+			 * socket.
+			 */
+			if (handle->opt.tstamp_type == PCAP_TSTAMP_ADAPTER) {
+				/*
+				 * Hardware timestamp, synchronized
+				 * with the system clock.
+				 */
+				timesource = SOF_TIMESTAMPING_SYS_HARDWARE;
+			} else {
+				/*
+				 * PCAP_TSTAMP_ADAPTER_UNSYNCED - hardware
+				 * timestamp, not synchronized with the
+				 * system clock.
+				 */
+				timesource = SOF_TIMESTAMPING_RAW_HARDWARE;
+			}
+			if (setsockopt(handle->fd, SOL_PACKET, PACKET_TIMESTAMP,
+				(void *)&timesource, sizeof(timesource))) {
+				pcapint_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno,
+				    "can't set PACKET_TIMESTAMP");
+				return PCAP_ERROR;
+			}
+		}
+	}
+#endif /* HAVE_LINUX_NET_TSTAMP_H && PACKET_TIMESTAMP */
+
+	/* ask the kernel to create the ring */
+retry:
+	req.tp_block_nr = req.tp_frame_nr / frames_per_block;
+
+	/* req.tp_frame_nr is requested to match frames_per_block*req.tp_block_nr */
+	req.tp_frame_nr = req.tp_block_nr * frames_per_block;
+
+#ifdef HAVE_TPACKET3
+	/*
+	 * timeout value to retire block - use the one set with
+	 * pcap_set_block_timeout(), if any, otherwise the configured
+	 * buffering timeout, or default if <0.
+	 */
+	if (handle->opt.block_timeout_min > 0) {
+		/*
+		 * If we were given a range, the kernel retires blocks
+		 * after the shortest time, and we adjust how much
+		 * longer we wait before collecting them; see
+		 * adapt_block_wait().
+		 */
+		req.tp_retire_blk_tov = handle->opt.block_timeout_min;
+	} else if (handlep->timeout > 0) {
+		/* Use the user specified timeout as the block timeout */
+		req.tp_retire_blk_tov = handlep->timeout;
+	} else if (handlep->timeout == 0) {
+		/*
+		 * In pcap, this means "infinite timeout"; TPACKET_V3
+		 * doesn't support that, so just set it to UINT_MAX
+		 * milliseconds.  In the TPACKET_V3 loop, if the
+		 * timeout is 0, and we haven't yet seen any packets,
+		 * and we block and still don't have any packets, we
+		 * keep blocking until we do.
+		 */
+		req.tp_retire_blk_tov = UINT_MAX;
+	} else {
+		/*
+		 * XXX - this is not valid; use 0, meaning "have the
+		 * kernel pick a default", for now.
+		 */
+		req.tp_retire_blk_tov = 0;
+	}
+	/* private data not used */
+	req.tp_sizeof_priv = 0;
+	/*
+	 * Rx ring - feature request bits.  If the packets are being
+	 * spread over a fanout group by flow, the kernel has computed
+	 * the flow hash anyway, so have it put it into the ring for
+	 * pcap_dispatch_ex(); otherwise, don't ask for it.
+	 */
+	if (handlep->tp_version == TPACKET_V3 && fanout_by_hash(handle)) {
+		req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+		handlep->fill_rxhash = 1;
+	} else
+		req.tp_feature_req_word = 0;
+#endif
+
+	if (setsockopt(handle->fd, SOL_PACKET, PACKET_RX_RING,
+					(void *) &req, sizeof(req))) {
+		if ((errno == ENOMEM) && (req.tp_block_nr > 1)) {
+			/*
+			 * Memory failure; try to reduce the requested ring
+			 * size.
+			 *
+			 * We used to reduce this by half -- do 5% instead.
+			 * That may result in more iterations and a longer
+			 * startup, but the user will be much happier with
+			 * the resulting buffer size.
+			 */
+			if (req.tp_frame_nr < 20)
+				req.tp_frame_nr -= 1;
+			else
+				req.tp_frame_nr -= req.tp_frame_nr/20;
+			goto retry;
+		}
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "can't create rx ring on packet socket");
+		return PCAP_ERROR;
+	}
+
+	/* the tx ring, if any, has to exist before we map the rings */
+	if (create_tx_ring(handle) == -1) {
+		destroy_ring(handle);
+		return PCAP_ERROR;
+	}
+
+	/*
+	 * memory map the rx ring, and the tx ring, which the kernel
+	 * puts right after it
+	 */
+	handlep->mmapbuflen = req.tp_block_nr * req.tp_block_size;
+#ifdef MAP_32BIT
+	if (pcapint_mmap_32bit) flags |= MAP_32BIT;
+#endif
+	handlep->mmapbuf = mmap(0, handlep->mmapbuflen + handlep->tx_ring_len,
+	    PROT_READ | PROT_WRITE, flags, handle->fd, 0);
+	if (handlep->mmapbuf == MAP_FAILED) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "can't mmap rx ring");
+
+		/* clear the allocated ring on error*/
+		destroy_ring(handle);
+		return PCAP_ERROR;
+	}
+	if (handlep->tx_ring_len != 0)
+		handlep->tx_ring = handlep->mmapbuf + handlep->mmapbuflen;
+
+	/* allocate a ring for each frame header pointer*/
+	handle->cc = req.tp_frame_nr;
+	handle->buffer = malloc(handle->cc * sizeof(union thdr *));
+	if (!handle->buffer) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "can't allocate ring of frame headers");
+
+		destroy_ring(handle);
+		return PCAP_ERROR;
+	}
+	handlep->frame_holds = calloc(handle->cc, sizeof(*handlep->frame_holds));
+	if (handlep->frame_holds == NULL) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "can't allocate ring of frame hold counts");
+
+		destroy_ring(handle);
+		return PCAP_ERROR;
+	}
+	handlep->tp_block_size = req.tp_block_size;
+
+	/* fill the header ring with proper frame ptr*/
+	handle->offset = 0;
+	for (i=0; i<req.tp_block_nr; ++i) {
+		u_char *base = &handlep->mmapbuf[i*req.tp_block_size];
+		for (j=0; j<frames_per_block; ++j, ++handle->offset) {
+			RING_GET_CURRENT_FRAME(handle) = base;
+			base += req.tp_frame_size;
+		}
+	}
+
+	handle->bufsize = req.tp_frame_size;
+	handle->offset = 0;
+
+#ifdef HAVE_TPACKET3
+	/*
+	 * If we're to adapt how long we wait for blocks, don't wait so
+	 * long that, if a block is retired early every
+	 * block_timeout_min milliseconds, more than a quarter of the
+	 * ring fills up while we wait.
+	 */
+	if (handlep->tp_version == TPACKET_V3 &&
+	    handle->opt.block_timeout_max > handle->opt.block_timeout_min) {
+		handlep->block_wait_max = handle->opt.block_timeout_max -
+		    handle->opt.block_timeout_min;
+		if ((u_int)handlep->block_wait_max >
+		    (handle->cc / 4) * (u_int)handle->opt.block_timeout_min)
+			handlep->block_wait_max = (int)((handle->cc / 4) *
+			    (u_int)handle->opt.block_timeout_min);
+	}
+#endif
+	return status;
+}
+
+/*
+ * If asked to with pcap_set_tx_buffer_size(), have the kernel set up a
+ * PACKET_TX_RING for pcap_sendqueue_transmit().  Every frame holds one
+ * packet of up to the MTU plus the link-layer header.
+ *
+ * Returns 0 on success, even if we didn't set up a ring, and -1 on
+ * error.
+ */
+static int
+create_tx_ring(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+#ifdef HAVE_TPACKET3
+	/*
+	 * The fields at the end of a struct tpacket_req3 must be zero
+	 * for a TPACKET_V3 tx ring, and are ignored for TPACKET_V2.
+	 */
+	struct tpacket_req3 req;
+#else
+	struct tpacket_req req;
+#endif
+	unsigned int frame_size;
+	int mtu;
+
+	handlep->tx_ring_len = 0;
+	if (handle->opt.tx_buffer_size <= 0)
+		return 0;
+
+	/*
+	 * pcap_inject() can't send on these, so there's no point in
+	 * a ring; pcap_sendqueue_transmit() will report the error.
+	 */
+	if (handlep->ifindex == -1 || handlep->cooked)
+		return 0;
+
+	mtu = iface_get_mtu(handle->fd, handle->opt.device, handle->errbuf);
+	if (mtu == -1)
+		return -1;
+	frame_size = TPACKET_ALIGNMENT;
+	while (frame_size < TPACKET_ALIGN(handlep->tp_hdrlen) + mtu +
+	    MAX_LINKHEADER_SIZE)
+		frame_size <<= 1;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_frame_size = frame_size;
+	req.tp_block_size = getpagesize();
+	while (req.tp_block_size < req.tp_frame_size)
+		req.tp_block_size <<= 1;
+	req.tp_block_nr = (handle->opt.tx_buffer_size + req.tp_block_size - 1) /
+	    req.tp_block_size;
+	req.tp_frame_nr = req.tp_block_nr * (req.tp_block_size / frame_size);
+	if (setsockopt(handle->fd, SOL_PACKET, PACKET_TX_RING,
+	    (void *) &req, sizeof(req))) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "can't create tx ring on packet socket");
+		return -1;
+	}
+
+	/*
+	 * The frame size is a power of 2 no bigger than the block
+	 * size, so the frames are laid out back to back.
+	 */
+	handlep->tx_frame_size = frame_size;
+	handlep->tx_frame_nr = req.tp_frame_nr;
+	handlep->tx_head = 0;
+	handlep->tx_ring_len = (size_t)req.tp_block_nr * req.tp_block_size;
+	return 0;
+}
+
+/*
+ * Have the kernel put a virtio_net header before each packet in the
+ * ring, describing how the packet was aggregated by GRO or LRO.
+ *
+ * PACKET_VNET_HDR is only allowed on SOCK_RAW sockets.  Kernels before
+ * 5.7 accept it on a socket with a ring, but don't fill in the header
+ * for packets in the ring, so we'd be reading whatever was left there;
+ * check the version rather than reporting garbage.
+ */
+static int
+setup_vnet_hdr(pcap_t *handle)
+{
+#ifdef PACKET_VNET_HDR
+	struct pcap_linux *handlep = handle->priv;
+	struct utsname utsname;
+	long major, minor;
+	int val;
+
+	if (handlep->cooked) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "Segment information isn't available in cooked mode");
+		return -1;
+	}
+	if (uname(&utsname) == -1 ||
+	    sscanf(utsname.release, "%ld.%ld", &major, &minor) != 2 ||
+	    major < 5 || (major == 5 && minor < 7)) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "Segment information requires a 5.7 or later kernel");
+		return -1;
+	}
+	val = 1;
+	if (setsockopt(handle->fd, SOL_PACKET, PACKET_VNET_HDR, &val,
+	    sizeof(val)) == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "setsockopt (PACKET_VNET_HDR)");
+		return -1;
+	}
+	handlep->vnet_hdr_len = sizeof(struct virtio_net_hdr);
+	return 0;
+#else
+	snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+	    "Segment information is not supported by this version of libpcap");
+	return -1;
+#endif
+}
+
+/* free all ring related resources*/
+static void
+destroy_ring(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	/*
+	 * Tell the kernel to destroy the ring.
+	 * We don't check for setsockopt failure, as 1) we can't recover
+	 * from an error and 2) we might not yet have set it up in the
+	 * first place.
+	 */
+	struct tpacket_req req;
+	memset(&req, 0, sizeof(req));
+	(void)setsockopt(handle->fd, SOL_PACKET, PACKET_RX_RING,
+				(void *) &req, sizeof(req));
+	if (handlep->tx_ring_len != 0)
+		(void)setsockopt(handle->fd, SOL_PACKET, PACKET_TX_RING,
+					(void *) &req, sizeof(req));
+
+	/* if ring is mapped, unmap it*/
+	if (handlep->mmapbuf) {
+		/* do not test for mmap failure, as we can't recover from any error */
+		(void)munmap(handlep->mmapbuf,
+		    handlep->mmapbuflen + handlep->tx_ring_len);
+		handlep->mmapbuf = NULL;
+	}
+	handlep->tx_ring = NULL;
+	handlep->tx_ring_len = 0;
+	/*
+	 * Any packets still held are in the ring we just unmapped; the
+	 * documentation says they must all be released before the
+	 * handle is closed, and they can't be released afterwards.
+	 */
+	free(handlep->frame_holds);
+	handlep->frame_holds = NULL;
+	handlep->oneshot_held = NULL;
+}
+
+/*
+ * Special one-shot callback, used for pcap_next() and pcap_next_ex(),
+ * for Linux mmapped capture.
+ *
+ * The problem is that pcap_next() and pcap_next_ex() expect the packet
+ * data handed to the callback to be valid after the callback returns,
+ * but the read routines release that packet's frame or block as soon
+ * as they're done with it, so, in the callback, we hold the packet, and
+ * release it at the beginning of the next read.
+ *
+ * Until then, the kernel thinks there's still at least one unprocessed
+ * packet available in the ring, so a select() may return once more
+ * than it otherwise would; that's cheaper than copying every packet.
+ */
+static void
+pcapint_oneshot_linux(u_char *user, const struct pcap_pkthdr *h,
+    const u_char *bytes)
+{
+	struct oneshot_userdata *sp = (struct oneshot_userdata *)user;
+	pcap_t *handle = sp->pd;
+	struct pcap_linux *handlep = handle->priv;
+
+	*sp->hdr = *h;
+	if (pcap_hold_packet_linux(handle, bytes) == 0)
+		handlep->oneshot_held = bytes;
+	*sp->pkt = bytes;
+}
+
+/*
+ * Release the packet held for pcap_next()/pcap_next_ex(), if any.
+ */
+static inline void
+release_oneshot_linux(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	if (handlep->oneshot_held != NULL) {
+		(void)pcap_release_packet_linux(handle, handlep->oneshot_held);
+		handlep->oneshot_held = NULL;
+	}
+}
+
+/*
+ * Return the offset in the ring of the frame (TPACKET_V2) or block
+ * (TPACKET_V3) containing the given packet data, or -1 if the data
+ * isn't in the ring.
+ */
+static int
+ring_frame_offset(pcap_t *handle, const u_char *bytes)
+{
+	struct pcap_linux *handlep = handle->priv;
+	size_t off;
+	u_int frames_per_block;
+
+	if (handlep->mmapbuf == NULL || bytes < handlep->mmapbuf ||
+	    bytes >= handlep->mmapbuf + handlep->mmapbuflen)
+		return -1;
+	off = bytes - handlep->mmapbuf;
+	frames_per_block = handlep->tp_block_size / handle->bufsize;
+	return (int)((off / handlep->tp_block_size) * frames_per_block +
+	    (off % handlep->tp_block_size) / handle->bufsize);
+}
+
+/*
+ * We're done reading the frame or block at the given offset in the ring.
+ * Return 1 if it should be handed back to the kernel now, or 0 if it's
+ * held, in which case it's handed back when the last hold is released.
+ */
+static inline int
+ring_frame_done(struct pcap_linux *handlep, u_int offset)
+{
+	u_int *holdsp = &handlep->frame_holds[offset];
+
+	/*
+	 * Holds can only be added while the packet data is valid, i.e.
+	 * before our caller finishes with the frame, and the
+	 * documentation requires pcap_hold_packet() to be called by
+	 * the thread reading the packets, or otherwise before that
+	 * thread's next read or batch release, so, if there are none
+	 * now, there won't be any.  Holds can be released by any thread
+	 * at any time, which is why the count is atomic.
+	 */
+	if (__atomic_load_n(holdsp, __ATOMIC_ACQUIRE) == 0)
+		return 1;
+	if (__atomic_fetch_or(holdsp, FRAME_RELEASE_DEFERRED,
+	    __ATOMIC_ACQ_REL) != 0)
+		return 0;
+
+	/*
+	 * The last hold was released before we could mark the frame.
+	 */
+	__atomic_store_n(holdsp, 0, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int
+pcap_hold_packet_linux(pcap_t *handle, const u_char *bytes)
+{
+	struct pcap_linux *handlep = handle->priv;
+	int offset;
+
+	offset = ring_frame_offset(handle, bytes);
+	if (offset == -1) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "The packet data isn't in the capture ring");
+		return PCAP_ERROR;
+	}
+	(void)__atomic_add_fetch(&handlep->frame_holds[offset], 1,
+	    __ATOMIC_ACQ_REL);
+	return 0;
+}
+
+static int
+pcap_release_packet_linux(pcap_t *handle, const u_char *bytes)
+{
+	struct pcap_linux *handlep = handle->priv;
+	u_int *holdsp;
+	union thdr h;
+	int offset;
+
+	offset = ring_frame_offset(handle, bytes);
+	if (offset == -1) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "The packet data isn't in the capture ring");
+		return PCAP_ERROR;
+	}
+	holdsp = &handlep->frame_holds[offset];
+	if ((__atomic_load_n(holdsp, __ATOMIC_ACQUIRE) &
+	    ~FRAME_RELEASE_DEFERRED) == 0) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "The packet isn't being held");
+		return PCAP_ERROR;
+	}
+	if (__atomic_sub_fetch(holdsp, 1, __ATOMIC_ACQ_REL) ==
+	    FRAME_RELEASE_DEFERRED) {
+		/*
+		 * That was the last hold, and we've already finished
+		 * reading the frame, so hand it back to the kernel,
+		 * and then mark it as no longer held, so that we'll
+		 * read it again once the kernel fills it in.
+		 */
+		h.raw = RING_GET_FRAME_AT(handle, offset);
+		switch (handlep->tp_version) {
+
+		case TPACKET_V2:
+			packet_mmap_release(h.h2);
+			break;
+#ifdef HAVE_TPACKET3
+		case TPACKET_V3:
+			packet_mmap_v3_release(h.h3);
+			break;
+#endif
+		}
+		__atomic_store_n(holdsp, 0, __ATOMIC_RELEASE);
+
+		/*
+		 * If the reading thread is waiting for this frame to
+		 * stop being held, wake it up.
+		 */
+		if (handlep->poll_breakloop_fd != -1) {
+			uint64_t value = 1;
+
+DIAG_OFF_WARN_UNUSED_RESULT
+			(void)write(handlep->poll_breakloop_fd, &value,
+			    sizeof(value));
+DIAG_ON_WARN_UNUSED_RESULT
+		}
+	}
+	return 0;
+}
+
+static int
+pcap_getnonblock_linux(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	/* use negative value of timeout to indicate non blocking ops */
+	return (handlep->timeout<0);
+}
+
+static int
+pcap_setnonblock_linux(pcap_t *handle, int nonblock)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	/*
+	 * Set the file descriptor to the requested mode, as we use
+	 * it for sending packets.
+	 */
+	if (pcapint_setnonblock_fd(handle, nonblock) == -1)
+		return -1;
+
+	/*
+	 * Map each value to their corresponding negation to
+	 * preserve the timeout value provided with pcap_set_timeout.
+	 */
+	if (nonblock) {
+		/*
+		 * We're setting the mode to non-blocking mode.
+		 */
+		if (handlep->timeout >= 0) {
+			/*
+			 * Indicate that we're switching to
+			 * non-blocking mode.
+			 */
+			handlep->timeout = ~handlep->timeout;
+		}
+		if (handlep->poll_breakloop_fd != -1) {
+			/* Close the eventfd; we do not need it in nonblock mode. */
+			close(handlep->poll_breakloop_fd);
+			handlep->poll_breakloop_fd = -1;
+		}
+	} else {
+		/*
+		 * We're setting the mode to blocking mode.
+		 */
+		if (handlep->poll_breakloop_fd == -1) {
+			/* If we did not have an eventfd, open one now that we are blocking. */
+			if ( ( handlep->poll_breakloop_fd = eventfd(0, EFD_NONBLOCK) ) == -1 ) {
+				pcapint_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno,
+				    "could not open eventfd");
+				return -1;
+			}
+		}
+		if (handlep->timeout < 0) {
+			handlep->timeout = ~handlep->timeout;
+		}
+	}
+	/* Update the timeout to use in poll(). */
+	set_poll_timeout(handlep);
+	return 0;
+}
+
+/*
+ * Get the status field of the ring buffer frame at a specified offset.
+ */
+static inline u_int
+pcap_get_ring_frame_status(pcap_t *handle, u_int offset)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
+
+	h.raw = RING_GET_FRAME_AT(handle, offset);
+	switch (handlep->tp_version) {
+	case TPACKET_V2:
+		return __atomic_load_n(&h.h2->tp_status, __ATOMIC_ACQUIRE);
+#ifdef HAVE_TPACKET3
+	case TPACKET_V3:
+		return __atomic_load_n(&h.h3->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+#endif
+	}
+	/* This should not happen. */
+	return 0;
+}
+
+/*
+ * Return 1 if the frame or block at the current offset in the ring
+ * is ours to read, 0 otherwise.
+ */
+static int
+ring_frame_ready(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
+
+	if (RING_FRAME_HELD(handlep, handle->offset))
+		return 0;
+	h.raw = RING_GET_CURRENT_FRAME(handle);
+#ifdef HAVE_TPACKET3
+	if (handlep->tp_version == TPACKET_V3)
+		return packet_mmap_v3_acquire(h.h3);
+#endif
+	return packet_mmap_acquire(h.h2);
+}
+
+/*
+ * Spin on the ring for up to handlep->spin_ns nanoseconds, waiting for
+ * the current frame to be handed to us; return 1 if it was, 0 if we
+ * gave up.
+ *
+ * This checks the clock only every so often, as reading it costs more
+ * than checking the frame.
+ */
+static int
+spin_on_ring(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct timespec start, now;
+	uint64_t elapsed = 0;
+	u_int n;
+	int ready = 0;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 1;; n++) {
+		if (ring_frame_ready(handle)) {
+			ready = 1;
+			break;
+		}
+		if (handle->break_loop)
+			break;
+		if ((n & 63) == 0) {
+			(void)clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (uint64_t)(now.tv_sec - start.tv_sec) *
+			    1000000000 + (uint64_t)now.tv_nsec -
+			    (uint64_t)start.tv_nsec;
+			if (elapsed >= handlep->spin_ns)
+				break;
+		}
+	}
+	if (ready) {
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (uint64_t)(now.tv_sec - start.tv_sec) *
+		    1000000000 + (uint64_t)now.tv_nsec -
+		    (uint64_t)start.tv_nsec;
+		handlep->bp_stats.bps_spin_hits++;
+	}
+	handlep->bp_stats.bps_spin_ns += elapsed;
+	return ready;
+}
+
+/*
+ * Bucket for a value in a histogram with power-of-2 buckets; bucket
+ * 0 also counts 0, and the last bucket counts everything too big for
+ * the others.
+ */
+static u_int
+ring_stats_log2_bucket(uint64_t value)
+{
+	u_int bucket;
+
+	if (value == 0)
+		return 0;
+	bucket = 63 - (u_int)__builtin_clzll(value);
+	if (bucket >= PCAP_RING_LOG2_BUCKETS)
+		bucket = PCAP_RING_LOG2_BUCKETS - 1;
+	return bucket;
+}
+
+/*
+ * Note a wakeup from poll() in the ring statistics, along with how full
+ * the ring was; the frames or blocks the kernel has handed us are the
+ * ones from the current one up to the first one it still owns.
+ */
+static void
+ring_stats_wakeup(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct pcap_ring_stat *rs = handlep->ring_stats;
+	union thdr h;
+	u_int offset, ready;
+	int is_ready;
+
+	offset = handle->offset;
+	for (ready = 0; ready < handle->cc; ready++) {
+		if (RING_FRAME_HELD(handlep, offset))
+			break;
+		h.raw = RING_GET_FRAME_AT(handle, offset);
+#ifdef HAVE_TPACKET3
+		if (handlep->tp_version == TPACKET_V3)
+			is_ready = packet_mmap_v3_acquire(h.h3);
+		else
+#endif
+			is_ready = packet_mmap_acquire(h.h2);
+		if (!is_ready)
+			break;
+		if (++offset >= handle->cc)
+			offset = 0;
+	}
+
+	rs->rs_wakeups++;
+	if (ready == 0)
+		rs->rs_empty_wakeups++;
+	rs->rs_fill[(ready * (PCAP_RING_FILL_BUCKETS - 1) + handle->cc - 1) /
+	    handle->cc]++;
+}
+
+/*
+ * Call the callback, timing it for the ring statistics.
+ */
+static void
+ring_stats_callback(pcap_t *handle, pcap_handler callback, u_char *user,
+    const struct pcap_pkthdr *hdr, const u_char *bp)
+{
+	struct pcap_ring_stat *rs =
+	    ((struct pcap_linux *)handle->priv)->ring_stats;
+	struct timespec start, end;
+	uint64_t elapsed;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	callback(user, hdr, bp);
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+	    (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+
+	rs->rs_callbacks++;
+	rs->rs_callback_ns += elapsed;
+	if (elapsed > rs->rs_callback_max_ns)
+		rs->rs_callback_max_ns = elapsed;
+	rs->rs_callback_time[ring_stats_log2_bucket(elapsed)]++;
+}
+
+#ifdef HAVE_TPACKET3
+/*
+ * Note how many packets a TPACKET_V3 block we're about to read has in
+ * it, and how long ago the kernel started filling it in, in the ring
+ * statistics.
+ */
+static void
+ring_stats_block(struct pcap_ring_stat *rs, union thdr h)
+{
+	struct timespec now;
+	int64_t age_ns;
+
+	(void)clock_gettime(CLOCK_REALTIME, &now);
+	age_ns = ((int64_t)now.tv_sec -
+	    (int64_t)h.h3->hdr.bh1.ts_first_pkt.ts_sec) * 1000000000 +
+	    (int64_t)now.tv_nsec - (int64_t)h.h3->hdr.bh1.ts_first_pkt.ts_nsec;
+	if (age_ns < 0)
+		age_ns = 0;	/* the clock was stepped back */
+
+	rs->rs_blocks++;
+	rs->rs_block_packets[ring_stats_log2_bucket(h.h3->hdr.bh1.num_pkts)]++;
+	rs->rs_block_age[ring_stats_log2_bucket((uint64_t)age_ns / 1000)]++;
+}
+
+/*
+ * Note whether a TPACKET_V3 block we're about to read filled up or was
+ * retired early, less than half full, for adapt_block_wait(), and
+ * note it in the ring statistics if we're gathering them.
+ */
+static inline void
+note_block_retired(pcap_t *handle, union thdr h)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	if (handlep->ring_stats != NULL)
+		ring_stats_block(handlep->ring_stats, h);
+	if (handlep->block_wait_max == 0)
+		return;
+	handlep->blocks_seen++;
+	if (!(h.h3->hdr.bh1.block_status & TP_STATUS_BLK_TMO) ||
+	    h.h3->hdr.bh1.blk_len >= handlep->tp_block_size / 2)
+		handlep->blocks_full++;
+}
+
+/*
+ * Adjust how long to wait before collecting TPACKET_V3 blocks, based on
+ * the blocks collected since we last waited.  If they were all retired
+ * early, nearly empty, packets are arriving slowly, so wait longer, to
+ * collect more of them per wakeup; if any of them were full, or there
+ * were a lot of them, packets are arriving quickly enough that waiting
+ * would only add latency, so wait less.  If waiting didn't get us more
+ * than one block, packets are arriving too slowly for it to help, so
+ * wait less then, too.
+ */
+static void
+adapt_block_wait(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	if (handlep->blocks_seen == 0)
+		return;
+	if (handlep->blocks_full != 0 ||
+	    handlep->blocks_seen > handle->cc / 2 ||
+	    (handlep->block_wait != 0 && handlep->blocks_seen == 1))
+		handlep->block_wait /= 2;
+	else if (handlep->block_wait == 0)
+		handlep->block_wait = 1;
+	else {
+		handlep->block_wait *= 2;
+		if (handlep->block_wait > handlep->block_wait_max)
+			handlep->block_wait = handlep->block_wait_max;
+	}
+	handlep->blocks_seen = 0;
+	handlep->blocks_full = 0;
+}
+#endif
+
+/*
+ * Block waiting for frames to be available.
+ */
+static int pcap_wait_for_frames_mmap(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	int timeout;
+	struct ifreq ifr;
+	int ret;
+	struct pollfd pollinfo[2];
+	int numpollinfo;
+	pollinfo[0].fd = handle->fd;
+	pollinfo[0].events = POLLIN;
+	if ( handlep->poll_breakloop_fd == -1 ) {
+		numpollinfo = 1;
+		pollinfo[1].revents = 0;
+		/*
+		 * We set pollinfo[1].revents to zero, even though
+		 * numpollinfo = 1 meaning that poll() doesn't see
+		 * pollinfo[1], so that we do not have to add a
+		 * conditional of numpollinfo > 1 below when we
+		 * test pollinfo[1].revents.
+		 */
+	} else {
+		pollinfo[1].fd = handlep->poll_breakloop_fd;
+		pollinfo[1].events = POLLIN;
+		numpollinfo = 2;
+	}
+
+#ifdef HAVE_TPACKET3
+	if (handlep->block_wait_max != 0)
+		adapt_block_wait(handle);
+#endif
+
+	/*
+	 * If asked to with pcap_set_busy_poll(), spin on the ring for a
+	 * while before sleeping in poll(), so that a packet that arrives
+	 * in that time gets to us without waiting for a wakeup.  In
+	 * non-blocking mode, or while waiting to find out whether the
+	 * device went away, go straight to poll().
+	 */
+	if (handlep->poll_timeout != 0 && !handlep->netdown) {
+		if (handlep->spin_ns != 0 && spin_on_ring(handle))
+			return 0;
+		handlep->bp_stats.bps_sleeps++;
+	}
+
+	/*
+	 * Keep polling until we either get some packets to read, see
+	 * that we got told to break out of the loop, get a fatal error,
+	 * or discover that the device went away.
+	 *
+	 * In non-blocking mode, we must still do one poll() to catch
+	 * any pending error indications, but the poll() has a timeout
+	 * of 0, so that it doesn't block, and we quit after that one
+	 * poll().
+	 *
+	 * If we've seen an ENETDOWN, it might be the first indication
+	 * that the device went away, or it might just be that it was
+	 * configured down.  Unfortunately, there's no guarantee that
+	 * the device has actually been removed as an interface, because:
+	 *
+	 * 1) if, as appears to be the case at least some of the time,
+	 * the PF_PACKET socket code first gets a NETDEV_DOWN indication
+	 * for the device and then gets a NETDEV_UNREGISTER indication
+	 * for it, the first indication will cause a wakeup with ENETDOWN
+	 * but won't set the packet socket's field for the interface index
+	 * to -1, and the second indication won't cause a wakeup (because
+	 * the first indication also caused the protocol hook to be
+	 * unregistered) but will set the packet socket's field for the
+	 * interface index to -1;
+	 *
+	 * 2) even if just a NETDEV_UNREGISTER indication is registered,
+	 * the packet socket's field for the interface index only gets
+	 * set to -1 after the wakeup, so there's a small but non-zero
+	 * risk that a thread blocked waiting for the wakeup will get
+	 * to the "fetch the socket name" code before the interface index
+	 * gets set to -1, so it'll get the old interface index.
+	 *
+	 * Therefore, if we got an ENETDOWN and haven't seen a packet
+	 * since then, we assume that we might be waiting for the interface
+	 * to disappear, and poll with a timeout to try again in a short
+	 * period of time.  If we *do* see a packet, the interface has
+	 * come back up again, and is *definitely* still there, so we
+	 * don't need to poll.
+	 */
+	for (;;) {
+		/*
+		 * If the current frame is still held, the kernel can't
+		 * hand it to us, and the socket stays readable, so a
+		 * poll() on it would return at once; leave it out, and
+		 * wait on the event descriptor, which gets signaled when
+		 * a frame whose last hold is released is handed back.
+		 */
+		pollinfo[0].fd = RING_FRAME_HELD(handlep, handle->offset) ?
+		    -1 : handle->fd;
+
+		/*
+		 * Yes, we do this even in non-blocking mode, as it's
+		 * the only way to get error indications from a
+		 * tpacket socket.
+		 *
+		 * The timeout is 0 in non-blocking mode, so poll()
+		 * returns immediately.
+		 */
+		timeout = handlep->poll_timeout;
+
+		/*
+		 * If we got an ENETDOWN and haven't gotten an indication
+		 * that the device has gone away or that the device is up,
+		 * we don't yet know for certain whether the device has
+		 * gone away or not, do a poll() with a 1-millisecond timeout,
+		 * as we have to poll indefinitely for "device went away"
+		 * indications until we either get one or see that the
+		 * device is up.
+		 */
+		if (handlep->netdown) {
+			if (timeout != 0)
+				timeout = 1;
+		}
+		ret = poll(pollinfo, numpollinfo, timeout);
+		if (ret < 0) {
+			/*
+			 * Error.  If it's not EINTR, report it.
+			 */
+			if (errno != EINTR) {
+				pcapint_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno,
+				    "can't poll on packet socket");
+				return PCAP_ERROR;
+			}
+
+			/*
+			 * It's EINTR; if we were told to break out of
+			 * the loop, do so.
+			 */
+			if (handle->break_loop) {
+				handle->break_loop = 0;
+				return PCAP_ERROR_BREAK;
+			}
+		} else if (ret > 0) {
+			/*
+			 * OK, some descriptor is ready.
+			 * Check the socket descriptor first.
+			 *
+			 * As I read the Linux man page, pollinfo[0].revents
+			 * will either be POLLIN, POLLERR, POLLHUP, or POLLNVAL.
+			 */
+			if (pollinfo[0].revents == POLLIN) {
+				/*
+				 * OK, we may have packets to
+				 * read.
+				 */
+				break;
+			}
+			if (pollinfo[0].revents != 0) {
+				/*
+				 * There's some indication other than
+				 * "you can read on this descriptor" on
+				 * the descriptor.
+				 */
+				if (pollinfo[0].revents & POLLNVAL) {
+					snprintf(handle->errbuf,
+					    PCAP_ERRBUF_SIZE,
+					    "Invalid polling request on packet socket");
+					return PCAP_ERROR;
+				}
+				if (pollinfo[0].revents & (POLLHUP | POLLRDHUP)) {
+					snprintf(handle->errbuf,
+					    PCAP_ERRBUF_SIZE,
+					    "Hangup on packet socket");
+					return PCAP_ERROR;
+				}
+				if (pollinfo[0].revents & POLLERR) {
+					/*
+					 * Get the error.
+					 */
+					int err;
+					socklen_t errlen;
+
+					errlen = sizeof(err);
+					if (getsockopt(handle->fd, SOL_SOCKET,
+					    SO_ERROR, &err, &errlen) == -1) {
+						/*
+						 * The call *itself* returned
+						 * an error; make *that*
+						 * the error.
+						 */
+						err = errno;
+					}
+
+					/*
+					 * OK, we have the error.
+					 */
+					if (err == ENETDOWN) {
+						/*
+						 * The device on which we're
+						 * capturing went away or the
+						 * interface was taken down.
+						 *
+						 * We don't know for certain
+						 * which happened, and the
+						 * next poll() may indicate
+						 * that there are packets
+						 * to be read, so just set
+						 * a flag to get us to do
+						 * checks later, and set
+						 * the required select
+						 * timeout to 1 millisecond
+						 * so that event loops that
+						 * check our socket descriptor
+						 * also time out so that
+						 * they can call us and we
+						 * can do the checks.
+						 */
+						handlep->netdown = 1;
+						handle->required_select_timeout = &netdown_timeout;
+					} else if (err == 0) {
+						/*
+						 * This shouldn't happen, so
+						 * report a special indication
+						 * that it did.
+						 */
+						snprintf(handle->errbuf,
+						    PCAP_ERRBUF_SIZE,
+						    "Error condition on packet socket: Reported error was 0");
+						return PCAP_ERROR;
+					} else {
+						pcapint_fmt_errmsg_for_errno(handle->errbuf,
+						    PCAP_ERRBUF_SIZE,
+						    err,
+						    "Error condition on packet socket");
+						return PCAP_ERROR;
+					}
+				}
+			}
+			/*
+			 * Now check the event device.
+			 */
+			if (pollinfo[1].revents & POLLIN) {
+				ssize_t nread;
+				uint64_t value;
+
+				/*
+				 * This should never fail, but, just
+				 * in case....
+				 */
+				nread = read(handlep->poll_breakloop_fd, &value,
+				    sizeof(value));
+				if (nread == -1) {
+					pcapint_fmt_errmsg_for_errno(handle->errbuf,
+					    PCAP_ERRBUF_SIZE,
+					    errno,
+					    "Error reading from event FD");
+					return PCAP_ERROR;
+				}
+
+				/*
+				 * According to the Linux read(2) man
+				 * page, read() will transfer at most
+				 * 2^31-1 bytes, so the return value is
+				 * either -1 or a value between 0
+				 * and 2^31-1, so it's non-negative.
+				 *
+				 * Cast it to size_t to squelch
+				 * warnings from the compiler; add this
+				 * comment to squelch warnings from
+				 * humans reading the code. :-)
+				 *
+				 * Don't treat an EOF as an error, but
+				 * *do* treat a short read as an error;
+				 * that "shouldn't happen", but....
+				 */
+				if (nread != 0 &&
+				    (size_t)nread < sizeof(value)) {
+					snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+					    "Short read from event FD: expected %zu, got %zd",
+					    sizeof(value), nread);
+					return PCAP_ERROR;
+				}
+
+				/*
+				 * This event gets signaled by a
+				 * pcap_breakloop() call; if we were told
+				 * to break out of the loop, do so.
+				 */
+				if (handle->break_loop) {
+					handle->break_loop = 0;
+					return PCAP_ERROR_BREAK;
+				}
+
+				/*
+				 * It also gets signaled when a held
+				 * frame is handed back to the kernel;
+				 * if that was the frame we were waiting
+				 * on, go back to waiting on the socket.
+				 */
+				if (pollinfo[0].fd == -1 &&
+				    !RING_FRAME_HELD(handlep, handle->offset))
+					continue;
+			}
+		}
+
+		/*
+		 * Either:
+		 *
+		 *   1) we got neither an error from poll() nor any
+		 *      readable descriptors, in which case there
+		 *      are no packets waiting to read
+		 *
+		 * or
+		 *
+		 *   2) We got readable descriptors but the PF_PACKET
+		 *      socket wasn't one of them, in which case there
+		 *      are no packets waiting to read
+		 *
+		 * so, if we got an ENETDOWN, we've drained whatever
+		 * packets were available to read at the point of the
+		 * ENETDOWN.
+		 *
+		 * So, if we got an ENETDOWN and haven't gotten an indication
+		 * that the device has gone away or that the device is up,
+		 * we don't yet know for certain whether the device has
+		 * gone away or not, check whether the device exists and is
+		 * up.
+		 */
+		if (handlep->netdown) {
+			if (!device_still_exists(handle)) {
+				/*
+				 * The device doesn't exist any more;
+				 * report that.
+				 *
+				 * XXX - we should really return an
+				 * appropriate error for that, but
+				 * pcap_dispatch() etc. aren't documented
+				 * as having error returns other than
+				 * PCAP_ERROR or PCAP_ERROR_BREAK.
+				 */
+				snprintf(handle->errbuf,  PCAP_ERRBUF_SIZE,
+				    "The interface disappeared");
+				return PCAP_ERROR;
+			}
+
+			/*
+			 * The device still exists; try to see if it's up.
+			 */
+			memset(&ifr, 0, sizeof(ifr));
+			pcapint_strlcpy(ifr.ifr_name, handlep->device,
+			    sizeof(ifr.ifr_name));
+			if (ioctl(handle->fd, SIOCGIFFLAGS, &ifr) == -1) {
+				if (errno == ENXIO || errno == ENODEV) {
+					/*
+					 * OK, *now* it's gone.
+					 *
+					 * XXX - see above comment.
+					 */
+					snprintf(handle->errbuf,
+					    PCAP_ERRBUF_SIZE,
+					    "The interface disappeared");
+					return PCAP_ERROR;
+				} else {
+					pcapint_fmt_errmsg_for_errno(handle->errbuf,
+					    PCAP_ERRBUF_SIZE, errno,
+					    "%s: Can't get flags",
+					    handlep->device);
+					return PCAP_ERROR;
+				}
+			}
+			if (ifr.ifr_flags & IFF_UP) {
+				/*
+				 * It's up, so it definitely still exists.
+				 * Cancel the ENETDOWN indication - we
+				 * presumably got it due to the interface
+				 * going down rather than the device going
+				 * away - and revert to "no required select
+				 * timeout.
+				 */
+				handlep->netdown = 0;
+				handle->required_select_timeout = NULL;
+			}
+		}
+
+		/*
+		 * If we're in non-blocking mode, just quit now, rather
+		 * than spinning in a loop doing poll()s that immediately
+		 * time out if there's no indication on any descriptor.
+		 */
+		if (handlep->poll_timeout == 0)
+			break;
+	}
+
+#ifdef HAVE_TPACKET3
+	/*
+	 * A block is ready; if pcap_set_block_timeout() gave a range,
+	 * wait a while longer before collecting it, so that we collect
+	 * more blocks per wakeup if packets are arriving slowly.  Wait
+	 * on the event descriptor, if we have one, so that
+	 * pcap_breakloop() cuts the wait short.
+	 */
+	if (handlep->block_wait != 0 && handlep->poll_timeout != 0 &&
+	    (pollinfo[0].revents & POLLIN))
+		(void)poll(&pollinfo[1], numpollinfo - 1, handlep->block_wait);
+#endif
+	if (handlep->ring_stats != NULL)
+		ring_stats_wakeup(handle);
+	return 0;
+}
+
+/*
+ * Handle a single memory mapped packet: filter it in userland if
+ * necessary, fix up its link-layer header, and fill in its pcap header
+ * and the pointer to its data.  Return 1 if the packet is to be passed
+ * to the user, 0 if it's to be discarded, and -1 on error.
+ */
+/*
+ * Fill in the metadata in a struct pcap_pkthdr_ex from the ring's
+ * packet header and the sockaddr_ll that follows it.
+ */
+static inline void
+fill_pkthdr_ex(pcap_t *handle, struct pcap_pkthdr_ex *ex,
+    const struct sockaddr_ll *sll, unsigned int tp_status,
+    unsigned int tp_sec, unsigned int tp_nsec,
+    int tp_vlan_tci_valid, __u16 tp_vlan_tci, __u16 tp_vlan_tpid,
+    __u32 tp_rxhash)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	ex->pkh_flags = PCAP_PKTHDR_EX_IFINDEX | PCAP_PKTHDR_EX_PKTTYPE |
+	    PCAP_PKTHDR_EX_PROTOCOL | PCAP_PKTHDR_EX_TS_NS;
+	ex->pkh_ts_ns = TP_TS_NS(tp_sec, tp_nsec);
+	ex->pkh_ifindex = (bpf_u_int32)sll->sll_ifindex;
+	ex->pkh_pkttype = sll->sll_pkttype;
+	ex->pkh_protocol = ntohs(sll->sll_protocol);
+	if (tp_vlan_tci_valid) {
+		ex->pkh_flags |= PCAP_PKTHDR_EX_VLAN;
+		ex->pkh_vlan_tci = tp_vlan_tci;
+		ex->pkh_vlan_tpid = tp_vlan_tpid;
+	} else {
+		ex->pkh_vlan_tci = 0;
+		ex->pkh_vlan_tpid = 0;
+	}
+	if (handlep->fill_rxhash) {
+		ex->pkh_flags |= PCAP_PKTHDR_EX_RXHASH;
+		ex->pkh_rxhash = tp_rxhash;
+	} else
+		ex->pkh_rxhash = 0;
+	ex->pkh_gso_type = 0;
+	ex->pkh_gso_size = 0;
+	ex->pkh_gso_segs = 0;
+#ifdef TP_STATUS_TS_RAW_HARDWARE
+	if (tp_status & TP_STATUS_TS_RAW_HARDWARE)
+		ex->pkh_flags |= PCAP_PKTHDR_EX_TS_HARDWARE;
+	else if (tp_status & TP_STATUS_TS_SOFTWARE)
+		ex->pkh_flags |= PCAP_PKTHDR_EX_TS_SOFTWARE;
+#else
+	(void)tp_status;
+#endif
+}
+
+#ifdef PACKET_VNET_HDR
+/*
+ * Work out how many segments an aggregated packet was made from, by
+ * dividing the length of what follows its TCP or UDP header by the
+ * segment size.  Returns 0 if the headers aren't all in the part of
+ * the packet we captured, or aren't what the GSO type says.
+ */
+static bpf_u_int32
+gso_segments(pcap_t *handle, const u_char *bp, u_int caplen, u_int len,
+    u_int gso_type, u_int gso_size)
+{
+	u_int off, type, proto, hdrlen;
+	int i;
+
+	off = 0;
+	if (handle->linktype == DLT_EN10MB) {
+		/*
+		 * Skip the MAC addresses and any VLAN tags left in the
+		 * packet data.
+		 */
+		off = 12;
+		for (;;) {
+			if (off + 2 > caplen)
+				return 0;
+			type = (u_int)bp[off] << 8 | bp[off + 1];
+			off += 2;
+			if (type != ETH_P_8021Q && type != ETH_P_8021AD)
+				break;
+			off += 2;
+		}
+	} else if (handle->linktype == DLT_RAW) {
+		if (caplen == 0)
+			return 0;
+		type = (bp[0] >> 4) == 6 ? ETH_P_IPV6 : ETH_P_IP;
+	} else
+		return 0;
+
+	switch (type) {
+
+	case ETH_P_IP:
+		if (off + 20 > caplen)
+			return 0;
+		proto = bp[off + 9];
+		off += (bp[off] & 0x0f) * 4;
+		break;
+
+	case ETH_P_IPV6:
+		if (off + 40 > caplen)
+			return 0;
+		proto = bp[off + 6];
+		off += 40;
+
+		/*
+		 * Skip the hop-by-hop, routing and destination options
+		 * headers, if any; aggregated packets aren't fragments.
+		 */
+		for (i = 0; i < 8 &&
+		    (proto == 0 || proto == 43 || proto == 60); i++) {
+			if (off + 2 > caplen)
+				return 0;
+			proto = bp[off];
+			off += (bp[off + 1] + 1) * 8;
+		}
+		break;
+
+	default:
+		return 0;
+	}
+
+	switch (gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		if (proto != IPPROTO_TCP || off + 13 > caplen)
+			return 0;
+		hdrlen = (bp[off + 12] >> 4) * 4;
+		break;
+
+	case VIRTIO_NET_HDR_GSO_UDP:
+#ifdef VIRTIO_NET_HDR_GSO_UDP_L4
+	case VIRTIO_NET_HDR_GSO_UDP_L4:
+#endif
+		if (proto != IPPROTO_UDP)
+			return 0;
+		hdrlen = 8;
+		break;
+
+	default:
+		return 0;
+	}
+	off += hdrlen;
+	if (off >= len || gso_size == 0)
+		return 0;
+	return (bpf_u_int32)((len - off + gso_size - 1) / gso_size);
+}
+
+/*
+ * Fill in the segment information in a struct pcap_pkthdr_ex from the
+ * virtio_net header the kernel put just before the packet data; the
+ * kernel writes it in host byte order.  A packet that wasn't aggregated
+ * was one segment.
+ */
+static inline void
+fill_pkthdr_ex_gso(pcap_t *handle, struct pcap_pkthdr_ex *ex,
+    const u_char *bp, u_int tp_len, u_int tp_snaplen)
+{
+	struct virtio_net_hdr vnet_hdr;
+
+	memcpy(&vnet_hdr, bp - sizeof(vnet_hdr), sizeof(vnet_hdr));
+	ex->pkh_flags |= PCAP_PKTHDR_EX_GSO;
+	ex->pkh_gso_type = vnet_hdr.gso_type;
+	if ((vnet_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+	    VIRTIO_NET_HDR_GSO_NONE) {
+		ex->pkh_gso_size = 0;
+		ex->pkh_gso_segs = 1;
+	} else {
+		ex->pkh_gso_size = vnet_hdr.gso_size;
+		ex->pkh_gso_segs = gso_segments(handle, bp, tp_snaplen,
+		    tp_len, vnet_hdr.gso_type, vnet_hdr.gso_size);
+	}
+}
+#endif
+
+/*
+ * Return 1 if a packet with this time stamp, in nanoseconds, may have
+ * been run through the kernel filter that was on the socket before the
+ * current one, 0 otherwise.  Once we've seen a packet too late for any
+ * of those packets to be after it in the ring, stop checking.
+ */
+static inline int
+before_filter_cut(pcap_t *handle, uint64_t ts)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	if (ts < handlep->filter_cut)
+		return 1;
+	if (ts >= handlep->filter_cut_end)
+		handlep->filter_cut_pending = 0;
+	return 0;
+}
+
+static int pcap_handle_packet_mmap(
+		pcap_t *handle,
+		struct pcap_pkthdr *pcaphdr,
+		struct pcap_pkthdr_ex *ex,
+		u_char **bpp,
+		unsigned char *frame,
+		unsigned int tp_status,
+		unsigned int tp_len,
+		unsigned int tp_mac,
+		unsigned int tp_snaplen,
+		unsigned int tp_sec,
+		unsigned int tp_nsec,
+		int tp_vlan_tci_valid,
+		__u16 tp_vlan_tci,
+		__u16 tp_vlan_tpid,
+		__u32 tp_rxhash)
+{
+	struct pcap_linux *handlep = handle->priv;
+	unsigned char *bp;
+	struct sockaddr_ll *sll;
+	unsigned int snaplen = tp_snaplen;
+	u_int filter_caplen = (u_int)-1;
+	struct utsname utsname;
+
+	/* perform sanity check on internal offset. */
+	if (tp_mac + tp_snaplen > handle->bufsize) {
+		/*
+		 * Report some system information as a debugging aid.
+		 */
+		if (uname(&utsname) != -1) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				"corrupted frame on kernel ring mac "
+				"offset %u + caplen %u > frame len %d "
+				"(kernel %.32s version %s, machine %.16s)",
+				tp_mac, tp_snaplen, handle->bufsize,
+				utsname.release, utsname.version,
+				utsname.machine);
+		} else {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				"corrupted frame on kernel ring mac "
+				"offset %u + caplen %u > frame len %d",
+				tp_mac, tp_snaplen, handle->bufsize);
+		}
+		return -1;
+	}
+
+	/* run filter on received packet
+	 * If the kernel filtering is enabled we need to run the
+	 * filter until all the frames present into the ring
+	 * at filter creation time are processed.
+	 * In this case, blocks_to_filter_in_userland is used
+	 * as a counter for the packet we need to filter.
+	 * Note: alternatively it could be possible to stop applying
+	 * the filter when the ring became empty, but it can possibly
+	 * happen a lot later... */
+	bp = frame + tp_mac;
+
+	/* if required build in place the sll header*/
+	sll = (void *)(frame + TPACKET_ALIGN(handlep->tp_hdrlen));
+
+	/*
+	 * If pcap_dispatch_ex() wants the metadata, hand it over before
+	 * we overwrite any of it with the sll header.
+	 */
+	if (ex != NULL) {
+		fill_pkthdr_ex(handle, ex, sll, tp_status, tp_sec, tp_nsec,
+		    tp_vlan_tci_valid, tp_vlan_tci, tp_vlan_tpid, tp_rxhash);
+#ifdef PACKET_VNET_HDR
+		if (handlep->vnet_hdr_len != 0)
+			fill_pkthdr_ex_gso(handle, ex, bp, tp_len, tp_snaplen);
+#endif
+	}
+
+	if (handlep->cooked) {
+		if (handle->linktype == DLT_LINUX_SLL2) {
+			struct sll2_header *hdrp;
+
+			/*
+			 * The kernel should have left us with enough
+			 * space for an sll header; back up the packet
+			 * data pointer into that space, as that'll be
+			 * the beginning of the packet we pass to the
+			 * callback.
+			 */
+			bp -= SLL2_HDR_LEN;
+
+			/*
+			 * Let's make sure that's past the end of
+			 * the tpacket header, i.e. >=
+			 * ((u_char *)thdr + TPACKET_HDRLEN), so we
+			 * don't step on the header when we construct
+			 * the sll header.
+			 */
+			if (bp < (u_char *)frame +
+					   TPACKET_ALIGN(handlep->tp_hdrlen) +
+					   sizeof(struct sockaddr_ll)) {
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+					"cooked-mode frame doesn't have room for sll header");
+				return -1;
+			}
+
+			/*
+			 * OK, that worked; construct the sll header.
+			 */
+			hdrp = (struct sll2_header *)bp;
+			hdrp->sll2_protocol = sll->sll_protocol;
+			hdrp->sll2_reserved_mbz = 0;
+			hdrp->sll2_if_index = htonl(sll->sll_ifindex);
+			hdrp->sll2_hatype = htons(sll->sll_hatype);
+			hdrp->sll2_pkttype = sll->sll_pkttype;
+			hdrp->sll2_halen = sll->sll_halen;
+			memcpy(hdrp->sll2_addr, sll->sll_addr, SLL_ADDRLEN);
+
+			snaplen += sizeof(struct sll2_header);
+		} else {
+			struct sll_header *hdrp;
+
+			/*
+			 * The kernel should have left us with enough
+			 * space for an sll header; back up the packet
+			 * data pointer into that space, as that'll be
+			 * the beginning of the packet we pass to the
+			 * callback.
+			 */
+			bp -= SLL_HDR_LEN;
+
+			/*
+			 * Let's make sure that's past the end of
+			 * the tpacket header, i.e. >=
+			 * ((u_char *)thdr + TPACKET_HDRLEN), so we
+			 * don't step on the header when we construct
+			 * the sll header.
+			 */
+			if (bp < (u_char *)frame +
+					   TPACKET_ALIGN(handlep->tp_hdrlen) +
+					   sizeof(struct sockaddr_ll)) {
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+					"cooked-mode frame doesn't have room for sll header");
+				return -1;
+			}
+
+			/*
+			 * OK, that worked; construct the sll header.
+			 */
+			hdrp = (struct sll_header *)bp;
+			hdrp->sll_pkttype = htons(sll->sll_pkttype);
+			hdrp->sll_hatype = htons(sll->sll_hatype);
+			hdrp->sll_halen = htons(sll->sll_halen);
+			memcpy(hdrp->sll_addr, sll->sll_addr, SLL_ADDRLEN);
+			hdrp->sll_protocol = sll->sll_protocol;
+
+			snaplen += sizeof(struct sll_header);
+		}
+	} else {
+		/*
+		 * If this is a packet from a CAN device, so that
+		 * sll->sll_hatype is ARPHRD_CAN, then, as we're
+		 * not capturing in cooked mode, its link-layer
+		 * type is DLT_CAN_SOCKETCAN.  Fix up the header
+		 * provided by the code below us to match what
+		 * DLT_CAN_SOCKETCAN is expected to provide.
+		 */
+		if (sll->sll_hatype == ARPHRD_CAN) {
+			pcap_can_socketcan_hdr *canhdr = (pcap_can_socketcan_hdr *)bp;
+			pcap_can_socketcan_xl_hdr *canxl_hdr = (pcap_can_socketcan_xl_hdr *)bp;
+			uint16_t protocol = ntohs(sll->sll_protocol);
+
+			/*
+			 * Check the protocol field from the sll header.
+			 * If it's one of the known CAN protocol types,
+			 * make sure the appropriate flags are set, so
+			 * that a program can tell what type of frame
+			 * it is.
+			 *
+			 * These operations should not have any effect
+			 * when reading proper CAN frames from Linux
+			 * CAN interfaces. Enforcing these bit values
+			 * ensures proper DLT_CAN_SOCKETCAN data even
+			 * with malformed PF_PACKET content.
+			 *
+			 * The two flags are:
+			 *
+			 *   CANFD_FDF, which is in the fd_flags field
+			 *   of the CAN CC/CAN FD header;
+			 *
+			 *   CANXL_XLF, which is in the flags field
+			 *   of the CAN XL header, which overlaps
+			 *   the payload_length field of the CAN CC/
+			 *   CAN FD header. Setting CANXL_XLF in the
+			 *   payload_length of CAN CC/FD frames would
+			 *   intentionally break the payload length.
+			 */
+			switch (protocol) {
+
+			case LINUX_SLL_P_CAN:
+				/*
+				 * CAN CC frame (aka Classical CAN, CAN 2.0B)
+				 *
+				 * Zero out the CAN FD and CAN XL flags
+				 * so that this frame will be identified
+				 * as a CAN CC frame.
+				 */
+				canxl_hdr->flags &= ~CANXL_XLF;
+				canhdr->fd_flags &= ~CANFD_FDF;
+				break;
+
+			case LINUX_SLL_P_CANFD:
+				/*
+				 * CAN FD frame
+				 *
+				 * Set CANFD_FDF in the fd_flags field,
+				 * and clear the CANXL_XLF bit in the
+				 * CAN XL flags field, so that this frame
+				 * will be identified as a CAN FD frame.
+				 *
+				 * The CANFD_FDF bit is not reliably
+				 * set by the Linux kernel. But setting
+				 * that bit for CAN FD is recommended.
+				 */
+				canxl_hdr->flags &= ~CANXL_XLF;
+				canhdr->fd_flags |= CANFD_FDF;
+				break;
+
+			case LINUX_SLL_P_CANXL:
+				/*
+				 * CAN XL frame
+				 *
+				 * Set CANXL_XLF bit in the CAN XL flags
+				 * field, so that this frame will appear
+				 * to be a CAN XL frame.
+				 */
+				canxl_hdr->flags |= CANXL_XLF;
+				break;
+			}
+
+			/*
+			 * Put multi-byte header fields in a byte-order
+			 * -independent format.
+			 */
+			if (canxl_hdr->flags & CANXL_XLF) {
+				/*
+				 * This is a CAN XL frame.
+				 *
+				 * DLT_CAN_SOCKETCAN is specified as having
+				 * the Priority ID/VCID field in big-
+				 * endian byte order, and the payload length
+				 * and Acceptance Field in little-endian byte
+				 * order, but capturing on a CAN device
+				 * provides them in host byte order.
+				 * Convert them to the appropriate byte
+				 * orders.
+				 *
+				 * The reason we put the first field
+				 * into big-endian byte order is that
+				 * older libpcap code, ignorant of
+				 * CAN XL, treated it as the CAN ID
+				 * field and put it into big-endian
+				 * byte order, and we don't want to
+				 * break code that understands CAN XL
+				 * headers, and treats that field as
+				 * being big-endian.
+				 *
+				 * The reason other fields are put in little-
+				 * endian byte order is that older
+				 * libpcap code, ignorant of CAN XL,
+				 * left those fields alone, and the
+				 * processors on which the CAN XL
+				 * frames were captured are likely
+				 * to be little-endian processors.
+				 */
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+				/*
+				 * We're capturing on a little-endian
+				 * machine, so we put the priority/VCID
+				 * field into big-endian byte order, and
+				 * leave the payload length and acceptance
+				 * field in little-endian byte order.
+				 */
+				/* Byte-swap priority/VCID. */
+				canxl_hdr->priority_vcid = SWAPLONG(canxl_hdr->priority_vcid);
+#elif __BYTE_ORDER == __BIG_ENDIAN
+				/*
+				 * We're capturing on a big-endian
+				 * machine, so we want to leave the
+				 * priority/VCID field alone, and byte-swap
+				 * the payload length and acceptance
+				 * fields to little-endian.
+				 */
+				/* Byte-swap the payload length */
+				canxl_hdr->payload_length = SWAPSHORT(canxl_hdr->payload_length);
+
+				/*
+				 * Byte-swap the acceptance field.
+				 *
+				 * XXX - is it just a 4-octet string,
+				 * not in any byte order?
+				 */
+				canxl_hdr->acceptance_field = SWAPLONG(canxl_hdr->acceptance_field);
+#else
+#error "Unknown byte order"
+#endif
+			} else {
+				/*
+				 * CAN CC or CAN FD frame.
+				 *
+				 * DLT_CAN_SOCKETCAN is specified as having
+				 * the CAN ID and flags in network byte
+				 * order, but capturing on a CAN device
+				 * provides it in host byte order.  Convert
+				 * it to network byte order.
+				 */
+				canhdr->can_id = htonl(canhdr->can_id);
+			}
+		}
+	}
+
+	if ((handlep->filter_in_userland ||
+	    (handlep->filter_cut_pending &&
+	     before_filter_cut(handle, TP_TS_NS(tp_sec, tp_nsec)))) &&
+	    handle->fcode.bf_insns) {
+		struct pcap_bpf_aux_data aux_data;
+
+		aux_data.vlan_tag_present = tp_vlan_tci_valid;
+		aux_data.vlan_tag = tp_vlan_tci & 0x0fff;
+		aux_data.random = linux_random(handlep);
+
+		filter_caplen = pcapint_filter_with_aux_data(handle->fcode.bf_insns,
+							     bp,
+							     tp_len,
+							     snaplen,
+							     &aux_data);
+		if (filter_caplen == 0) {
+			handlep->filtered64++;
+			return 0;
+		}
+	}
+
+	if (!linux_check_direction(handle, sll))
+		return 0;
+
+#ifdef ENABLE_REMOTE
+	/*
+	 * If PCAP_SAMP_1_EVERY_N sampling was requested, but the kernel
+	 * filter isn't doing it, do it here.
+	 */
+	if (handlep->samp_threshold == 0) {
+		bpf_u_int32 samp_threshold = linux_samp_threshold(handle);
+
+		if (samp_threshold != 0 &&
+		    linux_random(handlep) >= samp_threshold)
+			return 0;
+	}
+#endif
+
+	/*
+	 * Get required packet info from ring header.
+	 *
+	 * The seconds part of the time stamp is a 32-bit
+	 * unsigned integer; this will have a problem in 2106,
+	 * but not in 2038.
+	 *
+	 * ts.tv_sec is a time_t, which is signed, and which
+	 * may be 32-bit or 64-bit.  Pass it through; if we
+	 * have a 32-bit signed time_t, in which values >
+	 * 2^31-1 won't fit, then:
+	 *
+	 *    Writing the packet to a file will pass the bits
+	 *    through.  If the program reading the file can
+	 *    handle 32-bit unsigned time stamps, including
+	 *    any conversion to local time or UTC, it will
+	 *    properly handle the time stamps.
+	 *
+	 *    Reporting the packet time stamp may give
+	 *    an error or a pre-1970 time stamp on platforms
+	 *    with signed 32-bit time stamps, but that
+	 *    will happen even if it's captured on a
+	 *    platform with a 64-bit time_t.
+	 */
+	pcaphdr->ts.tv_sec = tp_sec;
+	if (handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO)
+		pcaphdr->ts.tv_usec = tp_nsec;
+	else
+		pcaphdr->ts.tv_usec = tp_nsec / 1000;
+	pcaphdr->caplen = tp_snaplen;
+	pcaphdr->len = tp_len;
+
+	/* if required build in place the sll header*/
+	if (handlep->cooked) {
+		/* update packet len */
+		if (handle->linktype == DLT_LINUX_SLL2) {
+			pcaphdr->caplen += SLL2_HDR_LEN;
+			pcaphdr->len += SLL2_HDR_LEN;
+		} else {
+			pcaphdr->caplen += SLL_HDR_LEN;
+			pcaphdr->len += SLL_HDR_LEN;
+		}
+	}
+
+	/*
+	 * If we ran the filter in userland, cut the packet off at the
+	 * length the filter returned, as the kernel would have done.
+	 */
+	if (pcaphdr->caplen > filter_caplen)
+		pcaphdr->caplen = filter_caplen;
+
+	if (tp_vlan_tci_valid &&
+		handlep->vlan_offset != -1 &&
+		tp_snaplen >= (unsigned int) handlep->vlan_offset &&
+		!(handle->dispatch_ex & PCAP_DISPATCH_EX_NO_VLAN_INSERT))
+	{
+		struct vlan_tag *tag;
+
+		/*
+		 * Move everything in the header, except the type field,
+		 * down VLAN_TAG_LEN bytes, to allow us to insert the
+		 * VLAN tag between that stuff and the type field.
+		 */
+		bp -= VLAN_TAG_LEN;
+		memmove(bp, bp + VLAN_TAG_LEN, handlep->vlan_offset);
+
+		/*
+		 * Now insert the tag.
+		 */
+		tag = (struct vlan_tag *)(bp + handlep->vlan_offset);
+		tag->vlan_tpid = htons(tp_vlan_tpid);
+		tag->vlan_tci = htons(tp_vlan_tci);
+
+		/*
+		 * Add the tag to the packet lengths.
+		 */
+		pcaphdr->caplen += VLAN_TAG_LEN;
+		pcaphdr->len += VLAN_TAG_LEN;
+
+		if (ex != NULL)
+			ex->pkh_flags |= PCAP_PKTHDR_EX_VLAN_IN_DATA;
+	}
+
+	/*
+	 * The only way to tell the kernel to cut off the
+	 * packet at a snapshot length is with a filter program;
+	 * if there's no filter program, the kernel won't cut
+	 * the packet off.
+	 *
+	 * Trim the snapshot length to be no longer than the
+	 * specified snapshot length.
+	 *
+	 * XXX - an alternative is to put a filter, consisting
+	 * of a "ret <snaplen>" instruction, on the socket
+	 * in the activate routine, so that the truncation is
+	 * done in the kernel even if nobody specified a filter;
+	 * that means that less buffer space is consumed in
+	 * the memory-mapped buffer.
+	 */
+	if (pcaphdr->caplen > (bpf_u_int32)handle->snapshot)
+		pcaphdr->caplen = handle->snapshot;
+
+	*bpp = bp;
+	return 1;
+}
+
+/*
+ * Hand a TPACKET_V2 frame back to the kernel, unless it's held, and
+ * move on to the next one, counting it if we're counting frames that
+ * need to be filtered in userland after having been filtered by the
+ * kernel.
+ */
+static inline void
+pcap_release_frame_mmap_v2(pcap_t *handle, union thdr h)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	if (ring_frame_done(handlep, handle->offset))
+		packet_mmap_release(h.h2);
+	if (handlep->blocks_to_filter_in_userland != 0) {
+		handlep->blocks_to_filter_in_userland--;
+		if (handlep->blocks_to_filter_in_userland == 0) {
+			/*
+			 * No more blocks need to be filtered
+			 * in userland.
+			 */
+			handlep->filter_in_userland = 0;
+		}
+	}
+
+	/* next block */
+	if (++handle->offset >= handle->cc)
+		handle->offset = 0;
+}
+
+static int
+pcap_read_linux_mmap_v2(pcap_t *handle, int max_packets, pcap_handler callback,
+		u_char *user)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
+	struct pcap_pkthdr_ex pcaphdr;
+	u_char *bp;
+	int pkts = 0;
+	int ret;
+
+	release_oneshot_linux(handle);
+	if (handlep->pin_pending && pin_reading_thread(handle) == -1)
+		return PCAP_ERROR;
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+	if (update_kernel_sampling(handle) == -1)
+		return PCAP_ERROR;
+#endif
+
+	/* wait for frames availability.*/
+	h.raw = RING_GET_CURRENT_FRAME(handle);
+	if (RING_FRAME_HELD(handlep, handle->offset) ||
+	    !packet_mmap_acquire(h.h2)) {
+		/*
+		 * The current frame is owned by the kernel; wait for
+		 * a frame to be handed to us.
+		 */
+		ret = pcap_wait_for_frames_mmap(handle);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	/*
+	 * This can conceivably process more than INT_MAX packets,
+	 * which would overflow the packet count, causing it either
+	 * to look like a negative number, and thus cause us to
+	 * return a value that looks like an error, or overflow
+	 * back into positive territory, and thus cause us to
+	 * return a too-low count.
+	 *
+	 * Therefore, if the packet count is unlimited, we clip
+	 * it at INT_MAX; this routine is not expected to
+	 * process packets indefinitely, so that's not an issue.
+	 */
+	if (PACKET_COUNT_IS_UNLIMITED(max_packets))
+		max_packets = INT_MAX;
+
+	while (pkts < max_packets) {
+		/*
+		 * Get the current ring buffer frame, and break if
+		 * it's still owned by the kernel or still held from
+		 * the last time around the ring.
+		 */
+		h.raw = RING_GET_CURRENT_FRAME(handle);
+		if (RING_FRAME_HELD(handlep, handle->offset) ||
+		    !packet_mmap_acquire(h.h2))
+			break;
+
+		ret = pcap_handle_packet_mmap(
+				handle,
+				&pcaphdr.hdr,
+				handle->dispatch_ex ? &pcaphdr : NULL,
+				&bp,
+				h.raw,
+				h.h2->tp_status,
+				h.h2->tp_len,
+				h.h2->tp_mac,
+				h.h2->tp_snaplen,
+				h.h2->tp_sec,
+				h.h2->tp_nsec,
+				VLAN_VALID(h.h2, h.h2),
+				h.h2->tp_vlan_tci,
+				VLAN_TPID(h.h2, h.h2),
+				0);
+		if (ret == 1) {
+			/* pass the packet to the user */
+			if (handlep->ring_stats != NULL)
+				ring_stats_callback(handle, callback, user,
+				    &pcaphdr.hdr, bp);
+			else
+				callback(user, &pcaphdr.hdr, bp);
+			pkts++;
+		} else if (ret < 0) {
+			return ret;
+		}
+
+		/*
+		 * Hand this block back to the kernel.
+		 */
+		pcap_release_frame_mmap_v2(handle, h);
+
+		/* check for break loop condition*/
+		if (handle->break_loop) {
+			handle->break_loop = 0;
+			return PCAP_ERROR_BREAK;
+		}
+	}
+	return pkts;
+}
+
+/*
+ * Hand out up to max packets from consecutive TPACKET_V2 frames,
+ * keeping the frames until pcap_release_batch_linux_mmap_v2() is
+ * called.
+ */
+static int
+pcap_next_batch_linux_mmap_v2(pcap_t *handle, struct pcap_pkt_vec *vec,
+		int max)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
+	u_int offset;
+	int ret;
+
+	if (handlep->batch_frames != 0) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "The previous batch of packets has not been released");
+		return PCAP_ERROR;
+	}
+
+	release_oneshot_linux(handle);
+	if (handlep->pin_pending && pin_reading_thread(handle) == -1)
+		return PCAP_ERROR;
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+	if (update_kernel_sampling(handle) == -1)
+		return PCAP_ERROR;
+#endif
+
+again:
+	/* check for break loop condition*/
+	if (handle->break_loop) {
+		handle->break_loop = 0;
+		return PCAP_ERROR_BREAK;
+	}
+
+	/* wait for frames availability.*/
+	h.raw = RING_GET_CURRENT_FRAME(handle);
+	if (RING_FRAME_HELD(handlep, handle->offset) ||
+	    !packet_mmap_acquire(h.h2)) {
+		ret = pcap_wait_for_frames_mmap(handle);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	offset = handle->offset;
+	while (vec->count < (u_int)max && handlep->batch_frames < handle->cc) {
+		h.raw = RING_GET_FRAME_AT(handle, offset);
+		if (RING_FRAME_HELD(handlep, offset) ||
+		    !packet_mmap_acquire(h.h2))
+			break;
+
+		ret = pcap_handle_packet_mmap(
+				handle,
+				&vec->hdrs[vec->count],
+				NULL,
+				(u_char **)&vec->data[vec->count],
+				h.raw,
+				h.h2->tp_status,
+				h.h2->tp_len,
+				h.h2->tp_mac,
+				h.h2->tp_snaplen,
+				h.h2->tp_sec,
+				h.h2->tp_nsec,
+				VLAN_VALID(h.h2, h.h2),
+				h.h2->tp_vlan_tci,
+				VLAN_TPID(h.h2, h.h2),
+				0);
+		if (ret < 0) {
+			pcap_release_batch_linux_mmap_v2(handle, vec);
+			return ret;
 		}
+		vec->count += ret;
+		handlep->batch_frames++;
+		if (++offset >= handle->cc)
+			offset = 0;
+	}
 
+	if (vec->count == 0) {
 		/*
-		 * If we're in non-blocking mode, just quit now, rather
-		 * than spinning in a loop doing poll()s that immediately
-		 * time out if there's no indication on any descriptor.
+		 * Every packet we looked at was discarded; give the
+		 * frames back and, if we're to block until we see a
+		 * packet, wait for more.
 		 */
-		if (handlep->poll_timeout == 0)
-			break;
+		pcap_release_batch_linux_mmap_v2(handle, vec);
+		if (handlep->timeout == 0)
+			goto again;
 	}
-	return 0;
+	return (int)vec->count;
 }
 
-/* handle a single memory mapped packet */
-static int pcap_handle_packet_mmap(
-		pcap_t *handle,
-		pcap_handler callback,
-		u_char *user,
-		unsigned char *frame,
-		unsigned int tp_len,
-		unsigned int tp_mac,
-		unsigned int tp_snaplen,
-		unsigned int tp_sec,
-		unsigned int tp_usec,
-		int tp_vlan_tci_valid,
-		__u16 tp_vlan_tci,
-		__u16 tp_vlan_tpid)
+static void
+pcap_release_batch_linux_mmap_v2(pcap_t *handle, struct pcap_pkt_vec *vec _U_)
 {
 	struct pcap_linux *handlep = handle->priv;
-	unsigned char *bp;
-	struct sockaddr_ll *sll;
-	struct pcap_pkthdr pcaphdr;
-	unsigned int snaplen = tp_snaplen;
-	struct utsname utsname;
+	union thdr h;
 
-	/* perform sanity check on internal offset. */
-	if (tp_mac + tp_snaplen > handle->bufsize) {
-		/*
-		 * Report some system information as a debugging aid.
-		 */
-		if (uname(&utsname) != -1) {
-			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-				"corrupted frame on kernel ring mac "
-				"offset %u + caplen %u > frame len %d "
-				"(kernel %.32s version %s, machine %.16s)",
-				tp_mac, tp_snaplen, handle->bufsize,
-				utsname.release, utsname.version,
-				utsname.machine);
-		} else {
-			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-				"corrupted frame on kernel ring mac "
-				"offset %u + caplen %u > frame len %d",
-				tp_mac, tp_snaplen, handle->bufsize);
-		}
-		return -1;
+	while (handlep->batch_frames != 0) {
+		h.raw = RING_GET_CURRENT_FRAME(handle);
+		pcap_release_frame_mmap_v2(handle, h);
+		handlep->batch_frames--;
 	}
+}
 
-	/* run filter on received packet
-	 * If the kernel filtering is enabled we need to run the
-	 * filter until all the frames present into the ring
-	 * at filter creation time are processed.
-	 * In this case, blocks_to_filter_in_userland is used
-	 * as a counter for the packet we need to filter.
-	 * Note: alternatively it could be possible to stop applying
-	 * the filter when the ring became empty, but it can possibly
-	 * happen a lot later... */
-	bp = frame + tp_mac;
-
-	/* if required build in place the sll header*/
-	sll = (void *)(frame + TPACKET_ALIGN(handlep->tp_hdrlen));
-	if (handlep->cooked) {
-		if (handle->linktype == DLT_LINUX_SLL2) {
-			struct sll2_header *hdrp;
+#ifdef HAVE_TPACKET3
+/*
+ * Hand the current TPACKET_V3 block back to the kernel, unless it's
+ * held, and move on to the next one, counting it if we're counting
+ * blocks that need to be filtered in userland after having been
+ * filtered by the kernel.
+ */
+static inline void
+pcap_release_block_mmap_v3(pcap_t *handle, union thdr h)
+{
+	struct pcap_linux *handlep = handle->priv;
 
+	if (ring_frame_done(handlep, handle->offset))
+		packet_mmap_v3_release(h.h3);
+	if (handlep->blocks_to_filter_in_userland != 0) {
+		handlep->blocks_to_filter_in_userland--;
+		if (handlep->blocks_to_filter_in_userland == 0) {
 			/*
-			 * The kernel should have left us with enough
-			 * space for an sll header; back up the packet
-			 * data pointer into that space, as that'll be
-			 * the beginning of the packet we pass to the
-			 * callback.
+			 * No more blocks need to be filtered
+			 * in userland.
 			 */
-			bp -= SLL2_HDR_LEN;
+			handlep->filter_in_userland = 0;
+		}
+	}
+
+	/* next block */
+	if (++handle->offset >= handle->cc)
+		handle->offset = 0;
+
+	handlep->current_packet = NULL;
+}
+
+static int
+pcap_read_linux_mmap_v3(pcap_t *handle, int max_packets, pcap_handler callback,
+		u_char *user)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
+	struct pcap_pkthdr_ex pcaphdr;
+	u_char *bp;
+	int pkts = 0;
+	int ret;
+
+	release_oneshot_linux(handle);
+	if (handlep->pin_pending && pin_reading_thread(handle) == -1)
+		return PCAP_ERROR;
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+	if (update_kernel_sampling(handle) == -1)
+		return PCAP_ERROR;
+#endif
 
+again:
+	if (handlep->current_packet == NULL) {
+		/* wait for frames availability.*/
+		h.raw = RING_GET_CURRENT_FRAME(handle);
+		if (RING_FRAME_HELD(handlep, handle->offset) ||
+		    !packet_mmap_v3_acquire(h.h3)) {
 			/*
-			 * Let's make sure that's past the end of
-			 * the tpacket header, i.e. >=
-			 * ((u_char *)thdr + TPACKET_HDRLEN), so we
-			 * don't step on the header when we construct
-			 * the sll header.
+			 * The current frame is owned by the kernel; wait
+			 * for a frame to be handed to us.
 			 */
-			if (bp < (u_char *)frame +
-					   TPACKET_ALIGN(handlep->tp_hdrlen) +
-					   sizeof(struct sockaddr_ll)) {
-				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-					"cooked-mode frame doesn't have room for sll header");
-				return -1;
+			ret = pcap_wait_for_frames_mmap(handle);
+			if (ret) {
+				return ret;
 			}
+		}
+	}
+	h.raw = RING_GET_CURRENT_FRAME(handle);
+	if ((handlep->current_packet == NULL &&
+	     RING_FRAME_HELD(handlep, handle->offset)) ||
+	    !packet_mmap_v3_acquire(h.h3)) {
+		if (pkts == 0 && handlep->timeout == 0) {
+			/* Block until we see a packet. */
+			goto again;
+		}
+		return pkts;
+	}
+
+	/*
+	 * This can conceivably process more than INT_MAX packets,
+	 * which would overflow the packet count, causing it either
+	 * to look like a negative number, and thus cause us to
+	 * return a value that looks like an error, or overflow
+	 * back into positive territory, and thus cause us to
+	 * return a too-low count.
+	 *
+	 * Therefore, if the packet count is unlimited, we clip
+	 * it at INT_MAX; this routine is not expected to
+	 * process packets indefinitely, so that's not an issue.
+	 */
+	if (PACKET_COUNT_IS_UNLIMITED(max_packets))
+		max_packets = INT_MAX;
+
+	while (pkts < max_packets) {
+		int packets_to_read;
 
+		if (handlep->current_packet == NULL) {
+			h.raw = RING_GET_CURRENT_FRAME(handle);
+			if (RING_FRAME_HELD(handlep, handle->offset) ||
+			    !packet_mmap_v3_acquire(h.h3))
+				break;
+
+			handlep->current_packet = h.raw + h.h3->hdr.bh1.offset_to_first_pkt;
+			handlep->packets_left = h.h3->hdr.bh1.num_pkts;
+			note_block_retired(handle, h);
+		}
+		packets_to_read = handlep->packets_left;
+
+		if (packets_to_read > (max_packets - pkts)) {
 			/*
-			 * OK, that worked; construct the sll header.
+			 * There are more packets in the buffer than
+			 * the number of packets we have left to
+			 * process to get up to the maximum number
+			 * of packets to process.  Only process enough
+			 * of them to get us up to that maximum.
 			 */
-			hdrp = (struct sll2_header *)bp;
-			hdrp->sll2_protocol = sll->sll_protocol;
-			hdrp->sll2_reserved_mbz = 0;
-			hdrp->sll2_if_index = htonl(sll->sll_ifindex);
-			hdrp->sll2_hatype = htons(sll->sll_hatype);
-			hdrp->sll2_pkttype = sll->sll_pkttype;
-			hdrp->sll2_halen = sll->sll_halen;
-			memcpy(hdrp->sll2_addr, sll->sll_addr, SLL_ADDRLEN);
+			packets_to_read = max_packets - pkts;
+		}
 
-			snaplen += sizeof(struct sll2_header);
-		} else {
-			struct sll_header *hdrp;
+		while (packets_to_read-- && !handle->break_loop) {
+			struct tpacket3_hdr* tp3_hdr = (struct tpacket3_hdr*) handlep->current_packet;
+			ret = pcap_handle_packet_mmap(
+					handle,
+					&pcaphdr.hdr,
+					handle->dispatch_ex ? &pcaphdr : NULL,
+					&bp,
+					handlep->current_packet,
+					tp3_hdr->tp_status,
+					tp3_hdr->tp_len,
+					tp3_hdr->tp_mac,
+					tp3_hdr->tp_snaplen,
+					tp3_hdr->tp_sec,
+					tp3_hdr->tp_nsec,
+					VLAN_VALID(tp3_hdr, &tp3_hdr->hv1),
+					tp3_hdr->hv1.tp_vlan_tci,
+					VLAN_TPID(tp3_hdr, &tp3_hdr->hv1),
+					tp3_hdr->hv1.tp_rxhash);
+			if (ret == 1) {
+				/* pass the packet to the user */
+				if (handlep->ring_stats != NULL)
+					ring_stats_callback(handle, callback,
+					    user, &pcaphdr.hdr, bp);
+				else
+					callback(user, &pcaphdr.hdr, bp);
+				pkts++;
+			} else if (ret < 0) {
+				handlep->current_packet = NULL;
+				return ret;
+			}
+			handlep->current_packet += tp3_hdr->tp_next_offset;
+			handlep->packets_left--;
+		}
 
+		if (handlep->packets_left <= 0) {
 			/*
-			 * The kernel should have left us with enough
-			 * space for an sll header; back up the packet
-			 * data pointer into that space, as that'll be
-			 * the beginning of the packet we pass to the
-			 * callback.
+			 * Hand this block back to the kernel.
 			 */
-			bp -= SLL_HDR_LEN;
+			pcap_release_block_mmap_v3(handle, h);
+		}
+
+		/* check for break loop condition*/
+		if (handle->break_loop) {
+			handle->break_loop = 0;
+			return PCAP_ERROR_BREAK;
+		}
+	}
+	if (pkts == 0 && handlep->timeout == 0) {
+		/* Block until we see a packet. */
+		goto again;
+	}
+	return pkts;
+}
+
+/*
+ * Hand out up to max packets from the current TPACKET_V3 block, with
+ * no copying and no callbacks; the block stays ours until
+ * pcap_release_batch_linux_mmap_v3() is called and all its packets
+ * have been handed out.  A batch never spans more than one block.
+ */
+static int
+pcap_next_batch_linux_mmap_v3(pcap_t *handle, struct pcap_pkt_vec *vec,
+		int max)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct tpacket3_hdr *tp3_hdr;
+	union thdr h;
+	int ret;
+
+	if (handlep->batch_frames != 0) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "The previous batch of packets has not been released");
+		return PCAP_ERROR;
+	}
 
-			/*
-			 * Let's make sure that's past the end of
-			 * the tpacket header, i.e. >=
-			 * ((u_char *)thdr + TPACKET_HDRLEN), so we
-			 * don't step on the header when we construct
-			 * the sll header.
-			 */
-			if (bp < (u_char *)frame +
-					   TPACKET_ALIGN(handlep->tp_hdrlen) +
-					   sizeof(struct sockaddr_ll)) {
-				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-					"cooked-mode frame doesn't have room for sll header");
-				return -1;
-			}
+	release_oneshot_linux(handle);
+	if (handlep->pin_pending && pin_reading_thread(handle) == -1)
+		return PCAP_ERROR;
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+	if (update_kernel_sampling(handle) == -1)
+		return PCAP_ERROR;
+#endif
 
-			/*
-			 * OK, that worked; construct the sll header.
-			 */
-			hdrp = (struct sll_header *)bp;
-			hdrp->sll_pkttype = htons(sll->sll_pkttype);
-			hdrp->sll_hatype = htons(sll->sll_hatype);
-			hdrp->sll_halen = htons(sll->sll_halen);
-			memcpy(hdrp->sll_addr, sll->sll_addr, SLL_ADDRLEN);
-			hdrp->sll_protocol = sll->sll_protocol;
+again:
+	/* check for break loop condition*/
+	if (handle->break_loop) {
+		handle->break_loop = 0;
+		return PCAP_ERROR_BREAK;
+	}
 
-			snaplen += sizeof(struct sll_header);
+	h.raw = RING_GET_CURRENT_FRAME(handle);
+	if (handlep->current_packet == NULL) {
+		/* wait for frames availability.*/
+		if (RING_FRAME_HELD(handlep, handle->offset) ||
+		    !packet_mmap_v3_acquire(h.h3)) {
+			ret = pcap_wait_for_frames_mmap(handle);
+			if (ret) {
+				return ret;
+			}
+			if (RING_FRAME_HELD(handlep, handle->offset) ||
+			    !packet_mmap_v3_acquire(h.h3)) {
+				if (handlep->timeout == 0) {
+					/* Block until we see a packet. */
+					goto again;
+				}
+				return 0;
+			}
 		}
-	} else {
+		handlep->current_packet = h.raw + h.h3->hdr.bh1.offset_to_first_pkt;
+		handlep->packets_left = h.h3->hdr.bh1.num_pkts;
+		note_block_retired(handle, h);
+	}
+
+	while (handlep->packets_left > 0 && vec->count < (u_int)max) {
+		tp3_hdr = (struct tpacket3_hdr *)handlep->current_packet;
+		ret = pcap_handle_packet_mmap(
+				handle,
+				&vec->hdrs[vec->count],
+				NULL,
+				(u_char **)&vec->data[vec->count],
+				handlep->current_packet,
+				tp3_hdr->tp_status,
+				tp3_hdr->tp_len,
+				tp3_hdr->tp_mac,
+				tp3_hdr->tp_snaplen,
+				tp3_hdr->tp_sec,
+				tp3_hdr->tp_nsec,
+				VLAN_VALID(tp3_hdr, &tp3_hdr->hv1),
+				tp3_hdr->hv1.tp_vlan_tci,
+				VLAN_TPID(tp3_hdr, &tp3_hdr->hv1),
+				tp3_hdr->hv1.tp_rxhash);
+		if (ret < 0) {
+			handlep->current_packet = NULL;
+			return ret;
+		}
+		vec->count += ret;
+		handlep->current_packet += tp3_hdr->tp_next_offset;
+		handlep->packets_left--;
+	}
+	handlep->batch_frames = 1;
+
+	if (vec->count == 0) {
 		/*
-		 * If this is a packet from a CAN device, so that
-		 * sll->sll_hatype is ARPHRD_CAN, then, as we're
-		 * not capturing in cooked mode, its link-layer
-		 * type is DLT_CAN_SOCKETCAN.  Fix up the header
-		 * provided by the code below us to match what
-		 * DLT_CAN_SOCKETCAN is expected to provide.
+		 * Every packet in the block was discarded; give the
+		 * block back and look at the next one.
 		 */
-		if (sll->sll_hatype == ARPHRD_CAN) {
-			pcap_can_socketcan_hdr *canhdr = (pcap_can_socketcan_hdr *)bp;
-			pcap_can_socketcan_xl_hdr *canxl_hdr = (pcap_can_socketcan_xl_hdr *)bp;
-			uint16_t protocol = ntohs(sll->sll_protocol);
+		pcap_release_batch_linux_mmap_v3(handle, vec);
+		goto again;
+	}
+	return (int)vec->count;
+}
 
-			/*
-			 * Check the protocol field from the sll header.
-			 * If it's one of the known CAN protocol types,
-			 * make sure the appropriate flags are set, so
-			 * that a program can tell what type of frame
-			 * it is.
-			 *
-			 * These operations should not have any effect
-			 * when reading proper CAN frames from Linux
-			 * CAN interfaces. Enforcing these bit values
-			 * ensures proper DLT_CAN_SOCKETCAN data even
-			 * with malformed PF_PACKET content.
-			 *
-			 * The two flags are:
-			 *
-			 *   CANFD_FDF, which is in the fd_flags field
-			 *   of the CAN CC/CAN FD header;
-			 *
-			 *   CANXL_XLF, which is in the flags field
-			 *   of the CAN XL header, which overlaps
-			 *   the payload_length field of the CAN CC/
-			 *   CAN FD header. Setting CANXL_XLF in the
-			 *   payload_length of CAN CC/FD frames would
-			 *   intentionally break the payload length.
-			 */
-			switch (protocol) {
+static void
+pcap_release_batch_linux_mmap_v3(pcap_t *handle, struct pcap_pkt_vec *vec _U_)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
 
-			case LINUX_SLL_P_CAN:
-				/*
-				 * CAN CC frame (aka Classical CAN, CAN 2.0B)
-				 *
-				 * Zero out the CAN FD and CAN XL flags
-				 * so that this frame will be identified
-				 * as a CAN CC frame.
-				 */
-				canxl_hdr->flags &= ~CANXL_XLF;
-				canhdr->fd_flags &= ~CANFD_FDF;
-				break;
+	if (handlep->batch_frames == 0)
+		return;
+	handlep->batch_frames = 0;
 
-			case LINUX_SLL_P_CANFD:
-				/*
-				 * CAN FD frame
-				 *
-				 * Set CANFD_FDF in the fd_flags field,
-				 * and clear the CANXL_XLF bit in the
-				 * CAN XL flags field, so that this frame
-				 * will be identified as a CAN FD frame.
-				 *
-				 * The CANFD_FDF bit is not reliably
-				 * set by the Linux kernel. But setting
-				 * that bit for CAN FD is recommended.
-				 */
-				canxl_hdr->flags &= ~CANXL_XLF;
-				canhdr->fd_flags |= CANFD_FDF;
-				break;
+	/*
+	 * If all the packets in the block have been handed out, hand
+	 * the block back to the kernel.
+	 */
+	if (handlep->packets_left <= 0) {
+		h.raw = RING_GET_CURRENT_FRAME(handle);
+		pcap_release_block_mmap_v3(handle, h);
+	}
+}
+#endif /* HAVE_TPACKET3 */
 
-			case LINUX_SLL_P_CANXL:
-				/*
-				 * CAN XL frame
-				 *
-				 * Set CANXL_XLF bit in the CAN XL flags
-				 * field, so that this frame will appear
-				 * to be a CAN XL frame.
-				 */
-				canxl_hdr->flags |= CANXL_XLF;
-				break;
-			}
+/*
+ *  Attach the given BPF code to the packet capture device.
+ */
+static int
+pcap_setfilter_linux(pcap_t *handle, struct bpf_program *filter)
+{
+	if (!handle)
+		return -1;
+	if (!filter) {
+	        pcapint_strlcpy(handle->errbuf, "setfilter: No filter specified",
+			PCAP_ERRBUF_SIZE);
+		return -1;
+	}
 
-			/*
-			 * Put multi-byte header fields in a byte-order
-			 * -independent format.
-			 */
-			if (canxl_hdr->flags & CANXL_XLF) {
-				/*
-				 * This is a CAN XL frame.
-				 *
-				 * DLT_CAN_SOCKETCAN is specified as having
-				 * the Priority ID/VCID field in big-
-				 * endian byte order, and the payload length
-				 * and Acceptance Field in little-endian byte
-				 * order, but capturing on a CAN device
-				 * provides them in host byte order.
-				 * Convert them to the appropriate byte
-				 * orders.
-				 *
-				 * The reason we put the first field
-				 * into big-endian byte order is that
-				 * older libpcap code, ignorant of
-				 * CAN XL, treated it as the CAN ID
-				 * field and put it into big-endian
-				 * byte order, and we don't want to
-				 * break code that understands CAN XL
-				 * headers, and treats that field as
-				 * being big-endian.
-				 *
-				 * The reason other fields are put in little-
-				 * endian byte order is that older
-				 * libpcap code, ignorant of CAN XL,
-				 * left those fields alone, and the
-				 * processors on which the CAN XL
-				 * frames were captured are likely
-				 * to be little-endian processors.
-				 */
+	/* Make our private copy of the filter */
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-				/*
-				 * We're capturing on a little-endian
-				 * machine, so we put the priority/VCID
-				 * field into big-endian byte order, and
-				 * leave the payload length and acceptance
-				 * field in little-endian byte order.
-				 */
-				/* Byte-swap priority/VCID. */
-				canxl_hdr->priority_vcid = SWAPLONG(canxl_hdr->priority_vcid);
-#elif __BYTE_ORDER == __BIG_ENDIAN
-				/*
-				 * We're capturing on a big-endian
-				 * machine, so we want to leave the
-				 * priority/VCID field alone, and byte-swap
-				 * the payload length and acceptance
-				 * fields to little-endian.
-				 */
-				/* Byte-swap the payload length */
-				canxl_hdr->payload_length = SWAPSHORT(canxl_hdr->payload_length);
+	if (pcapint_install_bpf_program(handle, filter) < 0)
+		/* pcapint_install_bpf_program() filled in errbuf */
+		return -1;
 
-				/*
-				 * Byte-swap the acceptance field.
-				 *
-				 * XXX - is it just a 4-octet string,
-				 * not in any byte order?
-				 */
-				canxl_hdr->acceptance_field = SWAPLONG(canxl_hdr->acceptance_field);
-#else
-#error "Unknown byte order"
+	return install_kernel_filter(handle);
+}
+
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+/*
+ * pcap_setsampling() hands back a pointer to the sampling parameters
+ * rather than taking new ones, so we can't tell when they're changed;
+ * check before each read whether they have been, and, if so, redo the
+ * kernel filter, which is also what does the sampling if it can.
+ */
+static int
+update_kernel_sampling(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	if (linux_samp_threshold(handle) == handlep->samp_requested)
+		return 0;
+	return install_kernel_filter(handle);
+}
 #endif
-			} else {
-				/*
-				 * CAN CC or CAN FD frame.
-				 *
-				 * DLT_CAN_SOCKETCAN is specified as having
-				 * the CAN ID and flags in network byte
-				 * order, but capturing on a CAN device
-				 * provides it in host byte order.  Convert
-				 * it to network byte order.
-				 */
-				canhdr->can_id = htonl(canhdr->can_id);
+
+/*
+ * Attach the filter in handle->fcode, plus a sampling prologue if
+ * PCAP_SAMP_1_EVERY_N sampling was requested, to the socket if the
+ * kernel can run it; otherwise, arrange to do both in userland.
+ */
+static int
+install_kernel_filter(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct sock_fprog	fcode;
+	int			can_filter_in_kernel;
+	int			err = 0;
+	u_int			n, offset;
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+	bpf_u_int32		samp_threshold = 0;
+
+	handlep->samp_requested = linux_samp_threshold(handle);
+#endif
+
+	/*
+	 * Run user level packet filter by default. Will be overridden if
+	 * installing a kernel filter succeeds.
+	 */
+	handlep->filter_in_userland = 1;
+
+	/* Install kernel level filter if possible */
+
+	if (handle->fcode.bf_insns == NULL) {
+		/*
+		 * There's no filter; the only reason to have a kernel
+		 * filter is to do sampling, in which case we use one
+		 * that accepts everything and add the prologue to that.
+		 */
+		fcode.len = 0;
+		fcode.filter = NULL;
+		can_filter_in_kernel = 0;
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+		if (handlep->samp_requested != 0) {
+			struct bpf_insn accept_all[] = {
+				BPF_STMT(BPF_RET|BPF_K,
+				    (bpf_u_int32)handle->snapshot)
+			};
+			struct bpf_insn *f;
+
+			f = (struct bpf_insn *)malloc(sizeof(accept_all));
+			if (f == NULL) {
+				pcapint_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno, "malloc");
+				return -1;
 			}
+			memcpy(f, accept_all, sizeof(accept_all));
+			fcode.len = 1;
+			fcode.filter = (struct sock_filter *) f;
+			can_filter_in_kernel = 1;
 		}
-	}
+#endif
+	} else if (handle->fcode.bf_len > USHRT_MAX) {
+		/*
+		 * fcode.len is an unsigned short for current kernel.
+		 * I have yet to see BPF-Code with that much
+		 * instructions but still it is possible. So for the
+		 * sake of correctness I added this check.
+		 */
+		fprintf(stderr, "Warning: Filter too complex for kernel\n");
+		fcode.len = 0;
+		fcode.filter = NULL;
+		can_filter_in_kernel = 0;
+	} else {
+		/*
+		 * Oh joy, the Linux kernel uses struct sock_fprog instead
+		 * of struct bpf_program and of course the length field is
+		 * of different size. Pointed out by Sebastian
+		 *
+		 * Oh, and we also need to fix it up so that all "ret"
+		 * instructions with non-zero operands have MAXIMUM_SNAPLEN
+		 * as the operand if we're not capturing in memory-mapped
+		 * mode, and so that, if we're in cooked mode, all memory-
+		 * reference instructions use special magic offsets in
+		 * references to the link-layer header and assume that the
+		 * link-layer payload begins at 0; "fix_program()" will do
+		 * that.
+		 */
+		switch (fix_program(handle, &fcode)) {
 
-	if (handlep->filter_in_userland && handle->fcode.bf_insns) {
-		struct pcap_bpf_aux_data aux_data;
+		case -1:
+		default:
+			/*
+			 * Fatal error; just quit.
+			 * (The "default" case shouldn't happen; we
+			 * return -1 for that reason.)
+			 */
+			return -1;
 
-		aux_data.vlan_tag_present = tp_vlan_tci_valid;
-		aux_data.vlan_tag = tp_vlan_tci & 0x0fff;
+		case 0:
+			/*
+			 * The program performed checks that we can't make
+			 * work in the kernel.
+			 */
+			can_filter_in_kernel = 0;
+			break;
 
-		if (pcapint_filter_with_aux_data(handle->fcode.bf_insns,
-					      bp,
-					      tp_len,
-					      snaplen,
-					      &aux_data) == 0)
-			return 0;
+		case 1:
+			/*
+			 * We have a filter that'll work in the kernel.
+			 */
+			can_filter_in_kernel = 1;
+			break;
+		}
 	}
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+	/*
+	 * If PCAP_SAMP_1_EVERY_N sampling was requested, have the
+	 * kernel filter do it, so that the packets it drops don't
+	 * take up space in the ring.
+	 */
+	if (can_filter_in_kernel && handlep->samp_requested != 0) {
+		samp_threshold = handlep->samp_requested;
+		switch (add_sampling_prologue(handle, &fcode, samp_threshold)) {
 
-	if (!linux_check_direction(handle, sll))
-		return 0;
+		case -1:
+			free(fcode.filter);
+			return -1;
+
+		case 0:
+			/*
+			 * Too long; sample in userland.
+			 */
+			samp_threshold = 0;
+			break;
+		}
+	}
+#endif
 
 	/*
-	 * Get required packet info from ring header.
+	 * NOTE: at this point, we've set both the "len" and "filter"
+	 * fields of "fcode".  As of the 2.6.32.4 kernel, at least,
+	 * those are the only members of the "sock_fprog" structure,
+	 * so we initialize every member of that structure.
 	 *
-	 * The seconds part of the time stamp is a 32-bit
-	 * unsigned integer; this will have a problem in 2106,
-	 * but not in 2038.
+	 * If there is anything in "fcode" that is not initialized,
+	 * it is either a field added in a later kernel, or it's
+	 * padding.
 	 *
-	 * ts.tv_sec is a time_t, which is signed, and which
-	 * may be 32-bit or 64-bit.  Pass it through; if we
-	 * have a 32-bit signed time_t, in which values >
-	 * 2^31-1 won't fit, then:
+	 * If a new field is added, this code needs to be updated
+	 * to set it correctly.
 	 *
-	 *    Writing the packet to a file will pass the bits
-	 *    through.  If the program reading the file can
-	 *    handle 32-bit unsigned time stamps, including
-	 *    any conversion to local time or UTC, it will
-	 *    properly handle the time stamps.
+	 * If there are no other fields, then:
 	 *
-	 *    Reporting the packet time stamp may give
-	 *    an error or a pre-1970 time stamp on platforms
-	 *    with signed 32-bit time stamps, but that
-	 *    will happen even if it's captured on a
-	 *    platform with a 64-bit time_t.
+	 *	if the Linux kernel looks at the padding, it's
+	 *	buggy;
+	 *
+	 *	if the Linux kernel doesn't look at the padding,
+	 *	then if some tool complains that we're passing
+	 *	uninitialized data to the kernel, then the tool
+	 *	is buggy and needs to understand that it's just
+	 *	padding.
 	 */
-	pcaphdr.ts.tv_sec = tp_sec;
-	pcaphdr.ts.tv_usec = tp_usec;
-	pcaphdr.caplen = tp_snaplen;
-	pcaphdr.len = tp_len;
+	if (can_filter_in_kernel) {
+		if ((err = set_kernel_filter(handle, &fcode)) == 0)
+		{
+			/*
+			 * Installation succeeded - using kernel filter,
+			 * so userland filtering not needed.
+			 */
+			handlep->filter_in_userland = 0;
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+			handlep->samp_threshold = samp_threshold;
+#endif
+		}
+		else if (err == -1)	/* Non-fatal error */
+		{
+			/*
+			 * Print a warning if we weren't able to install
+			 * the filter for a reason other than "this kernel
+			 * isn't configured to support socket filters.
+			 */
+			if (errno == ENOMEM) {
+				/*
+				 * Either a kernel memory allocation
+				 * failure occurred, or there's too
+				 * much "other/option memory" allocated
+				 * for this socket.  Suggest that they
+				 * increase the "other/option memory"
+				 * limit.
+				 */
+				fprintf(stderr,
+				    "Warning: Couldn't allocate kernel memory for filter: try increasing net.core.optmem_max with sysctl\n");
+			} else if (errno != ENOPROTOOPT && errno != EOPNOTSUPP) {
+				fprintf(stderr,
+				    "Warning: Kernel filter failed: %s\n",
+					pcap_strerror(errno));
+			}
+		}
+	}
 
-	/* if required build in place the sll header*/
-	if (handlep->cooked) {
-		/* update packet len */
-		if (handle->linktype == DLT_LINUX_SLL2) {
-			pcaphdr.caplen += SLL2_HDR_LEN;
-			pcaphdr.len += SLL2_HDR_LEN;
-		} else {
-			pcaphdr.caplen += SLL_HDR_LEN;
-			pcaphdr.len += SLL_HDR_LEN;
+	/*
+	 * If we're not using the kernel filter, get rid of any kernel
+	 * filter that might've been there before, e.g. because the
+	 * previous filter could work in the kernel, or because some other
+	 * code attached a filter to the socket by some means other than
+	 * calling "pcap_setfilter()".  Otherwise, the kernel filter may
+	 * filter out packets that would pass the new userland filter.
+	 */
+	if (handlep->filter_in_userland) {
+#ifdef ENABLE_REMOTE
+		handlep->samp_threshold = 0;
+#endif
+		if (reset_kernel_filter(handle) == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "can't remove kernel filter");
+			err = -2;	/* fatal error */
 		}
 	}
 
-	if (tp_vlan_tci_valid &&
-		handlep->vlan_offset != -1 &&
-		tp_snaplen >= (unsigned int) handlep->vlan_offset)
-	{
-		struct vlan_tag *tag;
+	/*
+	 * Free up the copy of the filter that was made by "fix_program()".
+	 */
+	if (fcode.filter != NULL)
+		free(fcode.filter);
 
-		/*
-		 * Move everything in the header, except the type field,
-		 * down VLAN_TAG_LEN bytes, to allow us to insert the
-		 * VLAN tag between that stuff and the type field.
-		 */
-		bp -= VLAN_TAG_LEN;
-		memmove(bp, bp + VLAN_TAG_LEN, handlep->vlan_offset);
+	if (err == -2)
+		/* Fatal error */
+		return -1;
 
-		/*
-		 * Now insert the tag.
-		 */
-		tag = (struct vlan_tag *)(bp + handlep->vlan_offset);
-		tag->vlan_tpid = htons(tp_vlan_tpid);
-		tag->vlan_tci = htons(tp_vlan_tci);
+	/*
+	 * If we're filtering in userland, there's nothing to do;
+	 * the new filter will be used for the next packet.
+	 */
+	if (handlep->filter_in_userland)
+		return 0;
 
-		/*
-		 * Add the tag to the packet lengths.
-		 */
-		pcaphdr.caplen += VLAN_TAG_LEN;
-		pcaphdr.len += VLAN_TAG_LEN;
+	/*
+	 * We're filtering in the kernel; the packets present in
+	 * all blocks currently in the ring were already filtered
+	 * by the old filter, and so will need to be filtered in
+	 * userland by the new filter.
+	 *
+	 * Get an upper bound for the number of such blocks; first,
+	 * walk the ring backward and count the free blocks.
+	 */
+	offset = handle->offset;
+	if (offset == 0)
+		offset = handle->cc;
+	offset--;
+	for (n=0; n < handle->cc; ++n) {
+		if (offset == 0)
+			offset = handle->cc;
+		offset--;
+		if (pcap_get_ring_frame_status(handle, offset) != TP_STATUS_KERNEL)
+			break;
 	}
 
 	/*
-	 * The only way to tell the kernel to cut off the
-	 * packet at a snapshot length is with a filter program;
-	 * if there's no filter program, the kernel won't cut
-	 * the packet off.
+	 * If we found free blocks, decrement the count of free
+	 * blocks by 1, just in case we lost a race with another
+	 * thread of control that was adding a packet while
+	 * we were counting and that had run the filter before
+	 * we changed it.
 	 *
-	 * Trim the snapshot length to be no longer than the
-	 * specified snapshot length.
+	 * XXX - could there be more than one block added in
+	 * this fashion?
 	 *
-	 * XXX - an alternative is to put a filter, consisting
-	 * of a "ret <snaplen>" instruction, on the socket
-	 * in the activate routine, so that the truncation is
-	 * done in the kernel even if nobody specified a filter;
-	 * that means that less buffer space is consumed in
-	 * the memory-mapped buffer.
+	 * If the packets are time-stamped with the host clock,
+	 * set_kernel_filter() has noted when the new filter took
+	 * effect, and any packets that lost that race will be
+	 * filtered in userland because of their time stamps.
+	 */
+	if (n != 0)
+		n--;
+
+	/*
+	 * Set the count of blocks worth of packets to filter
+	 * in userland to the total number of blocks in the
+	 * ring minus the number of free blocks we found, and
+	 * turn on userland filtering.  (The count of blocks
+	 * worth of packets to filter in userland is guaranteed
+	 * not to be zero - n, above, couldn't be set to a
+	 * value > handle->cc, and if it were equal to
+	 * handle->cc, it wouldn't be zero, and thus would
+	 * be decremented to handle->cc - 1.)
 	 */
-	if (pcaphdr.caplen > (bpf_u_int32)handle->snapshot)
-		pcaphdr.caplen = handle->snapshot;
-
-	/* pass the packet to the user */
-	callback(user, &pcaphdr, bp);
+	handlep->blocks_to_filter_in_userland = handle->cc - n;
+	handlep->filter_in_userland = 1;
 
-	return 1;
+	return 0;
 }
 
+/*
+ *  Return the index of the given device name. Fill ebuf and return
+ *  -1 on failure.
+ */
 static int
-pcap_read_linux_mmap_v2(pcap_t *handle, int max_packets, pcap_handler callback,
-		u_char *user)
+iface_get_id(int fd, const char *device, char *ebuf)
 {
-	struct pcap_linux *handlep = handle->priv;
-	union thdr h;
-	int pkts = 0;
-	int ret;
+	struct ifreq	ifr;
 
-	/* wait for frames availability.*/
-	h.raw = RING_GET_CURRENT_FRAME(handle);
-	if (!packet_mmap_acquire(h.h2)) {
-		/*
-		 * The current frame is owned by the kernel; wait for
-		 * a frame to be handed to us.
-		 */
-		ret = pcap_wait_for_frames_mmap(handle);
-		if (ret) {
-			return ret;
-		}
+	memset(&ifr, 0, sizeof(ifr));
+	pcapint_strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1) {
+		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+		    errno, "SIOCGIFINDEX");
+		return -1;
 	}
 
-	/*
-	 * This can conceivably process more than INT_MAX packets,
-	 * which would overflow the packet count, causing it either
-	 * to look like a negative number, and thus cause us to
-	 * return a value that looks like an error, or overflow
-	 * back into positive territory, and thus cause us to
-	 * return a too-low count.
-	 *
-	 * Therefore, if the packet count is unlimited, we clip
-	 * it at INT_MAX; this routine is not expected to
-	 * process packets indefinitely, so that's not an issue.
-	 */
-	if (PACKET_COUNT_IS_UNLIMITED(max_packets))
-		max_packets = INT_MAX;
+	return ifr.ifr_ifindex;
+}
 
-	while (pkts < max_packets) {
-		/*
-		 * Get the current ring buffer frame, and break if
-		 * it's still owned by the kernel.
-		 */
-		h.raw = RING_GET_CURRENT_FRAME(handle);
-		if (!packet_mmap_acquire(h.h2))
-			break;
+/*
+ *  Bind the socket associated with FD to the given device.
+ *  Return 0 on success or a PCAP_ERROR_ value on a hard error.
+ */
+static int
+iface_bind(int fd, int ifindex, char *ebuf, int protocol)
+{
+	struct sockaddr_ll	sll;
+	int			ret, err;
+	socklen_t		errlen = sizeof(err);
 
-		ret = pcap_handle_packet_mmap(
-				handle,
-				callback,
-				user,
-				h.raw,
-				h.h2->tp_len,
-				h.h2->tp_mac,
-				h.h2->tp_snaplen,
-				h.h2->tp_sec,
-				handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO ? h.h2->tp_nsec : h.h2->tp_nsec / 1000,
-				VLAN_VALID(h.h2, h.h2),
-				h.h2->tp_vlan_tci,
-				VLAN_TPID(h.h2, h.h2));
-		if (ret == 1) {
-			pkts++;
-		} else if (ret < 0) {
-			return ret;
-		}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family		= AF_PACKET;
+	sll.sll_ifindex		= ifindex < 0 ? 0 : ifindex;
+	sll.sll_protocol	= protocol;
 
-		/*
-		 * Hand this block back to the kernel, and, if we're
-		 * counting blocks that need to be filtered in userland
-		 * after having been filtered by the kernel, count
-		 * the one we've just processed.
-		 */
-		packet_mmap_release(h.h2);
-		if (handlep->blocks_to_filter_in_userland != 0) {
-			handlep->blocks_to_filter_in_userland--;
-			if (handlep->blocks_to_filter_in_userland == 0) {
-				/*
-				 * No more blocks need to be filtered
-				 * in userland.
-				 */
-				handlep->filter_in_userland = 0;
-			}
+	if (bind(fd, (struct sockaddr *) &sll, sizeof(sll)) == -1) {
+		if (errno == ENETDOWN) {
+			/*
+			 * Return a "network down" indication, so that
+			 * the application can report that rather than
+			 * saying we had a mysterious failure and
+			 * suggest that they report a problem to the
+			 * libpcap developers.
+			 */
+			return PCAP_ERROR_IFACE_NOT_UP;
+		}
+		if (errno == ENODEV) {
+			/*
+			 * There's nothing more to say, so clear the
+			 * error message.
+			 */
+			ebuf[0] = '\0';
+			ret = PCAP_ERROR_NO_SUCH_DEVICE;
+		} else {
+			ret = PCAP_ERROR;
+			pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+			    errno, "bind");
 		}
+		return ret;
+	}
 
-		/* next block */
-		if (++handle->offset >= handle->cc)
-			handle->offset = 0;
+	/* Any pending errors, e.g., network is down? */
 
-		/* check for break loop condition*/
-		if (handle->break_loop) {
-			handle->break_loop = 0;
-			return PCAP_ERROR_BREAK;
-		}
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1) {
+		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+		    errno, "getsockopt (SO_ERROR)");
+		return PCAP_ERROR;
 	}
-	return pkts;
+
+	if (err == ENETDOWN) {
+		/*
+		 * Return a "network down" indication, so that
+		 * the application can report that rather than
+		 * saying we had a mysterious failure and
+		 * suggest that they report a problem to the
+		 * libpcap developers.
+		 */
+		return PCAP_ERROR_IFACE_NOT_UP;
+	} else if (err > 0) {
+		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+		    err, "bind");
+		return PCAP_ERROR;
+	}
+
+	return 0;
 }
 
-#ifdef HAVE_TPACKET3
+/*
+ * Try to enter monitor mode.
+ * If we have libnl, try to create a new monitor-mode device and
+ * capture on that; otherwise, just say "not supported".
+ */
+#ifdef HAVE_LIBNL
 static int
-pcap_read_linux_mmap_v3(pcap_t *handle, int max_packets, pcap_handler callback,
-		u_char *user)
+enter_rfmon_mode(pcap_t *handle, int sock_fd, const char *device)
 {
 	struct pcap_linux *handlep = handle->priv;
-	union thdr h;
-	int pkts = 0;
 	int ret;
+	char phydev_path[PATH_MAX+1];
+	struct nl80211_state nlstate;
+	struct ifreq ifr;
+	u_int n;
 
-again:
-	if (handlep->current_packet == NULL) {
-		/* wait for frames availability.*/
-		h.raw = RING_GET_CURRENT_FRAME(handle);
-		if (!packet_mmap_v3_acquire(h.h3)) {
-			/*
-			 * The current frame is owned by the kernel; wait
-			 * for a frame to be handed to us.
-			 */
-			ret = pcap_wait_for_frames_mmap(handle);
-			if (ret) {
-				return ret;
-			}
-		}
+	/*
+	 * Is this a mac80211 device?
+	 */
+	ret = get_mac80211_phydev(handle, device, phydev_path, PATH_MAX);
+	if (ret < 0)
+		return ret;	/* error */
+	if (ret == 0)
+		return 0;	/* no error, but not mac80211 device */
+
+	ret = nl80211_init(handle, &nlstate, device);
+	if (ret != 0)
+		return ret;
+
+	/*
+	 * Is this already a monN device?
+	 * If so, we're done.
+	 */
+	int type;
+	ret = get_if_type(handle, sock_fd, &nlstate, device, &type);
+	if (ret <= 0) {
+		/*
+		 * < 0 is a Hard failure.  Just return ret; handle->errbuf
+		 * has already been set.
+		 *
+		 * 0 is "device not available"; the caller should retry later.
+		 */
+		nl80211_cleanup(&nlstate);
+		return ret;
 	}
-	h.raw = RING_GET_CURRENT_FRAME(handle);
-	if (!packet_mmap_v3_acquire(h.h3)) {
-		if (pkts == 0 && handlep->timeout == 0) {
-			/* Block until we see a packet. */
-			goto again;
-		}
-		return pkts;
+	if (type == NL80211_IFTYPE_MONITOR) {
+		/*
+		 * OK, it's already a monitor mode device; just use it.
+		 * There's no point in creating another monitor device
+		 * that will have to be cleaned up.
+		 */
+		nl80211_cleanup(&nlstate);
+		return ret;
 	}
 
 	/*
-	 * This can conceivably process more than INT_MAX packets,
-	 * which would overflow the packet count, causing it either
-	 * to look like a negative number, and thus cause us to
-	 * return a value that looks like an error, or overflow
-	 * back into positive territory, and thus cause us to
-	 * return a too-low count.
-	 *
-	 * Therefore, if the packet count is unlimited, we clip
-	 * it at INT_MAX; this routine is not expected to
-	 * process packets indefinitely, so that's not an issue.
+	 * OK, it's apparently a mac80211 device but not a monitor device.
+	 * Try to find an unused monN device for it.
 	 */
-	if (PACKET_COUNT_IS_UNLIMITED(max_packets))
-		max_packets = INT_MAX;
-
-	while (pkts < max_packets) {
-		int packets_to_read;
-
-		if (handlep->current_packet == NULL) {
-			h.raw = RING_GET_CURRENT_FRAME(handle);
-			if (!packet_mmap_v3_acquire(h.h3))
-				break;
+	for (n = 0; n < UINT_MAX; n++) {
+		/*
+		 * Try mon{n}.
+		 */
+		char mondevice[3+10+1];	/* mon{UINT_MAX}\0 */
 
-			handlep->current_packet = h.raw + h.h3->hdr.bh1.offset_to_first_pkt;
-			handlep->packets_left = h.h3->hdr.bh1.num_pkts;
+		snprintf(mondevice, sizeof mondevice, "mon%u", n);
+		ret = add_mon_if(handle, sock_fd, &nlstate, device, mondevice);
+		if (ret == 1) {
+			/*
+			 * Success.  We don't clean up the libnl state
+			 * yet, as we'll be using it later.
+			 */
+			goto added;
 		}
-		packets_to_read = handlep->packets_left;
-
-		if (packets_to_read > (max_packets - pkts)) {
+		if (ret < 0) {
 			/*
-			 * There are more packets in the buffer than
-			 * the number of packets we have left to
-			 * process to get up to the maximum number
-			 * of packets to process.  Only process enough
-			 * of them to get us up to that maximum.
+			 * Hard failure.  Just return ret; handle->errbuf
+			 * has already been set.
 			 */
-			packets_to_read = max_packets - pkts;
+			nl80211_cleanup(&nlstate);
+			return ret;
 		}
+	}
 
-		while (packets_to_read-- && !handle->break_loop) {
-			struct tpacket3_hdr* tp3_hdr = (struct tpacket3_hdr*) handlep->current_packet;
-			ret = pcap_handle_packet_mmap(
-					handle,
-					callback,
-					user,
-					handlep->current_packet,
-					tp3_hdr->tp_len,
-					tp3_hdr->tp_mac,
-					tp3_hdr->tp_snaplen,
-					tp3_hdr->tp_sec,
-					handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO ? tp3_hdr->tp_nsec : tp3_hdr->tp_nsec / 1000,
-					VLAN_VALID(tp3_hdr, &tp3_hdr->hv1),
-					tp3_hdr->hv1.tp_vlan_tci,
-					VLAN_TPID(tp3_hdr, &tp3_hdr->hv1));
-			if (ret == 1) {
-				pkts++;
-			} else if (ret < 0) {
-				handlep->current_packet = NULL;
-				return ret;
-			}
-			handlep->current_packet += tp3_hdr->tp_next_offset;
-			handlep->packets_left--;
-		}
+	snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+	    "%s: No free monN interfaces", device);
+	nl80211_cleanup(&nlstate);
+	return PCAP_ERROR;
 
-		if (handlep->packets_left <= 0) {
-			/*
-			 * Hand this block back to the kernel, and, if
-			 * we're counting blocks that need to be
-			 * filtered in userland after having been
-			 * filtered by the kernel, count the one we've
-			 * just processed.
-			 */
-			packet_mmap_v3_release(h.h3);
-			if (handlep->blocks_to_filter_in_userland != 0) {
-				handlep->blocks_to_filter_in_userland--;
-				if (handlep->blocks_to_filter_in_userland == 0) {
-					/*
-					 * No more blocks need to be filtered
-					 * in userland.
-					 */
-					handlep->filter_in_userland = 0;
-				}
-			}
+added:
 
-			/* next block */
-			if (++handle->offset >= handle->cc)
-				handle->offset = 0;
+#if 0
+	/*
+	 * Sleep for .1 seconds.
+	 */
+	delay.tv_sec = 0;
+	delay.tv_nsec = 500000000;
+	nanosleep(&delay, NULL);
+#endif
 
-			handlep->current_packet = NULL;
-		}
+	/*
+	 * If we haven't already done so, arrange to have
+	 * "pcap_close_all()" called when we exit.
+	 */
+	if (!pcapint_do_addexit(handle)) {
+		/*
+		 * "atexit()" failed; don't put the interface
+		 * in rfmon mode, just give up.
+		 * handle->errbuf has already been filled.
+		 */
+		del_mon_if(handle, sock_fd, &nlstate, device,
+		    handlep->mondevice);
+		nl80211_cleanup(&nlstate);
+		return PCAP_ERROR;
+	}
 
-		/* check for break loop condition*/
-		if (handle->break_loop) {
-			handle->break_loop = 0;
-			return PCAP_ERROR_BREAK;
-		}
+	/*
+	 * Now configure the monitor interface up.
+	 */
+	memset(&ifr, 0, sizeof(ifr));
+	pcapint_strlcpy(ifr.ifr_name, handlep->mondevice, sizeof(ifr.ifr_name));
+	if (ioctl(sock_fd, SIOCGIFFLAGS, &ifr) == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "%s: Can't get flags for %s", device,
+		    handlep->mondevice);
+		del_mon_if(handle, sock_fd, &nlstate, device,
+		    handlep->mondevice);
+		nl80211_cleanup(&nlstate);
+		return PCAP_ERROR;
 	}
-	if (pkts == 0 && handlep->timeout == 0) {
-		/* Block until we see a packet. */
-		goto again;
+	ifr.ifr_flags |= IFF_UP|IFF_RUNNING;
+	if (ioctl(sock_fd, SIOCSIFFLAGS, &ifr) == -1) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "%s: Can't set flags for %s", device,
+		    handlep->mondevice);
+		del_mon_if(handle, sock_fd, &nlstate, device,
+		    handlep->mondevice);
+		nl80211_cleanup(&nlstate);
+		return PCAP_ERROR;
 	}
-	return pkts;
+
+	/*
+	 * Success.  Clean up the libnl state.
+	 */
+	nl80211_cleanup(&nlstate);
+
+	/*
+	 * Note that we have to delete the monitor device when we close
+	 * the handle.
+	 */
+	handlep->must_do_on_close |= MUST_DELETE_MONIF;
+
+	/*
+	 * Add this to the list of pcaps to close when we exit.
+	 */
+	pcapint_add_to_pcaps_to_close(handle);
+
+	return 1;
 }
-#endif /* HAVE_TPACKET3 */
+#else /* HAVE_LIBNL */
+static int
+enter_rfmon_mode(pcap_t *handle _U_, int sock_fd _U_, const char *device _U_)
+{
+	/*
+	 * We don't have libnl, so we can't do monitor mode.
+	 */
+	return 0;
+}
+#endif /* HAVE_LIBNL */
 
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP)
 /*
- *  Attach the given BPF code to the packet capture device.
+ * Map SOF_TIMESTAMPING_ values to PCAP_TSTAMP_ values.
+ */
+static const struct {
+	int soft_timestamping_val;
+	int pcap_tstamp_val;
+} sof_ts_type_map[3] = {
+	{ SOF_TIMESTAMPING_SOFTWARE, PCAP_TSTAMP_HOST },
+	{ SOF_TIMESTAMPING_SYS_HARDWARE, PCAP_TSTAMP_ADAPTER },
+	{ SOF_TIMESTAMPING_RAW_HARDWARE, PCAP_TSTAMP_ADAPTER_UNSYNCED }
+};
+#define NUM_SOF_TIMESTAMPING_TYPES	(sizeof sof_ts_type_map / sizeof sof_ts_type_map[0])
+
+/*
+ * Set the list of time stamping types to include all types.
  */
 static int
-pcap_setfilter_linux(pcap_t *handle, struct bpf_program *filter)
+iface_set_all_ts_types(pcap_t *handle, char *ebuf)
 {
-	struct pcap_linux *handlep;
-	struct sock_fprog	fcode;
-	int			can_filter_in_kernel;
-	int			err = 0;
-	u_int			n, offset;
+	u_int i;
 
-	if (!handle)
-		return -1;
-	if (!filter) {
-	        pcapint_strlcpy(handle->errbuf, "setfilter: No filter specified",
-			PCAP_ERRBUF_SIZE);
+	handle->tstamp_type_list = malloc(NUM_SOF_TIMESTAMPING_TYPES * sizeof(u_int));
+	if (handle->tstamp_type_list == NULL) {
+		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
 		return -1;
 	}
+	for (i = 0; i < NUM_SOF_TIMESTAMPING_TYPES; i++)
+		handle->tstamp_type_list[i] = sof_ts_type_map[i].pcap_tstamp_val;
+	handle->tstamp_type_count = NUM_SOF_TIMESTAMPING_TYPES;
+	return 0;
+}
 
-	handlep = handle->priv;
-
-	/* Make our private copy of the filter */
+/*
+ * Get a list of time stamp types.
+ */
+#ifdef ETHTOOL_GET_TS_INFO
+static int
+iface_get_ts_types(const char *device, pcap_t *handle, char *ebuf)
+{
+	int fd;
+	struct ifreq ifr;
+	struct ethtool_ts_info info;
+	int num_ts_types;
+	u_int i, j;
 
-	if (pcapint_install_bpf_program(handle, filter) < 0)
-		/* pcapint_install_bpf_program() filled in errbuf */
-		return -1;
+	/*
+	 * This doesn't apply to the "any" device; you can't say "turn on
+	 * hardware time stamping for all devices that exist now and arrange
+	 * that it be turned on for any device that appears in the future",
+	 * and not all devices even necessarily *support* hardware time
+	 * stamping, so don't report any time stamp types.
+	 */
+	if (strcmp(device, "any") == 0) {
+		handle->tstamp_type_list = NULL;
+		return 0;
+	}
 
 	/*
-	 * Run user level packet filter by default. Will be overridden if
-	 * installing a kernel filter succeeds.
+	 * Create a socket from which to fetch time stamping capabilities.
 	 */
-	handlep->filter_in_userland = 1;
+	fd = get_if_ioctl_socket();
+	if (fd < 0) {
+		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+		    errno, "socket for SIOCETHTOOL(ETHTOOL_GET_TS_INFO)");
+		return -1;
+	}
 
-	/* Install kernel level filter if possible */
+	memset(&ifr, 0, sizeof(ifr));
+	pcapint_strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+	memset(&info, 0, sizeof(info));
+	info.cmd = ETHTOOL_GET_TS_INFO;
+	ifr.ifr_data = (caddr_t)&info;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) == -1) {
+		int save_errno = errno;
 
-	if (handle->fcode.bf_len > USHRT_MAX) {
-		/*
-		 * fcode.len is an unsigned short for current kernel.
-		 * I have yet to see BPF-Code with that much
-		 * instructions but still it is possible. So for the
-		 * sake of correctness I added this check.
-		 */
-		fprintf(stderr, "Warning: Filter too complex for kernel\n");
-		fcode.len = 0;
-		fcode.filter = NULL;
-		can_filter_in_kernel = 0;
-	} else {
-		/*
-		 * Oh joy, the Linux kernel uses struct sock_fprog instead
-		 * of struct bpf_program and of course the length field is
-		 * of different size. Pointed out by Sebastian
-		 *
-		 * Oh, and we also need to fix it up so that all "ret"
-		 * instructions with non-zero operands have MAXIMUM_SNAPLEN
-		 * as the operand if we're not capturing in memory-mapped
-		 * mode, and so that, if we're in cooked mode, all memory-
-		 * reference instructions use special magic offsets in
-		 * references to the link-layer header and assume that the
-		 * link-layer payload begins at 0; "fix_program()" will do
-		 * that.
-		 */
-		switch (fix_program(handle, &fcode)) {
+		close(fd);
+		switch (save_errno) {
 
-		case -1:
-		default:
+		case EOPNOTSUPP:
+		case EINVAL:
 			/*
-			 * Fatal error; just quit.
-			 * (The "default" case shouldn't happen; we
-			 * return -1 for that reason.)
+			 * OK, this OS version or driver doesn't support
+			 * asking for the time stamping types, so let's
+			 * just return all the possible types.
 			 */
-			return -1;
+			if (iface_set_all_ts_types(handle, ebuf) == -1)
+				return -1;
+			return 0;
 
-		case 0:
+		case ENODEV:
 			/*
-			 * The program performed checks that we can't make
-			 * work in the kernel.
+			 * OK, no such device.
+			 * The user will find that out when they try to
+			 * activate the device; just return an empty
+			 * list of time stamp types.
 			 */
-			can_filter_in_kernel = 0;
-			break;
+			handle->tstamp_type_list = NULL;
+			return 0;
 
-		case 1:
+		default:
 			/*
-			 * We have a filter that'll work in the kernel.
+			 * Other error.
 			 */
-			can_filter_in_kernel = 1;
-			break;
+			pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+			    save_errno,
+			    "%s: SIOCETHTOOL(ETHTOOL_GET_TS_INFO) ioctl failed",
+			    device);
+			return -1;
 		}
 	}
+	close(fd);
 
 	/*
-	 * NOTE: at this point, we've set both the "len" and "filter"
-	 * fields of "fcode".  As of the 2.6.32.4 kernel, at least,
-	 * those are the only members of the "sock_fprog" structure,
-	 * so we initialize every member of that structure.
-	 *
-	 * If there is anything in "fcode" that is not initialized,
-	 * it is either a field added in a later kernel, or it's
-	 * padding.
-	 *
-	 * If a new field is added, this code needs to be updated
-	 * to set it correctly.
-	 *
-	 * If there are no other fields, then:
-	 *
-	 *	if the Linux kernel looks at the padding, it's
-	 *	buggy;
-	 *
-	 *	if the Linux kernel doesn't look at the padding,
-	 *	then if some tool complains that we're passing
-	 *	uninitialized data to the kernel, then the tool
-	 *	is buggy and needs to understand that it's just
-	 *	padding.
+	 * Do we support hardware time stamping of *all* packets?
 	 */
-	if (can_filter_in_kernel) {
-		if ((err = set_kernel_filter(handle, &fcode)) == 0)
-		{
-			/*
-			 * Installation succeeded - using kernel filter,
-			 * so userland filtering not needed.
-			 */
-			handlep->filter_in_userland = 0;
+	if (!(info.rx_filters & (1 << HWTSTAMP_FILTER_ALL))) {
+		/*
+		 * No, so don't report any time stamp types.
+		 *
+		 * XXX - some devices either don't report
+		 * HWTSTAMP_FILTER_ALL when they do support it, or
+		 * report HWTSTAMP_FILTER_ALL but map it to only
+		 * time stamping a few PTP packets.  See
+		 * http://marc.info/?l=linux-netdev&m=146318183529571&w=2
+		 *
+		 * Maybe that got fixed later.
+		 */
+		handle->tstamp_type_list = NULL;
+		return 0;
+	}
+
+	num_ts_types = 0;
+	for (i = 0; i < NUM_SOF_TIMESTAMPING_TYPES; i++) {
+		if (info.so_timestamping & sof_ts_type_map[i].soft_timestamping_val)
+			num_ts_types++;
+	}
+	if (num_ts_types != 0) {
+		handle->tstamp_type_list = malloc(num_ts_types * sizeof(u_int));
+		if (handle->tstamp_type_list == NULL) {
+			pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+			    errno, "malloc");
+			return -1;
 		}
-		else if (err == -1)	/* Non-fatal error */
-		{
-			/*
-			 * Print a warning if we weren't able to install
-			 * the filter for a reason other than "this kernel
-			 * isn't configured to support socket filters.
-			 */
-			if (errno == ENOMEM) {
-				/*
-				 * Either a kernel memory allocation
-				 * failure occurred, or there's too
-				 * much "other/option memory" allocated
-				 * for this socket.  Suggest that they
-				 * increase the "other/option memory"
-				 * limit.
-				 */
-				fprintf(stderr,
-				    "Warning: Couldn't allocate kernel memory for filter: try increasing net.core.optmem_max with sysctl\n");
-			} else if (errno != ENOPROTOOPT && errno != EOPNOTSUPP) {
-				fprintf(stderr,
-				    "Warning: Kernel filter failed: %s\n",
-					pcap_strerror(errno));
+		for (i = 0, j = 0; i < NUM_SOF_TIMESTAMPING_TYPES; i++) {
+			if (info.so_timestamping & sof_ts_type_map[i].soft_timestamping_val) {
+				handle->tstamp_type_list[j] = sof_ts_type_map[i].pcap_tstamp_val;
+				j++;
 			}
 		}
-	}
+		handle->tstamp_type_count = num_ts_types;
+	} else
+		handle->tstamp_type_list = NULL;
 
+	return 0;
+}
+#else /* ETHTOOL_GET_TS_INFO */
+static int
+iface_get_ts_types(const char *device, pcap_t *handle, char *ebuf)
+{
 	/*
-	 * If we're not using the kernel filter, get rid of any kernel
-	 * filter that might've been there before, e.g. because the
-	 * previous filter could work in the kernel, or because some other
-	 * code attached a filter to the socket by some means other than
-	 * calling "pcap_setfilter()".  Otherwise, the kernel filter may
-	 * filter out packets that would pass the new userland filter.
+	 * This doesn't apply to the "any" device; you can't say "turn on
+	 * hardware time stamping for all devices that exist now and arrange
+	 * that it be turned on for any device that appears in the future",
+	 * and not all devices even necessarily *support* hardware time
+	 * stamping, so don't report any time stamp types.
 	 */
-	if (handlep->filter_in_userland) {
-		if (reset_kernel_filter(handle) == -1) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno,
-			    "can't remove kernel filter");
-			err = -2;	/* fatal error */
-		}
+	if (strcmp(device, "any") == 0) {
+		handle->tstamp_type_list = NULL;
+		return 0;
 	}
 
 	/*
-	 * Free up the copy of the filter that was made by "fix_program()".
+	 * We don't have an ioctl to use to ask what's supported,
+	 * so say we support everything.
 	 */
-	if (fcode.filter != NULL)
-		free(fcode.filter);
+	if (iface_set_all_ts_types(handle, ebuf) == -1)
+		return -1;
+	return 0;
+}
+#endif /* ETHTOOL_GET_TS_INFO */
+#else  /* defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP) */
+static int
+iface_get_ts_types(const char *device _U_, pcap_t *p _U_, char *ebuf _U_)
+{
+	/*
+	 * Nothing to fetch, so it always "succeeds".
+	 */
+	return 0;
+}
+#endif /* defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP) */
 
-	if (err == -2)
-		/* Fatal error */
+/*
+ * Find out if we have any form of fragmentation/reassembly offloading.
+ *
+ * We do so using SIOCETHTOOL checking for various types of offloading;
+ * if SIOCETHTOOL isn't defined, or we don't have any #defines for any
+ * of the types of offloading, there's nothing we can do to check, so
+ * we just say "no, we don't".
+ *
+ * We treat EOPNOTSUPP, EINVAL and, if eperm_ok is true, EPERM as
+ * indications that the operation isn't supported.  We do EPERM
+ * weirdly because the SIOCETHTOOL code in later kernels 1) doesn't
+ * support ETHTOOL_GUFO, 2) also doesn't include it in the list
+ * of ethtool operations that don't require CAP_NET_ADMIN privileges,
+ * and 3) does the "is this permitted" check before doing the "is
+ * this even supported" check, so it fails with "this is not permitted"
+ * rather than "this is not even supported".  To work around this
+ * annoyance, we only treat EPERM as an error for the first feature,
+ * and assume that they all do the same permission checks, so if the
+ * first one is allowed all the others are allowed if supported.
+ */
+#if defined(SIOCETHTOOL) && (defined(ETHTOOL_GTSO) || defined(ETHTOOL_GUFO) || defined(ETHTOOL_GGSO) || defined(ETHTOOL_GFLAGS) || defined(ETHTOOL_GGRO))
+static int
+iface_ethtool_flag_ioctl(pcap_t *handle, int cmd, const char *cmdname,
+    int eperm_ok)
+{
+	struct ifreq	ifr;
+	struct ethtool_value eval;
+
+	memset(&ifr, 0, sizeof(ifr));
+	pcapint_strlcpy(ifr.ifr_name, handle->opt.device, sizeof(ifr.ifr_name));
+	eval.cmd = cmd;
+	eval.data = 0;
+	ifr.ifr_data = (caddr_t)&eval;
+	if (ioctl(handle->fd, SIOCETHTOOL, &ifr) == -1) {
+		if (errno == EOPNOTSUPP || errno == EINVAL ||
+		    (errno == EPERM && eperm_ok)) {
+			/*
+			 * OK, let's just return 0, which, in our
+			 * case, either means "no, what we're asking
+			 * about is not enabled" or "all the flags
+			 * are clear (i.e., nothing is enabled)".
+			 */
+			return 0;
+		}
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "%s: SIOCETHTOOL(%s) ioctl failed",
+		    handle->opt.device, cmdname);
+		return -1;
+	}
+	return eval.data;
+}
+
+/*
+ * XXX - it's annoying that we have to check for offloading at all, but,
+ * given that we have to, it's still annoying that we have to check for
+ * particular types of offloading, especially that shiny new types of
+ * offloading may be added - and, worse, may not be checkable with
+ * a particular ETHTOOL_ operation; ETHTOOL_GFEATURES would, in
+ * theory, give those to you, but the actual flags being used are
+ * opaque (defined in a non-uapi header), and there doesn't seem to
+ * be any obvious way to ask the kernel what all the offloading flags
+ * are - at best, you can ask for a set of strings(!) to get *names*
+ * for various flags.  (That whole mechanism appears to have been
+ * designed for the sole purpose of letting ethtool report flags
+ * by name and set flags by name, with the names having no semantics
+ * ethtool understands.)
+ */
+static int
+iface_get_offload(pcap_t *handle)
+{
+	int ret;
+
+#ifdef ETHTOOL_GTSO
+	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GTSO, "ETHTOOL_GTSO", 0);
+	if (ret == -1)
 		return -1;
+	if (ret)
+		return 1;	/* TCP segmentation offloading on */
+#endif
 
+#ifdef ETHTOOL_GGSO
 	/*
-	 * If we're filtering in userland, there's nothing to do;
-	 * the new filter will be used for the next packet.
+	 * XXX - will this cause large unsegmented packets to be
+	 * handed to PF_PACKET sockets on transmission?  If not,
+	 * this need not be checked.
 	 */
-	if (handlep->filter_in_userland)
-		return 0;
+	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GGSO, "ETHTOOL_GGSO", 0);
+	if (ret == -1)
+		return -1;
+	if (ret)
+		return 1;	/* generic segmentation offloading on */
+#endif
+
+#ifdef ETHTOOL_GFLAGS
+	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GFLAGS, "ETHTOOL_GFLAGS", 0);
+	if (ret == -1)
+		return -1;
+	if (ret & ETH_FLAG_LRO)
+		return 1;	/* large receive offloading on */
+#endif
 
+#ifdef ETHTOOL_GGRO
 	/*
-	 * We're filtering in the kernel; the packets present in
-	 * all blocks currently in the ring were already filtered
-	 * by the old filter, and so will need to be filtered in
-	 * userland by the new filter.
-	 *
-	 * Get an upper bound for the number of such blocks; first,
-	 * walk the ring backward and count the free blocks.
+	 * XXX - will this cause large reassembled packets to be
+	 * handed to PF_PACKET sockets on receipt?  If not,
+	 * this need not be checked.
 	 */
-	offset = handle->offset;
-	if (offset == 0)
-		offset = handle->cc;
-	offset--;
-	for (n=0; n < handle->cc; ++n) {
-		if (offset == 0)
-			offset = handle->cc;
-		offset--;
-		if (pcap_get_ring_frame_status(handle, offset) != TP_STATUS_KERNEL)
-			break;
-	}
+	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GGRO, "ETHTOOL_GGRO", 0);
+	if (ret == -1)
+		return -1;
+	if (ret)
+		return 1;	/* generic (large) receive offloading on */
+#endif
 
+#ifdef ETHTOOL_GUFO
 	/*
-	 * If we found free blocks, decrement the count of free
-	 * blocks by 1, just in case we lost a race with another
-	 * thread of control that was adding a packet while
-	 * we were counting and that had run the filter before
-	 * we changed it.
-	 *
-	 * XXX - could there be more than one block added in
-	 * this fashion?
-	 *
-	 * XXX - is there a way to avoid that race, e.g. somehow
-	 * wait for all packets that passed the old filter to
-	 * be added to the ring?
+	 * Do this one last, as support for it was removed in later
+	 * kernels, and it fails with EPERM on those kernels rather
+	 * than with EOPNOTSUPP (see explanation in comment for
+	 * iface_ethtool_flag_ioctl()).
 	 */
-	if (n != 0)
-		n--;
+	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GUFO, "ETHTOOL_GUFO", 1);
+	if (ret == -1)
+		return -1;
+	if (ret)
+		return 1;	/* UDP fragmentation offloading on */
+#endif
 
+	return 0;
+}
+#else /* SIOCETHTOOL */
+static int
+iface_get_offload(pcap_t *handle _U_)
+{
 	/*
-	 * Set the count of blocks worth of packets to filter
-	 * in userland to the total number of blocks in the
-	 * ring minus the number of free blocks we found, and
-	 * turn on userland filtering.  (The count of blocks
-	 * worth of packets to filter in userland is guaranteed
-	 * not to be zero - n, above, couldn't be set to a
-	 * value > handle->cc, and if it were equal to
-	 * handle->cc, it wouldn't be zero, and thus would
-	 * be decremented to handle->cc - 1.)
+	 * XXX - do we need to get this information if we don't
+	 * have the ethtool ioctls?  If so, how do we do that?
 	 */
-	handlep->blocks_to_filter_in_userland = handle->cc - n;
-	handlep->filter_in_userland = 1;
-
 	return 0;
 }
+#endif /* SIOCETHTOOL */
 
 /*
- *  Return the index of the given device name. Fill ebuf and return
- *  -1 on failure.
+ * Get the speed of the link, in Mb/s.
+ *
+ * We try ETHTOOL_GLINKSETTINGS first and, if that's not available,
+ * fall back on the older ETHTOOL_GSET.  Returns 0 if the speed
+ * isn't known - the device doesn't support ethtool (as is the case
+ * for, among others, the "any" device and the loopback device), the
+ * link is down, or the driver doesn't know - and -1 on error.
  */
+#if defined(SIOCETHTOOL) && (defined(ETHTOOL_GLINKSETTINGS) || defined(ETHTOOL_GSET))
 static int
-iface_get_id(int fd, const char *device, char *ebuf)
+iface_ethtool_speed_error(pcap_t *handle, const char *cmdname)
+{
+	if (errno == EOPNOTSUPP || errno == EINVAL || errno == EPERM ||
+	    errno == ENODEV) {
+		/*
+		 * Not supported, or not for this device; the speed
+		 * isn't known.
+		 */
+		return 0;
+	}
+	pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+	    errno, "%s: SIOCETHTOOL(%s) ioctl failed",
+	    handle->opt.device, cmdname);
+	return -1;
+}
+
+static int
+iface_get_link_speed(pcap_t *handle)
 {
 	struct ifreq	ifr;
+	uint32_t	speed;
+#ifdef ETHTOOL_GLINKSETTINGS
+	/*
+	 * The link mode masks follow the structure; the kernel tells
+	 * us how many 32-bit words each of the three masks has, as a
+	 * negative number, if we ask with a count that doesn't match.
+	 * The count is a signed 8-bit value, so 127 words is the most
+	 * it can be.
+	 */
+	struct {
+		struct ethtool_link_settings req;
+		uint32_t link_mode_data[3 * 127];
+	} ecmd;
 
 	memset(&ifr, 0, sizeof(ifr));
-	pcapint_strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+	pcapint_strlcpy(ifr.ifr_name, handle->opt.device, sizeof(ifr.ifr_name));
+	memset(&ecmd, 0, sizeof(ecmd));
+	ecmd.req.cmd = ETHTOOL_GLINKSETTINGS;
+	ifr.ifr_data = (caddr_t)&ecmd;
+	if (ioctl(handle->fd, SIOCETHTOOL, &ifr) == 0) {
+		if (ecmd.req.link_mode_masks_nwords < 0) {
+			ecmd.req.link_mode_masks_nwords =
+			    -ecmd.req.link_mode_masks_nwords;
+			ecmd.req.cmd = ETHTOOL_GLINKSETTINGS;
+			if (ioctl(handle->fd, SIOCETHTOOL, &ifr) == -1)
+				return iface_ethtool_speed_error(handle,
+				    "ETHTOOL_GLINKSETTINGS");
+		}
+		speed = ecmd.req.speed;
+		if (speed == 0 || speed > INT_MAX)
+			return 0;	/* including SPEED_UNKNOWN, all-ones */
+		return (int)speed;
+	}
+	if (errno != EOPNOTSUPP)
+		return iface_ethtool_speed_error(handle,
+		    "ETHTOOL_GLINKSETTINGS");
+#endif
+#ifdef ETHTOOL_GSET
+	{
+		struct ethtool_cmd cmd;
 
-	if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1) {
-		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-		    errno, "SIOCGIFINDEX");
-		return -1;
+		memset(&ifr, 0, sizeof(ifr));
+		pcapint_strlcpy(ifr.ifr_name, handle->opt.device,
+		    sizeof(ifr.ifr_name));
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.cmd = ETHTOOL_GSET;
+		ifr.ifr_data = (caddr_t)&cmd;
+		if (ioctl(handle->fd, SIOCETHTOOL, &ifr) == -1)
+			return iface_ethtool_speed_error(handle,
+			    "ETHTOOL_GSET");
+		speed = ethtool_cmd_speed(&cmd);
+		if (speed == 0 || speed > INT_MAX)
+			return 0;
+		return (int)speed;
 	}
-
-	return ifr.ifr_ifindex;
+#else
+	return 0;
+#endif
+}
+#else /* SIOCETHTOOL */
+static int
+iface_get_link_speed(pcap_t *handle _U_)
+{
+	return 0;
 }
+#endif /* SIOCETHTOOL */
 
 /*
- *  Bind the socket associated with FD to the given device.
- *  Return 0 on success or a PCAP_ERROR_ value on a hard error.
+ * As per
+ *
+ *    https://www.kernel.org/doc/html/latest/networking/dsa/dsa.html#switch-tagging-protocols
+ *
+ * Type 1 means that the tag is prepended to the Ethernet packet.
+ *
+ * Type 2 means that the tag is inserted into the Ethernet header
+ * after the source address and before the type/length field.
+ *
+ * Type 3 means that tag is a packet trailer.
+ *
+ * Every element in the array below uses a DLT.  Because a DSA-tagged frame is
+ * not a standard IEEE 802.3 Ethernet frame, the array elements must not use
+ * DLT_EN10MB.  It is safe, albeit only barely useful, to use DLT_DEBUG_ONLY,
+ * which is also the implicit default for any DSA tag that is not present in
+ * the array.  To implement proper support for a particular DSA tag of
+ * interest, please do as much of the following as is reasonably practicable:
+ *
+ * 1. Using recent versions of tcpdump and libpcap on a Linux host with a
+ *    network interface that implements the required DSA tag, capture packets
+ *    on the interface and study the hex dumps.
+ * 2. Using the hex dumps and any other available supporting materials, produce
+ *    a sufficiently detailed description of the DSA tag structure, complete
+ *    with a full comment indicating whether it's type 1, 2, or 3, and, for
+ *    type 2, indicating whether it has an EtherType and, if so, what that type
+ *    is, and whether it's registered with the IEEE or not.  Refer to the
+ *    specification(s), existing implementation(s), or any other relevant
+ *    resources.
+ * 3. Using the description, request and obtain a new DLT for the DSA tag.
+ * 4. Associate the new DLT with the DSA tag in the array below.
+ * 5. Using the updated libpcap, capture packets again, produce a .pcap file
+ *    and confirm it uses the new DLT.
+ * 6. Using the .pcap file as a test, prepare additional changes to tcpdump to
+ *    enable decoding of packets for the new DLT.
+ * 7. Using the .pcap file as a test, prepare additional changes to libpcap to
+ *    enable filtering of packets for the new DLT.
+ *
+ * For working examples of such support, see the existing DLTs other than
+ * DLT_DEBUG_ONLY in the array below.
  */
-static int
-iface_bind(int fd, int ifindex, char *ebuf, int protocol)
-{
-	struct sockaddr_ll	sll;
-	int			ret, err;
-	socklen_t		errlen = sizeof(err);
+static struct dsa_proto {
+	const char *name;
+	bpf_u_int32 linktype;
+} dsa_protos[] = {
+	/*
+	 * Type 1. See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ar9331.c
+	 */
+	{ "ar9331", DLT_DEBUG_ONLY },
 
-	memset(&sll, 0, sizeof(sll));
-	sll.sll_family		= AF_PACKET;
-	sll.sll_ifindex		= ifindex < 0 ? 0 : ifindex;
-	sll.sll_protocol	= protocol;
+	/*
+	 * Type 2, without an EtherType at the beginning.
+	 */
+	{ "brcm", DLT_DSA_TAG_BRCM },
 
-	if (bind(fd, (struct sockaddr *) &sll, sizeof(sll)) == -1) {
-		if (errno == ENETDOWN) {
-			/*
-			 * Return a "network down" indication, so that
-			 * the application can report that rather than
-			 * saying we had a mysterious failure and
-			 * suggest that they report a problem to the
-			 * libpcap developers.
-			 */
-			return PCAP_ERROR_IFACE_NOT_UP;
-		}
-		if (errno == ENODEV) {
-			/*
-			 * There's nothing more to say, so clear the
-			 * error message.
-			 */
-			ebuf[0] = '\0';
-			ret = PCAP_ERROR_NO_SUCH_DEVICE;
-		} else {
-			ret = PCAP_ERROR;
-			pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-			    errno, "bind");
-		}
-		return ret;
-	}
+	/*
+	 * Type 2, with EtherType 0x8874, assigned to Broadcom.
+	 */
+	{ "brcm-legacy", DLT_DEBUG_ONLY },
 
-	/* Any pending errors, e.g., network is down? */
+	/*
+	 * Type 1.
+	 */
+	{ "brcm-prepend", DLT_DSA_TAG_BRCM_PREPEND },
 
-	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1) {
-		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-		    errno, "getsockopt (SO_ERROR)");
-		return PCAP_ERROR;
-	}
+	/*
+	 * Type 2, without an EtherType at the beginning.
+	 */
+	{ "dsa", DLT_DSA_TAG_DSA },
+
+	/*
+	 * Type 2, with an EtherType field, but without
+	 * an assigned EtherType value that can be relied
+	 * on.
+	 */
+	{ "edsa", DLT_DSA_TAG_EDSA },
+
+	/*
+	 * Type 1, with different transmit and receive headers,
+	 * so can't really be handled well with the current
+	 * libpcap API and with pcap files.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_gswip.c
+	 */
+	{ "gswip", DLT_DEBUG_ONLY },
+
+	/*
+	 * Type 3. See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_hellcreek.c
+	 */
+	{ "hellcreek", DLT_DEBUG_ONLY },
+
+	/*
+	 * Type 3, with different transmit and receive headers,
+	 * so can't really be handled well with the current
+	 * libpcap API and with pcap files.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ksz.c#L102
+	 */
+	{ "ksz8795", DLT_DEBUG_ONLY },
 
-	if (err == ENETDOWN) {
-		/*
-		 * Return a "network down" indication, so that
-		 * the application can report that rather than
-		 * saying we had a mysterious failure and
-		 * suggest that they report a problem to the
-		 * libpcap developers.
-		 */
-		return PCAP_ERROR_IFACE_NOT_UP;
-	} else if (err > 0) {
-		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-		    err, "bind");
-		return PCAP_ERROR;
-	}
+	/*
+	 * Type 3, with different transmit and receive headers,
+	 * so can't really be handled well with the current
+	 * libpcap API and with pcap files.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ksz.c#L160
+	 */
+	{ "ksz9477", DLT_DEBUG_ONLY },
 
-	return 0;
-}
+	/*
+	 * Type 3, with different transmit and receive headers,
+	 * so can't really be handled well with the current
+	 * libpcap API and with pcap files.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ksz.c#L341
+	 */
+	{ "ksz9893", DLT_DEBUG_ONLY },
 
-/*
- * Try to enter monitor mode.
- * If we have libnl, try to create a new monitor-mode device and
- * capture on that; otherwise, just say "not supported".
- */
-#ifdef HAVE_LIBNL
-static int
-enter_rfmon_mode(pcap_t *handle, int sock_fd, const char *device)
-{
-	struct pcap_linux *handlep = handle->priv;
-	int ret;
-	char phydev_path[PATH_MAX+1];
-	struct nl80211_state nlstate;
-	struct ifreq ifr;
-	u_int n;
+	/*
+	 * Type 3, with different transmit and receive headers,
+	 * so can't really be handled well with the current
+	 * libpcap API and with pcap files.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ksz.c#L386
+	 */
+	{ "lan937x", DLT_DEBUG_ONLY },
 
 	/*
-	 * Is this a mac80211 device?
+	 * Type 2, with EtherType 0x8100; the VID can be interpreted
+	 * as per
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_lan9303.c#L24
 	 */
-	ret = get_mac80211_phydev(handle, device, phydev_path, PATH_MAX);
-	if (ret < 0)
-		return ret;	/* error */
-	if (ret == 0)
-		return 0;	/* no error, but not mac80211 device */
+	{ "lan9303", DLT_DEBUG_ONLY },
 
-	ret = nl80211_init(handle, &nlstate, device);
-	if (ret != 0)
-		return ret;
+	/*
+	 * Type 2, without an EtherType at the beginning.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_mtk.c#L15
+	 *
+	 * Linux kernel implements this tag so that it does not indicate the frame
+	 * encoding reliably.  The matter is, some drivers use METADATA_HW_PORT_MUX,
+	 * which (for the switch->CPU direction only, at the time of this writing)
+	 * means that the frame does not have a DSA tag, the frame metadata is stored
+	 * elsewhere and libpcap receives the frame only.  Specifically, this is the
+	 * case for drivers/net/ethernet/mediatek/mtk_eth_soc.c, but the tag visible
+	 * in sysfs is still "mtk" even though the wire encoding is different.
+	 */
+	{ "mtk", DLT_DEBUG_ONLY },
 
 	/*
-	 * Is this already a monN device?
-	 * If so, we're done.
+	 * Type 1.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ocelot.c
 	 */
-	int type;
-	ret = get_if_type(handle, sock_fd, &nlstate, device, &type);
-	if (ret <= 0) {
-		/*
-		 * < 0 is a Hard failure.  Just return ret; handle->errbuf
-		 * has already been set.
-		 *
-		 * 0 is "device not available"; the caller should retry later.
-		 */
-		nl80211_cleanup(&nlstate);
-		return ret;
-	}
-	if (type == NL80211_IFTYPE_MONITOR) {
-		/*
-		 * OK, it's already a monitor mode device; just use it.
-		 * There's no point in creating another monitor device
-		 * that will have to be cleaned up.
-		 */
-		nl80211_cleanup(&nlstate);
-		return ret;
-	}
+	{ "ocelot", DLT_DEBUG_ONLY },
 
 	/*
-	 * OK, it's apparently a mac80211 device but not a monitor device.
-	 * Try to find an unused monN device for it.
+	 * Type 1.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ocelot.c
 	 */
-	for (n = 0; n < UINT_MAX; n++) {
-		/*
-		 * Try mon{n}.
-		 */
-		char mondevice[3+10+1];	/* mon{UINT_MAX}\0 */
+	{ "seville", DLT_DEBUG_ONLY },
 
-		snprintf(mondevice, sizeof mondevice, "mon%u", n);
-		ret = add_mon_if(handle, sock_fd, &nlstate, device, mondevice);
-		if (ret == 1) {
-			/*
-			 * Success.  We don't clean up the libnl state
-			 * yet, as we'll be using it later.
-			 */
-			goto added;
-		}
-		if (ret < 0) {
-			/*
-			 * Hard failure.  Just return ret; handle->errbuf
-			 * has already been set.
-			 */
-			nl80211_cleanup(&nlstate);
-			return ret;
-		}
-	}
+	/*
+	 * Type 2, with EtherType 0x8100; the VID can be interpreted
+	 * as per
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_8021q.c#L15
+	 */
+	{ "ocelot-8021q", DLT_DEBUG_ONLY },
 
-	snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
-	    "%s: No free monN interfaces", device);
-	nl80211_cleanup(&nlstate);
-	return PCAP_ERROR;
+	/*
+	 * Type 2, without an EtherType at the beginning.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_qca.c
+	 */
+	{ "qca", DLT_DEBUG_ONLY },
 
-added:
+	/*
+	 * Type 2, with EtherType 0x8899, assigned to Realtek;
+	 * they use it for several on-the-Ethernet protocols
+	 * as well, but there are fields that allow the two
+	 * tag formats, and all the protocols in question,
+	 * to be distinguiished from one another.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_rtl4_a.c
+	 *
+	 *    http://realtek.info/pdf/rtl8306sd%28m%29_datasheet_1.1.pdf
+	 *
+	 * and various pages in tcpdump's print-realtek.c and Wireshark's
+	 * epan/dissectors/packet-realtek.c for the other protocols.
+	 */
+	{ "rtl4a", DLT_DEBUG_ONLY },
 
-#if 0
 	/*
-	 * Sleep for .1 seconds.
+	 * Type 2, with EtherType 0x8899, assigned to Realtek;
+	 * see above.
 	 */
-	delay.tv_sec = 0;
-	delay.tv_nsec = 500000000;
-	nanosleep(&delay, NULL);
-#endif
+	{ "rtl8_4", DLT_DEBUG_ONLY },
 
 	/*
-	 * If we haven't already done so, arrange to have
-	 * "pcap_close_all()" called when we exit.
+	 * Type 3, with the same tag format as rtl8_4.
 	 */
-	if (!pcapint_do_addexit(handle)) {
-		/*
-		 * "atexit()" failed; don't put the interface
-		 * in rfmon mode, just give up.
-		 * handle->errbuf has already been filled.
-		 */
-		del_mon_if(handle, sock_fd, &nlstate, device,
-		    handlep->mondevice);
-		nl80211_cleanup(&nlstate);
-		return PCAP_ERROR;
-	}
+	{ "rtl8_4t", DLT_DEBUG_ONLY },
 
 	/*
-	 * Now configure the monitor interface up.
+	 * Type 2, with EtherType 0xe001; that's probably
+	 * self-assigned.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_rzn1_a5psw.c
 	 */
-	memset(&ifr, 0, sizeof(ifr));
-	pcapint_strlcpy(ifr.ifr_name, handlep->mondevice, sizeof(ifr.ifr_name));
-	if (ioctl(sock_fd, SIOCGIFFLAGS, &ifr) == -1) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "%s: Can't get flags for %s", device,
-		    handlep->mondevice);
-		del_mon_if(handle, sock_fd, &nlstate, device,
-		    handlep->mondevice);
-		nl80211_cleanup(&nlstate);
-		return PCAP_ERROR;
-	}
-	ifr.ifr_flags |= IFF_UP|IFF_RUNNING;
-	if (ioctl(sock_fd, SIOCSIFFLAGS, &ifr) == -1) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "%s: Can't set flags for %s", device,
-		    handlep->mondevice);
-		del_mon_if(handle, sock_fd, &nlstate, device,
-		    handlep->mondevice);
-		nl80211_cleanup(&nlstate);
-		return PCAP_ERROR;
-	}
+	{ "a5psw", DLT_DEBUG_ONLY },
 
 	/*
-	 * Success.  Clean up the libnl state.
+	 * Type 2, with EtherType 0x8100 or the self-assigned
+	 * 0xdadb, so this really should have its own
+	 * LINKTYPE_/DLT_ value; that would also allow the
+	 * VID of the tag to be dissected as per
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_8021q.c#L15
 	 */
-	nl80211_cleanup(&nlstate);
+	{ "sja1105", DLT_DEBUG_ONLY },
 
 	/*
-	 * Note that we have to delete the monitor device when we close
-	 * the handle.
+	 * Type "none of the above", with both a header and trailer,
+	 * with different transmit and receive tags.  Has
+	 * EtherType 0xdadc, which is probably self-assigned.
 	 */
-	handlep->must_do_on_close |= MUST_DELETE_MONIF;
+	{ "sja1110", DLT_DEBUG_ONLY },
 
 	/*
-	 * Add this to the list of pcaps to close when we exit.
+	 * Type 3, as the name suggests.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_trailer.c
 	 */
-	pcapint_add_to_pcaps_to_close(handle);
+	{ "trailer", DLT_DEBUG_ONLY },
 
-	return 1;
-}
-#else /* HAVE_LIBNL */
-static int
-enter_rfmon_mode(pcap_t *handle _U_, int sock_fd _U_, const char *device _U_)
-{
 	/*
-	 * We don't have libnl, so we can't do monitor mode.
+	 * Type 2, with EtherType 0x8100; the VID can be interpreted
+	 * as per
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_8021q.c#L15
 	 */
-	return 0;
-}
-#endif /* HAVE_LIBNL */
+	{ "vsc73xx-8021q", DLT_DEBUG_ONLY },
 
-#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP)
-/*
- * Map SOF_TIMESTAMPING_ values to PCAP_TSTAMP_ values.
- */
-static const struct {
-	int soft_timestamping_val;
-	int pcap_tstamp_val;
-} sof_ts_type_map[3] = {
-	{ SOF_TIMESTAMPING_SOFTWARE, PCAP_TSTAMP_HOST },
-	{ SOF_TIMESTAMPING_SYS_HARDWARE, PCAP_TSTAMP_ADAPTER },
-	{ SOF_TIMESTAMPING_RAW_HARDWARE, PCAP_TSTAMP_ADAPTER_UNSYNCED }
+	/*
+	 * Type 3.
+	 *
+	 * See
+	 *
+	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_xrs700x.c
+	 */
+	{ "xrs700x", DLT_DEBUG_ONLY },
 };
-#define NUM_SOF_TIMESTAMPING_TYPES	(sizeof sof_ts_type_map / sizeof sof_ts_type_map[0])
-
-/*
- * Set the list of time stamping types to include all types.
- */
-static int
-iface_set_all_ts_types(pcap_t *handle, char *ebuf)
-{
-	u_int i;
-
-	handle->tstamp_type_list = malloc(NUM_SOF_TIMESTAMPING_TYPES * sizeof(u_int));
-	if (handle->tstamp_type_list == NULL) {
-		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-		    errno, "malloc");
-		return -1;
-	}
-	for (i = 0; i < NUM_SOF_TIMESTAMPING_TYPES; i++)
-		handle->tstamp_type_list[i] = sof_ts_type_map[i].pcap_tstamp_val;
-	handle->tstamp_type_count = NUM_SOF_TIMESTAMPING_TYPES;
-	return 0;
-}
 
 /*
- * Get a list of time stamp types.
+ * Return 1 if the interface uses DSA tagging, 0 if the interface does not use
+ * DSA tagging, or PCAP_ERROR on error.
  */
-#ifdef ETHTOOL_GET_TS_INFO
 static int
-iface_get_ts_types(const char *device, pcap_t *handle, char *ebuf)
+iface_dsa_get_proto_info(const char *device, pcap_t *handle)
 {
-	int fd;
-	struct ifreq ifr;
-	struct ethtool_ts_info info;
-	int num_ts_types;
-	u_int i, j;
-
+	char *pathstr;
+	unsigned int i;
 	/*
-	 * This doesn't apply to the "any" device; you can't say "turn on
-	 * hardware time stamping for all devices that exist now and arrange
-	 * that it be turned on for any device that appears in the future",
-	 * and not all devices even necessarily *support* hardware time
-	 * stamping, so don't report any time stamp types.
+	 * Make this significantly smaller than PCAP_ERRBUF_SIZE;
+	 * the tag *shouldn't* have some huge long name, and making
+	 * it smaller keeps newer versions of GCC from whining that
+	 * the error message if we don't support the tag could
+	 * overflow the error message buffer.
 	 */
-	if (strcmp(device, "any") == 0) {
-		handle->tstamp_type_list = NULL;
-		return 0;
+	char buf[128];
+	ssize_t r;
+	int fd;
+
+	fd = asprintf(&pathstr, "/sys/class/net/%s/dsa/tagging", device);
+	if (fd < 0) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+					  fd, "asprintf");
+		return PCAP_ERROR;
 	}
 
+	fd = open(pathstr, O_RDONLY);
+	free(pathstr);
 	/*
-	 * Create a socket from which to fetch time stamping capabilities.
+	 * This could be not fatal: kernel >= 4.20 *might* expose this
+	 * attribute.  However, if it exposes the attribute, but the read has
+	 * failed due to another reason (ENFILE, EMFILE, ENOMEM...), propagate
+	 * the failure.
 	 */
-	fd = get_if_ioctl_socket();
 	if (fd < 0) {
-		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-		    errno, "socket for SIOCETHTOOL(ETHTOOL_GET_TS_INFO)");
-		return -1;
+		if (errno == ENOENT)
+			return 0;
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		                             errno, "open");
+		return PCAP_ERROR;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	pcapint_strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
-	memset(&info, 0, sizeof(info));
-	info.cmd = ETHTOOL_GET_TS_INFO;
-	ifr.ifr_data = (caddr_t)&info;
-	if (ioctl(fd, SIOCETHTOOL, &ifr) == -1) {
-		int save_errno = errno;
-
+	r = read(fd, buf, sizeof(buf) - 1);
+	if (r <= 0) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+					  errno, "read");
 		close(fd);
-		switch (save_errno) {
-
-		case EOPNOTSUPP:
-		case EINVAL:
-			/*
-			 * OK, this OS version or driver doesn't support
-			 * asking for the time stamping types, so let's
-			 * just return all the possible types.
-			 */
-			if (iface_set_all_ts_types(handle, ebuf) == -1)
-				return -1;
-			return 0;
-
-		case ENODEV:
-			/*
-			 * OK, no such device.
-			 * The user will find that out when they try to
-			 * activate the device; just return an empty
-			 * list of time stamp types.
-			 */
-			handle->tstamp_type_list = NULL;
-			return 0;
-
-		default:
-			/*
-			 * Other error.
-			 */
-			pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-			    save_errno,
-			    "%s: SIOCETHTOOL(ETHTOOL_GET_TS_INFO) ioctl failed",
-			    device);
-			return -1;
-		}
+		return PCAP_ERROR;
 	}
 	close(fd);
 
 	/*
-	 * Do we support hardware time stamping of *all* packets?
+	 * Buffer should be LF terminated.
 	 */
-	if (!(info.rx_filters & (1 << HWTSTAMP_FILTER_ALL))) {
-		/*
-		 * No, so don't report any time stamp types.
-		 *
-		 * XXX - some devices either don't report
-		 * HWTSTAMP_FILTER_ALL when they do support it, or
-		 * report HWTSTAMP_FILTER_ALL but map it to only
-		 * time stamping a few PTP packets.  See
-		 * http://marc.info/?l=linux-netdev&m=146318183529571&w=2
-		 *
-		 * Maybe that got fixed later.
-		 */
-		handle->tstamp_type_list = NULL;
-		return 0;
-	}
-
-	num_ts_types = 0;
-	for (i = 0; i < NUM_SOF_TIMESTAMPING_TYPES; i++) {
-		if (info.so_timestamping & sof_ts_type_map[i].soft_timestamping_val)
-			num_ts_types++;
-	}
-	if (num_ts_types != 0) {
-		handle->tstamp_type_list = malloc(num_ts_types * sizeof(u_int));
-		if (handle->tstamp_type_list == NULL) {
-			pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-			    errno, "malloc");
-			return -1;
-		}
-		for (i = 0, j = 0; i < NUM_SOF_TIMESTAMPING_TYPES; i++) {
-			if (info.so_timestamping & sof_ts_type_map[i].soft_timestamping_val) {
-				handle->tstamp_type_list[j] = sof_ts_type_map[i].pcap_tstamp_val;
-				j++;
-			}
-		}
-		handle->tstamp_type_count = num_ts_types;
-	} else
-		handle->tstamp_type_list = NULL;
+	if (buf[r - 1] == '\n')
+		r--;
+	buf[r] = '\0';
 
-	return 0;
-}
-#else /* ETHTOOL_GET_TS_INFO */
-static int
-iface_get_ts_types(const char *device, pcap_t *handle, char *ebuf)
-{
 	/*
-	 * This doesn't apply to the "any" device; you can't say "turn on
-	 * hardware time stamping for all devices that exist now and arrange
-	 * that it be turned on for any device that appears in the future",
-	 * and not all devices even necessarily *support* hardware time
-	 * stamping, so don't report any time stamp types.
+	 * The string "none" indicates that the interface does not have
+	 * any tagging protocol configured, and is therefore a standard
+	 * Ethernet interface.
 	 */
-	if (strcmp(device, "any") == 0) {
-		handle->tstamp_type_list = NULL;
+	if (strcmp(buf, "none") == 0)
 		return 0;
-	}
 
 	/*
-	 * We don't have an ioctl to use to ask what's supported,
-	 * so say we support everything.
+	 * Every element in the array stands for a DSA-tagged interface.  Using
+	 * DLT_EN10MB (the standard IEEE 802.3 Ethernet) for such an interface
+	 * may seem a good idea at first, but doing so would certainly cause
+	 * major problems in areas that are already complicated and depend on
+	 * DLT_EN10MB meaning the standard IEEE 802.3 Ethernet only, namely:
+	 *
+	 * - live capturing of packets on Linux, and
+	 * - live kernel filtering of packets on Linux, and
+	 * - live userspace filtering of packets on Linux, and
+	 * - offline filtering of packets on all supported OSes, and
+	 * - identification of savefiles on all OSes.
+	 *
+	 * Therefore use a default DLT value that does not block capturing and
+	 * hexdumping of unsupported DSA encodings (in case the tag is not in
+	 * the array) and enforce the non-use of DLT_EN10MB (in case the tag is
+	 * in the array, but is incorrectly declared).
 	 */
-	if (iface_set_all_ts_types(handle, ebuf) == -1)
-		return -1;
-	return 0;
+	handle->linktype = DLT_DEBUG_ONLY;
+	for (i = 0; i < sizeof(dsa_protos) / sizeof(dsa_protos[0]); i++) {
+		if (strcmp(buf, dsa_protos[i].name) == 0) {
+			if (dsa_protos[i].linktype != DLT_EN10MB)
+				handle->linktype = dsa_protos[i].linktype;
+			break;
+		}
+	}
+	return 1;
 }
-#endif /* ETHTOOL_GET_TS_INFO */
-#else  /* defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP) */
+
+/*
+ *  Query the kernel for the MTU of the given interface.
+ */
 static int
-iface_get_ts_types(const char *device _U_, pcap_t *p _U_, char *ebuf _U_)
+iface_get_mtu(int fd, const char *device, char *ebuf)
 {
-	/*
-	 * Nothing to fetch, so it always "succeeds".
-	 */
-	return 0;
+	struct ifreq	ifr;
+
+	if (!device)
+		return BIGGER_THAN_ALL_MTUS;
+
+	memset(&ifr, 0, sizeof(ifr));
+	pcapint_strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+
+	if (ioctl(fd, SIOCGIFMTU, &ifr) == -1) {
+		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+		    errno, "SIOCGIFMTU");
+		return -1;
+	}
+
+	return ifr.ifr_mtu;
 }
-#endif /* defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP) */
 
 /*
- * Find out if we have any form of fragmentation/reassembly offloading.
- *
- * We do so using SIOCETHTOOL checking for various types of offloading;
- * if SIOCETHTOOL isn't defined, or we don't have any #defines for any
- * of the types of offloading, there's nothing we can do to check, so
- * we just say "no, we don't".
- *
- * We treat EOPNOTSUPP, EINVAL and, if eperm_ok is true, EPERM as
- * indications that the operation isn't supported.  We do EPERM
- * weirdly because the SIOCETHTOOL code in later kernels 1) doesn't
- * support ETHTOOL_GUFO, 2) also doesn't include it in the list
- * of ethtool operations that don't require CAP_NET_ADMIN privileges,
- * and 3) does the "is this permitted" check before doing the "is
- * this even supported" check, so it fails with "this is not permitted"
- * rather than "this is not even supported".  To work around this
- * annoyance, we only treat EPERM as an error for the first feature,
- * and assume that they all do the same permission checks, so if the
- * first one is allowed all the others are allowed if supported.
+ *  Get the hardware type of the given interface as ARPHRD_xxx constant.
  */
-#if defined(SIOCETHTOOL) && (defined(ETHTOOL_GTSO) || defined(ETHTOOL_GUFO) || defined(ETHTOOL_GGSO) || defined(ETHTOOL_GFLAGS) || defined(ETHTOOL_GGRO))
 static int
-iface_ethtool_flag_ioctl(pcap_t *handle, int cmd, const char *cmdname,
-    int eperm_ok)
+iface_get_arptype(int fd, const char *device, char *ebuf)
 {
 	struct ifreq	ifr;
-	struct ethtool_value eval;
+	int		ret;
 
 	memset(&ifr, 0, sizeof(ifr));
-	pcapint_strlcpy(ifr.ifr_name, handle->opt.device, sizeof(ifr.ifr_name));
-	eval.cmd = cmd;
-	eval.data = 0;
-	ifr.ifr_data = (caddr_t)&eval;
-	if (ioctl(handle->fd, SIOCETHTOOL, &ifr) == -1) {
-		if (errno == EOPNOTSUPP || errno == EINVAL ||
-		    (errno == EPERM && eperm_ok)) {
+	pcapint_strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1) {
+		if (errno == ENODEV) {
 			/*
-			 * OK, let's just return 0, which, in our
-			 * case, either means "no, what we're asking
-			 * about is not enabled" or "all the flags
-			 * are clear (i.e., nothing is enabled)".
+			 * No such device.
+			 *
+			 * There's nothing more to say, so clear
+			 * the error message.
 			 */
-			return 0;
+			ret = PCAP_ERROR_NO_SUCH_DEVICE;
+			ebuf[0] = '\0';
+		} else {
+			ret = PCAP_ERROR;
+			pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+			    errno, "SIOCGIFHWADDR");
 		}
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "%s: SIOCETHTOOL(%s) ioctl failed",
-		    handle->opt.device, cmdname);
-		return -1;
+		return ret;
 	}
-	return eval.data;
+
+	return ifr.ifr_hwaddr.sa_family;
 }
 
 /*
- * XXX - it's annoying that we have to check for offloading at all, but,
- * given that we have to, it's still annoying that we have to check for
- * particular types of offloading, especially that shiny new types of
- * offloading may be added - and, worse, may not be checkable with
- * a particular ETHTOOL_ operation; ETHTOOL_GFEATURES would, in
- * theory, give those to you, but the actual flags being used are
- * opaque (defined in a non-uapi header), and there doesn't seem to
- * be any obvious way to ask the kernel what all the offloading flags
- * are - at best, you can ask for a set of strings(!) to get *names*
- * for various flags.  (That whole mechanism appears to have been
- * designed for the sole purpose of letting ethtool report flags
- * by name and set flags by name, with the names having no semantics
- * ethtool understands.)
+ * In a DLT_CAN_SOCKETCAN frame the first four bytes are a 32-bit integer
+ * value in host byte order if the filter program is running in the kernel and
+ * in network byte order if in userland.  This applies to both CC, FD and XL
+ * frames, see pcap_handle_packet_mmap() for the rationale.  Return 1 iff the
+ * [possibly modified] filter program can work correctly in the kernel.
  */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
 static int
-iface_get_offload(pcap_t *handle)
+fix_dlt_can_socketcan(const u_int len, struct bpf_insn insn[])
 {
-	int ret;
+	for (u_int i = 0; i < len; ++i) {
+		switch (insn[i].code) {
+		case BPF_LD|BPF_B|BPF_ABS: // ldb [k]
+		case BPF_LDX|BPF_MSH|BPF_B: // ldxb 4*([k]&0xf)
+			if (insn[i].k < 4)
+				insn[i].k = 3 - insn[i].k; // Fixed now.
+			break;
+		case BPF_LD|BPF_H|BPF_ABS: // ldh [k]
+		case BPF_LD|BPF_W|BPF_ABS: // ld [k]
+			/*
+			 * A halfword or a word load cannot be fixed by just
+			 * changing k, even if every required byte is within
+			 * the byte-swapped part of the frame, even if the
+			 * load is aligned.  The fix would require either
+			 * rewriting the filter program extensively or
+			 * generating it differently in the first place.
+			 */
+		case BPF_LD|BPF_B|BPF_IND: // ldb [x + k]
+		case BPF_LD|BPF_H|BPF_IND: // ldh [x + k]
+		case BPF_LD|BPF_W|BPF_IND: // ld [x + k]
+			/*
+			 * In addition to the above, a variable offset load
+			 * cannot be fixed because x can have any value, thus
+			 * x + k can have any value, but only the first four
+			 * bytes are swapped.  An easy way to demonstrate it
+			 * is to compile "link[link[4]] == 0", which will use
+			 * "ldb [x + 0]" to access one of the first four bytes
+			 * of the frame iff CAN CC/FD payload length is less
+			 * than 4.
+			 */
+			if (insn[i].k < 4)
+				return 0; // Userland filtering only.
+			break;
+		}
+	}
+	return 1;
+}
+#else
+static int
+fix_dlt_can_socketcan(const u_int len _U_, struct bpf_insn insn[] _U_)
+{
+	return 1;
+}
+#endif // __BYTE_ORDER == __LITTLE_ENDIAN
 
-#ifdef ETHTOOL_GTSO
-	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GTSO, "ETHTOOL_GTSO", 0);
-	if (ret == -1)
-		return -1;
-	if (ret)
-		return 1;	/* TCP segmentation offloading on */
-#endif
+static int
+fix_program(pcap_t *handle, struct sock_fprog *fcode)
+{
+	struct pcap_linux *handlep = handle->priv;
+	size_t prog_size;
+	int i;
+	struct bpf_insn *p;
+	struct bpf_insn *f;
+	int len;
 
-#ifdef ETHTOOL_GGSO
 	/*
-	 * XXX - will this cause large unsegmented packets to be
-	 * handed to PF_PACKET sockets on transmission?  If not,
-	 * this need not be checked.
+	 * Make a copy of the filter, and modify that copy if
+	 * necessary.
 	 */
-	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GGSO, "ETHTOOL_GGSO", 0);
-	if (ret == -1)
+	prog_size = sizeof(*handle->fcode.bf_insns) * handle->fcode.bf_len;
+	len = handle->fcode.bf_len;
+	f = (struct bpf_insn *)malloc(prog_size);
+	if (f == NULL) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
 		return -1;
-	if (ret)
-		return 1;	/* generic segmentation offloading on */
-#endif
+	}
+	memcpy(f, handle->fcode.bf_insns, prog_size);
+	fcode->len = len;
+	fcode->filter = (struct sock_filter *) f;
 
-#ifdef ETHTOOL_GFLAGS
-	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GFLAGS, "ETHTOOL_GFLAGS", 0);
-	if (ret == -1)
-		return -1;
-	if (ret & ETH_FLAG_LRO)
-		return 1;	/* large receive offloading on */
-#endif
+	switch (handle->linktype) {
+	case DLT_CAN_SOCKETCAN:
+		/*
+		 * If a similar fix needs to be done for CAN frames that
+		 * appear on the "any" pseudo-interface, it needs to be done
+		 * differently because that would be within DLT_LINUX_SLL or
+		 * DLT_LINUX_SLL2.
+		 */
+		return fix_dlt_can_socketcan(len, f);
+	}
 
-#ifdef ETHTOOL_GGRO
-	/*
-	 * XXX - will this cause large reassembled packets to be
-	 * handed to PF_PACKET sockets on receipt?  If not,
-	 * this need not be checked.
-	 */
-	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GGRO, "ETHTOOL_GGRO", 0);
-	if (ret == -1)
-		return -1;
-	if (ret)
-		return 1;	/* generic (large) receive offloading on */
-#endif
+	for (i = 0; i < len; ++i) {
+		p = &f[i];
+		/*
+		 * What type of instruction is this?
+		 */
+		switch (BPF_CLASS(p->code)) {
 
-#ifdef ETHTOOL_GUFO
-	/*
-	 * Do this one last, as support for it was removed in later
-	 * kernels, and it fails with EPERM on those kernels rather
-	 * than with EOPNOTSUPP (see explanation in comment for
-	 * iface_ethtool_flag_ioctl()).
-	 */
-	ret = iface_ethtool_flag_ioctl(handle, ETHTOOL_GUFO, "ETHTOOL_GUFO", 1);
-	if (ret == -1)
-		return -1;
-	if (ret)
-		return 1;	/* UDP fragmentation offloading on */
-#endif
+		case BPF_LD:
+		case BPF_LDX:
+			/*
+			 * It's a load instruction; is it loading
+			 * from the packet?
+			 */
+			switch (BPF_MODE(p->code)) {
+
+			case BPF_ABS:
+			case BPF_IND:
+			case BPF_MSH:
+				/*
+				 * Yes; are we in cooked mode?
+				 */
+				if (handlep->cooked) {
+					/*
+					 * Yes, so we need to fix this
+					 * instruction.
+					 */
+					if (fix_offset(handle, p) < 0) {
+						/*
+						 * We failed to do so.
+						 * Return 0, so our caller
+						 * knows to punt to userland.
+						 */
+						return 0;
+					}
+				}
+				break;
+			}
+			break;
+		}
+	}
 
-	return 0;
-}
-#else /* SIOCETHTOOL */
-static int
-iface_get_offload(pcap_t *handle _U_)
-{
 	/*
-	 * XXX - do we need to get this information if we don't
-	 * have the ethtool ioctls?  If so, how do we do that?
+	 * In cooked mode, the accept length that a "slice headers"
+	 * program computes is an offset in the packet as seen by
+	 * userland, which includes the link-layer header; the kernel
+	 * doesn't see that header, so subtract its length.
 	 */
-	return 0;
+	if (handlep->cooked)
+		return fix_ret_a(handle, fcode);
+	return 1;	/* we succeeded */
 }
-#endif /* SIOCETHTOOL */
 
 /*
- * As per
- *
- *    https://www.kernel.org/doc/html/latest/networking/dsa/dsa.html#switch-tagging-protocols
- *
- * Type 1 means that the tag is prepended to the Ethernet packet.
- *
- * Type 2 means that the tag is inserted into the Ethernet header
- * after the source address and before the type/length field.
- *
- * Type 3 means that tag is a packet trailer.
- *
- * Every element in the array below uses a DLT.  Because a DSA-tagged frame is
- * not a standard IEEE 802.3 Ethernet frame, the array elements must not use
- * DLT_EN10MB.  It is safe, albeit only barely useful, to use DLT_DEBUG_ONLY,
- * which is also the implicit default for any DSA tag that is not present in
- * the array.  To implement proper support for a particular DSA tag of
- * interest, please do as much of the following as is reasonably practicable:
- *
- * 1. Using recent versions of tcpdump and libpcap on a Linux host with a
- *    network interface that implements the required DSA tag, capture packets
- *    on the interface and study the hex dumps.
- * 2. Using the hex dumps and any other available supporting materials, produce
- *    a sufficiently detailed description of the DSA tag structure, complete
- *    with a full comment indicating whether it's type 1, 2, or 3, and, for
- *    type 2, indicating whether it has an EtherType and, if so, what that type
- *    is, and whether it's registered with the IEEE or not.  Refer to the
- *    specification(s), existing implementation(s), or any other relevant
- *    resources.
- * 3. Using the description, request and obtain a new DLT for the DSA tag.
- * 4. Associate the new DLT with the DSA tag in the array below.
- * 5. Using the updated libpcap, capture packets again, produce a .pcap file
- *    and confirm it uses the new DLT.
- * 6. Using the .pcap file as a test, prepare additional changes to tcpdump to
- *    enable decoding of packets for the new DLT.
- * 7. Using the .pcap file as a test, prepare additional changes to libpcap to
- *    enable filtering of packets for the new DLT.
+ * Turn every "ret a" in a cooked-mode kernel filter into a jump to an
+ * "sub #hdrlen; ret a" sequence appended to the program.  Jumps only go
+ * forward and "ja" has a 32-bit offset, so no other instruction has to
+ * change.
  *
- * For working examples of such support, see the existing DLTs other than
- * DLT_DEBUG_ONLY in the array below.
+ * Return 1 on success, 0 if the result would be too long for the
+ * kernel, and -1 on error.
  */
-static struct dsa_proto {
-	const char *name;
-	bpf_u_int32 linktype;
-} dsa_protos[] = {
-	/*
-	 * Type 1. See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ar9331.c
-	 */
-	{ "ar9331", DLT_DEBUG_ONLY },
+static int
+fix_ret_a(pcap_t *handle, struct sock_fprog *fcode)
+{
+	struct bpf_insn epilogue[] = {
+		BPF_STMT(BPF_ALU|BPF_SUB|BPF_K,
+		    handle->linktype == DLT_LINUX_SLL2 ?
+		    SLL2_HDR_LEN : SLL_HDR_LEN),
+		BPF_STMT(BPF_RET|BPF_A, 0)
+	};
+	const u_int epilogue_len = sizeof(epilogue) / sizeof(epilogue[0]);
+	struct bpf_insn *f = (struct bpf_insn *)fcode->filter;
+	u_int i;
+	int found = 0;
 
-	/*
-	 * Type 2, without an EtherType at the beginning.
-	 */
-	{ "brcm", DLT_DSA_TAG_BRCM },
+	for (i = 0; i < fcode->len; i++) {
+		if (f[i].code == (BPF_RET|BPF_A)) {
+			found = 1;
+			break;
+		}
+	}
+	if (!found)
+		return 1;
+	if (fcode->len > USHRT_MAX - epilogue_len)
+		return 0;
+	f = (struct bpf_insn *)realloc(f, sizeof(*f) * (fcode->len + epilogue_len));
+	if (f == NULL) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "realloc");
+		free(fcode->filter);
+		fcode->filter = NULL;
+		return -1;
+	}
+	fcode->filter = (struct sock_filter *) f;
+	for (i = 0; i < fcode->len; i++) {
+		if (f[i].code == (BPF_RET|BPF_A)) {
+			f[i].code = BPF_JMP|BPF_JA;
+			f[i].k = fcode->len - i - 1;
+		}
+	}
+	memcpy(f + fcode->len, epilogue, sizeof(epilogue));
+	fcode->len += epilogue_len;
+	return 1;
+}
 
-	/*
-	 * Type 2, with EtherType 0x8874, assigned to Broadcom.
-	 */
-	{ "brcm-legacy", DLT_DEBUG_ONLY },
+/*
+ * Generate a 32-bit pseudo-random number for SKF_AD_RANDOM loads in
+ * filters run in userland, and for sampling done in userland.  This
+ * is xorshift32; it only has to be about as good as the kernel's
+ * prandom_u32().
+ */
+static bpf_u_int32
+linux_random(struct pcap_linux *handlep)
+{
+	uint32_t x = handlep->random_state;
 
-	/*
-	 * Type 1.
-	 */
-	{ "brcm-prepend", DLT_DSA_TAG_BRCM_PREPEND },
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	handlep->random_state = x;
+	return x;
+}
 
-	/*
-	 * Type 2, without an EtherType at the beginning.
-	 */
-	{ "dsa", DLT_DSA_TAG_DSA },
+#ifdef ENABLE_REMOTE
+/*
+ * Return the threshold below which a random number must be for the
+ * packet to be kept when doing PCAP_SAMP_1_EVERY_N sampling, or 0 if
+ * no such sampling was requested.  The kernel can only drop packets
+ * at random, so we keep one packet in N on average rather than
+ * exactly every Nth packet.
+ */
+static bpf_u_int32
+linux_samp_threshold(pcap_t *handle)
+{
+	if (handle->rmt_samp.method != PCAP_SAMP_1_EVERY_N ||
+	    handle->rmt_samp.value <= 1)
+		return 0;
+	return (bpf_u_int32)((UINT64_C(1) << 32) /
+	    (u_int)handle->rmt_samp.value);
+}
+#endif /* ENABLE_REMOTE */
 
-	/*
-	 * Type 2, with an EtherType field, but without
-	 * an assigned EtherType value that can be relied
-	 * on.
-	 */
-	{ "edsa", DLT_DSA_TAG_EDSA },
+#if defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM)
+/*
+ * Prepend to a kernel filter an "ld [random]; jge #threshold; ret #0"
+ * sequence that drops all packets for which the random number isn't
+ * below the threshold.  Dropping a random subset of packets before
+ * the filter runs rather than after is equivalent, and jumps are
+ * relative, so the rest of the program needn't change.
+ *
+ * Return 1 on success, 0 if the result would be too long for the
+ * kernel, and -1 on error.
+ */
+static int
+add_sampling_prologue(pcap_t *handle, struct sock_fprog *fcode,
+    bpf_u_int32 threshold)
+{
+	struct bpf_insn prologue[] = {
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM),
+		BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, threshold, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, 0)
+	};
+	const u_int prologue_len = sizeof(prologue) / sizeof(prologue[0]);
+	struct bpf_insn *f;
 
-	/*
-	 * Type 1, with different transmit and receive headers,
-	 * so can't really be handled well with the current
-	 * libpcap API and with pcap files.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_gswip.c
-	 */
-	{ "gswip", DLT_DEBUG_ONLY },
+	if (fcode->len > USHRT_MAX - prologue_len)
+		return 0;
+	f = (struct bpf_insn *)malloc(sizeof(*f) * (fcode->len + prologue_len));
+	if (f == NULL) {
+		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return -1;
+	}
+	memcpy(f, prologue, sizeof(prologue));
+	memcpy(f + prologue_len, fcode->filter, sizeof(*f) * fcode->len);
+	free(fcode->filter);
+	fcode->len += prologue_len;
+	fcode->filter = (struct sock_filter *) f;
+	return 1;
+}
+#endif /* defined(ENABLE_REMOTE) && defined(SKF_AD_RANDOM) */
 
+static int
+fix_offset(pcap_t *handle, struct bpf_insn *p)
+{
 	/*
-	 * Type 3. See
+	 * Existing references to auxiliary data shouldn't be adjusted.
 	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_hellcreek.c
+	 * Note that SKF_AD_OFF is negative, but p->k is unsigned, so
+	 * we use >= and cast SKF_AD_OFF to unsigned.
 	 */
-	{ "hellcreek", DLT_DEBUG_ONLY },
+	if (p->k >= (bpf_u_int32)SKF_AD_OFF)
+		return 0;
+	if (handle->linktype == DLT_LINUX_SLL2) {
+		/*
+		 * What's the offset?
+		 */
+		if (p->k >= SLL2_HDR_LEN) {
+			/*
+			 * It's within the link-layer payload; that starts
+			 * at an offset of 0, as far as the kernel packet
+			 * filter is concerned, so subtract the length of
+			 * the link-layer header.
+			 */
+			p->k -= SLL2_HDR_LEN;
+		} else if (p->k == 0) {
+			/*
+			 * It's the protocol field; map it to the
+			 * special magic kernel offset for that field.
+			 */
+			p->k = SKF_AD_OFF + SKF_AD_PROTOCOL;
+		} else if (p->k == 4) {
+			/*
+			 * It's the ifindex field; map it to the
+			 * special magic kernel offset for that field.
+			 */
+			p->k = SKF_AD_OFF + SKF_AD_IFINDEX;
+		} else if (p->k == 10) {
+			/*
+			 * It's the packet type field; map it to the
+			 * special magic kernel offset for that field.
+			 */
+			p->k = SKF_AD_OFF + SKF_AD_PKTTYPE;
+		} else if ((bpf_int32)(p->k) > 0) {
+			/*
+			 * It's within the header, but it's not one of
+			 * those fields; we can't do that in the kernel,
+			 * so punt to userland.
+			 */
+			return -1;
+		}
+	} else {
+		/*
+		 * What's the offset?
+		 */
+		if (p->k >= SLL_HDR_LEN) {
+			/*
+			 * It's within the link-layer payload; that starts
+			 * at an offset of 0, as far as the kernel packet
+			 * filter is concerned, so subtract the length of
+			 * the link-layer header.
+			 */
+			p->k -= SLL_HDR_LEN;
+		} else if (p->k == 0) {
+			/*
+			 * It's the packet type field; map it to the
+			 * special magic kernel offset for that field.
+			 */
+			p->k = SKF_AD_OFF + SKF_AD_PKTTYPE;
+		} else if (p->k == 14) {
+			/*
+			 * It's the protocol field; map it to the
+			 * special magic kernel offset for that field.
+			 */
+			p->k = SKF_AD_OFF + SKF_AD_PROTOCOL;
+		} else if ((bpf_int32)(p->k) > 0) {
+			/*
+			 * It's within the header, but it's not one of
+			 * those fields; we can't do that in the kernel,
+			 * so punt to userland.
+			 */
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	/*
-	 * Type 3, with different transmit and receive headers,
-	 * so can't really be handled well with the current
-	 * libpcap API and with pcap files.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ksz.c#L102
-	 */
-	{ "ksz8795", DLT_DEBUG_ONLY },
+/*
+ * How long after a kernel filter is attached a packet that was
+ * time-stamped before then might still turn up in the ring, in
+ * microseconds; until we've seen a packet time-stamped that long
+ * after the filter was attached, we keep checking time stamps.
+ */
+#define FILTER_CUT_MARGIN_US	20000
 
-	/*
-	 * Type 3, with different transmit and receive headers,
-	 * so can't really be handled well with the current
-	 * libpcap API and with pcap files.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ksz.c#L160
-	 */
-	{ "ksz9477", DLT_DEBUG_ONLY },
+/*
+ * Note that the kernel filter that was just attached applies to all
+ * packets time-stamped from now on; packets time-stamped before now
+ * were run through the old filter, so pcap_handle_packet_mmap() runs
+ * them through the new filter in userland.
+ *
+ * The cut has to be the time the filter was attached, not later: a
+ * packet stamped after that has already been through the new filter,
+ * and running it through again in userland would be wrong for a
+ * filter that doesn't give the same answer twice, such as "sample",
+ * which would then sample twice.
+ */
+static void
+set_filter_cut(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct timespec now;
 
-	/*
-	 * Type 3, with different transmit and receive headers,
-	 * so can't really be handled well with the current
-	 * libpcap API and with pcap files.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ksz.c#L341
-	 */
-	{ "ksz9893", DLT_DEBUG_ONLY },
+	(void)clock_gettime(CLOCK_REALTIME, &now);
+	handlep->filter_cut = TP_TS_NS(now.tv_sec, now.tv_nsec);
+	handlep->filter_cut_end = handlep->filter_cut +
+	    (uint64_t)FILTER_CUT_MARGIN_US * 1000;
+	handlep->filter_cut_pending = 1;
+}
 
-	/*
-	 * Type 3, with different transmit and receive headers,
-	 * so can't really be handled well with the current
-	 * libpcap API and with pcap files.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ksz.c#L386
-	 */
-	{ "lan937x", DLT_DEBUG_ONLY },
+static int
+set_kernel_filter(pcap_t *handle, struct sock_fprog *fcode)
+{
+	int total_filter_on = 0;
+	int save_mode;
+	int ret;
+	int save_errno;
 
 	/*
-	 * Type 2, with EtherType 0x8100; the VID can be interpreted
-	 * as per
+	 * Attaching a filter replaces the old one atomically, so,
+	 * if the packets are time-stamped with the host clock, we
+	 * just attach the new filter and note when it took effect.
+	 * Packets that arrive while the filter is being changed are
+	 * then run through one filter or the other, rather than
+	 * being discarded, and the packets in the ring that were
+	 * run through the old filter are recognized by their time
+	 * stamps, and run through the new filter in userland, so
+	 * that none of them are supplied if they don't pass it.
 	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_lan9303.c#L24
-	 */
-	{ "lan9303", DLT_DEBUG_ONLY },
+	 * Time stamps from the adapter can't be compared with the
+	 * host clock, so, for those, we discard what's queued up
+	 * as described below.
+	 */
+	if (handle->opt.tstamp_type != PCAP_TSTAMP_ADAPTER &&
+	    handle->opt.tstamp_type != PCAP_TSTAMP_ADAPTER_UNSYNCED) {
+		ret = setsockopt(handle->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+				 fcode, sizeof(*fcode));
+		if (ret == 0)
+			set_filter_cut(handle);
+		return ret;
+	}
 
 	/*
-	 * Type 2, without an EtherType at the beginning.
+	 * The socket filter code doesn't discard all packets queued
+	 * up on the socket when the filter is changed; this means
+	 * that packets that don't match the new filter may show up
+	 * after the new filter is put onto the socket, if those
+	 * packets haven't yet been read.
 	 *
-	 * See
+	 * This means, for example, that if you do a tcpdump capture
+	 * with a filter, the first few packets in the capture might
+	 * be packets that wouldn't have passed the filter.
 	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_mtk.c#L15
+	 * We therefore discard all packets queued up on the socket
+	 * when setting a kernel filter.  (This isn't an issue for
+	 * userland filters, as the userland filtering is done after
+	 * packets are queued up.)
 	 *
-	 * Linux kernel implements this tag so that it does not indicate the frame
-	 * encoding reliably.  The matter is, some drivers use METADATA_HW_PORT_MUX,
-	 * which (for the switch->CPU direction only, at the time of this writing)
-	 * means that the frame does not have a DSA tag, the frame metadata is stored
-	 * elsewhere and libpcap receives the frame only.  Specifically, this is the
-	 * case for drivers/net/ethernet/mediatek/mtk_eth_soc.c, but the tag visible
-	 * in sysfs is still "mtk" even though the wire encoding is different.
-	 */
-	{ "mtk", DLT_DEBUG_ONLY },
-
-	/*
-	 * Type 1.
+	 * To flush those packets, we put the socket in read-only mode,
+	 * and read packets from the socket until there are no more to
+	 * read.
 	 *
-	 * See
+	 * In order to keep that from being an infinite loop - i.e.,
+	 * to keep more packets from arriving while we're draining
+	 * the queue - we put the "total filter", which is a filter
+	 * that rejects all packets, onto the socket before draining
+	 * the queue.
 	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ocelot.c
+	 * This code deliberately ignores any errors, so that you may
+	 * get bogus packets if an error occurs, rather than having
+	 * the filtering done in userland even if it could have been
+	 * done in the kernel.
 	 */
-	{ "ocelot", DLT_DEBUG_ONLY },
+	if (setsockopt(handle->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+		       &total_fcode, sizeof(total_fcode)) == 0) {
+		char drain[1];
 
-	/*
-	 * Type 1.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_ocelot.c
-	 */
-	{ "seville", DLT_DEBUG_ONLY },
+		/*
+		 * Note that we've put the total filter onto the socket.
+		 */
+		total_filter_on = 1;
+
+		/*
+		 * Save the socket's current mode, and put it in
+		 * non-blocking mode; we drain it by reading packets
+		 * until we get an error (which is normally a
+		 * "nothing more to be read" error).
+		 */
+		save_mode = fcntl(handle->fd, F_GETFL, 0);
+		if (save_mode == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "can't get FD flags when changing filter");
+			return -2;
+		}
+		if (fcntl(handle->fd, F_SETFL, save_mode | O_NONBLOCK) < 0) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "can't set nonblocking mode when changing filter");
+			return -2;
+		}
+		while (recv(handle->fd, &drain, sizeof drain, MSG_TRUNC) >= 0)
+			;
+		save_errno = errno;
+		if (save_errno != EAGAIN) {
+			/*
+			 * Fatal error.
+			 *
+			 * If we can't restore the mode or reset the
+			 * kernel filter, there's nothing we can do.
+			 */
+			(void)fcntl(handle->fd, F_SETFL, save_mode);
+			(void)reset_kernel_filter(handle);
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, save_errno,
+			    "recv failed when changing filter");
+			return -2;
+		}
+		if (fcntl(handle->fd, F_SETFL, save_mode) == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "can't restore FD flags when changing filter");
+			return -2;
+		}
+	}
 
 	/*
-	 * Type 2, with EtherType 0x8100; the VID can be interpreted
-	 * as per
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_8021q.c#L15
+	 * Now attach the new filter.
 	 */
-	{ "ocelot-8021q", DLT_DEBUG_ONLY },
+	ret = setsockopt(handle->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+			 fcode, sizeof(*fcode));
+	if (ret == -1 && total_filter_on) {
+		/*
+		 * Well, we couldn't set that filter on the socket,
+		 * but we could set the total filter on the socket.
+		 *
+		 * This could, for example, mean that the filter was
+		 * too big to put into the kernel, so we'll have to
+		 * filter in userland; in any case, we'll be doing
+		 * filtering in userland, so we need to remove the
+		 * total filter so we see packets.
+		 */
+		save_errno = errno;
+
+		/*
+		 * If this fails, we're really screwed; we have the
+		 * total filter on the socket, and it won't come off.
+		 * Report it as a fatal error.
+		 */
+		if (reset_kernel_filter(handle) == -1) {
+			pcapint_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "can't remove kernel total filter");
+			return -2;	/* fatal error */
+		}
 
+		errno = save_errno;
+	}
+	return ret;
+}
+
+static int
+reset_kernel_filter(pcap_t *handle)
+{
+	int ret;
 	/*
-	 * Type 2, without an EtherType at the beginning.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_qca.c
+	 * setsockopt() barfs unless it get a dummy parameter.
+	 * valgrind whines unless the value is initialized,
+	 * as it has no idea that setsockopt() ignores its
+	 * parameter.
 	 */
-	{ "qca", DLT_DEBUG_ONLY },
+	int dummy = 0;
 
+	ret = setsockopt(handle->fd, SOL_SOCKET, SO_DETACH_FILTER,
+				   &dummy, sizeof(dummy));
 	/*
-	 * Type 2, with EtherType 0x8899, assigned to Realtek;
-	 * they use it for several on-the-Ethernet protocols
-	 * as well, but there are fields that allow the two
-	 * tag formats, and all the protocols in question,
-	 * to be distinguiished from one another.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_rtl4_a.c
-	 *
-	 *    http://realtek.info/pdf/rtl8306sd%28m%29_datasheet_1.1.pdf
+	 * Ignore ENOENT - it means "we don't have a filter", so there
+	 * was no filter to remove, and there's still no filter.
 	 *
-	 * and various pages in tcpdump's print-realtek.c and Wireshark's
-	 * epan/dissectors/packet-realtek.c for the other protocols.
+	 * Also ignore ENONET, as a lot of kernel versions had a
+	 * typo where ENONET, rather than ENOENT, was returned.
 	 */
-	{ "rtl4a", DLT_DEBUG_ONLY },
+	if (ret == -1 && errno != ENOENT && errno != ENONET)
+		return -1;
+	return 0;
+}
 
-	/*
-	 * Type 2, with EtherType 0x8899, assigned to Realtek;
-	 * see above.
-	 */
-	{ "rtl8_4", DLT_DEBUG_ONLY },
+int
+pcap_set_protocol_linux(pcap_t *p, int protocol)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	p->opt.protocol = protocol;
+	return (0);
+}
+
+/*
+ * Have the socket join PACKET_FANOUT group "group_id" when the handle is
+ * activated, so that the packets are spread over the sockets in the
+ * group, which can be in other threads or processes.  "mode" and "flags"
+ * are the PACKET_FANOUT_ mode and PACKET_FANOUT_FLAG_ flags from
+ * <linux/if_packet.h>.
+ */
+int
+pcap_set_fanout(pcap_t *p, int group_id, int mode, int flags)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (group_id < 0 || group_id > 0xffff) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Fanout group ID %d is not between 0 and 65535", group_id);
+		return (PCAP_ERROR);
+	}
+	if (mode < 0 || mode > 0xff || (flags & ~0xff00) != 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Fanout mode %d or flags 0x%x not valid", mode, flags);
+		return (PCAP_ERROR);
+	}
+	p->opt.fanout_group = group_id;
+	p->opt.fanout_type = mode | flags;
+	return (0);
+}
+
+/*
+ * Set the size of the PACKET_TX_RING that pcap_sendqueue_transmit()
+ * copies packets into; 0, the default, means no ring, in which case
+ * the packets are sent one send() at a time.
+ */
+int
+pcap_set_tx_buffer_size(pcap_t *p, int tx_buffer_size)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (tx_buffer_size < 0) {
+		/*
+		 * Silently ignore invalid values.
+		 */
+		return (0);
+	}
+	p->opt.tx_buffer_size = tx_buffer_size;
+	return (0);
+}
+
+/*
+ * Set PACKET_QDISC_BYPASS on the socket when the handle is activated,
+ * so that the packets we send skip the qdisc layer.
+ */
+int
+pcap_set_qdisc_bypass(pcap_t *p, int bypass)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	p->opt.qdisc_bypass = bypass;
+	return (0);
+}
 
-	/*
-	 * Type 3, with the same tag format as rtl8_4.
-	 */
-	{ "rtl8_4t", DLT_DEBUG_ONLY },
+/*
+ * Busy-poll the device, and spin on the ring, for up to "usec"
+ * microseconds when waiting for packets; 0, the default, means don't.
+ * "budget" is the number of packets to process per busy-poll pass, or
+ * 0 for the kernel's default.
+ */
+int
+pcap_set_busy_poll(pcap_t *p, int usec, int budget)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (usec < 0 || budget < 0 || budget > 0xffff) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Busy-poll time %d or budget %d not valid", usec, budget);
+		return (PCAP_ERROR);
+	}
+	p->opt.busy_poll_usec = usec;
+	p->opt.busy_poll_budget = budget;
+	return (0);
+}
 
-	/*
-	 * Type 2, with EtherType 0xe001; that's probably
-	 * self-assigned.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_rzn1_a5psw.c
-	 */
-	{ "a5psw", DLT_DEBUG_ONLY },
+/*
+ * Get the spin/sleep statistics, summed over all of the handle's queues.
+ */
+int
+pcap_busy_poll_stats(pcap_t *p, struct pcap_busy_poll_stat *ps)
+{
+	struct pcap_linux *handlep;
+	pcap_t *qp;
+	int i;
 
-	/*
-	 * Type 2, with EtherType 0x8100 or the self-assigned
-	 * 0xdadb, so this really should have its own
-	 * LINKTYPE_/DLT_ value; that would also allow the
-	 * VID of the tag to be dissected as per
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_8021q.c#L15
-	 */
-	{ "sja1105", DLT_DEBUG_ONLY },
+	if (!p->activated) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle hasn't been activated yet");
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (p->inject_op != pcap_inject_linux) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Busy-poll statistics are only available when capturing on a network interface");
+		return (PCAP_ERROR);
+	}
+	memset(ps, 0, sizeof(*ps));
+	for (i = -1; i < p->nqueues; i++) {
+		qp = i == -1 ? p : p->queues[i];
+		handlep = qp->priv;
+		ps->bps_spin_hits += handlep->bp_stats.bps_spin_hits;
+		ps->bps_sleeps += handlep->bp_stats.bps_sleeps;
+		ps->bps_spin_ns += handlep->bp_stats.bps_spin_ns;
+	}
+	return (0);
+}
 
-	/*
-	 * Type "none of the above", with both a header and trailer,
-	 * with different transmit and receive tags.  Has
-	 * EtherType 0xdadc, which is probably self-assigned.
-	 */
-	{ "sja1110", DLT_DEBUG_ONLY },
+/*
+ * Have the read routines gather statistics on how full the ring is when
+ * we wake up, how full and how old the blocks are when we read them,
+ * and how long the callback takes.
+ */
+int
+pcap_set_ring_stats(pcap_t *p, int enable)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	p->opt.ring_stats = enable != 0;
+	return (0);
+}
 
-	/*
-	 * Type 3, as the name suggests.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_trailer.c
-	 */
-	{ "trailer", DLT_DEBUG_ONLY },
+/*
+ * Get the ring statistics, summed over all of the handle's queues.
+ */
+int
+pcap_ring_stats(pcap_t *p, struct pcap_ring_stat *rs)
+{
+	struct pcap_ring_stat *qrs;
+	pcap_t *qp;
+	int i, j;
+
+	if (!p->activated) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle hasn't been activated yet");
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (p->inject_op != pcap_inject_linux) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Ring statistics are only available when capturing on a network interface");
+		return (PCAP_ERROR);
+	}
+	if (((struct pcap_linux *)p->priv)->ring_stats == NULL) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Ring statistics weren't enabled with pcap_set_ring_stats()");
+		return (PCAP_ERROR);
+	}
+	memset(rs, 0, sizeof(*rs));
+	for (i = -1; i < p->nqueues; i++) {
+		qp = i == -1 ? p : p->queues[i];
+		qrs = ((struct pcap_linux *)qp->priv)->ring_stats;
+		rs->rs_wakeups += qrs->rs_wakeups;
+		rs->rs_empty_wakeups += qrs->rs_empty_wakeups;
+		for (j = 0; j < PCAP_RING_FILL_BUCKETS; j++)
+			rs->rs_fill[j] += qrs->rs_fill[j];
+		rs->rs_blocks += qrs->rs_blocks;
+		rs->rs_callbacks += qrs->rs_callbacks;
+		rs->rs_callback_ns += qrs->rs_callback_ns;
+		if (qrs->rs_callback_max_ns > rs->rs_callback_max_ns)
+			rs->rs_callback_max_ns = qrs->rs_callback_max_ns;
+		for (j = 0; j < PCAP_RING_LOG2_BUCKETS; j++) {
+			rs->rs_block_packets[j] += qrs->rs_block_packets[j];
+			rs->rs_block_age[j] += qrs->rs_block_age[j];
+			rs->rs_callback_time[j] += qrs->rs_callback_time[j];
+		}
+	}
+	return (0);
+}
 
-	/*
-	 * Type 2, with EtherType 0x8100; the VID can be interpreted
-	 * as per
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_8021q.c#L15
-	 */
-	{ "vsc73xx-8021q", DLT_DEBUG_ONLY },
+/*
+ * Use blocks of block_size bytes, and block_count of them, for a
+ * TPACKET_V3 ring, rather than blocks of MAXIMUM_SNAPLEN bytes and
+ * enough of them to make up the buffer size; 0 means "the default".
+ */
+int
+pcap_set_ring_geometry(pcap_t *p, int block_size, int block_count)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (block_size < 0 || block_count < 0 ||
+	    (block_size != 0 && (block_size < getpagesize() ||
+	     (block_size & (block_size - 1)) != 0))) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Block size %d or block count %d not valid", block_size,
+		    block_count);
+		return (PCAP_ERROR);
+	}
+	p->opt.block_size = block_size;
+	p->opt.block_count = block_count;
+	return (0);
+}
 
-	/*
-	 * Type 3.
-	 *
-	 * See
-	 *
-	 *    https://elixir.bootlin.com/linux/v6.13.2/source/net/dsa/tag_xrs700x.c
-	 */
-	{ "xrs700x", DLT_DEBUG_ONLY },
-};
+/*
+ * Set how to deal with packets that the adapter or the kernel has
+ * aggregated from several received segments.
+ */
+int
+pcap_set_offload_flags(pcap_t *p, int flags)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if ((flags & ~(PCAP_OFFLOAD_MTU_FRAMES|PCAP_OFFLOAD_GSO_INFO)) != 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Offload flags 0x%x not valid", flags);
+		return (PCAP_ERROR);
+	}
+	p->opt.offload_flags = flags;
+	return (0);
+}
 
 /*
- * Return 1 if the interface uses DSA tagging, 0 if the interface does not use
- * DSA tagging, or PCAP_ERROR on error.
+ * Have the kernel retire TPACKET_V3 blocks after min_msec milliseconds,
+ * rather than after the packet buffer timeout; if max_msec is larger,
+ * adapt how much longer we wait for blocks to the rate at which they
+ * fill up.  0 for both means "the default".
  */
-static int
-iface_dsa_get_proto_info(const char *device, pcap_t *handle)
+int
+pcap_set_block_timeout(pcap_t *p, int min_msec, int max_msec)
 {
-	char *pathstr;
-	unsigned int i;
-	/*
-	 * Make this significantly smaller than PCAP_ERRBUF_SIZE;
-	 * the tag *shouldn't* have some huge long name, and making
-	 * it smaller keeps newer versions of GCC from whining that
-	 * the error message if we don't support the tag could
-	 * overflow the error message buffer.
-	 */
-	char buf[128];
-	ssize_t r;
-	int fd;
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (min_msec < 0 || max_msec < min_msec ||
+	    (min_msec == 0 && max_msec != 0)) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Block timeout range %d to %d not valid", min_msec,
+		    max_msec);
+		return (PCAP_ERROR);
+	}
+	p->opt.block_timeout_min = min_msec;
+	p->opt.block_timeout_max = max_msec;
+	return (0);
+}
 
-	fd = asprintf(&pathstr, "/sys/class/net/%s/dsa/tagging", device);
-	if (fd < 0) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-					  fd, "asprintf");
-		return PCAP_ERROR;
+/*
+ * Size the ring to hold msec milliseconds of traffic at the link's
+ * line rate; 0 means "just use the buffer size".
+ */
+int
+pcap_set_buffer_duration(pcap_t *p, int msec)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (msec < 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Buffer duration %d not valid", msec);
+		return (PCAP_ERROR);
 	}
+	p->opt.buffer_duration = msec;
+	return (0);
+}
 
-	fd = open(pathstr, O_RDONLY);
-	free(pathstr);
-	/*
-	 * This could be not fatal: kernel >= 4.20 *might* expose this
-	 * attribute.  However, if it exposes the attribute, but the read has
-	 * failed due to another reason (ENFILE, EMFILE, ENOMEM...), propagate
-	 * the failure.
-	 */
-	if (fd < 0) {
-		if (errno == ENOENT)
-			return 0;
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		                             errno, "open");
-		return PCAP_ERROR;
+/*
+ * Get the geometry of the ring that activation set up.
+ */
+int
+pcap_get_ring_geometry(pcap_t *p, struct pcap_ring_geometry *rg)
+{
+	struct pcap_linux *handlep;
+
+	if (!p->activated) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle hasn't been activated yet");
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (p->inject_op != pcap_inject_linux) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Ring geometry is only available when capturing on a network interface");
+		return (PCAP_ERROR);
+	}
+	handlep = p->priv;
+	rg->rg_block_size = handlep->tp_block_size;
+	rg->rg_block_count = handlep->mmapbuflen / handlep->tp_block_size;
+	rg->rg_frame_size = p->bufsize;
+	rg->rg_frame_count = p->cc;
+	rg->rg_link_speed = handlep->link_speed;
+	rg->rg_device_node = handlep->device_node;
+	rg->rg_numa_node = handlep->numa_node;
+	rg->rg_cpu = handlep->cpu;
+	return (0);
+}
+
+/*
+ * Put the ring on a NUMA node - either a given node or the one the
+ * device is attached to.
+ */
+int
+pcap_set_numa_node(pcap_t *p, int node)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (node < 0 && node != PCAP_NUMA_NODE_NONE &&
+	    node != PCAP_NUMA_NODE_DEVICE) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "NUMA node %d not valid", node);
+		return (PCAP_ERROR);
 	}
+	p->opt.numa_node = node;
+	return (0);
+}
 
-	r = read(fd, buf, sizeof(buf) - 1);
-	if (r <= 0) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-					  errno, "read");
-		close(fd);
-		return PCAP_ERROR;
+/*
+ * Pin the thread that reads from the handle to a CPU, or to the CPUs on
+ * the ring's NUMA node.
+ */
+int
+pcap_set_cpu_affinity(pcap_t *p, int cpu)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if ((cpu < 0 && cpu != PCAP_CPU_NONE && cpu != PCAP_CPU_NUMA_NODE) ||
+	    cpu >= CPU_SETSIZE) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "CPU %d not valid", cpu);
+		return (PCAP_ERROR);
 	}
-	close(fd);
+	p->opt.cpu = cpu;
+	return (0);
+}
 
-	/*
-	 * Buffer should be LF terminated.
-	 */
-	if (buf[r - 1] == '\n')
-		r--;
-	buf[r] = '\0';
+/*
+ * Savefile replay.
+ *
+ * Packets are read from the savefile into a send queue, and the queue
+ * is handed to pcap_sendqueue_transmit() - so that, with a transmit
+ * ring, all packets that are due are sent with one system call -
+ * whenever the next packet isn't due yet or the queue is full.
+ */
+#define REPLAY_QUEUE_SIZE	(1024*1024)
 
-	/*
-	 * The string "none" indicates that the interface does not have
-	 * any tagging protocol configured, and is therefore a standard
-	 * Ethernet interface.
-	 */
-	if (strcmp(buf, "none") == 0)
-		return 0;
+/*
+ * With PCAP_REPLAY_TXTIME, packets are handed to the kernel this many
+ * nanoseconds before their launch time.
+ */
+#define REPLAY_TXTIME_LEAD	2000000
 
-	/*
-	 * Every element in the array stands for a DSA-tagged interface.  Using
-	 * DLT_EN10MB (the standard IEEE 802.3 Ethernet) for such an interface
-	 * may seem a good idea at first, but doing so would certainly cause
-	 * major problems in areas that are already complicated and depend on
-	 * DLT_EN10MB meaning the standard IEEE 802.3 Ethernet only, namely:
-	 *
-	 * - live capturing of packets on Linux, and
-	 * - live kernel filtering of packets on Linux, and
-	 * - live userspace filtering of packets on Linux, and
-	 * - offline filtering of packets on all supported OSes, and
-	 * - identification of savefiles on all OSes.
-	 *
-	 * Therefore use a default DLT value that does not block capturing and
-	 * hexdumping of unsupported DSA encodings (in case the tag is not in
-	 * the array) and enforce the non-use of DLT_EN10MB (in case the tag is
-	 * in the array, but is incorrectly declared).
-	 */
-	handle->linktype = DLT_DEBUG_ONLY;
-	for (i = 0; i < sizeof(dsa_protos) / sizeof(dsa_protos[0]); i++) {
-		if (strcmp(buf, dsa_protos[i].name) == 0) {
-			if (dsa_protos[i].linktype != DLT_EN10MB)
-				handle->linktype = dsa_protos[i].linktype;
-			break;
-		}
-	}
-	return 1;
-}
+/*
+ * If there's no event FD to wake us up when pcap_breakloop() is
+ * called, don't sleep for more than this many nanoseconds at a time.
+ */
+#define REPLAY_MAX_SLEEP	100000000
+
+struct replay_state {
+	pcap_t *p;
+	int flags;
+	int timed;		/* non-zero if packets have times to go out */
+	int timerfd;
+	int breakfd;
+	struct timespec start;	/* CLOCK_MONOTONIC time we started */
+	uint64_t txtime_start;	/* CLOCK_TAI time we started, in ns */
+	pcap_send_queue *queue;
+	u_int nqueued;		/* packets in the queue */
+	uint64_t due_first;	/* when the first of them was due */
+	uint64_t due_sum;	/* sum of when they were all due */
+	struct pcap_replay_stat stat;
+	uint64_t late_sum;	/* sum of how late packets were sent */
+};
 
 /*
- *  Query the kernel for the MTU of the given interface.
+ * Nanoseconds since the replay started.
  */
-static int
-iface_get_mtu(int fd, const char *device, char *ebuf)
+static uint64_t
+replay_now(struct replay_state *rs)
 {
-	struct ifreq	ifr;
+	struct timespec now;
 
-	if (!device)
-		return BIGGER_THAN_ALL_MTUS;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)(now.tv_sec - rs->start.tv_sec) * 1000000000 +
+	    (uint64_t)now.tv_nsec - (uint64_t)rs->start.tv_nsec);
+}
 
-	memset(&ifr, 0, sizeof(ifr));
-	pcapint_strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+/*
+ * Wait until "due" nanoseconds after the replay started, either by
+ * spinning or with a timer FD.  Returns 0 when that time comes,
+ * PCAP_ERROR_BREAK if pcap_breakloop() was called, or PCAP_ERROR.
+ */
+static int
+replay_wait(struct replay_state *rs, uint64_t due)
+{
+	struct itimerspec its;
+	struct pollfd pollinfo[2];
+	uint64_t now, until, value;
 
-	if (ioctl(fd, SIOCGIFMTU, &ifr) == -1) {
-		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-		    errno, "SIOCGIFMTU");
-		return -1;
+	for (;;) {
+		if (rs->p->break_loop) {
+			rs->p->break_loop = 0;
+			return (PCAP_ERROR_BREAK);
+		}
+		now = replay_now(rs);
+		if (now >= due)
+			return (0);
+		if (rs->flags & PCAP_REPLAY_BUSY_WAIT)
+			continue;
+
+		until = due;
+		if (rs->breakfd == -1 && until - now > REPLAY_MAX_SLEEP)
+			until = now + REPLAY_MAX_SLEEP;
+		memset(&its, 0, sizeof(its));
+		until += (uint64_t)rs->start.tv_nsec;
+		its.it_value.tv_sec = rs->start.tv_sec +
+		    (time_t)(until / 1000000000);
+		its.it_value.tv_nsec = (long)(until % 1000000000);
+		if (timerfd_settime(rs->timerfd, TFD_TIMER_ABSTIME, &its,
+		    NULL) == -1) {
+			pcapint_fmt_errmsg_for_errno(rs->p->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "timerfd_settime");
+			return (PCAP_ERROR);
+		}
+		pollinfo[0].fd = rs->timerfd;
+		pollinfo[0].events = POLLIN;
+		pollinfo[1].fd = rs->breakfd;
+		pollinfo[1].events = POLLIN;
+		pollinfo[1].revents = 0;
+		if (poll(pollinfo, rs->breakfd == -1 ? 1 : 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			pcapint_fmt_errmsg_for_errno(rs->p->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "poll");
+			return (PCAP_ERROR);
+		}
+DIAG_OFF_WARN_UNUSED_RESULT
+		if (pollinfo[0].revents & POLLIN)
+			(void)read(rs->timerfd, &value, sizeof(value));
+		if (pollinfo[1].revents & POLLIN)
+			(void)read(rs->breakfd, &value, sizeof(value));
+DIAG_ON_WARN_UNUSED_RESULT
 	}
-
-	return ifr.ifr_mtu;
 }
 
 /*
- *  Get the hardware type of the given interface as ARPHRD_xxx constant.
+ * Send the packets in the queue.
  */
 static int
-iface_get_arptype(int fd, const char *device, char *ebuf)
+replay_flush(struct replay_state *rs)
 {
-	struct ifreq	ifr;
-	int		ret;
+	struct pcap_pkthdr h;
+	uint64_t now;
+	u_int sent, off;
 
-	memset(&ifr, 0, sizeof(ifr));
-	pcapint_strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+	if (rs->nqueued == 0)
+		return (0);
+	now = replay_now(rs);
+	sent = pcap_sendqueue_transmit(rs->p, rs->queue, 0);
+	for (off = 0; off < sent; off += (u_int)sizeof(h) + h.caplen) {
+		memcpy(&h, rs->queue->buffer + off, sizeof(h));
+		rs->stat.prs_packets++;
+		rs->stat.prs_bytes += h.caplen;
+	}
 
-	if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1) {
-		if (errno == ENODEV) {
-			/*
-			 * No such device.
-			 *
-			 * There's nothing more to say, so clear
-			 * the error message.
-			 */
-			ret = PCAP_ERROR_NO_SUCH_DEVICE;
-			ebuf[0] = '\0';
-		} else {
-			ret = PCAP_ERROR;
-			pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
-			    errno, "SIOCGIFHWADDR");
-		}
-		return ret;
+	/*
+	 * The packets were all due at or before "now", and the first
+	 * of them is the one that was waiting the longest.
+	 */
+	if (rs->timed) {
+		rs->late_sum += (uint64_t)rs->nqueued * now - rs->due_sum;
+		if (now - rs->due_first > rs->stat.prs_jitter_max_ns)
+			rs->stat.prs_jitter_max_ns = now - rs->due_first;
 	}
 
-	return ifr.ifr_hwaddr.sa_family;
+	rs->nqueued = 0;
+	rs->due_sum = 0;
+	if (sent < rs->queue->len) {
+		rs->queue->len = 0;
+		return (PCAP_ERROR);
+	}
+	rs->queue->len = 0;
+	return (0);
 }
 
 /*
- * In a DLT_CAN_SOCKETCAN frame the first four bytes are a 32-bit integer
- * value in host byte order if the filter program is running in the kernel and
- * in network byte order if in userland.  This applies to both CC, FD and XL
- * frames, see pcap_handle_packet_mmap() for the rationale.  Return 1 iff the
- * [possibly modified] filter program can work correctly in the kernel.
+ * Queue a packet that's due "due" nanoseconds after the replay started,
+ * first sending whatever is already queued and waiting if it's not due
+ * yet.  "*nowp" is a recent reading of replay_now(), to save a clock
+ * read per packet when sending faster than real time.
  */
-#if __BYTE_ORDER == __LITTLE_ENDIAN
 static int
-fix_dlt_can_socketcan(const u_int len, struct bpf_insn insn[])
+replay_queue(struct replay_state *rs, const struct pcap_pkthdr *h,
+    const u_char *data, uint64_t due, uint64_t *nowp)
 {
-	for (u_int i = 0; i < len; ++i) {
-		switch (insn[i].code) {
-		case BPF_LD|BPF_B|BPF_ABS: // ldb [k]
-		case BPF_LDX|BPF_MSH|BPF_B: // ldxb 4*([k]&0xf)
-			if (insn[i].k < 4)
-				insn[i].k = 3 - insn[i].k; // Fixed now.
-			break;
-		case BPF_LD|BPF_H|BPF_ABS: // ldh [k]
-		case BPF_LD|BPF_W|BPF_ABS: // ld [k]
-			/*
-			 * A halfword or a word load cannot be fixed by just
-			 * changing k, even if every required byte is within
-			 * the byte-swapped part of the frame, even if the
-			 * load is aligned.  The fix would require either
-			 * rewriting the filter program extensively or
-			 * generating it differently in the first place.
-			 */
-		case BPF_LD|BPF_B|BPF_IND: // ldb [x + k]
-		case BPF_LD|BPF_H|BPF_IND: // ldh [x + k]
-		case BPF_LD|BPF_W|BPF_IND: // ld [x + k]
-			/*
-			 * In addition to the above, a variable offset load
-			 * cannot be fixed because x can have any value, thus
-			 * x + k can have any value, but only the first four
-			 * bytes are swapped.  An easy way to demonstrate it
-			 * is to compile "link[link[4]] == 0", which will use
-			 * "ldb [x + 0]" to access one of the first four bytes
-			 * of the frame iff CAN CC/FD payload length is less
-			 * than 4.
-			 */
-			if (insn[i].k < 4)
-				return 0; // Userland filtering only.
-			break;
+	int ret;
+
+	if (due > *nowp) {
+		*nowp = replay_now(rs);
+		if (due > *nowp) {
+			if ((ret = replay_flush(rs)) != 0)
+				return (ret);
+			if ((ret = replay_wait(rs, due)) != 0)
+				return (ret);
+			*nowp = due;
 		}
 	}
-	return 1;
-}
-#else
-static int
-fix_dlt_can_socketcan(const u_int len _U_, struct bpf_insn insn[] _U_)
-{
-	return 1;
+	if (rs->queue->len + sizeof(*h) + h->caplen > rs->queue->maxlen) {
+		if ((ret = replay_flush(rs)) != 0)
+			return (ret);
+		if (sizeof(*h) + h->caplen > rs->queue->maxlen) {
+			snprintf(rs->p->errbuf, PCAP_ERRBUF_SIZE,
+			    "%u-byte packet is too big to replay",
+			    h->caplen);
+			return (PCAP_ERROR);
+		}
+	}
+	(void)pcap_sendqueue_queue(rs->queue, h, data);
+	if (rs->nqueued == 0)
+		rs->due_first = due;
+	rs->nqueued++;
+	rs->due_sum += due;
+	return (0);
 }
-#endif // __BYTE_ORDER == __LITTLE_ENDIAN
 
+#if defined(SCM_TXTIME) && defined(CLOCK_TAI)
+/*
+ * Hand a packet to the kernel with an SO_TXTIME launch time of "due"
+ * nanoseconds after the replay started, waiting until shortly before
+ * then.
+ */
 static int
-fix_program(pcap_t *handle, struct sock_fprog *fcode)
+replay_send_txtime(struct replay_state *rs, const struct pcap_pkthdr *h,
+    const u_char *data, uint64_t due)
 {
-	struct pcap_linux *handlep = handle->priv;
-	size_t prog_size;
-	int i;
-	struct bpf_insn *p;
-	struct bpf_insn *f;
-	int len;
+	struct pcap_linux *handlep = rs->p->priv;
+	struct msghdr msg;
+	struct iovec iov[2];
+#ifdef PACKET_VNET_HDR
+	struct virtio_net_hdr vnet_hdr;
+#endif
+	union {
+		char buf[CMSG_SPACE(sizeof(uint64_t))];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	uint64_t txtime, now;
+	int ret;
 
+	if (due > REPLAY_TXTIME_LEAD &&
+	    (ret = replay_wait(rs, due - REPLAY_TXTIME_LEAD)) != 0)
+		return (ret);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+#ifdef PACKET_VNET_HDR
 	/*
-	 * Make a copy of the filter, and modify that copy if
-	 * necessary.
+	 * As in pcap_inject_linux(), precede the packet with an all-zero
+	 * virtio_net header if PACKET_VNET_HDR is on.
 	 */
-	prog_size = sizeof(*handle->fcode.bf_insns) * handle->fcode.bf_len;
-	len = handle->fcode.bf_len;
-	f = (struct bpf_insn *)malloc(prog_size);
-	if (f == NULL) {
-		pcapint_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
-		    errno, "malloc");
-		return -1;
+	if (handlep->vnet_hdr_len != 0) {
+		memset(&vnet_hdr, 0, sizeof(vnet_hdr));
+		iov[msg.msg_iovlen].iov_base = &vnet_hdr;
+		iov[msg.msg_iovlen].iov_len = sizeof(vnet_hdr);
+		msg.msg_iovlen++;
 	}
-	memcpy(f, handle->fcode.bf_insns, prog_size);
-	fcode->len = len;
-	fcode->filter = (struct sock_filter *) f;
+#else
+	(void)handlep;
+#endif
+	iov[msg.msg_iovlen].iov_base = (void *)data;
+	iov[msg.msg_iovlen].iov_len = h->caplen;
+	msg.msg_iovlen++;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+	txtime = rs->txtime_start + due;
+	memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+	if (sendmsg(rs->p->fd, &msg, 0) == -1) {
+		pcapint_fmt_errmsg_for_errno(rs->p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "sendmsg");
+		return (PCAP_ERROR);
+	}
+
+	/*
+	 * A packet handed over before its launch time will be sent on
+	 * time, as far as we can tell.
+	 */
+	now = replay_now(rs);
+	if (rs->timed && now > due) {
+		rs->late_sum += now - due;
+		if (now - due > rs->stat.prs_jitter_max_ns)
+			rs->stat.prs_jitter_max_ns = now - due;
+	}
+	rs->stat.prs_packets++;
+	rs->stat.prs_bytes += h->caplen;
+	return (0);
+}
 
-	switch (handle->linktype) {
-	case DLT_CAN_SOCKETCAN:
-		/*
-		 * If a similar fix needs to be done for CAN frames that
-		 * appear on the "any" pseudo-interface, it needs to be done
-		 * differently because that would be within DLT_LINUX_SLL or
-		 * DLT_LINUX_SLL2.
-		 */
-		return fix_dlt_can_socketcan(len, f);
-	}
+static int
+replay_setup_txtime(struct replay_state *rs)
+{
+	struct pcap_linux *handlep = rs->p->priv;
+	struct sock_txtime txt;
+	struct timespec tai;
 
-	for (i = 0; i < len; ++i) {
-		p = &f[i];
+	if (rs->p->inject_op != pcap_inject_linux) {
+		snprintf(rs->p->errbuf, PCAP_ERRBUF_SIZE,
+		    "SO_TXTIME launch times can only be used when sending on a network interface");
+		return (PCAP_ERROR);
+	}
+	if (handlep->ifindex == -1 || handlep->cooked) {
 		/*
-		 * What type of instruction is this?
+		 * Let pcap_inject_linux() supply the error message.
 		 */
-		switch (BPF_CLASS(p->code)) {
-
-		case BPF_LD:
-		case BPF_LDX:
-			/*
-			 * It's a load instruction; is it loading
-			 * from the packet?
-			 */
-			switch (BPF_MODE(p->code)) {
+		(void)pcap_inject_linux(rs->p, NULL, 0);
+		return (PCAP_ERROR);
+	}
 
-			case BPF_ABS:
-			case BPF_IND:
-			case BPF_MSH:
-				/*
-				 * Yes; are we in cooked mode?
-				 */
-				if (handlep->cooked) {
-					/*
-					 * Yes, so we need to fix this
-					 * instruction.
-					 */
-					if (fix_offset(handle, p) < 0) {
-						/*
-						 * We failed to do so.
-						 * Return 0, so our caller
-						 * knows to punt to userland.
-						 */
-						return 0;
-					}
-				}
-				break;
-			}
-			break;
-		}
+	/*
+	 * The etf queueing discipline, which is what honors launch
+	 * times, uses CLOCK_TAI.
+	 */
+	memset(&txt, 0, sizeof(txt));
+	txt.clockid = CLOCK_TAI;
+	if (setsockopt(rs->p->fd, SOL_SOCKET, SO_TXTIME, &txt,
+	    sizeof(txt)) == -1) {
+		pcapint_fmt_errmsg_for_errno(rs->p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "can't set SO_TXTIME");
+		return (PCAP_ERROR);
 	}
-	return 1;	/* we succeeded */
+	(void)clock_gettime(CLOCK_TAI, &tai);
+	rs->txtime_start = (uint64_t)tai.tv_sec * 1000000000 +
+	    (uint64_t)tai.tv_nsec;
+	return (0);
 }
+#endif /* defined(SCM_TXTIME) && defined(CLOCK_TAI) */
 
-static int
-fix_offset(pcap_t *handle, struct bpf_insn *p)
+/*
+ * Send the packets in the savefile "sf" on "p", "loop" times, or
+ * until pcap_breakloop() is called if "loop" is 0, spaced according
+ * to "speed" and "flags".
+ */
+int
+pcap_replay(pcap_t *p, pcap_t *sf, double speed, int loop, int flags,
+    struct pcap_replay_stat *stat)
 {
-	/*
-	 * Existing references to auxiliary data shouldn't be adjusted.
-	 *
-	 * Note that SKF_AD_OFF is negative, but p->k is unsigned, so
-	 * we use >= and cast SKF_AD_OFF to unsigned.
-	 */
-	if (p->k >= (bpf_u_int32)SKF_AD_OFF)
-		return 0;
-	if (handle->linktype == DLT_LINUX_SLL2) {
-		/*
-		 * What's the offset?
-		 */
-		if (p->k >= SLL2_HDR_LEN) {
-			/*
-			 * It's within the link-layer payload; that starts
-			 * at an offset of 0, as far as the kernel packet
-			 * filter is concerned, so subtract the length of
-			 * the link-layer header.
-			 */
-			p->k -= SLL2_HDR_LEN;
-		} else if (p->k == 0) {
-			/*
-			 * It's the protocol field; map it to the
-			 * special magic kernel offset for that field.
-			 */
-			p->k = SKF_AD_OFF + SKF_AD_PROTOCOL;
-		} else if (p->k == 4) {
-			/*
-			 * It's the ifindex field; map it to the
-			 * special magic kernel offset for that field.
-			 */
-			p->k = SKF_AD_OFF + SKF_AD_IFINDEX;
-		} else if (p->k == 10) {
-			/*
-			 * It's the packet type field; map it to the
-			 * special magic kernel offset for that field.
-			 */
-			p->k = SKF_AD_OFF + SKF_AD_PKTTYPE;
-		} else if ((bpf_int32)(p->k) > 0) {
-			/*
-			 * It's within the header, but it's not one of
-			 * those fields; we can't do that in the kernel,
-			 * so punt to userland.
-			 */
-			return -1;
+	struct replay_state rs;
+	struct pcap_pkthdr *h;
+	const u_char *data;
+	uint64_t ts, pass_ts, pass_due, due, last_due, now, bits;
+	int ts_nano, pass, first, status, ret;
+
+	if (stat != NULL)
+		memset(stat, 0, sizeof(*stat));
+	if (!p->activated) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle hasn't been activated yet");
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (sf->rfile == NULL) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Packets can only be replayed from a savefile");
+		return (PCAP_ERROR);
+	}
+	if ((flags & ~(PCAP_REPLAY_PPS|PCAP_REPLAY_BPS|PCAP_REPLAY_BUSY_WAIT|PCAP_REPLAY_TXTIME)) != 0 ||
+	    (flags & (PCAP_REPLAY_PPS|PCAP_REPLAY_BPS)) ==
+	    (PCAP_REPLAY_PPS|PCAP_REPLAY_BPS)) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Replay flags 0x%x not valid", flags);
+		return (PCAP_ERROR);
+	}
+	if (!(speed >= 0.0) ||
+	    (speed == 0.0 && (flags & (PCAP_REPLAY_PPS|PCAP_REPLAY_BPS)))) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Replay speed %g not valid", speed);
+		return (PCAP_ERROR);
+	}
+	if (loop < 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Replay loop count %d is negative", loop);
+		return (PCAP_ERROR);
+	}
+	if (loop != 1 && sf->rfile_rewind == -1) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "The savefile isn't seekable, so it can only be replayed once");
+		return (PCAP_ERROR);
+	}
+	if ((flags & PCAP_REPLAY_TXTIME) && speed == 0.0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "SO_TXTIME launch times can't be used when sending as fast as possible");
+		return (PCAP_ERROR);
+	}
+#if !defined(SCM_TXTIME) || !defined(CLOCK_TAI)
+	if (flags & PCAP_REPLAY_TXTIME) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "SO_TXTIME isn't supported by this version of libpcap");
+		return (PCAP_ERROR);
+	}
+#endif
+
+	memset(&rs, 0, sizeof(rs));
+	rs.p = p;
+	rs.flags = flags;
+	rs.timed = speed != 0.0;
+	rs.timerfd = -1;
+	rs.breakfd = -1;
+	if (p->inject_op == pcap_inject_linux)
+		rs.breakfd = ((struct pcap_linux *)p->priv)->poll_breakloop_fd;
+	rs.queue = pcap_sendqueue_alloc(REPLAY_QUEUE_SIZE);
+	if (rs.queue == NULL) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    ENOMEM, "malloc");
+		return (PCAP_ERROR);
+	}
+	if (rs.timed && !(flags & PCAP_REPLAY_BUSY_WAIT)) {
+		rs.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (rs.timerfd == -1) {
+			pcapint_fmt_errmsg_for_errno(p->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "timerfd_create");
+			pcap_sendqueue_destroy(rs.queue);
+			return (PCAP_ERROR);
 		}
-	} else {
-		/*
-		 * What's the offset?
-		 */
-		if (p->k >= SLL_HDR_LEN) {
-			/*
-			 * It's within the link-layer payload; that starts
-			 * at an offset of 0, as far as the kernel packet
-			 * filter is concerned, so subtract the length of
-			 * the link-layer header.
-			 */
-			p->k -= SLL_HDR_LEN;
-		} else if (p->k == 0) {
-			/*
-			 * It's the packet type field; map it to the
-			 * special magic kernel offset for that field.
-			 */
-			p->k = SKF_AD_OFF + SKF_AD_PKTTYPE;
-		} else if (p->k == 14) {
-			/*
-			 * It's the protocol field; map it to the
-			 * special magic kernel offset for that field.
-			 */
-			p->k = SKF_AD_OFF + SKF_AD_PROTOCOL;
-		} else if ((bpf_int32)(p->k) > 0) {
+	}
+	ret = 0;
+#if defined(SCM_TXTIME) && defined(CLOCK_TAI)
+	if (flags & PCAP_REPLAY_TXTIME)
+		ret = replay_setup_txtime(&rs);
+#endif
+	(void)clock_gettime(CLOCK_MONOTONIC, &rs.start);
+
+	ts_nano = sf->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO;
+	pass_ts = pass_due = last_due = now = bits = 0;
+	for (pass = 0; ret == 0 && (loop == 0 || pass < loop); pass++) {
+		if (pass != 0 && pcapint_offline_rewind(sf) == -1) {
+			(void)replay_flush(&rs);
+			pcapint_strlcpy(p->errbuf, sf->errbuf,
+			    PCAP_ERRBUF_SIZE);
+			ret = PCAP_ERROR;
+			break;
+		}
+		first = 1;
+		while ((status = pcap_next_ex(sf, &h, &data)) == 1) {
+			if (p->break_loop) {
+				p->break_loop = 0;
+				ret = PCAP_ERROR_BREAK;
+				break;
+			}
+			if (flags & PCAP_REPLAY_PPS) {
+				due = (uint64_t)((double)(rs.stat.prs_packets +
+				    rs.nqueued) * 1e9 / speed);
+			} else if (flags & PCAP_REPLAY_BPS) {
+				due = (uint64_t)((double)bits * 1e9 / speed);
+				bits += (uint64_t)h->caplen * 8;
+			} else if (speed != 0.0) {
+				/*
+				 * Each pass starts when the previous one
+				 * ended; packets with time stamps earlier
+				 * than the ones before them are sent
+				 * straight away.
+				 */
+				ts = (uint64_t)h->ts.tv_sec * 1000000000 +
+				    (uint64_t)h->ts.tv_usec * (ts_nano ? 1 : 1000);
+				if (first) {
+					pass_ts = ts;
+					pass_due = last_due;
+				}
+				due = pass_due + (ts > pass_ts ?
+				    (uint64_t)((double)(ts - pass_ts) / speed) : 0);
+				if (due < last_due)
+					due = last_due;
+			} else
+				due = 0;
+			last_due = due;
+			first = 0;
+
+#if defined(SCM_TXTIME) && defined(CLOCK_TAI)
+			if (flags & PCAP_REPLAY_TXTIME)
+				ret = replay_send_txtime(&rs, h, data, due);
+			else
+#endif
+				ret = replay_queue(&rs, h, data, due, &now);
+			if (ret != 0)
+				break;
+		}
+		if (status == -1) {
+			(void)replay_flush(&rs);
+			pcapint_strlcpy(p->errbuf, sf->errbuf,
+			    PCAP_ERRBUF_SIZE);
+			ret = PCAP_ERROR;
+		}
+		if (first) {
 			/*
-			 * It's within the header, but it's not one of
-			 * those fields; we can't do that in the kernel,
-			 * so punt to userland.
+			 * No packets; don't go round again.
 			 */
-			return -1;
+			break;
 		}
 	}
-	return 0;
+	if (ret != PCAP_ERROR && replay_flush(&rs) != 0)
+		ret = PCAP_ERROR;
+
+	if (stat != NULL) {
+		*stat = rs.stat;
+		stat->prs_elapsed_ns = replay_now(&rs);
+		if (stat->prs_elapsed_ns != 0) {
+			stat->prs_pps = (double)stat->prs_packets * 1e9 /
+			    (double)stat->prs_elapsed_ns;
+			stat->prs_bps = (double)stat->prs_bytes * 8e9 /
+			    (double)stat->prs_elapsed_ns;
+		}
+		if (stat->prs_packets != 0)
+			stat->prs_jitter_avg_ns = rs.late_sum /
+			    stat->prs_packets;
+	}
+	if (rs.timerfd != -1)
+		close(rs.timerfd);
+	pcap_sendqueue_destroy(rs.queue);
+	return (ret);
+}
+
+/*
+ * Capture groups.
+ *
+ * A group has one epoll instance, with the selectable file descriptor of
+ * each of its handles and an eventfd for pcap_group_breakloop() in it.
+ * The handles are put into non-blocking mode, so that dispatching on one
+ * of them never waits; when epoll_wait() says some of them are ready,
+ * each of those gets one pcap_dispatch() call, starting with a different
+ * handle each time, so that a busy handle can't starve the others.
+ */
+struct pcap_group_member {
+	pcap_t		*p;
+	pcap_handler	callback;
+	u_char		*user;
+	int		fd;		/* the handle's selectable descriptor */
+	int		breakloop_fd;	/* the handle's eventfd, or -1 */
+	int		own_breakloop_fd; /* we opened it, and close it */
+	int		was_nonblock;	/* mode to put it back in when removed */
+	int		ready;		/* dispatch on it this time around */
+};
+
+struct pcap_group {
+	int		epoll_fd;
+	int		breakloop_fd;	/* eventfd to wake up epoll_wait() */
+	volatile sig_atomic_t break_loop; /* set by pcap_group_breakloop() */
+	int		dispatching;	/* in pcap_group_dispatch() */
+	struct pcap_group_member **members;
+	int		nmembers;
+	int		maxmembers;
+	int		next;		/* member to dispatch on first */
+	struct epoll_event *events;
+	char		errbuf[PCAP_ERRBUF_SIZE];
+};
+
+pcap_group_t *
+pcap_group_create(char *errbuf)
+{
+	pcap_group_t *g;
+	struct epoll_event ev;
+
+	g = calloc(1, sizeof(*g));
+	if (g == NULL) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (NULL);
+	}
+	g->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (g->epoll_fd == -1) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "epoll_create1");
+		free(g);
+		return (NULL);
+	}
+	g->breakloop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g->breakloop_fd == -1) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "could not open eventfd");
+		close(g->epoll_fd);
+		free(g);
+		return (NULL);
+	}
+
+	/*
+	 * The eventfd is the only thing in the epoll instance with a
+	 * null pointer.
+	 */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, g->breakloop_fd,
+	    &ev) == -1) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "epoll_ctl");
+		close(g->breakloop_fd);
+		close(g->epoll_fd);
+		free(g);
+		return (NULL);
+	}
+	g->events = malloc(sizeof(*g->events));
+	if (g->events == NULL) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		close(g->breakloop_fd);
+		close(g->epoll_fd);
+		free(g);
+		return (NULL);
+	}
+	return (g);
 }
 
+/*
+ * Find a handle in a group; returns its index, or -1 if it's not there.
+ */
 static int
-set_kernel_filter(pcap_t *handle, struct sock_fprog *fcode)
+group_find(pcap_group_t *g, pcap_t *p)
 {
-	int total_filter_on = 0;
-	int save_mode;
-	int ret;
-	int save_errno;
+	int i;
 
-	/*
-	 * The socket filter code doesn't discard all packets queued
-	 * up on the socket when the filter is changed; this means
-	 * that packets that don't match the new filter may show up
-	 * after the new filter is put onto the socket, if those
-	 * packets haven't yet been read.
-	 *
-	 * This means, for example, that if you do a tcpdump capture
-	 * with a filter, the first few packets in the capture might
-	 * be packets that wouldn't have passed the filter.
-	 *
-	 * We therefore discard all packets queued up on the socket
-	 * when setting a kernel filter.  (This isn't an issue for
-	 * userland filters, as the userland filtering is done after
-	 * packets are queued up.)
-	 *
-	 * To flush those packets, we put the socket in read-only mode,
-	 * and read packets from the socket until there are no more to
-	 * read.
-	 *
-	 * In order to keep that from being an infinite loop - i.e.,
-	 * to keep more packets from arriving while we're draining
-	 * the queue - we put the "total filter", which is a filter
-	 * that rejects all packets, onto the socket before draining
-	 * the queue.
-	 *
-	 * This code deliberately ignores any errors, so that you may
-	 * get bogus packets if an error occurs, rather than having
-	 * the filtering done in userland even if it could have been
-	 * done in the kernel.
-	 */
-	if (setsockopt(handle->fd, SOL_SOCKET, SO_ATTACH_FILTER,
-		       &total_fcode, sizeof(total_fcode)) == 0) {
-		char drain[1];
+	for (i = 0; i < g->nmembers; i++) {
+		if (g->members[i]->p == p)
+			return (i);
+	}
+	return (-1);
+}
 
-		/*
-		 * Note that we've put the total filter onto the socket.
-		 */
-		total_filter_on = 1;
+/*
+ * Stop watching a handle, put it back in the mode it was in, and free
+ * its entry; returns -1 if the mode couldn't be put back, with the
+ * error in errbuf.
+ */
+static int
+group_member_cleanup(pcap_group_t *g, struct pcap_group_member *m,
+    char *errbuf)
+{
+	struct pcap_linux *handlep;
+	int ret = 0;
+
+	(void)epoll_ctl(g->epoll_fd, EPOLL_CTL_DEL, m->fd, NULL);
+	if (m->breakloop_fd != -1) {
+		(void)epoll_ctl(g->epoll_fd, EPOLL_CTL_DEL, m->breakloop_fd,
+		    NULL);
+		if (m->own_breakloop_fd) {
+			handlep = m->p->priv;
+			close(handlep->poll_breakloop_fd);
+			handlep->poll_breakloop_fd = -1;
+		}
+	}
+	if (!m->was_nonblock && pcap_setnonblock(m->p, 0, errbuf) == -1)
+		ret = -1;
+	free(m);
+	return (ret);
+}
 
+int
+pcap_group_add(pcap_group_t *g, pcap_t *p, pcap_handler callback,
+    u_char *user)
+{
+	struct pcap_group_member *m, **members;
+	struct epoll_event ev, *events;
+	int maxmembers;
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	if (g->dispatching) {
+		snprintf(g->errbuf, PCAP_ERRBUF_SIZE,
+		    "Handles can't be added to a group from a callback");
+		return (PCAP_ERROR);
+	}
+	if (!p->activated) {
+		snprintf(g->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle hasn't been activated yet");
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (group_find(g, p) != -1) {
+		snprintf(g->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle is already in the group");
+		return (PCAP_ERROR);
+	}
+	if (p->selectable_fd == -1) {
+		snprintf(g->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle has no selectable file descriptor");
+		return (PCAP_ERROR);
+	}
+
+	if (g->nmembers == g->maxmembers) {
+		maxmembers = g->maxmembers == 0 ? 8 : 2 * g->maxmembers;
+		members = realloc(g->members, maxmembers * sizeof(*members));
+		if (members == NULL) {
+			pcapint_fmt_errmsg_for_errno(g->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "malloc");
+			return (PCAP_ERROR);
+		}
+		g->members = members;
 		/*
-		 * Save the socket's current mode, and put it in
-		 * non-blocking mode; we drain it by reading packets
-		 * until we get an error (which is normally a
-		 * "nothing more to be read" error).
+		 * Two for each handle, for its descriptor and its
+		 * eventfd, and one more, for our eventfd.
 		 */
-		save_mode = fcntl(handle->fd, F_GETFL, 0);
-		if (save_mode == -1) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno,
-			    "can't get FD flags when changing filter");
-			return -2;
-		}
-		if (fcntl(handle->fd, F_SETFL, save_mode | O_NONBLOCK) < 0) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno,
-			    "can't set nonblocking mode when changing filter");
-			return -2;
-		}
-		while (recv(handle->fd, &drain, sizeof drain, MSG_TRUNC) >= 0)
-			;
-		save_errno = errno;
-		if (save_errno != EAGAIN) {
-			/*
-			 * Fatal error.
-			 *
-			 * If we can't restore the mode or reset the
-			 * kernel filter, there's nothing we can do.
-			 */
-			(void)fcntl(handle->fd, F_SETFL, save_mode);
-			(void)reset_kernel_filter(handle);
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, save_errno,
-			    "recv failed when changing filter");
-			return -2;
+		events = realloc(g->events,
+		    (2 * maxmembers + 1) * sizeof(*events));
+		if (events == NULL) {
+			pcapint_fmt_errmsg_for_errno(g->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "malloc");
+			return (PCAP_ERROR);
 		}
-		if (fcntl(handle->fd, F_SETFL, save_mode) == -1) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno,
-			    "can't restore FD flags when changing filter");
-			return -2;
+		g->events = events;
+		g->maxmembers = maxmembers;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		pcapint_fmt_errmsg_for_errno(g->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (PCAP_ERROR);
+	}
+	m->p = p;
+	m->callback = callback;
+	m->user = user;
+	m->fd = p->selectable_fd;
+	m->was_nonblock = pcap_getnonblock(p, g->errbuf);
+	if (m->was_nonblock == -1) {
+		free(m);
+		return (PCAP_ERROR);
+	}
+	if (!m->was_nonblock && pcap_setnonblock(p, 1, g->errbuf) == -1) {
+		free(m);
+		return (PCAP_ERROR);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = m;
+	if (epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, m->fd, &ev) == -1) {
+		pcapint_fmt_errmsg_for_errno(g->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "epoll_ctl");
+		if (!m->was_nonblock) {
+DIAG_OFF_WARN_UNUSED_RESULT
+			(void)pcap_setnonblock(p, 0, errbuf);
+DIAG_ON_WARN_UNUSED_RESULT
 		}
+		free(m);
+		return (PCAP_ERROR);
 	}
 
 	/*
-	 * Now attach the new filter.
+	 * pcap_breakloop() on the handle has to wake us up, so watch
+	 * its eventfd as well.  A handle in non-blocking mode doesn't
+	 * have one, so give it one.
 	 */
-	ret = setsockopt(handle->fd, SOL_SOCKET, SO_ATTACH_FILTER,
-			 fcode, sizeof(*fcode));
-	if (ret == -1 && total_filter_on) {
-		/*
-		 * Well, we couldn't set that filter on the socket,
-		 * but we could set the total filter on the socket.
-		 *
-		 * This could, for example, mean that the filter was
-		 * too big to put into the kernel, so we'll have to
-		 * filter in userland; in any case, we'll be doing
-		 * filtering in userland, so we need to remove the
-		 * total filter so we see packets.
-		 */
-		save_errno = errno;
+	m->breakloop_fd = -1;
+	if (p->inject_op == pcap_inject_linux) {
+		struct pcap_linux *handlep = p->priv;
 
-		/*
-		 * If this fails, we're really screwed; we have the
-		 * total filter on the socket, and it won't come off.
-		 * Report it as a fatal error.
-		 */
-		if (reset_kernel_filter(handle) == -1) {
-			pcapint_fmt_errmsg_for_errno(handle->errbuf,
-			    PCAP_ERRBUF_SIZE, errno,
-			    "can't remove kernel total filter");
-			return -2;	/* fatal error */
+		if (handlep->poll_breakloop_fd == -1) {
+			handlep->poll_breakloop_fd = eventfd(0, EFD_NONBLOCK);
+			if (handlep->poll_breakloop_fd == -1) {
+				pcapint_fmt_errmsg_for_errno(g->errbuf,
+				    PCAP_ERRBUF_SIZE, errno,
+				    "could not open eventfd");
+				(void)group_member_cleanup(g, m, errbuf);
+				return (PCAP_ERROR);
+			}
+			m->own_breakloop_fd = m->was_nonblock;
+		}
+		m->breakloop_fd = handlep->poll_breakloop_fd;
+		if (epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, m->breakloop_fd,
+		    &ev) == -1) {
+			pcapint_fmt_errmsg_for_errno(g->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "epoll_ctl");
+			(void)group_member_cleanup(g, m, errbuf);
+			return (PCAP_ERROR);
 		}
+	}
+	g->members[g->nmembers++] = m;
+	return (0);
+}
 
-		errno = save_errno;
+int
+pcap_group_remove(pcap_group_t *g, pcap_t *p)
+{
+	struct pcap_group_member *m;
+	int i, ret;
+
+	if (g->dispatching) {
+		snprintf(g->errbuf, PCAP_ERRBUF_SIZE,
+		    "Handles can't be removed from a group from a callback");
+		return (PCAP_ERROR);
+	}
+	i = group_find(g, p);
+	if (i == -1) {
+		snprintf(g->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle isn't in the group");
+		return (PCAP_ERROR);
+	}
+	m = g->members[i];
+	g->nmembers--;
+	memmove(&g->members[i], &g->members[i + 1],
+	    (g->nmembers - i) * sizeof(*g->members));
+	if (g->next >= g->nmembers)
+		g->next = 0;
+
+	ret = 0;
+	if (group_member_cleanup(g, m, g->errbuf) == -1)
+		ret = PCAP_ERROR;
+	return (ret);
+}
+
+int
+pcap_group_dispatch(pcap_group_t *g, int cnt, int timeout)
+{
+	struct pcap_group_member *m = NULL;
+	const struct timeval *tv;
+	uint64_t value;
+	int i, n, first, status, total;
+	long msec;
+
+	/*
+	 * Handles that have to be looked at every so often, whether
+	 * or not they're ready, such as ones whose interface went
+	 * down, set how long we can sleep.
+	 */
+	for (i = 0; i < g->nmembers; i++) {
+		tv = pcap_get_required_select_timeout(g->members[i]->p);
+		if (tv != NULL) {
+			msec = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+			if (msec > INT_MAX)
+				msec = INT_MAX;
+			if (timeout < 0 || msec < timeout)
+				timeout = (int)msec;
+			g->members[i]->ready = 1;
+		}
 	}
-	return ret;
+
+	n = epoll_wait(g->epoll_fd, g->events, 2 * g->nmembers + 1, timeout);
+	if (n == -1) {
+		if (errno != EINTR) {
+			pcapint_fmt_errmsg_for_errno(g->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "epoll_wait");
+			return (PCAP_ERROR);
+		}
+		n = 0;
+	}
+	for (i = 0; i < n; i++) {
+		m = g->events[i].data.ptr;
+		if (m == NULL) {
+			/*
+			 * pcap_group_breakloop() woke us up; the flag
+			 * says so, so the count doesn't matter.
+			 */
+DIAG_OFF_WARN_UNUSED_RESULT
+			(void)read(g->breakloop_fd, &value, sizeof(value));
+DIAG_ON_WARN_UNUSED_RESULT
+		} else {
+			/*
+			 * Either the handle has packets or pcap_breakloop()
+			 * was called on it; empty the eventfd in case it was
+			 * the latter, and check for that below.
+			 */
+			m->ready = 1;
+			if (m->breakloop_fd != -1) {
+DIAG_OFF_WARN_UNUSED_RESULT
+				(void)read(m->breakloop_fd, &value,
+				    sizeof(value));
+DIAG_ON_WARN_UNUSED_RESULT
+			}
+		}
+	}
+
+	status = 0;
+	total = 0;
+	if (g->break_loop) {
+		g->break_loop = 0;
+		status = PCAP_ERROR_BREAK;
+	} else if (g->nmembers != 0) {
+		g->dispatching = 1;
+		first = g->next;
+		g->next = (first + 1) % g->nmembers;
+		for (i = 0; i < g->nmembers; i++) {
+			m = g->members[(first + i) % g->nmembers];
+			if (!m->ready)
+				continue;
+			m->ready = 0;
+			/*
+			 * We've emptied the handle's eventfd, so, if
+			 * pcap_breakloop() was called on it, its read
+			 * routine might not notice in non-blocking mode.
+			 */
+			if (m->p->break_loop) {
+				m->p->break_loop = 0;
+				status = PCAP_ERROR_BREAK;
+				break;
+			}
+			status = pcap_dispatch(m->p, cnt, m->callback,
+			    m->user);
+			if (status < 0)
+				break;
+			if (total <= INT_MAX - status)
+				total += status;
+		}
+		g->dispatching = 0;
+	}
+	if (status < 0) {
+		/*
+		 * Leave the rest for next time.
+		 */
+		for (i = 0; i < g->nmembers; i++)
+			g->members[i]->ready = 0;
+		if (status == PCAP_ERROR)
+			snprintf(g->errbuf, PCAP_ERRBUF_SIZE, "%s: %s",
+			    m->p->opt.device != NULL ? m->p->opt.device : "",
+			    pcap_geterr(m->p));
+		return (status);
+	}
+	return (total);
 }
 
-static int
-reset_kernel_filter(pcap_t *handle)
+void
+pcap_group_breakloop(pcap_group_t *g)
 {
-	int ret;
-	/*
-	 * setsockopt() barfs unless it get a dummy parameter.
-	 * valgrind whines unless the value is initialized,
-	 * as it has no idea that setsockopt() ignores its
-	 * parameter.
-	 */
-	int dummy = 0;
+	uint64_t value = 1;
 
-	ret = setsockopt(handle->fd, SOL_SOCKET, SO_DETACH_FILTER,
-				   &dummy, sizeof(dummy));
 	/*
-	 * Ignore ENOENT - it means "we don't have a filter", so there
-	 * was no filter to remove, and there's still no filter.
-	 *
-	 * Also ignore ENONET, as a lot of kernel versions had a
-	 * typo where ENONET, rather than ENOENT, was returned.
+	 * This can be called from a signal handler, so just set the
+	 * flag and wake up epoll_wait().
 	 */
-	if (ret == -1 && errno != ENOENT && errno != ENONET)
-		return -1;
-	return 0;
+	g->break_loop = 1;
+DIAG_OFF_WARN_UNUSED_RESULT
+	(void)write(g->breakloop_fd, &value, sizeof(value));
+DIAG_ON_WARN_UNUSED_RESULT
 }
 
-int
-pcap_set_protocol_linux(pcap_t *p, int protocol)
+char *
+pcap_group_geterr(pcap_group_t *g)
 {
-	if (pcapint_check_activated(p))
-		return (PCAP_ERROR_ACTIVATED);
-	p->opt.protocol = protocol;
-	return (0);
+	return (g->errbuf);
+}
+
+void
+pcap_group_close(pcap_group_t *g)
+{
+	struct pcap_group_member *m;
+	int i;
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	for (i = 0; i < g->nmembers; i++) {
+		m = g->members[i];
+		/*
+		 * XXX - pcap_group_close() doesn't have a return value,
+		 * so we can't indicate an error.
+		 */
+		(void)group_member_cleanup(g, m, errbuf);
+	}
+	free(g->members);
+	free(g->events);
+	close(g->breakloop_fd);
+	close(g->epoll_fd);
+	free(g);
 }
 
 /*
@@ -0,0 +1,1075 @@
+/*
+ * Copyright (c) 2026 The Tcpdump Group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The names of the authors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Capture on a single receive queue of a Linux network interface
+ * through an AF_XDP socket.
+ *
+ * The device name is "xdp:<interface>" or "xdp:<interface>:<queue>";
+ * the queue defaults to 0.  On activation we load a minimal XDP
+ * program that redirects the packets arriving on that queue into an
+ * XSKMAP holding our socket, and attach it to the interface in native
+ * mode if the driver supports it and in generic (SKB) mode otherwise,
+ * so this also works on interfaces such as veth devices.
+ *
+ * Packets arrive in a UMEM area that we allocate and share with the
+ * kernel; they are handed to the application where they lie, and
+ * the frame is given back to the kernel through the fill ring once
+ * the callback returns (or, for pcap_next_batch(), once the batch
+ * is released).  The packets that we redirect are not passed up the
+ * networking stack of the host.
+ *
+ * Neither libbpf nor libxdp is required; everything is done with the
+ * bpf() system call and the socket options in <linux/if_xdp.h>.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "pcap-int.h"
+#include "pcap-xdp.h"
+
+#include "diag-control.h"
+
+/*
+ * <linux/bpf.h> has its own struct bpf_insn, which collides with the
+ * one from <pcap/bpf.h>.
+ */
+#define bpf_insn linux_bpf_insn
+#include <linux/bpf.h>
+#undef bpf_insn
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+#define AF_XDP		44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP		283
+#endif
+
+#ifndef HAVE___ATOMIC_LOAD_N
+#define __atomic_load_n(ptr, memory_model)		(*(ptr))
+#endif
+#ifndef HAVE___ATOMIC_STORE_N
+#define __atomic_store_n(ptr, val, memory_model)	*(ptr) = (val)
+#endif
+
+/*
+ * Size of a UMEM frame; every packet is received into, or sent from,
+ * a frame of its own, so this is also the largest packet we can
+ * handle.
+ */
+#define XDP_FRAME_SIZE		2048
+
+/*
+ * Default and minimum number of frames for receiving, and the number
+ * of frames for transmitting.  All of them must be powers of 2, as
+ * they are also the sizes of the rings.
+ */
+#define XDP_RX_FRAMES_DEFAULT	4096
+#define XDP_RX_FRAMES_MIN	64
+#define XDP_TX_FRAMES		256
+
+/*
+ * One of the four rings shared with the kernel; the producer and
+ * consumer indices are free-running, and "mask" turns them into an
+ * index into the ring.
+ */
+struct xdp_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *ring;
+	uint32_t mask;
+	void *map;
+	size_t map_len;
+};
+
+struct pcap_xdp {
+	int ifindex;
+	u_int queue;
+	int map_fd;		/* XSKMAP holding our socket */
+	int prog_fd;		/* redirect program */
+	int link_fd;		/* link attaching it to the interface */
+	u_char *umem;
+	size_t umem_len;
+	u_int rx_frames;
+	struct xdp_ring rx;
+	struct xdp_ring tx;
+	struct xdp_ring fill;
+	struct xdp_ring comp;
+	uint64_t *tx_free;	/* stack of transmit frames not in use */
+	u_int tx_nfree;
+	uint64_t *batch_addrs;	/* frames of the outstanding batch */
+	u_int batch_count;
+	int nonblock;
+	int poll_breakloop_fd;
+	int must_clear_promisc;
+	uint64_t rx_pkts;	/* # of pkts received before the filter */
+};
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Load a program that does
+ *
+ *	return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+ *
+ * so that packets arriving on a queue with a socket in the map go to
+ * that socket, and all other packets go up the stack as usual.
+ */
+static int
+xdp_load_redirect_prog(pcap_t *p, int map_fd)
+{
+	struct linux_bpf_insn insns[] = {
+		/* r2 = ctx->rx_queue_index */
+		{ BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+		  offsetof(struct xdp_md, rx_queue_index), 0 },
+		/* r1 = xsks_map (two-instruction 64-bit load) */
+		{ BPF_LD | BPF_IMM | BPF_DW, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+		  0, map_fd },
+		{ 0, 0, 0, 0, 0 },
+		/* r3 = XDP_PASS */
+		{ BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+		/* r0 = bpf_redirect_map(r1, r2, r3) */
+		{ BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+		/* return r0 */
+		{ BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+	};
+	union bpf_attr attr;
+	int fd, err;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uint64_t)(uintptr_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (uint64_t)(uintptr_t)"Dual BSD/GPL";
+	(void)pcapint_strlcpy(attr.prog_name, "pcap_xsk_redir",
+	    sizeof(attr.prog_name));
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0) {
+		err = errno;
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    err, "Can't load XDP program");
+		return (err == EPERM ? PCAP_ERROR_PERM_DENIED : PCAP_ERROR);
+	}
+	return (fd);
+}
+
+/*
+ * Attach the redirect program to the interface.  Try native mode
+ * first, as it's faster, and fall back on generic mode, which works
+ * with any driver.
+ */
+static int
+xdp_attach_prog(pcap_t *p)
+{
+	struct pcap_xdp *px = p->priv;
+	static const uint32_t modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+	union bpf_attr attr;
+	size_t i;
+	int fd = -1, err;
+
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.link_create.prog_fd = px->prog_fd;
+		attr.link_create.target_ifindex = px->ifindex;
+		attr.link_create.attach_type = BPF_XDP;
+		attr.link_create.flags = modes[i];
+		fd = sys_bpf(BPF_LINK_CREATE, &attr);
+		if (fd >= 0 || errno == EBUSY || errno == EEXIST ||
+		    errno == EPERM)
+			break;
+	}
+	if (fd < 0) {
+		err = errno;
+		if (err == EBUSY || err == EEXIST) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "Another XDP program is already attached to %s",
+			    p->opt.device);
+			return (PCAP_ERROR);
+		}
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    err, "Can't attach XDP program to %s", p->opt.device);
+		return (err == EPERM ? PCAP_ERROR_PERM_DENIED : PCAP_ERROR);
+	}
+	px->link_fd = fd;
+	return (0);
+}
+
+static int
+xdp_create_map(pcap_t *p)
+{
+	struct pcap_xdp *px = p->priv;
+	union bpf_attr attr;
+	uint32_t key, value;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(key);
+	attr.value_size = sizeof(value);
+	attr.max_entries = px->queue + 1;
+	(void)pcapint_strlcpy(attr.map_name, "pcap_xsks",
+	    sizeof(attr.map_name));
+	px->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (px->map_fd < 0) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't create XSKMAP");
+		return (-1);
+	}
+
+	key = px->queue;
+	value = (uint32_t)p->fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = px->map_fd;
+	attr.key = (uint64_t)(uintptr_t)&key;
+	attr.value = (uint64_t)(uintptr_t)&value;
+	attr.flags = BPF_ANY;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't add AF_XDP socket to XSKMAP");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+xdp_map_ring(pcap_t *p, struct xdp_ring *r, const struct xdp_ring_offset *off,
+    u_int entries, size_t entry_size, off_t pgoff, const char *name)
+{
+	u_char *map;
+
+	r->map_len = off->desc + entries * entry_size;
+	map = mmap(NULL, r->map_len, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, p->fd, pgoff);
+	if (map == MAP_FAILED) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't mmap %s ring", name);
+		r->map = NULL;
+		return (-1);
+	}
+	r->map = map;
+	r->producer = (uint32_t *)(map + off->producer);
+	r->consumer = (uint32_t *)(map + off->consumer);
+	r->flags = (uint32_t *)(map + off->flags);
+	r->ring = map + off->desc;
+	r->mask = entries - 1;
+	return (0);
+}
+
+static int
+xdp_set_ring_size(pcap_t *p, int optname, u_int entries, const char *name)
+{
+	if (setsockopt(p->fd, SOL_XDP, optname, &entries,
+	    sizeof(entries)) == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't set %s ring size", name);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Hand frames to the kernel to receive packets into.  As there are
+ * exactly as many slots in the fill ring as there are receive frames,
+ * there's always room.
+ */
+static inline void
+xdp_fill_put(struct xdp_ring *fill, uint32_t *prod, uint64_t addr)
+{
+	((uint64_t *)fill->ring)[*prod & fill->mask] =
+	    addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+	(*prod)++;
+}
+
+static inline void
+xdp_fill_publish(pcap_t *p, uint32_t prod)
+{
+	struct pcap_xdp *px = p->priv;
+
+	__atomic_store_n(px->fill.producer, prod, __ATOMIC_RELEASE);
+	if (__atomic_load_n(px->fill.flags, __ATOMIC_RELAXED) &
+	    XDP_RING_NEED_WAKEUP)
+		(void)recvfrom(p->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+static void
+xdp_breakloop(pcap_t *p)
+{
+	struct pcap_xdp *px = p->priv;
+	uint64_t value = 1;
+
+	pcapint_breakloop_common(p);
+	if (px->poll_breakloop_fd != -1) {
+DIAG_OFF_WARN_UNUSED_RESULT
+		(void)write(px->poll_breakloop_fd, &value, sizeof(value));
+DIAG_ON_WARN_UNUSED_RESULT
+	}
+}
+
+/*
+ * Wait for packets to show up in the receive ring.  Returns the
+ * number of packets available, which can be 0 if the timeout
+ * expired, or PCAP_ERROR or PCAP_ERROR_BREAK.
+ */
+static int
+xdp_wait_for_packets(pcap_t *p)
+{
+	struct pcap_xdp *px = p->priv;
+	struct pollfd pollinfo[2];
+	uint32_t avail;
+	uint64_t value;
+	int timeout;
+
+	for (;;) {
+		if (p->break_loop) {
+			p->break_loop = 0;
+			return (PCAP_ERROR_BREAK);
+		}
+		avail = __atomic_load_n(px->rx.producer, __ATOMIC_ACQUIRE) -
+		    *px->rx.consumer;
+		if (avail != 0)
+			return ((int)avail);
+
+		if (px->nonblock)
+			timeout = 0;
+		else if (p->opt.timeout > 0)
+			timeout = p->opt.timeout;
+		else
+			timeout = -1;
+		pollinfo[0].fd = p->fd;
+		pollinfo[0].events = POLLIN;
+		pollinfo[0].revents = 0;
+		pollinfo[1].fd = px->poll_breakloop_fd;
+		pollinfo[1].events = POLLIN;
+		pollinfo[1].revents = 0;
+		if (poll(pollinfo, 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			pcapint_fmt_errmsg_for_errno(p->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "can't poll on AF_XDP socket");
+			return (PCAP_ERROR);
+		}
+		if (pollinfo[0].revents & POLLERR) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "Error condition on AF_XDP socket");
+			return (PCAP_ERROR);
+		}
+		if (pollinfo[1].revents & POLLIN) {
+DIAG_OFF_WARN_UNUSED_RESULT
+			(void)read(px->poll_breakloop_fd, &value,
+			    sizeof(value));
+DIAG_ON_WARN_UNUSED_RESULT
+			continue;
+		}
+		if (pollinfo[0].revents & POLLIN)
+			continue;
+		if (timeout != -1) {
+			/* Timed out, or non-blocking with nothing there. */
+			return (0);
+		}
+	}
+}
+
+static void
+xdp_get_time(pcap_t *p, struct timeval *tv)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	tv->tv_sec = ts.tv_sec;
+	if (p->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO)
+		tv->tv_usec = ts.tv_nsec;
+	else
+		tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+/*
+ * Fill in the header for a received packet and run the filter over it;
+ * returns 1 if the packet should be handed to the application and
+ * 0 if not.
+ */
+static inline int
+xdp_accept(pcap_t *p, const struct xdp_desc *desc, const u_char *bp,
+    const struct timeval *tv, struct pcap_pkthdr *h)
+{
+	const struct bpf_insn *pc = p->fcode.bf_insns;
+	u_int snaplen = (u_int)p->snapshot; /* guaranteed not to be negative */
+
+	h->ts = *tv;
+	h->len = desc->len;
+	h->caplen = desc->len;
+	if (pc != NULL &&
+	    (snaplen = pcapint_filter(pc, bp, h->len, h->caplen)) == 0)
+		return (0);
+	if (h->caplen > snaplen)
+		h->caplen = snaplen;
+	return (1);
+}
+
+static int
+pcap_xdp_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
+{
+	struct pcap_xdp *px = p->priv;
+	const struct xdp_desc *desc;
+	struct pcap_pkthdr h;
+	struct timeval tv;
+	uint32_t cons, fill_prod;
+	int avail, i, pkts = 0;
+	const u_char *bp;
+
+	avail = xdp_wait_for_packets(p);
+	if (avail <= 0)
+		return (avail);
+
+	/*
+	 * There are no per-packet time stamps with AF_XDP; all the
+	 * packets we pick up in one go get the same time stamp.
+	 */
+	xdp_get_time(p, &tv);
+	cons = *px->rx.consumer;
+	fill_prod = *px->fill.producer;
+	for (i = 0; i < avail && !p->break_loop; i++) {
+		desc = &((const struct xdp_desc *)px->rx.ring)[cons & px->rx.mask];
+		cons++;
+		px->rx_pkts++;
+		bp = px->umem + desc->addr;
+		if (xdp_accept(p, desc, bp, &tv, &h)) {
+			callback(user, &h, bp);
+			pkts++;
+		}
+		/*
+		 * The callback is done with the packet; hand its frame
+		 * back to the kernel.
+		 */
+		xdp_fill_put(&px->fill, &fill_prod, desc->addr);
+		if (!PACKET_COUNT_IS_UNLIMITED(cnt) && pkts >= cnt)
+			break;
+	}
+	__atomic_store_n(px->rx.consumer, cons, __ATOMIC_RELEASE);
+	xdp_fill_publish(p, fill_prod);
+
+	if (p->break_loop) {
+		p->break_loop = 0;
+		return (PCAP_ERROR_BREAK);
+	}
+	return (pkts);
+}
+
+/*
+ * Hand out the packets in the receive ring without copying them; the
+ * frames they're in stay ours until pcap_xdp_release_batch() gives
+ * them back through the fill ring.
+ */
+static int
+pcap_xdp_next_batch(pcap_t *p, struct pcap_pkt_vec *vec, int max)
+{
+	struct pcap_xdp *px = p->priv;
+	const struct xdp_desc *desc;
+	struct timeval tv;
+	uint32_t cons, fill_prod;
+	int avail, i;
+	const u_char *bp;
+
+	if (px->batch_count != 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "The previous batch of packets has not been released");
+		return (PCAP_ERROR);
+	}
+
+	do {
+		avail = xdp_wait_for_packets(p);
+		if (avail <= 0)
+			return (avail);
+		if (avail > max)
+			avail = max;
+
+		xdp_get_time(p, &tv);
+		cons = *px->rx.consumer;
+		fill_prod = *px->fill.producer;
+		for (i = 0; i < avail; i++) {
+			desc = &((const struct xdp_desc *)px->rx.ring)[cons & px->rx.mask];
+			cons++;
+			px->rx_pkts++;
+			bp = px->umem + desc->addr;
+			if (xdp_accept(p, desc, bp, &tv, &vec->hdrs[vec->count])) {
+				vec->data[vec->count++] = bp;
+				px->batch_addrs[px->batch_count++] = desc->addr;
+			} else
+				xdp_fill_put(&px->fill, &fill_prod, desc->addr);
+		}
+		/*
+		 * The descriptors have been copied out, so the slots in the
+		 * receive ring can be reused even while the frames are held.
+		 */
+		__atomic_store_n(px->rx.consumer, cons, __ATOMIC_RELEASE);
+		if (fill_prod != *px->fill.producer)
+			xdp_fill_publish(p, fill_prod);
+	} while (vec->count == 0);
+	return ((int)vec->count);
+}
+
+static void
+pcap_xdp_release_batch(pcap_t *p, struct pcap_pkt_vec *vec _U_)
+{
+	struct pcap_xdp *px = p->priv;
+	uint32_t fill_prod;
+	u_int i;
+
+	if (px->batch_count == 0)
+		return;
+	fill_prod = *px->fill.producer;
+	for (i = 0; i < px->batch_count; i++)
+		xdp_fill_put(&px->fill, &fill_prod, px->batch_addrs[i]);
+	px->batch_count = 0;
+	xdp_fill_publish(p, fill_prod);
+}
+
+/*
+ * Move the frames of packets the kernel has finished sending back
+ * onto the free list.
+ */
+static void
+xdp_reclaim_tx(struct pcap_xdp *px)
+{
+	uint32_t prod, cons;
+
+	prod = __atomic_load_n(px->comp.producer, __ATOMIC_ACQUIRE);
+	cons = *px->comp.consumer;
+	while (cons != prod) {
+		px->tx_free[px->tx_nfree++] =
+		    ((const uint64_t *)px->comp.ring)[cons & px->comp.mask];
+		cons++;
+	}
+	__atomic_store_n(px->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+static int
+xdp_kick_tx(pcap_t *p)
+{
+	if (sendto(p->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 &&
+	    errno != EAGAIN && errno != EBUSY && errno != ENOBUFS &&
+	    errno != ENETDOWN) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "send");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+pcap_xdp_inject(pcap_t *p, const void *buf, int size)
+{
+	struct pcap_xdp *px = p->priv;
+	struct xdp_desc *desc;
+	uint32_t prod;
+	uint64_t addr;
+
+	if (size > XDP_FRAME_SIZE) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "The packet is larger than the AF_XDP frame size of %d",
+		    XDP_FRAME_SIZE);
+		return (PCAP_ERROR);
+	}
+
+	xdp_reclaim_tx(px);
+	if (px->tx_nfree == 0) {
+		/*
+		 * Everything is still queued; get the kernel to send
+		 * something.  In copy mode, that completes synchronously.
+		 */
+		if (xdp_kick_tx(p) == -1)
+			return (PCAP_ERROR);
+		xdp_reclaim_tx(px);
+		if (px->tx_nfree == 0) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "The AF_XDP transmit ring is full");
+			return (PCAP_ERROR);
+		}
+	}
+
+	/*
+	 * There are as many slots in the transmit ring as there are
+	 * transmit frames, so if we have a frame we have a slot.
+	 */
+	addr = px->tx_free[--px->tx_nfree];
+	memcpy(px->umem + addr, buf, size);
+	prod = *px->tx.producer;
+	desc = &((struct xdp_desc *)px->tx.ring)[prod & px->tx.mask];
+	desc->addr = addr;
+	desc->len = (uint32_t)size;
+	desc->options = 0;
+	__atomic_store_n(px->tx.producer, prod + 1, __ATOMIC_RELEASE);
+	if (xdp_kick_tx(p) == -1)
+		return (PCAP_ERROR);
+	return (size);
+}
+
+static int
+pcap_xdp_stats(pcap_t *p, struct pcap_stat *ps)
+{
+	struct pcap_xdp *px = p->priv;
+	struct xdp_statistics st;
+	socklen_t len = sizeof(st);
+
+	/*
+	 * Older kernels don't fill in all of the structure.
+	 */
+	memset(&st, 0, sizeof(st));
+	if (getsockopt(p->fd, SOL_XDP, XDP_STATISTICS, &st, &len) == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "getsockopt: XDP_STATISTICS");
+		return (PCAP_ERROR);
+	}
+	ps->ps_recv = (u_int)px->rx_pkts;
+	ps->ps_drop = (u_int)(st.rx_dropped + st.rx_ring_full +
+	    st.rx_fill_ring_empty_descs);
+	ps->ps_ifdrop = 0;
+	return (0);
+}
+
+static int
+pcap_xdp_getnonblock(pcap_t *p)
+{
+	struct pcap_xdp *px = p->priv;
+
+	return (px->nonblock);
+}
+
+static int
+pcap_xdp_setnonblock(pcap_t *p, int nonblock)
+{
+	struct pcap_xdp *px = p->priv;
+
+	px->nonblock = nonblock;
+	return (0);
+}
+
+static int
+xdp_get_if_flags(pcap_t *p, const char *ifname, short *flags)
+{
+	struct ifreq ifr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "socket");
+		return (-1);
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	(void)pcapint_strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr) == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "SIOCGIFFLAGS on %s", ifname);
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+	*flags = ifr.ifr_flags;
+	return (0);
+}
+
+static int
+xdp_set_if_flags(pcap_t *p, const char *ifname, short flags)
+{
+	struct ifreq ifr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "socket");
+		return (-1);
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	(void)pcapint_strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	ifr.ifr_flags = flags;
+	if (ioctl(fd, SIOCSIFFLAGS, &ifr) == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "SIOCSIFFLAGS on %s", ifname);
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+	return (0);
+}
+
+static void
+xdp_unmap_ring(struct xdp_ring *r)
+{
+	if (r->map != NULL) {
+		munmap(r->map, r->map_len);
+		r->map = NULL;
+	}
+}
+
+static void
+pcap_xdp_cleanup(pcap_t *p)
+{
+	struct pcap_xdp *px = p->priv;
+	char ifname[IF_NAMESIZE];
+	short flags;
+
+	/*
+	 * Closing the link detaches the program from the interface.
+	 */
+	if (px->link_fd != -1) {
+		close(px->link_fd);
+		px->link_fd = -1;
+	}
+	if (px->prog_fd != -1) {
+		close(px->prog_fd);
+		px->prog_fd = -1;
+	}
+	if (px->map_fd != -1) {
+		close(px->map_fd);
+		px->map_fd = -1;
+	}
+	if (px->must_clear_promisc &&
+	    if_indextoname(px->ifindex, ifname) != NULL &&
+	    xdp_get_if_flags(p, ifname, &flags) == 0 &&
+	    (flags & IFF_PROMISC))
+		(void)xdp_set_if_flags(p, ifname, flags & ~IFF_PROMISC);
+	px->must_clear_promisc = 0;
+	xdp_unmap_ring(&px->rx);
+	xdp_unmap_ring(&px->tx);
+	xdp_unmap_ring(&px->fill);
+	xdp_unmap_ring(&px->comp);
+	if (px->umem != NULL) {
+		munmap(px->umem, px->umem_len);
+		px->umem = NULL;
+	}
+	free(px->tx_free);
+	px->tx_free = NULL;
+	free(px->batch_addrs);
+	px->batch_addrs = NULL;
+	if (px->poll_breakloop_fd != -1) {
+		close(px->poll_breakloop_fd);
+		px->poll_breakloop_fd = -1;
+	}
+	pcapint_cleanup_live_common(p);
+}
+
+/*
+ * Split "xdp:<interface>[:<queue>]" into its parts.
+ */
+static int
+xdp_parse_device(pcap_t *p, char *ifname, u_int *queue)
+{
+	const char *name = p->opt.device + 4;
+	const char *colon;
+	size_t len;
+	char *end;
+	unsigned long q = 0;
+
+	colon = strrchr(name, ':');
+	if (colon != NULL) {
+		errno = 0;
+		q = strtoul(colon + 1, &end, 10);
+		if (colon[1] == '\0' || *end != '\0' || errno != 0 ||
+		    q > 65535) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "Invalid queue number in %s", p->opt.device);
+			return (PCAP_ERROR);
+		}
+		len = colon - name;
+	} else
+		len = strlen(name);
+	if (len == 0 || len >= IF_NAMESIZE) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Invalid interface name in %s", p->opt.device);
+		return (PCAP_ERROR_NO_SUCH_DEVICE);
+	}
+	memcpy(ifname, name, len);
+	ifname[len] = '\0';
+	*queue = (u_int)q;
+	return (0);
+}
+
+static int
+pcap_xdp_activate(pcap_t *p)
+{
+	struct pcap_xdp *px = p->priv;
+	char ifname[IF_NAMESIZE];
+	struct xdp_umem_reg mr;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen;
+	uint32_t fill_prod;
+	u_int i;
+	short flags;
+	int status;
+
+	px->map_fd = -1;
+	px->prog_fd = -1;
+	px->link_fd = -1;
+	px->poll_breakloop_fd = -1;
+
+	status = xdp_parse_device(p, ifname, &px->queue);
+	if (status != 0)
+		goto fail;
+	px->ifindex = (int)if_nametoindex(ifname);
+	if (px->ifindex == 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "%s: No such device exists", ifname);
+		status = PCAP_ERROR_NO_SUCH_DEVICE;
+		goto fail;
+	}
+
+	/*
+	 * Turn a negative snapshot value (invalid), a snapshot value of
+	 * 0 (unspecified), or a value bigger than the normal maximum
+	 * value, into the maximum allowed value.
+	 *
+	 * No packet can be bigger than a frame anyway.
+	 */
+	if (p->snapshot <= 0 || p->snapshot > MAXIMUM_SNAPLEN)
+		p->snapshot = MAXIMUM_SNAPLEN;
+
+	/*
+	 * Use the buffer size, if one was specified, to pick the
+	 * number of receive frames; it has to be a power of 2.
+	 */
+	px->rx_frames = XDP_RX_FRAMES_DEFAULT;
+	if (p->opt.buffer_size != 0) {
+		px->rx_frames = XDP_RX_FRAMES_MIN;
+		while (px->rx_frames < 65536 &&
+		    (size_t)px->rx_frames * 2 * XDP_FRAME_SIZE <=
+		    (size_t)p->opt.buffer_size)
+			px->rx_frames *= 2;
+	}
+
+	p->fd = socket(AF_XDP, SOCK_RAW|SOCK_CLOEXEC, 0);
+	if (p->fd == -1) {
+		status = (errno == EPERM || errno == EACCES) ?
+		    PCAP_ERROR_PERM_DENIED : PCAP_ERROR;
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "socket: AF_XDP");
+		goto fail;
+	}
+	status = PCAP_ERROR;
+
+	/*
+	 * Set up the UMEM: the receive frames, followed by the
+	 * transmit frames.
+	 */
+	px->umem_len = (size_t)(px->rx_frames + XDP_TX_FRAMES) * XDP_FRAME_SIZE;
+	px->umem = mmap(NULL, px->umem_len, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (px->umem == MAP_FAILED) {
+		px->umem = NULL;
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't allocate UMEM");
+		goto fail;
+	}
+	memset(&mr, 0, sizeof(mr));
+	mr.addr = (uint64_t)(uintptr_t)px->umem;
+	mr.len = px->umem_len;
+	mr.chunk_size = XDP_FRAME_SIZE;
+	mr.headroom = 0;
+	if (setsockopt(p->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't register UMEM");
+		goto fail;
+	}
+
+	if (xdp_set_ring_size(p, XDP_UMEM_FILL_RING, px->rx_frames, "fill") == -1 ||
+	    xdp_set_ring_size(p, XDP_UMEM_COMPLETION_RING, XDP_TX_FRAMES, "completion") == -1 ||
+	    xdp_set_ring_size(p, XDP_RX_RING, px->rx_frames, "receive") == -1 ||
+	    xdp_set_ring_size(p, XDP_TX_RING, XDP_TX_FRAMES, "transmit") == -1)
+		goto fail;
+
+	optlen = sizeof(off);
+	if (getsockopt(p->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "getsockopt: XDP_MMAP_OFFSETS");
+		goto fail;
+	}
+	if (xdp_map_ring(p, &px->rx, &off.rx, px->rx_frames,
+	        sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, "receive") == -1 ||
+	    xdp_map_ring(p, &px->tx, &off.tx, XDP_TX_FRAMES,
+	        sizeof(struct xdp_desc), XDP_PGOFF_TX_RING, "transmit") == -1 ||
+	    xdp_map_ring(p, &px->fill, &off.fr, px->rx_frames,
+	        sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, "fill") == -1 ||
+	    xdp_map_ring(p, &px->comp, &off.cr, XDP_TX_FRAMES,
+	        sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING, "completion") == -1)
+		goto fail;
+
+	px->tx_free = malloc(XDP_TX_FRAMES * sizeof(*px->tx_free));
+	px->batch_addrs = malloc(px->rx_frames * sizeof(*px->batch_addrs));
+	if (px->tx_free == NULL || px->batch_addrs == NULL) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		goto fail;
+	}
+	for (i = 0; i < XDP_TX_FRAMES; i++)
+		px->tx_free[i] = (uint64_t)(px->rx_frames + i) * XDP_FRAME_SIZE;
+	px->tx_nfree = XDP_TX_FRAMES;
+
+	/*
+	 * Give all the receive frames to the kernel.
+	 */
+	fill_prod = *px->fill.producer;
+	for (i = 0; i < px->rx_frames; i++)
+		xdp_fill_put(&px->fill, &fill_prod, (uint64_t)i * XDP_FRAME_SIZE);
+	__atomic_store_n(px->fill.producer, fill_prod, __ATOMIC_RELEASE);
+
+	/*
+	 * Bind to the queue; the kernel uses zero-copy mode if the
+	 * driver supports it, and copy mode otherwise.
+	 */
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = px->ifindex;
+	sxdp.sxdp_queue_id = px->queue;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+	if (bind(p->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == -1) {
+		if (errno == EINVAL) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "%s has no queue %u", ifname, px->queue);
+		} else {
+			pcapint_fmt_errmsg_for_errno(p->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "bind to %s queue %u",
+			    ifname, px->queue);
+		}
+		goto fail;
+	}
+
+	if (xdp_create_map(p) == -1)
+		goto fail;
+	px->prog_fd = xdp_load_redirect_prog(p, px->map_fd);
+	if (px->prog_fd < 0) {
+		status = px->prog_fd;
+		px->prog_fd = -1;
+		goto fail;
+	}
+	status = xdp_attach_prog(p);
+	if (status != 0)
+		goto fail;
+	status = PCAP_ERROR;
+
+	if (p->opt.promisc) {
+		if (xdp_get_if_flags(p, ifname, &flags) == -1)
+			goto fail;
+		if (!(flags & IFF_PROMISC)) {
+			if (xdp_set_if_flags(p, ifname, flags | IFF_PROMISC) == -1)
+				goto fail;
+			px->must_clear_promisc = 1;
+		}
+	}
+
+	px->poll_breakloop_fd = eventfd(0, EFD_NONBLOCK);
+	if (px->poll_breakloop_fd == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "eventfd");
+		goto fail;
+	}
+
+	p->linktype = DLT_EN10MB;
+	p->selectable_fd = p->fd;
+	p->read_op = pcap_xdp_read;
+	p->next_batch_op = pcap_xdp_next_batch;
+	p->release_batch_op = pcap_xdp_release_batch;
+	p->inject_op = pcap_xdp_inject;
+	p->setfilter_op = pcapint_install_bpf_program;
+	p->setdirection_op = NULL;
+	p->set_datalink_op = NULL;
+	p->getnonblock_op = pcap_xdp_getnonblock;
+	p->setnonblock_op = pcap_xdp_setnonblock;
+	p->stats_op = pcap_xdp_stats;
+	p->breakloop_op = xdp_breakloop;
+	p->cleanup_op = pcap_xdp_cleanup;
+
+	return (0);
+
+fail:
+	pcap_xdp_cleanup(p);
+	return (status);
+}
+
+pcap_t *
+pcap_xdp_create(const char *device, char *ebuf, int *is_ours)
+{
+	pcap_t *p;
+
+	*is_ours = (strncmp(device, "xdp:", 4) == 0);
+	if (! *is_ours)
+		return (NULL);
+	p = PCAP_CREATE_COMMON(ebuf, struct pcap_xdp);
+	if (p == NULL)
+		return (NULL);
+	p->activate_op = pcap_xdp_activate;
+
+	/*
+	 * Time stamps are generated in userland, so we can supply
+	 * them with either precision.
+	 */
+	p->tstamp_precision_list = malloc(2 * sizeof(u_int));
+	if (p->tstamp_precision_list == NULL) {
+		pcapint_fmt_errmsg_for_errno(ebuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		pcap_close(p);
+		return (NULL);
+	}
+	p->tstamp_precision_list[0] = PCAP_TSTAMP_PRECISION_MICRO;
+	p->tstamp_precision_list[1] = PCAP_TSTAMP_PRECISION_NANO;
+	p->tstamp_precision_count = 2;
+	return (p);
+}
+
+/*
+ * An AF_XDP "device" is a queue of a regular network interface, which
+ * is already in the list under its own name, so there's nothing to add.
+ */
+int
+pcap_xdp_findalldevs(pcap_if_list_t *devlistp _U_, char *err_str _U_)
+{
+	return (0);
+}
@@ -0,0 +1,2 @@
+pcap_t *pcap_xdp_create(const char *, char *, int *);
+int pcap_xdp_findalldevs(pcap_if_list_t *devlistp, char *errbuf);
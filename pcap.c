@@ -71,6 +71,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 
 #include "diag-control.h"
 
@@ -112,6 +113,10 @@
 #include "pcap-netmap.h"
 #endif
 
+#ifdef PCAP_SUPPORT_XDP
+#include "pcap-xdp.h"
+#endif
+
 #ifdef PCAP_SUPPORT_DBUS
 #include "pcap-dbus.h"
 #endif
@@ -369,6 +374,14 @@ pcap_stats_not_initialized(pcap_t *pcap, struct pcap_stat *ps _U_)
 	return (PCAP_ERROR_NOT_ACTIVATED);
 }
 
+static u_int
+pcap_sendqueue_transmit_not_initialized(pcap_t *pcap, pcap_send_queue* queue _U_,
+    int sync _U_)
+{
+	pcap_set_not_initialized_message(pcap);
+	return (0);
+}
+
 #ifdef _WIN32
 static struct pcap_stat *
 pcap_stats_ex_not_initialized(pcap_t *pcap, int *pcap_stat_size _U_)
@@ -424,14 +437,6 @@ pcap_oid_set_request_not_initialized(pcap_t *pcap, bpf_u_int32 oid _U_,
 	return (PCAP_ERROR_NOT_ACTIVATED);
 }
 
-static u_int
-pcap_sendqueue_transmit_not_initialized(pcap_t *pcap, pcap_send_queue* queue _U_,
-    int sync _U_)
-{
-	pcap_set_not_initialized_message(pcap);
-	return (0);
-}
-
 static int
 pcap_setuserbuffer_not_initialized(pcap_t *pcap, int size _U_)
 {
@@ -547,6 +552,138 @@ pcapint_oneshot(u_char *user, const struct pcap_pkthdr *h, const u_char *pkt)
 	*sp->pkt = pkt;
 }
 
+/*
+ * State for pcap_setfilter_adaptive().
+ *
+ * While learning, packets are handed to adaptive_observe() rather than
+ * to the caller's callback, which records the length of the link-layer
+ * prefix of each packet and then calls the caller's callback; once
+ * ADAPTIVE_LEARN_PACKETS packets in a row have had the same prefix
+ * length, a filter specialized for that length is installed, and the
+ * read path goes back to calling the caller's callback directly.
+ */
+#define ADAPTIVE_OFF		0	/* not adapting */
+#define ADAPTIVE_LEARNING	1	/* watching prefix lengths */
+#define ADAPTIVE_READY		2	/* prefix length learned, not installed */
+#define ADAPTIVE_SPECIALIZED	3	/* done */
+
+#define ADAPTIVE_LEARN_PACKETS	64
+
+struct pcap_adaptive_filter {
+	int state;
+	char *expr;			/* filter expression */
+	int optimize;
+	bpf_u_int32 netmask;
+	struct bpf_program generic;	/* filter for any prefix length */
+	bpf_u_int32 llprefixlen;	/* prefix length of the current run */
+	u_int run;			/* number of packets in that run */
+	pcap_handler callback;		/* caller's callback and argument */
+	u_char *user;
+};
+
+/*
+ * Get the length of the variable-length prefix preceding the link-layer
+ * header or, for DLT_PFLOG, of the pflog header, as the code generated
+ * by pcap_compile() computes it; returns 0 if the packet is too short
+ * to tell.
+ */
+static int
+llprefixlen_of_packet(int linktype, const u_char *pkt, bpf_u_int32 caplen,
+    bpf_u_int32 *lenp)
+{
+	switch (linktype) {
+
+	case DLT_IEEE802_11_RADIO:
+	case DLT_PPI:
+		if (caplen < 4)
+			return (0);
+		*lenp = pkt[2] | (pkt[3] << 8);
+		return (1);
+
+	case DLT_IEEE802_11_RADIO_AVS:
+		if (caplen < 8)
+			return (0);
+		*lenp = ((bpf_u_int32)pkt[4] << 24) | ((bpf_u_int32)pkt[5] << 16) |
+		    ((bpf_u_int32)pkt[6] << 8) | (bpf_u_int32)pkt[7];
+		return (1);
+
+	case DLT_PFLOG:
+		if (caplen < 1)
+			return (0);
+		*lenp = (pkt[0] + 3U) & ~3U;
+		return (1);
+	}
+	return (0);
+}
+
+static void
+adaptive_observe(u_char *user, const struct pcap_pkthdr *h, const u_char *pkt)
+{
+	pcap_t *p = (pcap_t *)user;
+	struct pcap_adaptive_filter *af = p->adaptive;
+	bpf_u_int32 len;
+
+	if (af->state == ADAPTIVE_LEARNING &&
+	    llprefixlen_of_packet(p->linktype, pkt, h->caplen, &len)) {
+		if (af->run != 0 && len == af->llprefixlen) {
+			if (++af->run >= ADAPTIVE_LEARN_PACKETS)
+				af->state = ADAPTIVE_READY;
+		} else {
+			af->llprefixlen = len;
+			af->run = 1;
+		}
+	}
+	(*af->callback)(af->user, h, pkt);
+}
+
+/*
+ * Install the filter specialized for the learned prefix length.  This
+ * is an optimization, so failing to do it isn't an error; we just keep
+ * using the generic filter.
+ */
+static void
+adaptive_specialize(pcap_t *p)
+{
+	struct pcap_adaptive_filter *af = p->adaptive;
+	struct bpf_program fcode;
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	/*
+	 * Don't clobber any error message from the read.
+	 */
+	pcapint_strlcpy(errbuf, p->errbuf, sizeof(errbuf));
+	af->state = ADAPTIVE_SPECIALIZED;
+	if (pcapint_compile_llprefix_guarded(p, &fcode, af->expr,
+	    af->optimize, af->netmask, af->llprefixlen) == 0) {
+		if (p->setfilter_op(p, &fcode) == -1)
+			(void)p->setfilter_op(p, &af->generic);
+		pcap_freecode(&fcode);
+	}
+	pcapint_strlcpy(p->errbuf, errbuf, PCAP_ERRBUF_SIZE);
+}
+
+/*
+ * Read packets with the given read routine, watching the link-layer
+ * prefix lengths if pcap_setfilter_adaptive() is learning them.
+ */
+static int
+pcap_read_adaptive(pcap_t *p, read_op_t read_op, int cnt,
+    pcap_handler callback, u_char *user)
+{
+	struct pcap_adaptive_filter *af = p->adaptive;
+	int n;
+
+	if (af == NULL || af->state != ADAPTIVE_LEARNING)
+		return (read_op(p, cnt, callback, user));
+
+	af->callback = callback;
+	af->user = user;
+	n = read_op(p, cnt, adaptive_observe, (u_char *)p);
+	if (af->state == ADAPTIVE_READY)
+		adaptive_specialize(p);
+	return (n);
+}
+
 const u_char *
 pcap_next(pcap_t *p, struct pcap_pkthdr *h)
 {
@@ -578,8 +715,8 @@ pcap_next_ex(pcap_t *p, struct pcap_pkthdr **pkt_header,
 		int status;
 
 		/* We are on an offline capture */
-		status = pcapint_offline_read(p, 1, p->oneshot_callback,
-		    (u_char *)&s);
+		status = pcap_read_adaptive(p, pcapint_offline_read, 1,
+		    p->oneshot_callback, (u_char *)&s);
 
 		/*
 		 * Return codes for pcapint_offline_read() are:
@@ -612,7 +749,122 @@ pcap_next_ex(pcap_t *p, struct pcap_pkthdr **pkt_header,
 	 * The first one ('0') conflicts with the return code of 0 from
 	 * pcapint_offline_read() meaning "end of file".
 	*/
-	return (p->read_op(p, 1, p->oneshot_callback, (u_char *)&s));
+	return (pcap_read_adaptive(p, p->read_op, 1, p->oneshot_callback,
+	    (u_char *)&s));
+}
+
+/*
+ * User data structure for the callbacks used for pcap_dispatch_ex().
+ */
+struct dispatch_ex_userdata {
+	pcap_handler_ex callback;
+	u_char *user;
+	pcap_t *pd;
+};
+
+static void
+dispatch_ex_callback(u_char *user, const struct pcap_pkthdr *h,
+    const u_char *pkt)
+{
+	struct dispatch_ex_userdata *sp = (struct dispatch_ex_userdata *)user;
+	struct pcap_pkthdr_ex hdr;
+
+	if (sp->pd->pkthdr_ex_supported) {
+		/*
+		 * The read routine filled in the rest of the header.
+		 */
+		(*sp->callback)(sp->user, (const struct pcap_pkthdr_ex *)h,
+		    pkt);
+		return;
+	}
+
+	/*
+	 * The read routine has no metadata to supply.
+	 */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.hdr = *h;
+	(*sp->callback)(sp->user, &hdr, pkt);
+}
+
+int
+pcap_dispatch_ex(pcap_t *p, int cnt, int flags, pcap_handler_ex callback,
+    u_char *user)
+{
+	struct dispatch_ex_userdata s;
+	int n;
+
+	if (flags & ~PCAP_DISPATCH_EX_NO_VLAN_INSERT) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "pcap_dispatch_ex flags 0x%x not valid", (u_int)flags);
+		return (PCAP_ERROR);
+	}
+	s.callback = callback;
+	s.user = user;
+	s.pd = p;
+	p->dispatch_ex = DISPATCH_EX_ACTIVE | (u_int)flags;
+	n = pcap_read_adaptive(p, p->read_op, cnt, dispatch_ex_callback,
+	    (u_char *)&s);
+	p->dispatch_ex = 0;
+	return (n);
+}
+
+int
+pcap_next_batch(pcap_t *p, struct pcap_pkt_vec *vec, int max)
+{
+	vec->count = 0;
+	if (!p->activated) {
+		pcap_set_not_initialized_message(p);
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (p->next_batch_op == NULL) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Reading batches of packets is not supported on this device");
+		return (PCAP_ERROR);
+	}
+	if (max <= 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Maximum batch size %d is not positive", max);
+		return (PCAP_ERROR);
+	}
+	return (p->next_batch_op(p, vec, max));
+}
+
+void
+pcap_release_batch(pcap_t *p, struct pcap_pkt_vec *vec)
+{
+	if (p->release_batch_op != NULL)
+		p->release_batch_op(p, vec);
+	vec->count = 0;
+}
+
+int
+pcap_hold_packet(pcap_t *p, const u_char *pkt)
+{
+	if (!p->activated) {
+		pcap_set_not_initialized_message(p);
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (p->hold_packet_op == NULL) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Holding packets is not supported on this device");
+		return (PCAP_ERROR);
+	}
+	return (p->hold_packet_op(p, pkt));
+}
+
+int
+pcap_release_packet(pcap_t *p, const u_char *pkt)
+{
+	if (!p->activated) {
+		pcap_set_not_initialized_message(p);
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	}
+	if (p->release_packet_op == NULL) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Holding packets is not supported on this device");
+		return (PCAP_ERROR);
+	}
+	return (p->release_packet_op(p, pkt));
 }
 
 /*
@@ -647,6 +899,9 @@ static struct capture_source_type {
 #ifdef PCAP_SUPPORT_NETMAP
 	{ pcap_netmap_findalldevs, pcap_netmap_create },
 #endif
+#ifdef PCAP_SUPPORT_XDP
+	{ pcap_xdp_findalldevs, pcap_xdp_create },
+#endif
 #ifdef PCAP_SUPPORT_DBUS
 	{ dbus_findalldevs, dbus_create },
 #endif
@@ -1398,6 +1653,87 @@ pcapint_add_any_dev(pcap_if_list_t *devlistp, char *errbuf)
 	    any_descr, errbuf);
 }
 
+/*
+ * Remove and free all the entries in a list of interfaces.
+ */
+void
+pcapint_clear_devlist(pcap_if_list_t *devlistp)
+{
+	if (devlistp->beginning != NULL) {
+		pcap_freealldevs(devlistp->beginning);
+		devlistp->beginning = NULL;
+	}
+}
+
+/*
+ * Allocate an empty list of interfaces.
+ */
+pcap_if_list_t *
+pcapint_alloc_devlist(char *errbuf)
+{
+	pcap_if_list_t *devlistp;
+
+	devlistp = (pcap_if_list_t *)calloc(1, sizeof(*devlistp));
+	if (devlistp == NULL) {
+		pcapint_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (NULL);
+	}
+	return (devlistp);
+}
+
+/*
+ * Free a list of interfaces allocated with pcapint_alloc_devlist(),
+ * along with all its entries.
+ */
+void
+pcapint_free_devlist(pcap_if_list_t *devlistp)
+{
+	pcapint_clear_devlist(devlistp);
+	free(devlistp);
+}
+
+pcap_if_t *
+pcapint_first_dev(pcap_if_list_t *devlistp)
+{
+	return (devlistp->beginning);
+}
+
+/*
+ * Remove an entry from a list of interfaces, without freeing it.
+ */
+void
+pcapint_unlink_dev(pcap_if_list_t *devlistp, pcap_if_t *dev)
+{
+	pcap_if_t **prevp;
+
+	for (prevp = &devlistp->beginning; *prevp != NULL;
+	    prevp = &(*prevp)->next) {
+		if (*prevp == dev) {
+			*prevp = dev->next;
+			dev->next = NULL;
+			return;
+		}
+	}
+}
+
+/*
+ * Append a chain of entries to the end of a list of interfaces;
+ * the list takes ownership of them.  They're not sorted, so they
+ * should already be in the right order relative to each other and
+ * to what's in the list.
+ */
+void
+pcapint_append_devs(pcap_if_list_t *devlistp, pcap_if_t *devs)
+{
+	pcap_if_t **lastp;
+
+	for (lastp = &devlistp->beginning; *lastp != NULL;
+	    lastp = &(*lastp)->next)
+		;
+	*lastp = devs;
+}
+
 /*
  * Free a list of interfaces.
  */
@@ -1563,6 +1899,9 @@ pcap_lookupnet(const char *device, bpf_u_int32 *netp, bpf_u_int32 *maskp,
 #ifdef PCAP_SUPPORT_NETMAP
 	    || strncmp(device, "netmap:", 7) == 0
 	    || strncmp(device, "vale", 4) == 0
+#endif
+#ifdef PCAP_SUPPORT_XDP
+	    || strncmp(device, "xdp:", 4) == 0
 #endif
 	    ) {
 		*netp = *maskp = 0;
@@ -2442,6 +2781,7 @@ initialize_ops(pcap_t *p)
 	p->set_datalink_op = pcap_set_datalink_not_initialized;
 	p->getnonblock_op = pcap_getnonblock_not_initialized;
 	p->stats_op = pcap_stats_not_initialized;
+	p->sendqueue_transmit_op = pcap_sendqueue_transmit_not_initialized;
 #ifdef _WIN32
 	p->stats_ex_op = pcap_stats_ex_not_initialized;
 	p->setbuff_op = pcap_setbuff_not_initialized;
@@ -2450,7 +2790,6 @@ initialize_ops(pcap_t *p)
 	p->getevent_op = pcap_getevent_not_initialized;
 	p->oid_get_request_op = pcap_oid_get_request_not_initialized;
 	p->oid_set_request_op = pcap_oid_set_request_not_initialized;
-	p->sendqueue_transmit_op = pcap_sendqueue_transmit_not_initialized;
 	p->setuserbuffer_op = pcap_setuserbuffer_not_initialized;
 	p->live_dump_op = pcap_live_dump_not_initialized;
 	p->live_dump_ended_op = pcap_live_dump_ended_not_initialized;
@@ -2554,11 +2893,27 @@ pcapint_create_common(char *ebuf, size_t total_size, size_t private_offset)
 	p->opt.immediate = 0;
 	p->opt.tstamp_type = -1;	/* default to not setting time stamp type */
 	p->opt.tstamp_precision = PCAP_TSTAMP_PRECISION_MICRO;
+	p->opt.queues = 1;
 	/*
 	 * Platform-dependent options.
 	 */
 #ifdef __linux__
 	p->opt.protocol = 0;
+	p->opt.fanout_group = -1;
+	p->opt.fanout_type = 0;
+	p->opt.tx_buffer_size = 0;
+	p->opt.qdisc_bypass = 0;
+	p->opt.busy_poll_usec = 0;
+	p->opt.busy_poll_budget = 0;
+	p->opt.block_size = 0;
+	p->opt.block_count = 0;
+	p->opt.block_timeout_min = 0;
+	p->opt.block_timeout_max = 0;
+	p->opt.buffer_duration = 0;
+	p->opt.numa_node = PCAP_NUMA_NODE_NONE;
+	p->opt.cpu = PCAP_CPU_NONE;
+	p->opt.ring_stats = 0;
+	p->opt.offload_flags = 0;
 #endif
 #ifdef _WIN32
 	p->opt.nocapture_local = 0;
@@ -2673,6 +3028,21 @@ pcap_set_immediate_mode(pcap_t *p, int immediate)
 	return (0);
 }
 
+int
+pcap_set_queues(pcap_t *p, int queues)
+{
+	if (pcapint_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (queues <= 0) {
+		/*
+		 * Silently ignore invalid values.
+		 */
+		return (0);
+	}
+	p->opt.queues = queues;
+	return (0);
+}
+
 int
 pcap_set_buffer_size(pcap_t *p, int buffer_size)
 {
@@ -2743,6 +3113,10 @@ pcap_get_tstamp_precision(pcap_t *p)
         return (p->opt.tstamp_precision);
 }
 
+#ifndef _WIN32
+static u_int pcap_sendqueue_transmit_inject(pcap_t *, pcap_send_queue *, int);
+#endif
+
 int
 pcap_activate(pcap_t *p)
 {
@@ -2775,6 +3149,14 @@ pcap_activate(pcap_t *p)
 				return (status);
 			}
 		}
+#ifndef _WIN32
+		/*
+		 * If the module can't send a queue of packets in one
+		 * go, send them one at a time.
+		 */
+		if (p->sendqueue_transmit_op == pcap_sendqueue_transmit_not_initialized)
+			p->sendqueue_transmit_op = pcap_sendqueue_transmit_inject;
+#endif
 		p->activated = 1;
 	} else {
 		if (p->errbuf[0] == '\0') {
@@ -2944,7 +3326,7 @@ pcapint_open_offline_common(char *ebuf, size_t total_size, size_t private_offset
 int
 pcap_dispatch(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 {
-	return (p->read_op(p, cnt, callback, user));
+	return (pcap_read_adaptive(p, p->read_op, cnt, callback, user));
 }
 
 int
@@ -2957,14 +3339,16 @@ pcap_loop(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 			/*
 			 * 0 means EOF, so don't loop if we get 0.
 			 */
-			n = pcapint_offline_read(p, cnt, callback, user);
+			n = pcap_read_adaptive(p, pcapint_offline_read, cnt,
+			    callback, user);
 		} else {
 			/*
 			 * XXX keep reading until we get something
 			 * (or an error occurs)
 			 */
 			do {
-				n = p->read_op(p, cnt, callback, user);
+				n = pcap_read_adaptive(p, p->read_op, cnt,
+				    callback, user);
 			} while (n == 0);
 		}
 		if (n <= 0)
@@ -2983,7 +3367,71 @@ pcap_loop(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 void
 pcap_breakloop(pcap_t *p)
 {
+	int i;
+
 	p->breakloop_op(p);
+	for (i = 0; i < p->nqueues; i++)
+		p->queues[i]->breakloop_op(p->queues[i]);
+}
+
+/*
+ * Return the handle for queue q of p, or NULL, with an error message
+ * in p->errbuf, if there's no such queue.
+ */
+static pcap_t *
+pcap_get_queue(pcap_t *p, int q)
+{
+	if (!p->activated) {
+		pcap_set_not_initialized_message(p);
+		return (NULL);
+	}
+	if (q < 0 || q > p->nqueues) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Queue %d is not between 0 and %d", q, p->nqueues);
+		return (NULL);
+	}
+	if (q == 0)
+		return (p);
+	return (p->queues[q - 1]);
+}
+
+int
+pcap_queue_count(pcap_t *p)
+{
+	if (!p->activated)
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	return (p->nqueues + 1);
+}
+
+int
+pcap_dispatch_queue(pcap_t *p, int q, int cnt, pcap_handler callback,
+    u_char *user)
+{
+	pcap_t *qp;
+	int ret;
+
+	qp = pcap_get_queue(p, q);
+	if (qp == NULL)
+		return (PCAP_ERROR);
+	ret = pcap_dispatch(qp, cnt, callback, user);
+	if (ret == PCAP_ERROR && qp != p)
+		pcapint_strlcpy(p->errbuf, qp->errbuf, PCAP_ERRBUF_SIZE);
+	return (ret);
+}
+
+int
+pcap_stats_queue(pcap_t *p, int q, struct pcap_stat *ps)
+{
+	pcap_t *qp;
+	int ret;
+
+	qp = pcap_get_queue(p, q);
+	if (qp == NULL)
+		return (PCAP_ERROR);
+	ret = qp->stats_op(qp, ps);
+	if (ret != 0 && qp != p)
+		pcapint_strlcpy(p->errbuf, qp->errbuf, PCAP_ERRBUF_SIZE);
+	return (ret);
 }
 
 int
@@ -3055,7 +3503,8 @@ pcap_free_datalinks(int *dlt_list)
 int
 pcap_set_datalink(pcap_t *p, int dlt)
 {
-	int i;
+	int i, j;
+	int old_dlt;
 	const char *dlt_name;
 
 	if (dlt < 0)
@@ -3098,9 +3547,29 @@ pcap_set_datalink(pcap_t *p, int dlt)
 		p->linktype = dlt;
 		return (0);
 	}
+	old_dlt = p->linktype;
 	if (p->set_datalink_op(p, dlt) == -1)
 		return (-1);
 	p->linktype = dlt;
+	for (i = 0; i < p->nqueues; i++) {
+		if (pcap_set_datalink(p->queues[i], dlt) == -1) {
+			/*
+			 * Put the other queues back the way they were,
+			 * so that they all still supply the same
+			 * link-layer type.
+			 */
+			for (j = 0; j < i; j++) {
+				(void)p->queues[j]->set_datalink_op(p->queues[j],
+				    old_dlt);
+				p->queues[j]->linktype = old_dlt;
+			}
+			(void)p->set_datalink_op(p, old_dlt);
+			p->linktype = old_dlt;
+			pcapint_strlcpy(p->errbuf, p->queues[i]->errbuf,
+			    PCAP_ERRBUF_SIZE);
+			return (-1);
+		}
+	}
 	return (0);
 
 unsupported:
@@ -3586,6 +4055,17 @@ pcap_get_selectable_fd(pcap_t *p)
 	return (p->selectable_fd);
 }
 
+int
+pcap_get_queue_selectable_fd(pcap_t *p, int q)
+{
+	pcap_t *qp;
+
+	qp = pcap_get_queue(p, q);
+	if (qp == NULL)
+		return (PCAP_ERROR);
+	return (qp->selectable_fd);
+}
+
 const struct timeval *
 pcap_get_required_select_timeout(pcap_t *p)
 {
@@ -3652,9 +4132,15 @@ pcapint_getnonblock_fd(pcap_t *p)
 int
 pcap_setnonblock(pcap_t *p, int nonblock, char *errbuf)
 {
-	int ret;
+	int ret, i;
 
 	ret = p->setnonblock_op(p, nonblock);
+	for (i = 0; ret != -1 && i < p->nqueues; i++) {
+		ret = p->queues[i]->setnonblock_op(p->queues[i], nonblock);
+		if (ret == -1)
+			pcapint_strlcpy(p->errbuf, p->queues[i]->errbuf,
+			    PCAP_ERRBUF_SIZE);
+	}
 	if (ret == -1) {
 		/*
 		 * The set nonblock operation sets p->errbuf; this
@@ -3935,10 +4421,131 @@ pcapint_get_decuint(const char *cp, char **endptr, unsigned *nump)
 	return (0);
 }
 
+/*
+ * Set the filter on p and on all of its other queues, if it has any.
+ * If that fails on one of the other queues, put the previous filter
+ * back on the queues already changed, so that they all still filter
+ * the same way.
+ */
+static int
+setfilter_all_queues(pcap_t *p, struct bpf_program *fp)
+{
+	struct bpf_insn accept_all[] = {
+		BPF_STMT(BPF_RET|BPF_K, (bpf_u_int32)p->snapshot)
+	};
+	struct bpf_program old;
+	size_t prog_size;
+	int ret, i, j;
+
+	if (p->nqueues == 0)
+		return (p->setfilter_op(p, fp));
+
+	/*
+	 * Save a copy of the current filter; if there isn't one, going
+	 * back to one that accepts every packet is equivalent.
+	 */
+	if (p->fcode.bf_insns != NULL) {
+		prog_size = sizeof(*p->fcode.bf_insns) * p->fcode.bf_len;
+		old.bf_len = p->fcode.bf_len;
+		old.bf_insns = (struct bpf_insn *)malloc(prog_size);
+		if (old.bf_insns == NULL) {
+			pcapint_fmt_errmsg_for_errno(p->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "malloc");
+			return (-1);
+		}
+		memcpy(old.bf_insns, p->fcode.bf_insns, prog_size);
+	} else {
+		old.bf_len = 1;
+		old.bf_insns = accept_all;
+	}
+
+	ret = p->setfilter_op(p, fp);
+	if (ret == 0) {
+		for (i = 0; i < p->nqueues; i++) {
+			if (p->queues[i]->setfilter_op(p->queues[i], fp) == -1) {
+				for (j = 0; j < i; j++)
+					(void)p->queues[j]->setfilter_op(p->queues[j],
+					    &old);
+				(void)p->setfilter_op(p, &old);
+				pcapint_strlcpy(p->errbuf, p->queues[i]->errbuf,
+				    PCAP_ERRBUF_SIZE);
+				ret = -1;
+				break;
+			}
+		}
+	}
+	if (old.bf_insns != accept_all)
+		free(old.bf_insns);
+	return (ret);
+}
+
 int
 pcap_setfilter(pcap_t *p, struct bpf_program *fp)
 {
-	return (p->setfilter_op(p, fp));
+	/*
+	 * This replaces any filter set with pcap_setfilter_adaptive().
+	 */
+	if (p->adaptive != NULL)
+		p->adaptive->state = ADAPTIVE_OFF;
+	return (setfilter_all_queues(p, fp));
+}
+
+int
+pcap_setfilter_adaptive(pcap_t *p, const char *expr, int optimize,
+    bpf_u_int32 netmask)
+{
+	struct pcap_adaptive_filter *af;
+	struct bpf_program fcode;
+	char *expr_copy;
+
+	if (p->adaptive == NULL) {
+		p->adaptive = calloc(1, sizeof(*p->adaptive));
+		if (p->adaptive == NULL) {
+			pcapint_fmt_errmsg_for_errno(p->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "malloc");
+			return (PCAP_ERROR);
+		}
+	}
+	af = p->adaptive;
+	expr_copy = strdup(expr != NULL ? expr : "");
+	if (expr_copy == NULL) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (PCAP_ERROR);
+	}
+	if (pcap_compile(p, &fcode, expr_copy, optimize, netmask) == -1) {
+		free(expr_copy);
+		return (PCAP_ERROR);
+	}
+	af->state = ADAPTIVE_OFF;
+	if (setfilter_all_queues(p, &fcode) == -1) {
+		pcap_freecode(&fcode);
+		free(expr_copy);
+		return (PCAP_ERROR);
+	}
+
+	free(af->expr);
+	af->expr = expr_copy;
+	af->optimize = optimize;
+	af->netmask = netmask;
+	pcap_freecode(&af->generic);
+	af->generic = fcode;
+	af->run = 0;
+
+	/*
+	 * Only link-layer types with a variable-length prefix can
+	 * benefit; for everything else this is just pcap_setfilter().
+	 */
+	switch (p->linktype) {
+
+	case DLT_IEEE802_11_RADIO:
+	case DLT_IEEE802_11_RADIO_AVS:
+	case DLT_PPI:
+	case DLT_PFLOG:
+		af->state = ADAPTIVE_LEARNING;
+		break;
+	}
+	return (0);
 }
 
 /*
@@ -3950,6 +4557,9 @@ pcap_setfilter(pcap_t *p, struct bpf_program *fp)
 int
 pcap_setdirection(pcap_t *p, pcap_direction_t d)
 {
+	int ret, i, j;
+	pcap_direction_t old_d;
+
 	if (p->setdirection_op == NULL) {
 		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
 		    "Setting direction is not supported on this device");
@@ -3963,7 +4573,28 @@ pcap_setdirection(pcap_t *p, pcap_direction_t d)
 			/*
 			 * Valid direction.
 			 */
-			return (p->setdirection_op(p, d));
+			old_d = p->direction;
+			ret = p->setdirection_op(p, d);
+			if (ret != 0)
+				return (ret);
+			for (i = 0; i < p->nqueues; i++) {
+				if (p->queues[i]->setdirection_op(p->queues[i],
+				    d) == -1) {
+					/*
+					 * Put the queues already changed
+					 * back the way they were.
+					 */
+					for (j = 0; j < i; j++)
+						(void)p->queues[j]->setdirection_op(
+						    p->queues[j], old_d);
+					(void)p->setdirection_op(p, old_d);
+					pcapint_strlcpy(p->errbuf,
+					    p->queues[i]->errbuf,
+					    PCAP_ERRBUF_SIZE);
+					return (-1);
+				}
+			}
+			return (0);
 
 		default:
 			/*
@@ -3979,50 +4610,27 @@ pcap_setdirection(pcap_t *p, pcap_direction_t d)
 int
 pcap_stats(pcap_t *p, struct pcap_stat *ps)
 {
-	return (p->stats_op(p, ps));
-}
+	struct pcap_stat qs;
+	int ret, i;
 
-#ifdef _WIN32
-struct pcap_stat *
-pcap_stats_ex(pcap_t *p, int *pcap_stat_size)
-{
-	return (p->stats_ex_op(p, pcap_stat_size));
-}
-
-int
-pcap_setbuff(pcap_t *p, int dim)
-{
-	return (p->setbuff_op(p, dim));
-}
+	ret = p->stats_op(p, ps);
+	if (ret != 0)
+		return (ret);
 
-int
-pcap_setmode(pcap_t *p, int mode)
-{
-	return (p->setmode_op(p, mode));
-}
-
-int
-pcap_setmintocopy(pcap_t *p, int size)
-{
-	return (p->setmintocopy_op(p, size));
-}
-
-HANDLE
-pcap_getevent(pcap_t *p)
-{
-	return (p->getevent_op(p));
-}
-
-int
-pcap_oid_get_request(pcap_t *p, bpf_u_int32 oid, void *data, size_t *lenp)
-{
-	return (p->oid_get_request_op(p, oid, data, lenp));
-}
-
-int
-pcap_oid_set_request(pcap_t *p, bpf_u_int32 oid, const void *data, size_t *lenp)
-{
-	return (p->oid_set_request_op(p, oid, data, lenp));
+	/*
+	 * Add up the statistics for all queues, except for ps_ifdrop,
+	 * which counts drops by the interface that they all share.
+	 */
+	for (i = 0; i < p->nqueues; i++) {
+		if (p->queues[i]->stats_op(p->queues[i], &qs) == -1) {
+			pcapint_strlcpy(p->errbuf, p->queues[i]->errbuf,
+			    PCAP_ERRBUF_SIZE);
+			return (-1);
+		}
+		ps->ps_recv += qs.ps_recv;
+		ps->ps_drop += qs.ps_drop;
+	}
+	return (0);
 }
 
 pcap_send_queue *
@@ -4080,6 +4688,134 @@ pcap_sendqueue_transmit(pcap_t *p, pcap_send_queue *queue, int sync)
 	return (p->sendqueue_transmit_op(p, queue, sync));
 }
 
+#ifndef _WIN32
+/*
+ * For pcap_sendqueue_transmit() with "sync" set: the time, in
+ * nanoseconds after the first packet of the queue went out, at which
+ * the packet with the header "h" should go out, going by the time
+ * stamps, which are in the handle's time stamp precision.
+ */
+uint64_t
+pcapint_sendqueue_due(pcap_t *p, const struct pcap_pkthdr *first,
+    const struct pcap_pkthdr *h)
+{
+	int64_t sec, frac;
+
+	sec = (int64_t)h->ts.tv_sec - (int64_t)first->ts.tv_sec;
+	frac = (int64_t)h->ts.tv_usec - (int64_t)first->ts.tv_usec;
+	if (p->opt.tstamp_precision != PCAP_TSTAMP_PRECISION_NANO)
+		frac *= 1000;
+	frac += sec * 1000000000;
+	return (frac > 0 ? (uint64_t)frac : 0);
+}
+
+/*
+ * Return 1 if it's at least "due" nanoseconds after "start" on the
+ * monotonic clock.  If it isn't, return 0 if "block" is zero, and
+ * otherwise sleep until it is and return 1.
+ */
+int
+pcapint_sendqueue_wait(const struct timespec *start, uint64_t due, int block)
+{
+	struct timespec now, ts;
+	uint64_t elapsed;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000 +
+	    (uint64_t)now.tv_nsec - (uint64_t)start->tv_nsec;
+	if (elapsed >= due)
+		return (1);
+	if (!block)
+		return (0);
+	due -= elapsed;
+	ts.tv_sec = (time_t)(due / 1000000000);
+	ts.tv_nsec = (long)(due % 1000000000);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	return (1);
+}
+
+/*
+ * pcap_sendqueue_transmit() for capture mechanisms with no way of
+ * sending more than one packet at a time: hand the packets to
+ * pcap_inject() one by one.
+ */
+static u_int
+pcap_sendqueue_transmit_inject(pcap_t *p, pcap_send_queue *queue, int sync)
+{
+	struct pcap_pkthdr first, h;
+	struct timespec start;
+	u_int off = 0;
+
+	while (queue->len - off >= sizeof(h)) {
+		memcpy(&h, queue->buffer + off, sizeof(h));
+		if (h.caplen > queue->len - off - sizeof(h)) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "Packet at offset %u runs past the end of the send queue",
+			    off);
+			break;
+		}
+		if (sync) {
+			if (off == 0) {
+				first = h;
+				(void)clock_gettime(CLOCK_MONOTONIC, &start);
+			} else {
+				(void)pcapint_sendqueue_wait(&start,
+				    pcapint_sendqueue_due(p, &first, &h), 1);
+			}
+		}
+		if (p->inject_op(p, queue->buffer + off + sizeof(h),
+		    (int)h.caplen) < 0)
+			break;
+		off += (u_int)sizeof(h) + h.caplen;
+	}
+	return (off);
+}
+#endif /* _WIN32 */
+
+#ifdef _WIN32
+struct pcap_stat *
+pcap_stats_ex(pcap_t *p, int *pcap_stat_size)
+{
+	return (p->stats_ex_op(p, pcap_stat_size));
+}
+
+int
+pcap_setbuff(pcap_t *p, int dim)
+{
+	return (p->setbuff_op(p, dim));
+}
+
+int
+pcap_setmode(pcap_t *p, int mode)
+{
+	return (p->setmode_op(p, mode));
+}
+
+int
+pcap_setmintocopy(pcap_t *p, int size)
+{
+	return (p->setmintocopy_op(p, size));
+}
+
+HANDLE
+pcap_getevent(pcap_t *p)
+{
+	return (p->getevent_op(p));
+}
+
+int
+pcap_oid_get_request(pcap_t *p, bpf_u_int32 oid, void *data, size_t *lenp)
+{
+	return (p->oid_get_request_op(p, oid, data, lenp));
+}
+
+int
+pcap_oid_set_request(pcap_t *p, bpf_u_int32 oid, const void *data, size_t *lenp)
+{
+	return (p->oid_set_request_op(p, oid, data, lenp));
+}
+
 int
 pcap_setuserbuffer(pcap_t *p, int size)
 {
@@ -4255,6 +4991,15 @@ pcapint_cleanup_live_common(pcap_t *p)
 		p->tstamp_precision_count = 0;
 	}
 	pcap_freecode(&p->fcode);
+	if (p->queues != NULL) {
+		int i;
+
+		for (i = 0; i < p->nqueues; i++)
+			pcap_close(p->queues[i]);
+		free(p->queues);
+		p->queues = NULL;
+		p->nqueues = 0;
+	}
 #if !defined(_WIN32)
 	if (p->fd >= 0) {
 		close(p->fd);
@@ -4325,6 +5070,11 @@ pcap_close(pcap_t *p)
 		free(p->opt.device);
 		p->opt.device = NULL;
 	}
+	if (p->adaptive != NULL) {
+		free(p->adaptive->expr);
+		pcap_freecode(&p->adaptive->generic);
+		free(p->adaptive);
+	}
 	free(p);
 }
 
@@ -4521,6 +5271,15 @@ pcap_stats_dead(pcap_t *p, struct pcap_stat *ps _U_)
 	return (-1);
 }
 
+static u_int
+pcap_sendqueue_transmit_dead(pcap_t *p, pcap_send_queue *queue _U_,
+    int sync _U_)
+{
+	snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+	    "Packets cannot be transmitted on a pcap_open_dead pcap_t");
+	return (0);
+}
+
 #ifdef _WIN32
 static struct pcap_stat *
 pcap_stats_ex_dead(pcap_t *p, int *pcap_stat_size _U_)
@@ -4580,15 +5339,6 @@ pcap_oid_set_request_dead(pcap_t *p, bpf_u_int32 oid _U_, const void *data _U_,
 	return (PCAP_ERROR);
 }
 
-static u_int
-pcap_sendqueue_transmit_dead(pcap_t *p, pcap_send_queue *queue _U_,
-    int sync _U_)
-{
-	snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
-	    "Packets cannot be transmitted on a pcap_open_dead pcap_t");
-	return (0);
-}
-
 static int
 pcap_setuserbuffer_dead(pcap_t *p, int size _U_)
 {
@@ -4658,6 +5408,7 @@ pcap_open_dead_with_tstamp_precision(int linktype, int snaplen, u_int precision)
 	p->getnonblock_op = pcap_getnonblock_dead;
 	p->setnonblock_op = pcap_setnonblock_dead;
 	p->stats_op = pcap_stats_dead;
+	p->sendqueue_transmit_op = pcap_sendqueue_transmit_dead;
 #ifdef _WIN32
 	p->stats_ex_op = pcap_stats_ex_dead;
 	p->setbuff_op = pcap_setbuff_dead;
@@ -4666,7 +5417,6 @@ pcap_open_dead_with_tstamp_precision(int linktype, int snaplen, u_int precision)
 	p->getevent_op = pcap_getevent_dead;
 	p->oid_get_request_op = pcap_oid_get_request_dead;
 	p->oid_set_request_op = pcap_oid_set_request_dead;
-	p->sendqueue_transmit_op = pcap_sendqueue_transmit_dead;
 	p->setuserbuffer_op = pcap_setuserbuffer_dead;
 	p->live_dump_op = pcap_live_dump_dead;
 	p->live_dump_ended_op = pcap_live_dump_ended_dead;
@@ -316,6 +316,65 @@ struct pcap_stat {
 #endif /* _WIN32 */
 };
 
+/*
+ * A batch of packets, as returned by pcap_next_batch().  The caller
+ * supplies the two arrays, each with room for at least as many entries
+ * as the maximum batch size passed to pcap_next_batch().
+ */
+struct pcap_pkt_vec {
+	u_int count;			/* number of packets in the batch */
+	struct pcap_pkthdr *hdrs;	/* their headers */
+	const u_char **data;		/* their data */
+};
+
+/*
+ * Extended packet header, as supplied by pcap_dispatch_ex().  It starts
+ * with the usual packet header, followed by metadata that the capture
+ * mechanism supplied along with the packet; pkh_flags indicates which
+ * of the metadata fields are valid.
+ */
+struct pcap_pkthdr_ex {
+	struct pcap_pkthdr hdr;	/* time stamp and lengths */
+	bpf_u_int32 pkh_flags;	/* PCAP_PKTHDR_EX_ flags */
+	bpf_u_int32 pkh_ifindex; /* index of the interface it arrived on */
+	bpf_u_int32 pkh_rxhash;	/* flow hash computed by the OS or adapter */
+	uint16_t pkh_pkttype;	/* OS's packet type, e.g. Linux PACKET_HOST */
+	uint16_t pkh_protocol;	/* link-layer protocol type */
+	uint16_t pkh_vlan_tci;	/* VLAN tag control information */
+	uint16_t pkh_vlan_tpid;	/* VLAN tag protocol identifier */
+	uint64_t pkh_ts_ns;	/* time stamp, in nanoseconds since the Epoch */
+	uint16_t pkh_gso_type;	/* PCAP_GSO_ type, if it was aggregated */
+	uint16_t pkh_gso_size;	/* size of the segments it was aggregated from */
+	bpf_u_int32 pkh_gso_segs; /* number of segments it was aggregated from */
+};
+
+#define PCAP_PKTHDR_EX_IFINDEX		0x00000001	/* pkh_ifindex is valid */
+#define PCAP_PKTHDR_EX_PKTTYPE		0x00000002	/* pkh_pkttype is valid */
+#define PCAP_PKTHDR_EX_PROTOCOL		0x00000004	/* pkh_protocol is valid */
+#define PCAP_PKTHDR_EX_VLAN		0x00000008	/* pkh_vlan_tci and pkh_vlan_tpid are valid */
+#define PCAP_PKTHDR_EX_VLAN_IN_DATA	0x00000010	/* that VLAN tag is also in the packet data */
+#define PCAP_PKTHDR_EX_RXHASH		0x00000020	/* pkh_rxhash is valid */
+#define PCAP_PKTHDR_EX_TS_SOFTWARE	0x00000040	/* time stamp is from the host */
+#define PCAP_PKTHDR_EX_TS_HARDWARE	0x00000080	/* time stamp is from the adapter */
+#define PCAP_PKTHDR_EX_TS_NS		0x00000100	/* pkh_ts_ns is valid */
+#define PCAP_PKTHDR_EX_GSO		0x00000200	/* pkh_gso_type, pkh_gso_size and pkh_gso_segs are valid */
+
+/*
+ * Values for pkh_gso_type; these are the virtio_net header's
+ * VIRTIO_NET_HDR_GSO_ values.
+ */
+#define PCAP_GSO_NONE		0	/* not aggregated */
+#define PCAP_GSO_TCPV4		1	/* TCP over IPv4 */
+#define PCAP_GSO_UDP		3	/* UDP, fragmented */
+#define PCAP_GSO_TCPV6		4	/* TCP over IPv6 */
+#define PCAP_GSO_UDP_L4		5	/* UDP, segmented */
+#define PCAP_GSO_ECN		0x80	/* TCP segments had CWR set */
+
+/*
+ * Flags for pcap_dispatch_ex().
+ */
+#define PCAP_DISPATCH_EX_NO_VLAN_INSERT	0x00000001	/* leave stripped VLAN tags out of the data */
+
 /*
  * Item in a list of interfaces.
  */
@@ -350,6 +409,8 @@ struct pcap_addr {
 
 typedef void (*pcap_handler)(u_char *, const struct pcap_pkthdr *,
 			     const u_char *);
+typedef void (*pcap_handler_ex)(u_char *, const struct pcap_pkthdr_ex *,
+			     const u_char *);
 
 /*
  * Error codes for the pcap API.
@@ -449,6 +510,9 @@ PCAP_API int	pcap_set_immediate_mode(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
 PCAP_AVAILABLE_1_0
 PCAP_API int	pcap_set_buffer_size(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
 
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_queues(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
 PCAP_AVAILABLE_1_5
 PCAP_API int	pcap_set_tstamp_precision(pcap_t *, int)
 	    PCAP_WARN_UNUSED_RESULT;
@@ -477,6 +541,136 @@ PCAP_API const char *pcap_tstamp_type_val_to_description(int);
 #ifdef __linux__
 PCAP_AVAILABLE_1_9
 PCAP_API int	pcap_set_protocol_linux(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_fanout(pcap_t *, int, int, int) PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_tx_buffer_size(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_qdisc_bypass(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_busy_poll(pcap_t *, int, int) PCAP_WARN_UNUSED_RESULT;
+
+/*
+ * As returned by pcap_busy_poll_stats().
+ */
+struct pcap_busy_poll_stat {
+	uint64_t bps_spin_hits;	/* waits ended by a packet while spinning */
+	uint64_t bps_sleeps;	/* waits that went on to sleep in poll() */
+	uint64_t bps_spin_ns;	/* time spent spinning */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_busy_poll_stats(pcap_t *, struct pcap_busy_poll_stat *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_ring_stats(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
+/*
+ * As returned by pcap_ring_stats().
+ *
+ * rs_fill[0] counts wakeups with nothing in the ring, and rs_fill[i]
+ * counts wakeups with more than (i-1)/10 and at most i/10 of the ring
+ * ready to read.  The other histograms have power-of-2 buckets:
+ * bucket i counts values from 2^i up to 2^(i+1)-1, bucket 0 also
+ * counts 0, and the last bucket also counts everything bigger.
+ */
+#define PCAP_RING_FILL_BUCKETS	11
+#define PCAP_RING_LOG2_BUCKETS	24
+
+struct pcap_ring_stat {
+	uint64_t rs_wakeups;	/* waits in poll() that ended */
+	uint64_t rs_empty_wakeups; /* ...with nothing in the ring */
+	uint64_t rs_fill[PCAP_RING_FILL_BUCKETS]; /* wakeups, by fill level */
+	uint64_t rs_blocks;	/* TPACKET_V3 blocks read */
+	uint64_t rs_block_packets[PCAP_RING_LOG2_BUCKETS]; /* blocks, by packets in them */
+	uint64_t rs_block_age[PCAP_RING_LOG2_BUCKETS]; /* blocks, by age in microseconds when read */
+	uint64_t rs_callbacks;	/* callback calls */
+	uint64_t rs_callback_ns; /* time spent in the callback */
+	uint64_t rs_callback_max_ns; /* longest callback call */
+	uint64_t rs_callback_time[PCAP_RING_LOG2_BUCKETS]; /* callback calls, by time in nanoseconds */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_ring_stats(pcap_t *, struct pcap_ring_stat *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_ring_geometry(pcap_t *, int, int) PCAP_WARN_UNUSED_RESULT;
+
+/*
+ * Flags for pcap_set_offload_flags().
+ */
+#define PCAP_OFFLOAD_MTU_FRAMES	0x00000001	/* size frames for the MTU even with offloads on */
+#define PCAP_OFFLOAD_GSO_INFO	0x00000002	/* report what aggregated packets were made from */
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_offload_flags(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_block_timeout(pcap_t *, int, int) PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_buffer_duration(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
+/*
+ * Values for pcap_set_numa_node() other than a node number.
+ */
+#define PCAP_NUMA_NODE_NONE	-1	/* let the kernel place the ring */
+#define PCAP_NUMA_NODE_DEVICE	-2	/* the node the device is attached to */
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_numa_node(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
+/*
+ * Values for pcap_set_cpu_affinity() other than a CPU number.
+ */
+#define PCAP_CPU_NONE		-1	/* don't pin the reading thread */
+#define PCAP_CPU_NUMA_NODE	-2	/* any CPU on the ring's NUMA node */
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_cpu_affinity(pcap_t *, int) PCAP_WARN_UNUSED_RESULT;
+
+/*
+ * As returned by pcap_get_ring_geometry().
+ */
+struct pcap_ring_geometry {
+	u_int	rg_block_size;	/* size of a ring block, in bytes */
+	u_int	rg_block_count;	/* number of blocks in the ring */
+	u_int	rg_frame_size;	/* size of a frame, in bytes */
+	u_int	rg_frame_count;	/* number of frames in the ring */
+	u_int	rg_link_speed;	/* link speed used to size the ring, in Mb/s */
+	int	rg_device_node;	/* NUMA node of the device, or -1 if not known */
+	int	rg_numa_node;	/* NUMA node the ring was put on, or -1 */
+	int	rg_cpu;		/* CPU the reading thread is pinned to, or PCAP_CPU_ */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_get_ring_geometry(pcap_t *, struct pcap_ring_geometry *);
+
+/*
+ * As returned by pcap_stats64(); ps64_flags says which of the counts
+ * are supplied.
+ */
+struct pcap_stat64 {
+	bpf_u_int32 ps64_flags;	/* PCAP_STAT64_ flags */
+	uint64_t ps64_recv;	/* packets received, as for ps_recv */
+	uint64_t ps64_drop;	/* packets dropped because the ring was full */
+	uint64_t ps64_ifdrop;	/* packets dropped by the interface */
+	uint64_t ps64_freeze_q;	/* times the ring was full and the kernel froze it */
+	uint64_t ps64_filtered;	/* packets rejected by filtering in userland */
+};
+
+#define PCAP_STAT64_RECV	0x00000001
+#define PCAP_STAT64_DROP	0x00000002
+#define PCAP_STAT64_IFDROP	0x00000004
+#define PCAP_STAT64_FREEZE_Q	0x00000008
+#define PCAP_STAT64_FILTERED	0x00000010
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_stats64(pcap_t *, struct pcap_stat64 *);
 #endif
 
 /*
@@ -605,9 +799,38 @@ PCAP_API const u_char *pcap_next(pcap_t *, struct pcap_pkthdr *);
 PCAP_AVAILABLE_0_8
 PCAP_API int	pcap_next_ex(pcap_t *, struct pcap_pkthdr **, const u_char **);
 
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_dispatch_ex(pcap_t *, int, int, pcap_handler_ex, u_char *)
+	    PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_next_batch(pcap_t *, struct pcap_pkt_vec *, int)
+	    PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_release_batch(pcap_t *, struct pcap_pkt_vec *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_hold_packet(pcap_t *, const u_char *)
+	    PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_release_packet(pcap_t *, const u_char *);
+
 PCAP_AVAILABLE_0_8
 PCAP_API void	pcap_breakloop(pcap_t *);
 
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_queue_count(pcap_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_dispatch_queue(pcap_t *, int, int, pcap_handler, u_char *)
+	    PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_stats_queue(pcap_t *, int, struct pcap_stat *)
+	    PCAP_WARN_UNUSED_RESULT;
+
 PCAP_AVAILABLE_0_4
 PCAP_API int	pcap_stats(pcap_t *, struct pcap_stat *)
 	    PCAP_WARN_UNUSED_RESULT;
@@ -616,6 +839,10 @@ PCAP_AVAILABLE_0_4
 PCAP_API int	pcap_setfilter(pcap_t *, struct bpf_program *)
 	     PCAP_WARN_UNUSED_RESULT;
 
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_setfilter_adaptive(pcap_t *, const char *, int,
+	    bpf_u_int32) PCAP_WARN_UNUSED_RESULT;
+
 PCAP_AVAILABLE_0_9
 PCAP_API int	pcap_setdirection(pcap_t *, pcap_direction_t)
 	     PCAP_WARN_UNUSED_RESULT;
@@ -811,19 +1038,6 @@ PCAP_API const char *pcap_lib_version(void);
    * Win32 definitions
    */
 
-  /*!
-    \brief A queue of raw packets that will be sent to the network with pcap_sendqueue_transmit().
-  */
-  struct pcap_send_queue
-  {
-	u_int maxlen;	/* Maximum size of the queue, in bytes. This
-			   variable contains the size of the buffer field. */
-	u_int len;	/* Current size of the queue, in bytes. */
-	char *buffer;	/* Buffer containing the packets to be sent. */
-  };
-
-  typedef struct pcap_send_queue pcap_send_queue;
-
   /*!
     \brief This typedef is a support for the pcap_get_airpcap_handle() function
 */
@@ -846,14 +1060,6 @@ PCAP_API const char *pcap_lib_version(void);
   PCAP_API int pcap_oid_set_request(pcap_t *, bpf_u_int32, const void *,
 	    size_t *) PCAP_WARN_UNUSED_RESULT;
 
-  PCAP_API pcap_send_queue* pcap_sendqueue_alloc(u_int memsize);
-
-  PCAP_API void pcap_sendqueue_destroy(pcap_send_queue* queue);
-
-  PCAP_API int pcap_sendqueue_queue(pcap_send_queue* queue, const struct pcap_pkthdr *pkt_header, const u_char *pkt_data);
-
-  PCAP_API u_int pcap_sendqueue_transmit(pcap_t *p, pcap_send_queue* queue, int sync);
-
   PCAP_API struct pcap_stat *pcap_stats_ex(pcap_t *p, int *pcap_stat_size);
 
   PCAP_API int pcap_setuserbuffer(pcap_t *p, int size) PCAP_WARN_UNUSED_RESULT;
@@ -882,11 +1088,143 @@ PCAP_API const char *pcap_lib_version(void);
   PCAP_AVAILABLE_0_8
   PCAP_API int	pcap_get_selectable_fd(pcap_t *);
 
+  PCAP_AVAILABLE_1_11
+  PCAP_API int	pcap_get_queue_selectable_fd(pcap_t *, int);
+
   PCAP_AVAILABLE_1_9
   PCAP_API const struct timeval *pcap_get_required_select_timeout(pcap_t *);
 
 #endif /* _WIN32/UN*X */
 
+/*
+ * Send queues.  These were added in WinPcap, and became available on
+ * other platforms in libpcap 1.11.
+ */
+
+/*!
+  \brief A queue of raw packets that will be sent to the network with pcap_sendqueue_transmit().
+*/
+struct pcap_send_queue
+{
+	u_int maxlen;	/* Maximum size of the queue, in bytes. This
+			   variable contains the size of the buffer field. */
+	u_int len;	/* Current size of the queue, in bytes. */
+	char *buffer;	/* Buffer containing the packets to be sent. */
+};
+
+typedef struct pcap_send_queue pcap_send_queue;
+
+#ifdef _WIN32
+  /*
+   * These have always been available on Windows.
+   */
+  PCAP_API pcap_send_queue* pcap_sendqueue_alloc(u_int memsize);
+
+  PCAP_API void pcap_sendqueue_destroy(pcap_send_queue* queue);
+
+  PCAP_API int pcap_sendqueue_queue(pcap_send_queue* queue, const struct pcap_pkthdr *pkt_header, const u_char *pkt_data);
+
+  PCAP_API u_int pcap_sendqueue_transmit(pcap_t *p, pcap_send_queue* queue, int sync);
+#else /* _WIN32 */
+PCAP_AVAILABLE_1_11
+PCAP_API pcap_send_queue* pcap_sendqueue_alloc(u_int memsize);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void pcap_sendqueue_destroy(pcap_send_queue* queue);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int pcap_sendqueue_queue(pcap_send_queue* queue, const struct pcap_pkthdr *pkt_header, const u_char *pkt_data);
+
+PCAP_AVAILABLE_1_11
+PCAP_API u_int pcap_sendqueue_transmit(pcap_t *p, pcap_send_queue* queue, int sync);
+#endif /* _WIN32 */
+
+#ifdef __linux__
+/*
+ * Savefile replay.
+ *
+ * By default, the "speed" argument to pcap_replay() scales the gaps
+ * between the packets' time stamps (2.0 sends twice as fast as the
+ * packets were captured), and 0 sends them as fast as possible; with
+ * PCAP_REPLAY_PPS or PCAP_REPLAY_BPS, it's a fixed rate in packets or
+ * bits per second.
+ */
+#define PCAP_REPLAY_PPS		0x00000001	/* speed is packets/second */
+#define PCAP_REPLAY_BPS		0x00000002	/* speed is bits/second */
+#define PCAP_REPLAY_BUSY_WAIT	0x00000004	/* spin rather than sleep */
+#define PCAP_REPLAY_TXTIME	0x00000008	/* use SO_TXTIME launch times */
+
+/*
+ * As filled in by pcap_replay().  Jitter is how late, on average and
+ * at most, packets were sent relative to when they were due.
+ */
+struct pcap_replay_stat {
+	uint64_t prs_packets;		/* packets sent */
+	uint64_t prs_bytes;		/* bytes sent */
+	uint64_t prs_elapsed_ns;	/* time taken */
+	double prs_pps;			/* achieved rate, packets/second */
+	double prs_bps;			/* achieved rate, bits/second */
+	uint64_t prs_jitter_avg_ns;	/* mean lateness */
+	uint64_t prs_jitter_max_ns;	/* largest lateness */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_replay(pcap_t *, pcap_t *, double, int, int,
+	    struct pcap_replay_stat *);
+
+/*
+ * Capture groups: many handles served by one thread, with one
+ * epoll_wait() per pcap_group_dispatch() call.
+ */
+typedef struct pcap_group pcap_group_t;
+
+PCAP_AVAILABLE_1_11
+PCAP_API pcap_group_t *pcap_group_create(char *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_group_add(pcap_group_t *, pcap_t *, pcap_handler,
+	    u_char *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_group_remove(pcap_group_t *, pcap_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_group_dispatch(pcap_group_t *, int, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_group_breakloop(pcap_group_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API char	*pcap_group_geterr(pcap_group_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_group_close(pcap_group_t *);
+
+/*
+ * Device cache: pcap_findalldevs() returns a copy of a list of
+ * network interfaces kept up to date from routing netlink
+ * notifications, and the handler is told of changes to it.
+ */
+#define PCAP_DEVEVENT_ADDED	1	/* interface was added */
+#define PCAP_DEVEVENT_REMOVED	2	/* interface was removed */
+#define PCAP_DEVEVENT_CHANGED	3	/* flags, description or addresses changed */
+
+typedef void (*pcap_devevent_handler)(u_char *, int, const pcap_if_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_devcache_enable(pcap_devevent_handler, u_char *,
+	    char *) PCAP_WARN_UNUSED_RESULT;
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_devcache_get_selectable_fd(void);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_devcache_dispatch(char *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_devcache_disable(void);
+#endif
+
 /*
  * APIs added in WinPcap for remote capture.
  *
@@ -1186,7 +1524,8 @@ PCAP_API int	pcap_findalldevs_ex(const char *source,
  * These allow pcap_loop(), pcap_dispatch(), pcap_next(), and pcap_next_ex()
  * to see only a sample of packets, rather than all packets.
  *
- * Currently, they work only on Windows local captures.
+ * Currently, they work only on Windows local captures and, for
+ * PCAP_SAMP_1_EVERY_N, on Linux local captures.
  */
 
 /*
@@ -1204,6 +1543,11 @@ PCAP_API int	pcap_findalldevs_ex(const char *source,
  * accepted.
  * In other words, if 'value = 10', the first packet is returned to the
  * caller, while the following 9 are discarded.
+ *
+ * On Linux, packets are instead discarded at random, so that on average
+ * 1 out of N packets is returned; this is done by the kernel filter
+ * installed by pcap_setfilter(), so the setting takes effect when
+ * pcap_setfilter() is next called, and is done in userland until then.
  */
 #define PCAP_SAMP_1_EVERY_N	1
 
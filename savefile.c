@@ -180,14 +180,6 @@ sf_oid_set_request(pcap_t *p, bpf_u_int32 oid _U_, const void *data _U_,
 	return (PCAP_ERROR);
 }
 
-static u_int
-sf_sendqueue_transmit(pcap_t *p, pcap_send_queue *queue _U_, int sync _U_)
-{
-	pcapint_strlcpy(p->errbuf, "Sending packets isn't supported on savefiles",
-	    PCAP_ERRBUF_SIZE);
-	return (0);
-}
-
 static int
 sf_setuserbuffer(pcap_t *p, int size _U_)
 {
@@ -213,6 +205,14 @@ sf_live_dump_ended(pcap_t *p, int sync _U_)
 }
 #endif
 
+static u_int
+sf_sendqueue_transmit(pcap_t *p, pcap_send_queue *queue _U_, int sync _U_)
+{
+	pcapint_strlcpy(p->errbuf, "Sending packets isn't supported on savefiles",
+	    PCAP_ERRBUF_SIZE);
+	return (0);
+}
+
 static int
 sf_inject(pcap_t *p, const void *buf _U_, int size _U_)
 {
@@ -472,6 +472,7 @@ pcap_fopen_offline_with_tstamp_precision(FILE *fp, u_int precision,
 	size_t amt_read;
 	u_int i;
 	int err;
+	long start;
 
 	/*
 	 * Fail if we were passed a NULL fp.
@@ -486,6 +487,12 @@ pcap_fopen_offline_with_tstamp_precision(FILE *fp, u_int precision,
 		return (NULL);
 	}
 
+	/*
+	 * Remember where the file starts, for pcapint_offline_rewind();
+	 * this is -1 if fp isn't seekable.
+	 */
+	start = ftell(fp);
+
 	/*
 	 * Read the first 4 bytes of the file; the network analyzer dump
 	 * file formats we support (pcap and pcapng), and several other
@@ -532,6 +539,17 @@ pcap_fopen_offline_with_tstamp_precision(FILE *fp, u_int precision,
 found:
 	p->rfile = fp;
 
+	/*
+	 * To read the packets again, a pcap file is read from just
+	 * after its file header, but a pcapng file has to be read
+	 * from its first Section Header Block, so that the Interface
+	 * Description Blocks are seen again.
+	 */
+	if (start != -1 && check_headers[i] == pcap_check_header)
+		p->rfile_rewind = ftell(fp);
+	else
+		p->rfile_rewind = start;
+
 	/* Padding only needed for live capture fcode */
 	p->fddipad = 0;
 
@@ -555,6 +573,7 @@ found:
 	p->getnonblock_op = sf_getnonblock;
 	p->setnonblock_op = sf_setnonblock;
 	p->stats_op = sf_stats;
+	p->sendqueue_transmit_op = sf_sendqueue_transmit;
 #ifdef _WIN32
 	p->stats_ex_op = sf_stats_ex;
 	p->setbuff_op = sf_setbuff;
@@ -563,7 +582,6 @@ found:
 	p->getevent_op = sf_getevent;
 	p->oid_get_request_op = sf_oid_get_request;
 	p->oid_set_request_op = sf_oid_set_request;
-	p->sendqueue_transmit_op = sf_sendqueue_transmit;
 	p->setuserbuffer_op = sf_setuserbuffer;
 	p->live_dump_op = sf_live_dump;
 	p->live_dump_ended_op = sf_live_dump_ended;
@@ -575,6 +593,12 @@ found:
 	 */
 	p->oneshot_callback = pcapint_oneshot;
 
+	/*
+	 * pcapint_offline_read() hands pcap_dispatch_ex() a
+	 * struct pcap_pkthdr_ex.
+	 */
+	p->pkthdr_ex_supported = 1;
+
 	/*
 	 * Default breakloop operation.
 	 */
@@ -625,6 +649,7 @@ pcapint_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 	struct bpf_insn *fcode;
 	int n = 0;
 	u_char *data;
+	u_int caplen;
 
 	/*
 	 * This can conceivably process more than INT_MAX packets,
@@ -642,7 +667,7 @@ pcapint_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 		cnt = INT_MAX;
 
 	for (;;) {
-		struct pcap_pkthdr h;
+		struct pcap_pkthdr_ex h;
 		int status;
 
 		/*
@@ -662,7 +687,14 @@ pcapint_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 				return (n);
 		}
 
-		status = p->next_packet_op(p, &h, &data);
+		/*
+		 * If pcap_dispatch_ex() is reading, start out with no
+		 * metadata; the savefile reader supplies the time stamp
+		 * in nanoseconds, with all the precision the file has.
+		 */
+		if (p->dispatch_ex)
+			memset(&h, 0, sizeof(h));
+		status = p->next_packet_op(p, &h.hdr, &data);
 		if (status < 0) {
 			/*
 			 * Error.  Pass it back to the caller.
@@ -678,11 +710,18 @@ pcapint_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 
 		/*
 		 * OK, we've read a packet; run it through the filter
-		 * and, if it passes, process it.
+		 * and, if it passes, process it, first cutting it off
+		 * at the length the filter returned if that's what
+		 * the filter computes.  (Other filters just return the
+		 * snapshot length they were compiled for, which needn't
+		 * be that of this file.)
 		 */
 		if ((fcode = p->fcode.bf_insns) == NULL ||
-		    pcapint_filter(fcode, data, h.len, h.caplen)) {
-			(*callback)(user, &h, data);
+		    (caplen = pcapint_filter(fcode, data, h.hdr.len, h.hdr.caplen)) != 0) {
+			if (fcode != NULL && p->fcode_slices &&
+			    h.hdr.caplen > caplen)
+				h.hdr.caplen = caplen;
+			(*callback)(user, &h.hdr, data);
 			n++;	/* count the packet */
 			if (n >= cnt)
 				break;
@@ -691,3 +730,23 @@ pcapint_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 	/*XXX this breaks semantics tcpslice expects */
 	return (n);
 }
+
+/*
+ * Go back to the first packet of a capture file, so that its packets
+ * can be read again.
+ */
+int
+pcapint_offline_rewind(pcap_t *p)
+{
+	if (p->rfile_rewind == -1) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "The capture file isn't seekable, so it can't be read again");
+		return (-1);
+	}
+	if (fseek(p->rfile, p->rfile_rewind, SEEK_SET) == -1) {
+		pcapint_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "error seeking in dump file");
+		return (-1);
+	}
+	return (0);
+}
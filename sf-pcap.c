@@ -208,6 +208,7 @@ struct pcap_sf {
 	size_t hdrsize;
 	swapped_type_t lengths_swapped;
 	tstamp_scale_type_t scale_type;
+	u_int ns_mult;		/* takes the file's fractions of a second to nanoseconds */
 };
 
 /*
@@ -332,6 +333,7 @@ pcap_check_header(const uint8_t *magic, FILE *fp, u_int precision, char *errbuf,
 	 * Will we need to scale the timestamps to match what the
 	 * user wants?
 	 */
+	ps->ns_mult = magic_int == NSEC_TCPDUMP_MAGIC ? 1 : 1000;
 	switch (precision) {
 
 	case PCAP_TSTAMP_PRECISION_MICRO:
@@ -553,6 +555,20 @@ pcap_next_packet(pcap_t *p, struct pcap_pkthdr *hdr, u_char **data)
 		hdr->ts.tv_usec = sf_hdr.ts.tv_usec;
 	}
 
+	/*
+	 * If pcap_dispatch_ex() is reading, supply the time stamp in
+	 * nanoseconds as well, before it's scaled to the precision
+	 * the user asked for.
+	 */
+	if (p->dispatch_ex) {
+		struct pcap_pkthdr_ex *ex = (struct pcap_pkthdr_ex *)hdr;
+
+		ex->pkh_flags |= PCAP_PKTHDR_EX_TS_NS;
+		ex->pkh_ts_ns =
+		    (uint64_t)(bpf_u_int32)hdr->ts.tv_sec * 1000000000 +
+		    (uint64_t)(bpf_u_int32)hdr->ts.tv_usec * ps->ns_mult;
+	}
+
 	switch (ps->scale_type) {
 
 	case PASS_THROUGH:
@@ -189,18 +189,33 @@ typedef enum {
 	PASS_THROUGH,
 	SCALE_UP_DEC,
 	SCALE_DOWN_DEC,
-	SCALE_UP_BIN,
-	SCALE_DOWN_BIN
+	SCALE_DOWN_DEC_32,
+	SCALE_BIN
 } tstamp_scale_type_t;
 
+/*
+ * How to convert the fractional part of a time stamp from units of an
+ * interface's resolution to units of another resolution; it's worked
+ * out when we see the Interface Description Block, so that converting
+ * a time stamp takes no more than a multiply and some shifts.
+ */
+struct tstamp_scale {
+	tstamp_scale_type_t type;
+	uint64_t factor;		/* SCALE_UP_DEC multiplier, SCALE_DOWN_DEC divisor */
+	uint64_t mult;			/* SCALE_DOWN_DEC_32 and SCALE_BIN multiplier */
+	u_int shift1;			/* SCALE_DOWN_DEC_32 and SCALE_BIN shifts */
+	u_int shift2;
+};
+
 /*
  * Per-interface information.
  */
 struct pcap_ng_if {
 	uint32_t snaplen;		/* snapshot length */
 	uint64_t tsresol;		/* time stamp resolution */
-	tstamp_scale_type_t scale_type;	/* how to scale */
-	uint64_t scale_factor;		/* time stamp scale factor for power-of-10 tsresol */
+	u_int tsresol_shift;		/* log2(tsresol), if it's a power of 2, otherwise 0 */
+	struct tstamp_scale user_scale;	/* how to scale to the user's resolution */
+	struct tstamp_scale ns_scale;	/* how to scale to nanoseconds */
 	int64_t tsoffset;		/* time stamp offset */
 };
 
@@ -588,6 +603,118 @@ done:
 	return (0);
 }
 
+/*
+ * Work out how to scale the fractional part of a time stamp from units
+ * of an interface's resolution to units of resolution, which is a
+ * power of 10 no greater than 10^9.
+ */
+static void
+set_tstamp_scale(struct tstamp_scale *sc, const struct pcap_ng_if *ifp,
+    uint64_t resolution)
+{
+	uint64_t d;
+	u_int l;
+
+	memset(sc, 0, sizeof(*sc));
+	if (ifp->tsresol == resolution) {
+		/*
+		 * The resolution is the one we want, so we don't have
+		 * to do scaling.
+		 */
+		sc->type = PASS_THROUGH;
+	} else if (ifp->tsresol_shift != 0 || ifp->tsresol == 1) {
+		/*
+		 * The resolution is 2^tsresol_shift, so we multiply by
+		 * the resolution we want and shift right by
+		 * tsresol_shift, rather than dividing by the interface's
+		 * resolution.
+		 *
+		 * The resolution we want is less than 2^30, so the
+		 * product can't overflow if the fraction has no more
+		 * than 34 significant bits; if it has more, multiply
+		 * the upper and lower 32 bits separately, and shift
+		 * the lower product right by 32 bits before adding
+		 * it, which doesn't change the result.
+		 */
+		sc->type = SCALE_BIN;
+		sc->mult = resolution;
+		sc->shift1 = ifp->tsresol_shift > 34 ? 32 : 0;
+		sc->shift2 = ifp->tsresol_shift - sc->shift1;
+	} else if (ifp->tsresol < resolution) {
+		/*
+		 * Both resolutions are powers of 10, and the one we
+		 * want is greater, so the quotient is an integer; we
+		 * just multiply by it.
+		 */
+		sc->type = SCALE_UP_DEC;
+		sc->factor = resolution / ifp->tsresol;
+	} else {
+		/*
+		 * Both resolutions are powers of 10, and the one we
+		 * want is less, so we divide by the reciprocal of the
+		 * quotient, which is an integer.
+		 */
+		d = ifp->tsresol / resolution;
+		sc->factor = d;
+		if (ifp->tsresol <= 0xFFFFFFFFU) {
+			/*
+			 * The fraction and the divisor fit in 32 bits,
+			 * so divide by multiplying by a magic number
+			 * and shifting, as compilers do when dividing
+			 * by a constant; see "Division by Invariant
+			 * Integers using Multiplication", Granlund and
+			 * Montgomery.
+			 *
+			 * With l = ceil(log2(d)), and the multiplier
+			 * m = floor(2^32 * (2^l - d) / d) + 1, then
+			 * for any 32-bit n, with t = (m * n) >> 32,
+			 * n / d = (t + ((n - t) >> 1)) >> (l - 1).
+			 */
+			for (l = 0; (((uint64_t)1) << l) < d; l++)
+				;
+			sc->type = SCALE_DOWN_DEC_32;
+			sc->mult = (((((uint64_t)1) << l) - d) << 32) / d + 1;
+			sc->shift1 = 1;
+			sc->shift2 = l - 1;
+		} else
+			sc->type = SCALE_DOWN_DEC;
+	}
+}
+
+static inline uint64_t
+scale_tstamp(const struct tstamp_scale *sc, uint64_t frac)
+{
+	uint64_t t;
+
+	switch (sc->type) {
+
+	case PASS_THROUGH:
+		break;
+
+	case SCALE_UP_DEC:
+		frac *= sc->factor;
+		break;
+
+	case SCALE_DOWN_DEC_32:
+		t = (sc->mult * frac) >> 32;
+		frac = (t + ((frac - t) >> sc->shift1)) >> sc->shift2;
+		break;
+
+	case SCALE_DOWN_DEC:
+		frac /= sc->factor;
+		break;
+
+	case SCALE_BIN:
+		if (sc->shift1 == 0)
+			frac = (frac * sc->mult) >> sc->shift2;
+		else
+			frac = ((frac >> 32) * sc->mult +
+			    (((frac & 0xFFFFFFFFU) * sc->mult) >> 32)) >> sc->shift2;
+		break;
+	}
+	return (frac);
+}
+
 static int
 add_interface(pcap_t *p, struct interface_description_block *idbp,
     struct block_cursor *cursor, char *errbuf)
@@ -717,47 +844,22 @@ add_interface(pcap_t *p, struct interface_description_block *idbp,
 		return (0);
 
 	ps->ifaces[ps->ifcount - 1].tsresol = tsresol;
+	ps->ifaces[ps->ifcount - 1].tsresol_shift = 0;
+	if (is_binary) {
+		while ((((uint64_t)1) << ps->ifaces[ps->ifcount - 1].tsresol_shift) != tsresol)
+			ps->ifaces[ps->ifcount - 1].tsresol_shift++;
+	}
 	ps->ifaces[ps->ifcount - 1].tsoffset = tsoffset;
 
 	/*
-	 * Determine whether we're scaling up or down or not
-	 * at all for this interface.
+	 * Work out how to scale the time stamps for this interface
+	 * to the resolution the user wants, and to nanoseconds for
+	 * pcap_dispatch_ex().
 	 */
-	if (tsresol == ps->user_tsresol) {
-		/*
-		 * The resolution is the resolution the user wants,
-		 * so we don't have to do scaling.
-		 */
-		ps->ifaces[ps->ifcount - 1].scale_type = PASS_THROUGH;
-	} else if (tsresol > ps->user_tsresol) {
-		/*
-		 * The resolution is greater than what the user wants,
-		 * so we have to scale the timestamps down.
-		 */
-		if (is_binary)
-			ps->ifaces[ps->ifcount - 1].scale_type = SCALE_DOWN_BIN;
-		else {
-			/*
-			 * Calculate the scale factor.
-			 */
-			ps->ifaces[ps->ifcount - 1].scale_factor = tsresol/ps->user_tsresol;
-			ps->ifaces[ps->ifcount - 1].scale_type = SCALE_DOWN_DEC;
-		}
-	} else {
-		/*
-		 * The resolution is less than what the user wants,
-		 * so we have to scale the timestamps up.
-		 */
-		if (is_binary)
-			ps->ifaces[ps->ifcount - 1].scale_type = SCALE_UP_BIN;
-		else {
-			/*
-			 * Calculate the scale factor.
-			 */
-			ps->ifaces[ps->ifcount - 1].scale_factor = ps->user_tsresol/tsresol;
-			ps->ifaces[ps->ifcount - 1].scale_type = SCALE_UP_DEC;
-		}
-	}
+	set_tstamp_scale(&ps->ifaces[ps->ifcount - 1].user_scale,
+	    &ps->ifaces[ps->ifcount - 1], ps->user_tsresol);
+	set_tstamp_scale(&ps->ifaces[ps->ifcount - 1].ns_scale,
+	    &ps->ifaces[ps->ifcount - 1], 1000000000);
 	return (1);
 }
 
@@ -1110,6 +1212,7 @@ pcap_ng_next_packet(pcap_t *p, struct pcap_pkthdr *hdr, u_char **data)
 	struct interface_description_block *idbp;
 	struct section_header_block *shbp;
 	FILE *fp = p->rfile;
+	struct pcap_ng_if *ifp;
 	uint64_t t, sec, frac;
 
 	/*
@@ -1381,111 +1484,49 @@ found:
 	/*
 	 * Convert the time stamp to seconds and fractions of a second,
 	 * with the fractions being in units of the file-supplied resolution.
+	 * The resolution is usually a power of 2, microseconds or
+	 * nanoseconds, so we can usually avoid dividing by a variable.
 	 */
-	sec = t / ps->ifaces[interface_id].tsresol + ps->ifaces[interface_id].tsoffset;
-	frac = t % ps->ifaces[interface_id].tsresol;
-
-	/*
-	 * Convert the fractions from units of the file-supplied resolution
-	 * to units of the user-requested resolution.
-	 */
-	switch (ps->ifaces[interface_id].scale_type) {
-
-	case PASS_THROUGH:
-		/*
-		 * The interface resolution is what the user wants,
-		 * so we're done.
-		 */
-		break;
+	ifp = &ps->ifaces[interface_id];
+	if (ifp->tsresol_shift != 0) {
+		sec = t >> ifp->tsresol_shift;
+		frac = t & ((((uint64_t)1) << ifp->tsresol_shift) - 1);
+	} else {
+		switch (ifp->tsresol) {
 
-	case SCALE_UP_DEC:
-		/*
-		 * The interface resolution is less than what the user
-		 * wants; scale the fractional part up to the units of
-		 * the resolution the user requested by multiplying by
-		 * the quotient of the user-requested resolution and the
-		 * file-supplied resolution.
-		 *
-		 * Those resolutions are both powers of 10, and the user-
-		 * requested resolution is greater than the file-supplied
-		 * resolution, so the quotient in question is an integer.
-		 * We've calculated that quotient already, so we just
-		 * multiply by it.
-		 */
-		frac *= ps->ifaces[interface_id].scale_factor;
-		break;
+		case 1000000:
+			sec = t / 1000000;
+			break;
 
-	case SCALE_UP_BIN:
-		/*
-		 * The interface resolution is less than what the user
-		 * wants; scale the fractional part up to the units of
-		 * the resolution the user requested by multiplying by
-		 * the quotient of the user-requested resolution and the
-		 * file-supplied resolution.
-		 *
-		 * The file-supplied resolution is a power of 2, so the
-		 * quotient is not an integer, so, in order to do this
-		 * entirely with integer arithmetic, we multiply by the
-		 * user-requested resolution and divide by the file-
-		 * supplied resolution.
-		 *
-		 * XXX - Is there something clever we could do here,
-		 * given that we know that the file-supplied resolution
-		 * is a power of 2?  Doing a multiplication followed by
-		 * a division runs the risk of overflowing, and involves
-		 * two non-simple arithmetic operations.
-		 */
-		frac *= ps->user_tsresol;
-		frac /= ps->ifaces[interface_id].tsresol;
-		break;
+		case 1000000000:
+			sec = t / 1000000000;
+			break;
 
-	case SCALE_DOWN_DEC:
-		/*
-		 * The interface resolution is greater than what the user
-		 * wants; scale the fractional part up to the units of
-		 * the resolution the user requested by multiplying by
-		 * the quotient of the user-requested resolution and the
-		 * file-supplied resolution.
-		 *
-		 * Those resolutions are both powers of 10, and the user-
-		 * requested resolution is less than the file-supplied
-		 * resolution, so the quotient in question isn't an
-		 * integer, but its reciprocal is, and we can just divide
-		 * by the reciprocal of the quotient.  We've calculated
-		 * the reciprocal of that quotient already, so we must
-		 * divide by it.
-		 */
-		frac /= ps->ifaces[interface_id].scale_factor;
-		break;
+		default:
+			sec = t / ifp->tsresol;
+			break;
+		}
+		frac = t - sec * ifp->tsresol;
+	}
+	sec += ifp->tsoffset;
 
+	/*
+	 * If pcap_dispatch_ex() is reading, supply the time stamp in
+	 * nanoseconds as well.
+	 */
+	if (p->dispatch_ex) {
+		struct pcap_pkthdr_ex *ex = (struct pcap_pkthdr_ex *)hdr;
 
-	case SCALE_DOWN_BIN:
-		/*
-		 * The interface resolution is greater than what the user
-		 * wants; convert the fractional part to units of the
-		 * resolution the user requested by multiplying by the
-		 * quotient of the user-requested resolution and the
-		 * file-supplied resolution.  We do that by multiplying
-		 * by the user-requested resolution and dividing by the
-		 * file-supplied resolution, as the quotient might not
-		 * fit in an integer.
-		 *
-		 * The file-supplied resolution is a power of 2, so the
-		 * quotient is not an integer, and neither is its
-		 * reciprocal, so, in order to do this entirely with
-		 * integer arithmetic, we multiply by the user-requested
-		 * resolution and divide by the file-supplied resolution.
-		 *
-		 * XXX - Is there something clever we could do here,
-		 * given that we know that the file-supplied resolution
-		 * is a power of 2?  Doing a multiplication followed by
-		 * a division runs the risk of overflowing, and involves
-		 * two non-simple arithmetic operations.
-		 */
-		frac *= ps->user_tsresol;
-		frac /= ps->ifaces[interface_id].tsresol;
-		break;
+		ex->pkh_flags |= PCAP_PKTHDR_EX_TS_NS;
+		ex->pkh_ts_ns = sec * 1000000000 +
+		    scale_tstamp(&ifp->ns_scale, frac);
 	}
+
+	/*
+	 * Convert the fractions from units of the file-supplied resolution
+	 * to units of the user-requested resolution.
+	 */
+	frac = scale_tstamp(&ifp->user_scale, frac);
 #ifdef _WIN32
 	/*
 	 * tv_sec and tv_usec in the Windows struct timeval are both
@@ -42,6 +42,9 @@ The Regents of the University of California.  All rights reserved.\n";
   #include <signal.h>
 #endif
 #include <sys/types.h>
+#ifdef __linux__
+  #include <linux/if_packet.h>
+#endif
 
 #include <pcap.h>
 
@@ -55,6 +58,7 @@ static char *program_name;
 
 /* Forwards */
 static void countme(u_char *, const struct pcap_pkthdr *, const u_char *);
+static void printme_ex(u_char *, const struct pcap_pkthdr_ex *, const u_char *);
 static void PCAP_NORETURN usage(void);
 static void PCAP_NORETURN error(const char *, ...) PCAP_PRINTFLIKE(1, 2);
 static void warning(const char *, ...) PCAP_PRINTFLIKE(1, 2);
@@ -97,8 +101,30 @@ sigint_handler(int signum _U_)
 #define S_OPTION	"s"
 #endif
 
-#define COMMAND_OPTIONS	B_OPTION "i:mn" R_OPTION S_OPTION "t:"
-#define USAGE_OPTIONS	"-" B_OPTION "mn" R_OPTION S_OPTION
+#ifdef __linux__
+/*
+ * We have ring placement and sizing by duration, PACKET_FANOUT, busy
+ * polling, ring statistics and offload handling.
+ */
+#define C_OPTION	"C:"
+#define D_OPTION	"D:"
+#define F_OPTION	"F:"
+#define N_OPTION	"N:"
+#define P_OPTION	"P:"
+#define RING_STATS_OPTION	"R"
+#define OFFLOAD_OPTIONS	"GM"
+#else
+#define C_OPTION	""
+#define D_OPTION	""
+#define F_OPTION	""
+#define N_OPTION	""
+#define P_OPTION	""
+#define RING_STATS_OPTION	""
+#define OFFLOAD_OPTIONS	""
+#endif
+
+#define COMMAND_OPTIONS	"B:" B_OPTION C_OPTION D_OPTION F_OPTION OFFLOAD_OPTIONS "i:mn" N_OPTION P_OPTION "q:" R_OPTION RING_STATS_OPTION S_OPTION "t:x"
+#define USAGE_OPTIONS	"-" B_OPTION OFFLOAD_OPTIONS "mn" R_OPTION RING_STATS_OPTION S_OPTION "x"
 
 int
 main(int argc, char **argv)
@@ -110,6 +136,20 @@ main(int argc, char **argv)
 	int timeout = 1000;
 	int immediate = 0;
 	int nonblock = 0;
+	int queues = 1;
+	int nqueues, queue;
+	int batch_size = 0;
+	struct pcap_pkt_vec vec;
+	int metadata = 0;
+#ifdef __linux__
+	int buffer_duration = 0;
+	int cpu = PCAP_CPU_NONE;
+	int fanout_group = -1;
+	int numa_node = PCAP_NUMA_NODE_NONE;
+	int busy_poll = 0;
+	int ring_stats = 0;
+	int offload_flags = 0;
+#endif
 #ifndef _WIN32
 #ifdef SA_RESTART
 	int sigrestart = 0;
@@ -133,12 +173,73 @@ main(int argc, char **argv)
 	while ((op = getopt(argc, argv, COMMAND_OPTIONS)) != -1) {
 		switch (op) {
 
+		case 'B':
+			longarg = strtol(optarg, &p, 10);
+			if (p == optarg || *p != '\0') {
+				error("Batch size \"%s\" is not a number",
+				    optarg);
+				/* NOTREACHED */
+			}
+			if (longarg < 1 || longarg > 65536) {
+				error("Batch size %ld is not between 1 and 65536",
+				    longarg);
+				/* NOTREACHED */
+			}
+			batch_size = (int)longarg;
+			break;
+
 #ifndef _WIN32
 		case 'b':
 			breaksigint = 1;
 			break;
 #endif
 
+#ifdef __linux__
+		case 'C':
+			longarg = strtol(optarg, &p, 10);
+			if (p == optarg || *p != '\0') {
+				error("CPU \"%s\" is not a number", optarg);
+				/* NOTREACHED */
+			}
+			if (longarg < PCAP_CPU_NUMA_NODE || longarg > INT_MAX) {
+				error("CPU %ld is not between %d and %d",
+				    longarg, PCAP_CPU_NUMA_NODE, INT_MAX);
+				/* NOTREACHED */
+			}
+			cpu = (int)longarg;
+			break;
+
+		case 'D':
+			longarg = strtol(optarg, &p, 10);
+			if (p == optarg || *p != '\0') {
+				error("Buffer duration \"%s\" is not a number",
+				    optarg);
+				/* NOTREACHED */
+			}
+			if (longarg < 0 || longarg > INT_MAX) {
+				error("Buffer duration %ld is not between 0 and %d",
+				    longarg, INT_MAX);
+				/* NOTREACHED */
+			}
+			buffer_duration = (int)longarg;
+			break;
+
+		case 'F':
+			longarg = strtol(optarg, &p, 10);
+			if (p == optarg || *p != '\0') {
+				error("Fanout group \"%s\" is not a number",
+				    optarg);
+				/* NOTREACHED */
+			}
+			if (longarg < 0 || longarg > 65535) {
+				error("Fanout group %ld is not between 0 and 65535",
+				    longarg);
+				/* NOTREACHED */
+			}
+			fanout_group = (int)longarg;
+			break;
+#endif
+
 		case 'i':
 			device = optarg;
 			break;
@@ -147,10 +248,73 @@ main(int argc, char **argv)
 			immediate = 1;
 			break;
 
+#ifdef __linux__
+		case 'P':
+			longarg = strtol(optarg, &p, 10);
+			if (p == optarg || *p != '\0') {
+				error("Busy-poll time \"%s\" is not a number",
+				    optarg);
+				/* NOTREACHED */
+			}
+			if (longarg < 0 || longarg > INT_MAX) {
+				error("Busy-poll time %ld is not between 0 and %d",
+				    longarg, INT_MAX);
+				/* NOTREACHED */
+			}
+			busy_poll = (int)longarg;
+			break;
+#endif
+
 		case 'n':
 			nonblock = 1;
 			break;
 
+#ifdef __linux__
+		case 'N':
+			longarg = strtol(optarg, &p, 10);
+			if (p == optarg || *p != '\0') {
+				error("NUMA node \"%s\" is not a number",
+				    optarg);
+				/* NOTREACHED */
+			}
+			if (longarg < PCAP_NUMA_NODE_DEVICE || longarg > INT_MAX) {
+				error("NUMA node %ld is not between %d and %d",
+				    longarg, PCAP_NUMA_NODE_DEVICE, INT_MAX);
+				/* NOTREACHED */
+			}
+			numa_node = (int)longarg;
+			break;
+#endif
+
+#ifdef __linux__
+		case 'R':
+			ring_stats = 1;
+			break;
+
+		case 'G':
+			offload_flags |= PCAP_OFFLOAD_GSO_INFO;
+			break;
+
+		case 'M':
+			offload_flags |= PCAP_OFFLOAD_MTU_FRAMES;
+			break;
+#endif
+
+		case 'q':
+			longarg = strtol(optarg, &p, 10);
+			if (p == optarg || *p != '\0') {
+				error("Queue count \"%s\" is not a number",
+				    optarg);
+				/* NOTREACHED */
+			}
+			if (longarg < 1 || longarg > 1024) {
+				error("Queue count %ld is not between 1 and 1024",
+				    longarg);
+				/* NOTREACHED */
+			}
+			queues = (int)longarg;
+			break;
+
 #ifndef _WIN32
 #ifdef SA_RESTART
 		case 'r':
@@ -182,6 +346,10 @@ main(int argc, char **argv)
 			timeout = (int)longarg;
 			break;
 
+		case 'x':
+			metadata = 1;
+			break;
+
 		default:
 			usage();
 			/* NOTREACHED */
@@ -240,6 +408,59 @@ main(int argc, char **argv)
 	if (status != 0)
 		error("%s: pcap_set_timeout failed: %s",
 		    device, pcap_statustostr(status));
+	status = pcap_set_queues(pd, queues);
+	if (status != 0)
+		error("%s: pcap_set_queues failed: %s",
+		    device, pcap_statustostr(status));
+#ifdef __linux__
+	if (buffer_duration != 0) {
+		status = pcap_set_buffer_duration(pd, buffer_duration);
+		if (status != 0)
+			error("%s: pcap_set_buffer_duration failed: %s",
+			    device, pcap_geterr(pd));
+	}
+	if (numa_node != PCAP_NUMA_NODE_NONE) {
+		status = pcap_set_numa_node(pd, numa_node);
+		if (status != 0)
+			error("%s: pcap_set_numa_node failed: %s",
+			    device, pcap_geterr(pd));
+	}
+	if (cpu != PCAP_CPU_NONE) {
+		status = pcap_set_cpu_affinity(pd, cpu);
+		if (status != 0)
+			error("%s: pcap_set_cpu_affinity failed: %s",
+			    device, pcap_geterr(pd));
+	}
+	if (fanout_group != -1) {
+		/*
+		 * Share the packets, by flow, with the other capturetest
+		 * processes that were given the same group.
+		 */
+		status = pcap_set_fanout(pd, fanout_group, PACKET_FANOUT_HASH,
+		    PACKET_FANOUT_FLAG_DEFRAG);
+		if (status != 0)
+			error("%s: pcap_set_fanout failed: %s",
+			    device, pcap_geterr(pd));
+	}
+	if (busy_poll != 0) {
+		status = pcap_set_busy_poll(pd, busy_poll, 0);
+		if (status != 0)
+			error("%s: pcap_set_busy_poll failed: %s",
+			    device, pcap_geterr(pd));
+	}
+	if (ring_stats) {
+		status = pcap_set_ring_stats(pd, 1);
+		if (status != 0)
+			error("%s: pcap_set_ring_stats failed: %s",
+			    device, pcap_geterr(pd));
+	}
+	if (offload_flags != 0) {
+		status = pcap_set_offload_flags(pd, offload_flags);
+		if (status != 0)
+			error("%s: pcap_set_offload_flags failed: %s",
+			    device, pcap_geterr(pd));
+	}
+#endif
 	status = pcap_activate(pd);
 	if (status < 0) {
 		/*
@@ -255,6 +476,21 @@ main(int argc, char **argv)
 		warning("%s: %s\n(%s)", device,
 		    pcap_statustostr(status), pcap_geterr(pd));
 	}
+#ifdef __linux__
+	if (buffer_duration != 0 || numa_node != PCAP_NUMA_NODE_NONE ||
+	    cpu != PCAP_CPU_NONE) {
+		struct pcap_ring_geometry rg;
+
+		if (pcap_get_ring_geometry(pd, &rg) < 0)
+			error("%s: pcap_get_ring_geometry failed: %s",
+			    device, pcap_geterr(pd));
+		fprintf(stderr, "%s: %u blocks of %u bytes, %u frames of %u bytes, link speed %u Mb/s\n",
+		    device, rg.rg_block_count, rg.rg_block_size,
+		    rg.rg_frame_count, rg.rg_frame_size, rg.rg_link_speed);
+		fprintf(stderr, "%s: device on NUMA node %d, ring on NUMA node %d, reading on CPU %d\n",
+		    device, rg.rg_device_node, rg.rg_numa_node, rg.rg_cpu);
+	}
+#endif
 	if (pcap_lookupnet(device, &localnet, &netmask, ebuf) < 0) {
 		localnet = 0;
 		netmask = 0;
@@ -269,14 +505,48 @@ main(int argc, char **argv)
 		error("%s", pcap_geterr(pd));
 	if (pcap_setnonblock(pd, nonblock, ebuf) == -1)
 		error("pcap_setnonblock failed: %s", ebuf);
-	printf("Listening on %s\n", device);
-	for (;;) {
+	if (batch_size != 0) {
+		vec.hdrs = malloc(batch_size * sizeof(*vec.hdrs));
+		vec.data = malloc(batch_size * sizeof(*vec.data));
+		if (vec.hdrs == NULL || vec.data == NULL)
+			error("Can't allocate batch of %d packets", batch_size);
+	}
+	nqueues = pcap_queue_count(pd);
+	if (nqueues > 1)
+		printf("Listening on %s, %d queues\n", device, nqueues);
+	else
+		printf("Listening on %s\n", device);
+	for (queue = 0;; queue = (queue + 1) % nqueues) {
+		/*
+		 * Read from the queues in turn; a real program would
+		 * read from each of them in a separate thread.
+		 */
 		packet_count = 0;
-		status = pcap_dispatch(pd, -1, countme,
-		    (u_char *)&packet_count);
+		if (batch_size != 0) {
+			/*
+			 * Batches only come from queue 0.
+			 */
+			queue = 0;
+			status = pcap_next_batch(pd, &vec, batch_size);
+			if (status > 0) {
+				packet_count = vec.count;
+				pcap_release_batch(pd, &vec);
+			}
+		} else if (metadata) {
+			/*
+			 * So does the metadata.
+			 */
+			queue = 0;
+			status = pcap_dispatch_ex(pd, -1, 0, printme_ex,
+			    (u_char *)&packet_count);
+		} else
+			status = pcap_dispatch_queue(pd, queue, -1, countme,
+			    (u_char *)&packet_count);
 		if (status < 0)
 			break;
 		if (status != 0) {
+			if (nqueues > 1)
+				printf("queue %d: ", queue);
 			printf("%d packets seen, %d packets counted after pcap_dispatch returns\n",
 			    status, packet_count);
 			struct pcap_stat ps;
@@ -287,6 +557,58 @@ main(int argc, char **argv)
 				printf("%d ps_recv, %d ps_drop, %d ps_ifdrop\n",
 				    ps.ps_recv, ps.ps_drop, ps.ps_ifdrop);
 			}
+#ifdef __linux__
+			struct pcap_stat64 ps64;
+
+			if (pcap_stats64(pd, &ps64) < 0) {
+				(void)fprintf(stderr, "pcap_stats64: %s\n",
+				    pcap_geterr(pd));
+			} else {
+				printf("%llu recv, %llu drop, %llu ifdrop, %llu freeze_q, %llu filtered\n",
+				    (unsigned long long)ps64.ps64_recv,
+				    (unsigned long long)ps64.ps64_drop,
+				    (unsigned long long)ps64.ps64_ifdrop,
+				    (unsigned long long)ps64.ps64_freeze_q,
+				    (unsigned long long)ps64.ps64_filtered);
+			}
+			if (busy_poll != 0) {
+				struct pcap_busy_poll_stat bps;
+
+				if (pcap_busy_poll_stats(pd, &bps) < 0) {
+					(void)fprintf(stderr,
+					    "pcap_busy_poll_stats: %s\n",
+					    pcap_geterr(pd));
+				} else {
+					printf("%llu spin hits, %llu sleeps, %llu ns spinning\n",
+					    (unsigned long long)bps.bps_spin_hits,
+					    (unsigned long long)bps.bps_sleeps,
+					    (unsigned long long)bps.bps_spin_ns);
+				}
+			}
+			if (ring_stats) {
+				struct pcap_ring_stat rs;
+				int i;
+
+				if (pcap_ring_stats(pd, &rs) < 0) {
+					(void)fprintf(stderr,
+					    "pcap_ring_stats: %s\n",
+					    pcap_geterr(pd));
+				} else {
+					printf("%llu wakeups, %llu empty, %llu blocks, %llu callbacks, %llu ns in callbacks, %llu ns longest\n",
+					    (unsigned long long)rs.rs_wakeups,
+					    (unsigned long long)rs.rs_empty_wakeups,
+					    (unsigned long long)rs.rs_blocks,
+					    (unsigned long long)rs.rs_callbacks,
+					    (unsigned long long)rs.rs_callback_ns,
+					    (unsigned long long)rs.rs_callback_max_ns);
+					printf("fill:");
+					for (i = 0; i < PCAP_RING_FILL_BUCKETS; i++)
+						printf(" %llu",
+						    (unsigned long long)rs.rs_fill[i]);
+					putchar('\n');
+				}
+			}
+#endif
 		}
 	}
 	if (status == -2) {
@@ -308,6 +630,10 @@ main(int argc, char **argv)
 	}
 	pcap_close(pd);
 	pcap_freecode(&fcode);
+	if (batch_size != 0) {
+		free(vec.hdrs);
+		free(vec.data);
+	}
 	free(cmdbuf);
 	exit(status == -1 ? 1 : 0);
 }
@@ -320,11 +646,51 @@ countme(u_char *user, const struct pcap_pkthdr *h _U_, const u_char *sp _U_)
 	(*counterp)++;
 }
 
+static void
+printme_ex(u_char *user, const struct pcap_pkthdr_ex *h,
+    const u_char *sp _U_)
+{
+	int *counterp = (int *)user;
+
+	(*counterp)++;
+	printf("%u bytes", h->hdr.len);
+	if (h->pkh_flags & PCAP_PKTHDR_EX_IFINDEX)
+		printf(", ifindex %u", h->pkh_ifindex);
+	if (h->pkh_flags & PCAP_PKTHDR_EX_PKTTYPE)
+		printf(", pkttype %u", h->pkh_pkttype);
+	if (h->pkh_flags & PCAP_PKTHDR_EX_PROTOCOL)
+		printf(", protocol 0x%04x", h->pkh_protocol);
+	if (h->pkh_flags & PCAP_PKTHDR_EX_VLAN)
+		printf(", VLAN TCI 0x%04x TPID 0x%04x%s", h->pkh_vlan_tci,
+		    h->pkh_vlan_tpid,
+		    (h->pkh_flags & PCAP_PKTHDR_EX_VLAN_IN_DATA) ? " (in data)" : "");
+	if (h->pkh_flags & PCAP_PKTHDR_EX_RXHASH)
+		printf(", hash 0x%08x", h->pkh_rxhash);
+	if (h->pkh_flags & PCAP_PKTHDR_EX_TS_NS)
+		printf(", time %llu.%09llu",
+		    (unsigned long long)(h->pkh_ts_ns / 1000000000),
+		    (unsigned long long)(h->pkh_ts_ns % 1000000000));
+	if ((h->pkh_flags & PCAP_PKTHDR_EX_GSO) &&
+	    h->pkh_gso_type != PCAP_GSO_NONE)
+		printf(", GSO type %u, %u segments of %u bytes",
+		    h->pkh_gso_type, h->pkh_gso_segs, h->pkh_gso_size);
+	if (h->pkh_flags & PCAP_PKTHDR_EX_TS_HARDWARE)
+		printf(", hardware time stamp");
+	else if (h->pkh_flags & PCAP_PKTHDR_EX_TS_SOFTWARE)
+		printf(", software time stamp");
+	putchar('\n');
+}
+
 static void
 usage(void)
 {
-	(void)fprintf(stderr, "Usage: %s [ " USAGE_OPTIONS " ] [ -i interface ] [ -t timeout] [expression]\n",
+#ifdef __linux__
+	(void)fprintf(stderr, "Usage: %s [ " USAGE_OPTIONS " ] [ -B batch_size ] [ -C cpu ] [ -D buffer_duration ] [ -F fanout_group ] [ -i interface ] [ -N numa_node ] [ -P busy_poll_usec ] [ -q queues ] [ -t timeout] [expression]\n",
 	    program_name);
+#else
+	(void)fprintf(stderr, "Usage: %s [ " USAGE_OPTIONS " ] [ -B batch_size ] [ -i interface ] [ -q queues ] [ -t timeout] [expression]\n",
+	    program_name);
+#endif
 	exit(1);
 }
 
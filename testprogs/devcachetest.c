@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 1988, 1989, 1990, 1991, 1992, 1993, 1994, 1995, 1996, 1997, 2000
+ *	The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that: (1) source code distributions
+ * retain the above copyright notice and this paragraph in its entirety, (2)
+ * distributions including binary code include the above copyright notice and
+ * this paragraph in its entirety in the documentation or other materials
+ * provided with the distribution, and (3) all advertising materials mentioning
+ * features or use of this software display the following acknowledgement:
+ * ``This product includes software developed by the University of California,
+ * Lawrence Berkeley Laboratory and its contributors.'' Neither the name of
+ * the University nor the names of its contributors may be used to endorse
+ * or promote products derived from this software without specific prior
+ * written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include "varattrs.h"
+
+#ifndef lint
+static const char copyright[] _U_ =
+    "@(#) Copyright (c) 1988, 1989, 1990, 1991, 1992, 1993, 1994, 1995, 1996, 1997, 2000\n\
+The Regents of the University of California.  All rights reserved.\n";
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+
+#include <pcap.h>
+
+#include "pcap/funcattrs.h"
+
+#ifndef __linux__
+int
+main(void)
+{
+	(void)fprintf(stderr, "The device cache is only supported on Linux\n");
+	return (1);
+}
+#else /* __linux__ */
+static char *program_name;
+
+/* Forwards */
+static void PCAP_NORETURN usage(void);
+static void PCAP_NORETURN error(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+
+static volatile sig_atomic_t stop;
+
+static void
+stop_watching(int signum _U_)
+{
+	stop = 1;
+}
+
+static void
+print_event(u_char *user _U_, int event, const pcap_if_t *dev)
+{
+	const char *what;
+
+	switch (event) {
+
+	case PCAP_DEVEVENT_ADDED:
+		what = "added";
+		break;
+
+	case PCAP_DEVEVENT_REMOVED:
+		what = "removed";
+		break;
+
+	case PCAP_DEVEVENT_CHANGED:
+		what = "changed";
+		break;
+
+	default:
+		what = "unknown event";
+		break;
+	}
+	printf("%s: %s (flags 0x%08x)\n", dev->name, what, dev->flags);
+	(void)fflush(stdout);
+}
+
+static double
+time_findalldevs(int count)
+{
+	struct timespec start, end;
+	pcap_if_t *alldevs;
+	char ebuf[PCAP_ERRBUF_SIZE];
+	int i;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		if (pcap_findalldevs(&alldevs, ebuf) == -1)
+			error("pcap_findalldevs: %s", ebuf);
+		pcap_freealldevs(alldevs);
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	return (((end.tv_sec - start.tv_sec) * 1e6 +
+	    (end.tv_nsec - start.tv_nsec) / 1e3) / count);
+}
+
+#define COMMAND_OPTIONS	"n:w"
+
+int
+main(int argc, char **argv)
+{
+	int op;
+	char *cp, *end;
+	int count = 100;
+	int watch = 0;
+	char ebuf[PCAP_ERRBUF_SIZE];
+	struct sigaction action;
+	struct pollfd pfd;
+	int status;
+
+	if ((cp = strrchr(argv[0], '/')) != NULL)
+		program_name = cp + 1;
+	else
+		program_name = argv[0];
+
+	opterr = 0;
+	while ((op = getopt(argc, argv, COMMAND_OPTIONS)) != -1) {
+		switch (op) {
+
+		case 'n':
+			count = (int)strtol(optarg, &end, 0);
+			if (optarg == end || *end != '\0' || count <= 0)
+				error("invalid count %s (must be > 0)",
+				    optarg);
+			break;
+
+		case 'w':
+			watch = 1;
+			break;
+
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	printf("Without the cache: %.1f us per pcap_findalldevs() call\n",
+	    time_findalldevs(count));
+	if (pcap_devcache_enable(print_event, NULL, ebuf) != 0)
+		error("pcap_devcache_enable: %s", ebuf);
+	printf("With the cache: %.1f us per pcap_findalldevs() call\n",
+	    time_findalldevs(count));
+	(void)fflush(stdout);
+
+	if (watch) {
+		action.sa_handler = stop_watching;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = 0;
+		if (sigaction(SIGINT, &action, NULL) == -1)
+			error("Can't catch SIGINT: %s\n", strerror(errno));
+
+		printf("Watching for interface changes\n");
+		(void)fflush(stdout);
+		pfd.fd = pcap_devcache_get_selectable_fd();
+		pfd.events = POLLIN;
+		while (!stop) {
+			status = poll(&pfd, 1, -1);
+			if (status == -1) {
+				if (errno == EINTR)
+					continue;
+				error("poll: %s", strerror(errno));
+			}
+			if (pcap_devcache_dispatch(ebuf) < 0)
+				error("pcap_devcache_dispatch: %s", ebuf);
+		}
+	}
+	pcap_devcache_disable();
+	exit(0);
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr, "Usage: %s [ -w ] [ -n count ]\n",
+	    program_name);
+	exit(1);
+}
+/* VARARGS */
+static void
+error(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)fprintf(stderr, "%s: ", program_name);
+	va_start(ap, fmt);
+	(void)vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (*fmt) {
+		fmt += strlen(fmt);
+		if (fmt[-1] != '\n')
+			(void)fputc('\n', stderr);
+	}
+	exit(1);
+	/* NOTREACHED */
+}
+#endif /* __linux__ */
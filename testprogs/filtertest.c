@@ -326,6 +326,7 @@ main(int argc, char **argv)
 	bool lflag = false;
 #endif
 	bool qflag = false;
+	bool cflag = false;
 	int snaplen = MAXIMUM_SNAPLEN;
 	enum {
 		NOT_SAVEFILE_FILTER,
@@ -347,13 +348,17 @@ main(int argc, char **argv)
 		program_name = argv[0];
 
 	opterr = 0;
-	while ((op = getopt(argc, argv, "hdF:gm:Os:S:lqr:")) != -1) {
+	while ((op = getopt(argc, argv, "chdF:gm:Os:S:lqr:")) != -1) {
 		switch (op) {
 
 		case 'h':
 			usage(stdout);
 			/* NOTREACHED */
 
+		case 'c':
+			cflag = true;
+			break;
+
 		case 'd':
 			++dflag;
 			break;
@@ -459,13 +464,15 @@ main(int argc, char **argv)
 			error(EX_USAGE, "-r is not compatible with -q");
 		if (Sflag != NOT_SAVEFILE_FILTER)
 			error(EX_USAGE, "-r is not compatible with -S");
-		if (snaplen != MAXIMUM_SNAPLEN)
-			error(EX_USAGE, "-r is not compatible with -s");
+		if (snaplen != MAXIMUM_SNAPLEN && ! cflag)
+			error(EX_USAGE, "-r is not compatible with -s unless -c is in use");
 
 		char errbuf[PCAP_ERRBUF_SIZE];
 		if (NULL == (pd = pcap_open_offline(insavefile, errbuf)))
 			error(EX_NOINPUT, "Failed opening: %s", errbuf);
 	} else {
+		if (cflag)
+			error(EX_USAGE, "-c requires -r");
 		// Must have at least one command-line argument for the DLT.
 		if (optind >= argc) {
 			usage(stderr);
@@ -527,7 +534,18 @@ main(int argc, char **argv)
 		exit(EX_OK);
 	}
 
-	if (pcap_compile(pd, &fcode, cmdbuf, Oflag, netmask) < 0) // cmdbuf == NULL is valid.
+	if (insavefile && snaplen != MAXIMUM_SNAPLEN) {
+		/*
+		 * Compile the filter for this snapshot length rather
+		 * than the savefile's.
+		 */
+		pcap_t *cd = pcap_open_dead(pcap_datalink(pd), snaplen);
+		if (cd == NULL)
+			error(EX_SOFTWARE, "Can't open fake pcap_t");
+		if (pcap_compile(cd, &fcode, cmdbuf, Oflag, netmask) < 0)
+			error(EX_DATAERR, "%s", pcap_geterr(cd));
+		pcap_close(cd);
+	} else if (pcap_compile(pd, &fcode, cmdbuf, Oflag, netmask) < 0) // cmdbuf == NULL is valid.
 		error(EX_DATAERR, "%s", pcap_geterr(pd));
 
 	if (!bpf_validate(fcode.bf_insns, fcode.bf_len))
@@ -550,6 +568,20 @@ main(int argc, char **argv)
 #endif
 		if (! qflag)
 			bpf_dump(&fcode, dflag);
+	} else if (cflag) {
+		struct pcap_pkthdr *h;
+		const u_char *d;
+		int ret;
+		if (pcap_setfilter(pd, &fcode) < 0)
+			error(EX_SOFTWARE, "pcap_setfilter() failed: %s", pcap_geterr(pd));
+		while (PCAP_ERROR_BREAK != (ret = pcap_next_ex(pd, &h, &d))) {
+			if (ret == PCAP_ERROR)
+				error(EX_IOERR, "pcap_next_ex() failed: %s", pcap_geterr(pd));
+			if (ret == 1)
+				printf("%u\n", h->caplen);
+			else
+				error(EX_IOERR, "pcap_next_ex() failed: %d", ret);
+		}
 	} else {
 		struct pcap_pkthdr *h;
 		const u_char *d;
@@ -591,6 +623,11 @@ usage(FILE *f)
 	    program_name);
 	(void)fprintf(f, "       (compile a filter expression, validate the program and print the\n");
 	(void)fprintf(f, "       filtering result for each packet in the specified savefile)\n");
+	(void)fprintf(f, "  or:  %s -c [-O] [-F <file>] [-m <netmask>] [-s <snaplen>] -r <file>\n",
+	    program_name);
+	(void)fprintf(f, "       [<expression>]\n");
+	(void)fprintf(f, "       (compile a filter expression, set it on the specified savefile and\n");
+	(void)fprintf(f, "       print the captured length of each packet that it delivers)\n");
 	(void)fprintf(f, "  or:  %s -h\n", program_name);
 	(void)fprintf(f, "       (print the detailed help screen)\n");
 	if (f != stdout)
@@ -598,6 +635,7 @@ usage(FILE *f)
 	(void)fprintf(f, "\nOptions specific to %s:\n", program_name);
 	(void)fprintf(f, "  <DLT>           a valid DLT name, e.g. 'EN10MB'\n");
 	(void)fprintf(f, "  <expression>    a valid filter expression, e.g. 'tcp port 80'\n");
+	(void)fprintf(f, "  -c              with -r, use pcap_setfilter(3PCAP) and print caplens\n");
 #ifdef BDEBUG
 	(void)fprintf(f, "  -g              print Graphviz dot graphs for the optimizer steps\n");
 #endif
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 1988, 1989, 1990, 1991, 1992, 1993, 1994, 1995, 1996, 1997, 2000
+ *	The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that: (1) source code distributions
+ * retain the above copyright notice and this paragraph in its entirety, (2)
+ * distributions including binary code include the above copyright notice and
+ * this paragraph in its entirety in the documentation or other materials
+ * provided with the distribution, and (3) all advertising materials mentioning
+ * features or use of this software display the following acknowledgement:
+ * ``This product includes software developed by the University of California,
+ * Lawrence Berkeley Laboratory and its contributors.'' Neither the name of
+ * the University nor the names of its contributors may be used to endorse
+ * or promote products derived from this software without specific prior
+ * written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include "varattrs.h"
+
+#ifndef lint
+static const char copyright[] _U_ =
+    "@(#) Copyright (c) 1988, 1989, 1990, 1991, 1992, 1993, 1994, 1995, 1996, 1997, 2000\n\
+The Regents of the University of California.  All rights reserved.\n";
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <pcap.h>
+
+#include "pcap/funcattrs.h"
+
+#ifndef __linux__
+int
+main(void)
+{
+	(void)fprintf(stderr, "Capture groups are only supported on Linux\n");
+	return (1);
+}
+#else /* __linux__ */
+static char *program_name;
+
+/* Forwards */
+static void PCAP_NORETURN usage(void);
+static void PCAP_NORETURN error(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+static void warning(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+static char *copy_argv(char **);
+
+#define MAX_DEVICES	64
+
+static pcap_group_t *group;
+
+static void
+stop_capture(int signum _U_)
+{
+	pcap_group_breakloop(group);
+}
+
+static void
+countme(u_char *user, const struct pcap_pkthdr *h _U_, const u_char *sp _U_)
+{
+	unsigned long long *countp = (unsigned long long *)user;
+
+	(*countp)++;
+}
+
+#define COMMAND_OPTIONS	"c:i:mt:"
+
+int
+main(int argc, char **argv)
+{
+	int op;
+	char *cp, *cmdbuf, *end;
+	char *devices[MAX_DEVICES];
+	pcap_t *pds[MAX_DEVICES];
+	unsigned long long counts[MAX_DEVICES];
+	int ndevices = 0;
+	int cnt = 64;
+	int timeout = 1000;
+	int immediate = 0;
+	unsigned long long wakeups = 0, empty_wakeups = 0;
+	struct bpf_program fcode;
+	char ebuf[PCAP_ERRBUF_SIZE];
+	struct sigaction action;
+	int i, status;
+
+	if ((cp = strrchr(argv[0], '/')) != NULL)
+		program_name = cp + 1;
+	else
+		program_name = argv[0];
+
+	opterr = 0;
+	while ((op = getopt(argc, argv, COMMAND_OPTIONS)) != -1) {
+		switch (op) {
+
+		case 'c':
+			cnt = (int)strtol(optarg, &end, 0);
+			if (optarg == end || *end != '\0' || cnt <= 0)
+				error("invalid batch count %s (must be > 0)",
+				    optarg);
+			break;
+
+		case 'i':
+			if (ndevices == MAX_DEVICES)
+				error("more than %d interfaces specified",
+				    MAX_DEVICES);
+			devices[ndevices++] = optarg;
+			break;
+
+		case 'm':
+			immediate = 1;
+			break;
+
+		case 't':
+			timeout = (int)strtol(optarg, &end, 0);
+			if (optarg == end || *end != '\0' || timeout < 0)
+				error("invalid timeout %s (must be >= 0)",
+				    optarg);
+			break;
+
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	if (ndevices == 0)
+		error("no interface specified");
+	cmdbuf = copy_argv(&argv[optind]);
+
+	group = pcap_group_create(ebuf);
+	if (group == NULL)
+		error("%s", ebuf);
+	for (i = 0; i < ndevices; i++) {
+		pds[i] = pcap_create(devices[i], ebuf);
+		if (pds[i] == NULL)
+			error("%s", ebuf);
+		status = pcap_set_timeout(pds[i], timeout);
+		if (status != 0)
+			error("%s: pcap_set_timeout failed: %s",
+			    devices[i], pcap_statustostr(status));
+		status = pcap_set_immediate_mode(pds[i], immediate);
+		if (status != 0)
+			error("%s: pcap_set_immediate_mode failed: %s",
+			    devices[i], pcap_statustostr(status));
+		status = pcap_activate(pds[i]);
+		if (status < 0)
+			error("%s: %s\n(%s)", devices[i],
+			    pcap_statustostr(status), pcap_geterr(pds[i]));
+		else if (status > 0)
+			warning("%s: %s\n(%s)", devices[i],
+			    pcap_statustostr(status), pcap_geterr(pds[i]));
+		if (cmdbuf != NULL) {
+			if (pcap_compile(pds[i], &fcode, cmdbuf, 1,
+			    PCAP_NETMASK_UNKNOWN) < 0)
+				error("%s", pcap_geterr(pds[i]));
+			if (pcap_setfilter(pds[i], &fcode) < 0)
+				error("%s", pcap_geterr(pds[i]));
+			pcap_freecode(&fcode);
+		}
+		counts[i] = 0;
+		if (pcap_group_add(group, pds[i], countme,
+		    (u_char *)&counts[i]) < 0)
+			error("%s: pcap_group_add failed: %s", devices[i],
+			    pcap_group_geterr(group));
+	}
+
+	action.sa_handler = stop_capture;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = 0;
+	if (sigaction(SIGINT, &action, NULL) == -1)
+		error("Can't catch SIGINT: %s\n", strerror(errno));
+
+	printf("Listening on %d interfaces\n", ndevices);
+	(void)fflush(stdout);
+	for (;;) {
+		/*
+		 * Wait until some handle has packets; the SIGINT
+		 * handler wakes us up.
+		 */
+		status = pcap_group_dispatch(group, cnt, -1);
+		if (status < 0)
+			break;
+		wakeups++;
+		if (status == 0)
+			empty_wakeups++;
+	}
+	if (status == PCAP_ERROR_BREAK)
+		printf("Broken out of loop from SIGINT handler\n");
+	for (i = 0; i < ndevices; i++)
+		printf("%s: %llu packets\n", devices[i], counts[i]);
+	printf("%llu wakeups, %llu with no packets\n", wakeups,
+	    empty_wakeups);
+	(void)fflush(stdout);
+	if (status == PCAP_ERROR) {
+		/*
+		 * Error.  Report it.
+		 */
+		(void)fprintf(stderr, "%s: pcap_group_dispatch: %s\n",
+		    program_name, pcap_group_geterr(group));
+	}
+	pcap_group_close(group);
+	for (i = 0; i < ndevices; i++)
+		pcap_close(pds[i]);
+	free(cmdbuf);
+	exit(status == PCAP_ERROR ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr, "Usage: %s [ -m ] [ -c count ] -i interface [ -i interface ... ] [ -t timeout ] [expression]\n",
+	    program_name);
+	exit(1);
+}
+/* VARARGS */
+static void
+error(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)fprintf(stderr, "%s: ", program_name);
+	va_start(ap, fmt);
+	(void)vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (*fmt) {
+		fmt += strlen(fmt);
+		if (fmt[-1] != '\n')
+			(void)fputc('\n', stderr);
+	}
+	exit(1);
+	/* NOTREACHED */
+}
+
+/* VARARGS */
+static void
+warning(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)fprintf(stderr, "%s: WARNING: ", program_name);
+	va_start(ap, fmt);
+	(void)vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (*fmt) {
+		fmt += strlen(fmt);
+		if (fmt[-1] != '\n')
+			(void)fputc('\n', stderr);
+	}
+}
+
+/*
+ * Copy arg vector into a new buffer, concatenating arguments with spaces.
+ */
+static char *
+copy_argv(char **argv)
+{
+	char **p;
+	size_t len = 0;
+	char *buf;
+	char *src, *dst;
+
+	p = argv;
+	if (*p == 0)
+		return 0;
+
+	while (*p)
+		len += strlen(*p++) + 1;
+
+	buf = (char *)malloc(len);
+	if (buf == NULL)
+		error("copy_argv: malloc");
+
+	p = argv;
+	dst = buf;
+	while ((src = *p++) != NULL) {
+		while ((*dst++ = *src++) != '\0')
+			;
+		dst[-1] = ' ';
+	}
+	dst[-1] = '\0';
+
+	return buf;
+}
+#endif /* __linux__ */
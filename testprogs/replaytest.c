@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 1988, 1989, 1990, 1991, 1992, 1993, 1994, 1995, 1996, 1997, 2000
+ *	The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that: (1) source code distributions
+ * retain the above copyright notice and this paragraph in its entirety, (2)
+ * distributions including binary code include the above copyright notice and
+ * this paragraph in its entirety in the documentation or other materials
+ * provided with the distribution, and (3) all advertising materials mentioning
+ * features or use of this software display the following acknowledgement:
+ * ``This product includes software developed by the University of California,
+ * Lawrence Berkeley Laboratory and its contributors.'' Neither the name of
+ * the University nor the names of its contributors may be used to endorse
+ * or promote products derived from this software without specific prior
+ * written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include "varattrs.h"
+
+#ifndef lint
+static const char copyright[] _U_ =
+    "@(#) Copyright (c) 1988, 1989, 1990, 1991, 1992, 1993, 1994, 1995, 1996, 1997, 2000\n\
+The Regents of the University of California.  All rights reserved.\n";
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <pcap.h>
+
+#include "pcap/funcattrs.h"
+
+#ifndef __linux__
+int
+main(void)
+{
+	(void)fprintf(stderr, "pcap_replay() is only supported on Linux\n");
+	return (1);
+}
+#else /* __linux__ */
+static char *program_name;
+
+/* Forwards */
+static void PCAP_NORETURN usage(void);
+static void PCAP_NORETURN error(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+static void warning(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+static char *copy_argv(char **);
+
+static pcap_t *pd;
+
+static void
+stop_replay(int signum _U_)
+{
+	pcap_breakloop(pd);
+}
+
+#define COMMAND_OPTIONS	"Bbi:l:pqr:s:Tt:"
+
+int
+main(int argc, char **argv)
+{
+	int op;
+	char *cp, *cmdbuf = NULL, *device = NULL, *end, *savefile = NULL;
+	double speed = 1.0;
+	int loop = 1;
+	int flags = 0;
+	int tx_buffer_size = 0;
+	int qdisc_bypass = 0;
+	pcap_t *sf;
+	struct bpf_program fcode;
+	char ebuf[PCAP_ERRBUF_SIZE];
+	struct sigaction action;
+	struct pcap_replay_stat rs;
+	int status;
+
+	if ((cp = strrchr(argv[0], '/')) != NULL)
+		program_name = cp + 1;
+	else
+		program_name = argv[0];
+
+	opterr = 0;
+	while ((op = getopt(argc, argv, COMMAND_OPTIONS)) != -1) {
+		switch (op) {
+
+		case 'B':
+			flags |= PCAP_REPLAY_BUSY_WAIT;
+			break;
+
+		case 'b':
+			flags |= PCAP_REPLAY_BPS;
+			break;
+
+		case 'i':
+			device = optarg;
+			break;
+
+		case 'l':
+			loop = (int)strtol(optarg, &end, 0);
+			if (optarg == end || *end != '\0' || loop < 0)
+				error("invalid loop count %s (must be >= 0)",
+				    optarg);
+			break;
+
+		case 'p':
+			flags |= PCAP_REPLAY_PPS;
+			break;
+
+		case 'q':
+			qdisc_bypass = 1;
+			break;
+
+		case 'r':
+			savefile = optarg;
+			break;
+
+		case 's':
+			speed = strtod(optarg, &end);
+			if (optarg == end || *end != '\0' || speed < 0)
+				error("invalid speed %s (must be >= 0)",
+				    optarg);
+			break;
+
+		case 'T':
+			flags |= PCAP_REPLAY_TXTIME;
+			break;
+
+		case 't':
+			tx_buffer_size = (int)strtol(optarg, &end, 0);
+			if (optarg == end || *end != '\0' ||
+			    tx_buffer_size < 0)
+				error("invalid transmit buffer size %s (must be >= 0)",
+				    optarg);
+			break;
+
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	if (device == NULL)
+		error("no interface specified");
+	if (savefile == NULL)
+		error("no savefile specified");
+
+	sf = pcap_open_offline_with_tstamp_precision(savefile,
+	    PCAP_TSTAMP_PRECISION_NANO, ebuf);
+	if (sf == NULL)
+		error("%s", ebuf);
+	if (optind < argc) {
+		cmdbuf = copy_argv(&argv[optind]);
+
+		if (pcap_compile(sf, &fcode, cmdbuf, 1,
+		    PCAP_NETMASK_UNKNOWN) < 0)
+			error("%s", pcap_geterr(sf));
+
+		if (pcap_setfilter(sf, &fcode) < 0)
+			error("%s", pcap_geterr(sf));
+	}
+
+	pd = pcap_create(device, ebuf);
+	if (pd == NULL)
+		error("%s", ebuf);
+	status = pcap_set_tx_buffer_size(pd, tx_buffer_size);
+	if (status != 0)
+		error("%s: pcap_set_tx_buffer_size failed: %s",
+		    device, pcap_statustostr(status));
+	status = pcap_set_qdisc_bypass(pd, qdisc_bypass);
+	if (status != 0)
+		error("%s: pcap_set_qdisc_bypass failed: %s",
+		    device, pcap_statustostr(status));
+	status = pcap_activate(pd);
+	if (status < 0)
+		error("%s: %s\n(%s)", device, pcap_statustostr(status),
+		    pcap_geterr(pd));
+	else if (status > 0)
+		warning("%s: %s\n(%s)", device, pcap_statustostr(status),
+		    pcap_geterr(pd));
+
+	action.sa_handler = stop_replay;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = 0;
+	if (sigaction(SIGINT, &action, NULL) == -1)
+		error("Can't catch SIGINT: %s\n", strerror(errno));
+
+	printf("Replaying %s on %s\n", savefile, device);
+	(void)fflush(stdout);
+	status = pcap_replay(pd, sf, speed, loop, flags, &rs);
+	if (status == PCAP_ERROR_BREAK)
+		printf("Broken out of replay from SIGINT handler\n");
+	printf("%llu packets, %llu bytes in %.6f seconds\n",
+	    (unsigned long long)rs.prs_packets,
+	    (unsigned long long)rs.prs_bytes,
+	    (double)rs.prs_elapsed_ns / 1e9);
+	printf("%.0f packets/s, %.0f bits/s\n", rs.prs_pps, rs.prs_bps);
+	printf("jitter %llu ns average, %llu ns max\n",
+	    (unsigned long long)rs.prs_jitter_avg_ns,
+	    (unsigned long long)rs.prs_jitter_max_ns);
+	(void)fflush(stdout);
+	if (status < 0 && status != PCAP_ERROR_BREAK) {
+		/*
+		 * Error.  Report it.
+		 */
+		(void)fprintf(stderr, "%s: pcap_replay: %s\n",
+		    program_name, pcap_geterr(pd));
+	}
+	pcap_close(pd);
+	pcap_close(sf);
+	if (cmdbuf != NULL) {
+		pcap_freecode(&fcode);
+		free(cmdbuf);
+	}
+	exit(status < 0 && status != PCAP_ERROR_BREAK ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr, "Usage: %s [ -BbpqT ] -i interface [ -l loop ] -r file [ -s speed ] [ -t txbufsize ] [expression]\n",
+	    program_name);
+	exit(1);
+}
+/* VARARGS */
+static void
+error(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)fprintf(stderr, "%s: ", program_name);
+	va_start(ap, fmt);
+	(void)vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (*fmt) {
+		fmt += strlen(fmt);
+		if (fmt[-1] != '\n')
+			(void)fputc('\n', stderr);
+	}
+	exit(1);
+	/* NOTREACHED */
+}
+
+/* VARARGS */
+static void
+warning(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)fprintf(stderr, "%s: WARNING: ", program_name);
+	va_start(ap, fmt);
+	(void)vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (*fmt) {
+		fmt += strlen(fmt);
+		if (fmt[-1] != '\n')
+			(void)fputc('\n', stderr);
+	}
+}
+
+/*
+ * Copy arg vector into a new buffer, concatenating arguments with spaces.
+ */
+static char *
+copy_argv(char **argv)
+{
+	char **p;
+	size_t len = 0;
+	char *buf;
+	char *src, *dst;
+
+	p = argv;
+	if (*p == 0)
+		return 0;
+
+	while (*p)
+		len += strlen(*p++) + 1;
+
+	buf = (char *)malloc(len);
+	if (buf == NULL)
+		error("copy_argv: malloc");
+
+	p = argv;
+	dst = buf;
+	while ((src = *p++) != NULL) {
+		while ((*dst++ = *src++) != '\0')
+			;
+		dst[-1] = ' ';
+	}
+	dst[-1] = '\0';
+
+	return buf;
+}
+#endif /* __linux__ */
@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 1988, 1989, 1990, 1991, 1992, 1993, 1994, 1995, 1996, 1997, 2000
+ *	The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that: (1) source code distributions
+ * retain the above copyright notice and this paragraph in its entirety, (2)
+ * distributions including binary code include the above copyright notice and
+ * this paragraph in its entirety in the documentation or other materials
+ * provided with the distribution, and (3) all advertising materials mentioning
+ * features or use of this software display the following acknowledgement:
+ * ``This product includes software developed by the University of California,
+ * Lawrence Berkeley Laboratory and its contributors.'' Neither the name of
+ * the University nor the names of its contributors may be used to endorse
+ * or promote products derived from this software without specific prior
+ * written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* for unshare() */
+#endif
+
+#include "varattrs.h"
+
+#ifndef lint
+static const char copyright[] _U_ =
+    "@(#) Copyright (c) 1988, 1989, 1990, 1991, 1992, 1993, 1994, 1995, 1996, 1997, 2000\n\
+The Regents of the University of California.  All rights reserved.\n";
+#endif
+
+/*
+ * Capture on "xdp:lo" in a network namespace of our own, so that the
+ * XDP program doesn't take the loopback traffic of the rest of the
+ * host, and check that the packets we send to ourselves show up with
+ * the right lengths, that the filter only lets the ones we asked for
+ * through, that packets that don't fit in a frame are dropped, and that
+ * pcap_inject() works.
+ *
+ * This needs to run as root; if the system can't do AF_XDP capture,
+ * or we aren't allowed to, we say so and exit with EX_UNAVAILABLE so
+ * that TESTrun can report the test as skipped rather than failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <pcap.h>
+
+#include "pcap/funcattrs.h"
+
+#ifndef __linux__
+int
+main(void)
+{
+	(void)fprintf(stderr, "AF_XDP capture is only supported on Linux\n");
+	return (1);
+}
+#else /* __linux__ */
+#include <sched.h>
+#include <time.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#ifndef AF_XDP
+#define AF_XDP		44
+#endif
+
+#define EX_UNAVAILABLE	69	/* as in <sysexits.h> */
+
+#define SNAPLEN		128
+#define PORT_WANTED	9	/* discard */
+#define PORT_OTHER	7	/* echo */
+
+/*
+ * UDP payload sizes of the packets we send to PORT_WANTED; the last one
+ * makes a packet that doesn't fit in a 2048-byte frame.
+ */
+static const size_t payload_sizes[] = { 18, 200, 1400, 3000 };
+#define NUM_PAYLOADS	(sizeof(payload_sizes) / sizeof(payload_sizes[0]))
+#define NUM_FIT		(NUM_PAYLOADS - 1)
+
+/* Ethernet + IPv4 + UDP */
+#define HDRLEN		(14 + 20 + 8)
+
+static char *program_name;
+
+/* Forwards */
+static void PCAP_NORETURN usage(void);
+static void PCAP_NORETURN error(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+static void PCAP_NORETURN unavailable(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+
+struct results {
+	u_int count;
+	int verbose;
+	struct timespec start;
+	struct pcap_pkthdr hdrs[NUM_PAYLOADS + 1];
+	u_char marker[NUM_PAYLOADS + 1];
+};
+
+static void
+bring_up_loopback(void)
+{
+	struct ifreq ifr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		error("socket: %s", strerror(errno));
+	memset(&ifr, 0, sizeof(ifr));
+	(void)strncpy(ifr.ifr_name, "lo", sizeof(ifr.ifr_name) - 1);
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr) == -1)
+		error("SIOCGIFFLAGS on lo: %s", strerror(errno));
+	ifr.ifr_flags |= IFF_UP;
+	if (ioctl(fd, SIOCSIFFLAGS, &ifr) == -1)
+		error("SIOCSIFFLAGS on lo: %s", strerror(errno));
+	(void)close(fd);
+}
+
+static void
+send_udp(int fd, u_short port, size_t len, u_char marker)
+{
+	static u_char buf[4000];
+	struct sockaddr_in sin;
+
+	memset(buf, marker, len);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (sendto(fd, buf, len, 0, (struct sockaddr *)&sin,
+	    sizeof(sin)) == -1)
+		error("sendto: %s", strerror(errno));
+}
+
+static void
+collect(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
+{
+	struct results *res = (struct results *)user;
+
+	if (res->verbose)
+		printf("%ld.%06ld len %u caplen %u\n", (long)h->ts.tv_sec,
+		    (long)h->ts.tv_usec, h->len, h->caplen);
+	if (res->count < NUM_PAYLOADS + 1) {
+		res->hdrs[res->count] = *h;
+		res->marker[res->count] =
+		    h->caplen > HDRLEN ? bytes[HDRLEN] : 0;
+	}
+	res->count++;
+}
+
+/*
+ * Build an Ethernet frame with a UDP packet to PORT_WANTED on it, for
+ * pcap_inject(); the checksums don't matter, as it never gets past
+ * the XDP program.
+ */
+static size_t
+build_frame(u_char *frame, size_t payload, u_char marker)
+{
+	size_t iplen = 20 + 8 + payload;
+
+	memset(frame, 0, HDRLEN);
+	frame[12] = 0x08;			/* ethertype IPv4 */
+	frame[14] = 0x45;			/* version 4, IHL 5 */
+	frame[16] = (u_char)(iplen >> 8);
+	frame[17] = (u_char)iplen;
+	frame[22] = 64;				/* TTL */
+	frame[23] = IPPROTO_UDP;
+	frame[26] = 127; frame[29] = 1;		/* 127.0.0.1 */
+	frame[30] = 127; frame[33] = 1;		/* 127.0.0.1 */
+	frame[34] = 0x04; frame[35] = 0xd2;	/* sport 1234 */
+	frame[36] = 0; frame[37] = PORT_WANTED;
+	frame[38] = (u_char)((8 + payload) >> 8);
+	frame[39] = (u_char)(8 + payload);
+	memset(frame + HDRLEN, marker, payload);
+	return (HDRLEN + payload);
+}
+
+/*
+ * Read until we have "want" packets, or we've waited for 2 seconds.
+ */
+static void
+read_packets(pcap_t *pd, struct results *res, u_int want)
+{
+	struct timespec now;
+	int status;
+
+	for (;;) {
+		status = pcap_dispatch(pd, -1, collect, (u_char *)res);
+		if (status < 0)
+			error("pcap_dispatch: %s", pcap_geterr(pd));
+		if (res->count >= want)
+			return;
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - res->start.tv_sec > 2)
+			return;
+	}
+}
+
+static int
+check_packet(const struct results *res, u_int i, size_t payload,
+    u_char marker, const struct timeval *before, const struct timeval *after)
+{
+	const struct pcap_pkthdr *h = &res->hdrs[i];
+	u_int len = (u_int)(HDRLEN + payload);
+	u_int caplen = len < SNAPLEN ? len : SNAPLEN;
+	int ok = 1;
+
+	if (h->len != len || h->caplen != caplen) {
+		printf("FAIL: packet %u: len %u caplen %u, expected len %u caplen %u\n",
+		    i + 1, h->len, h->caplen, len, caplen);
+		ok = 0;
+	}
+	if (res->marker[i] != marker) {
+		printf("FAIL: packet %u: payload 0x%02x, expected 0x%02x\n",
+		    i + 1, res->marker[i], marker);
+		ok = 0;
+	}
+	if (timercmp(&h->ts, before, <) || timercmp(&h->ts, after, >)) {
+		printf("FAIL: packet %u: time stamp %ld.%06ld outside [%ld.%06ld, %ld.%06ld]\n",
+		    i + 1, (long)h->ts.tv_sec, (long)h->ts.tv_usec,
+		    (long)before->tv_sec, (long)before->tv_usec,
+		    (long)after->tv_sec, (long)after->tv_usec);
+		ok = 0;
+	}
+	return (ok);
+}
+
+#define COMMAND_OPTIONS	"hv"
+
+int
+main(int argc, char **argv)
+{
+	int op;
+	char *cp;
+	int verbose = 0;
+	pcap_t *pd;
+	struct bpf_program fcode;
+	char ebuf[PCAP_ERRBUF_SIZE];
+	char filter[64];
+	u_char frame[HDRLEN + 64];
+	size_t framelen;
+	struct results res;
+	struct pcap_stat ps;
+	struct timeval before, after;
+	u_int i;
+	int fd, status, ok = 1;
+
+	if ((cp = strrchr(argv[0], '/')) != NULL)
+		program_name = cp + 1;
+	else
+		program_name = argv[0];
+
+	opterr = 0;
+	while ((op = getopt(argc, argv, COMMAND_OPTIONS)) != -1) {
+		switch (op) {
+
+		case 'h':
+			printf("Usage: %s [ -v ]\n", program_name);
+			exit(0);
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	if (geteuid() != 0)
+		unavailable("not running as root");
+	if (unshare(CLONE_NEWNET) == -1)
+		unavailable("can't create a network namespace: %s",
+		    strerror(errno));
+	fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (fd == -1)
+		unavailable("can't create an AF_XDP socket: %s",
+		    strerror(errno));
+	(void)close(fd);
+	bring_up_loopback();
+
+	pd = pcap_create("xdp:lo", ebuf);
+	if (pd == NULL)
+		error("%s", ebuf);
+	if (pcap_set_snaplen(pd, SNAPLEN) != 0 ||
+	    pcap_set_timeout(pd, 100) != 0)
+		error("can't set options on xdp:lo");
+	status = pcap_activate(pd);
+	if (status == PCAP_ERROR_NO_SUCH_DEVICE ||
+	    status == PCAP_ERROR_PERM_DENIED)
+		unavailable("xdp:lo: %s (%s)", pcap_statustostr(status),
+		    pcap_geterr(pd));
+	if (status < 0)
+		error("xdp:lo: %s (%s)", pcap_statustostr(status),
+		    pcap_geterr(pd));
+	if (pcap_datalink(pd) != DLT_EN10MB)
+		error("xdp:lo: link-layer header type %d, expected %d",
+		    pcap_datalink(pd), DLT_EN10MB);
+
+	snprintf(filter, sizeof(filter), "udp dst port %d", PORT_WANTED);
+	if (pcap_compile(pd, &fcode, filter, 1, PCAP_NETMASK_UNKNOWN) < 0)
+		error("%s", pcap_geterr(pd));
+	if (pcap_setfilter(pd, &fcode) < 0)
+		error("%s", pcap_geterr(pd));
+	pcap_freecode(&fcode);
+
+	/*
+	 * Send the packets the filter wants, with one it doesn't want
+	 * after each of them.
+	 */
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		error("socket: %s", strerror(errno));
+	memset(&res, 0, sizeof(res));
+	res.verbose = verbose;
+	(void)gettimeofday(&before, NULL);
+	(void)clock_gettime(CLOCK_MONOTONIC, &res.start);
+	for (i = 0; i < NUM_PAYLOADS; i++) {
+		send_udp(fd, PORT_WANTED, payload_sizes[i], (u_char)('a' + i));
+		send_udp(fd, PORT_OTHER, payload_sizes[i], 'x');
+	}
+	(void)close(fd);
+
+	read_packets(pd, &res, NUM_FIT);
+	(void)gettimeofday(&after, NULL);
+	if (res.count != NUM_FIT) {
+		printf("FAIL: got %u packets, expected %u\n", res.count,
+		    (u_int)NUM_FIT);
+		ok = 0;
+	}
+	for (i = 0; i < NUM_FIT && i < res.count; i++)
+		ok &= check_packet(&res, i, payload_sizes[i],
+		    (u_char)('a' + i), &before, &after);
+
+	if (pcap_stats(pd, &ps) < 0)
+		error("pcap_stats: %s", pcap_geterr(pd));
+	if (verbose)
+		printf("ps_recv %u ps_drop %u\n", ps.ps_recv, ps.ps_drop);
+	if (ps.ps_recv < 2 * NUM_FIT) {
+		printf("FAIL: ps_recv %u, expected at least %u\n", ps.ps_recv,
+		    (u_int)(2 * NUM_FIT));
+		ok = 0;
+	}
+	if (ps.ps_drop < 2) {
+		/* The oversized packet to each port. */
+		printf("FAIL: ps_drop %u, expected at least 2\n", ps.ps_drop);
+		ok = 0;
+	}
+
+	/*
+	 * A packet we inject goes out on lo, comes back in, and gets
+	 * handed to us by the XDP program.
+	 */
+	framelen = build_frame(frame, 22, 'i');
+	if (pcap_inject(pd, frame, framelen) != (int)framelen)
+		error("pcap_inject: %s", pcap_geterr(pd));
+	memset(&res, 0, sizeof(res));
+	res.verbose = verbose;
+	(void)clock_gettime(CLOCK_MONOTONIC, &res.start);
+	read_packets(pd, &res, 1);
+	(void)gettimeofday(&after, NULL);
+	if (res.count != 1) {
+		printf("FAIL: got %u injected packets, expected 1\n",
+		    res.count);
+		ok = 0;
+	} else
+		ok &= check_packet(&res, 0, framelen - HDRLEN, 'i', &before,
+		    &after);
+
+	pcap_close(pd);
+	if (!ok)
+		exit(1);
+	printf("OK\n");
+	exit(0);
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr, "Usage: %s [ -v ]\n", program_name);
+	exit(1);
+}
+
+/* VARARGS */
+static void
+error(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)fprintf(stderr, "%s: ", program_name);
+	va_start(ap, fmt);
+	(void)vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (*fmt) {
+		fmt += strlen(fmt);
+		if (fmt[-1] != '\n')
+			(void)fputc('\n', stderr);
+	}
+	exit(1);
+	/* NOTREACHED */
+}
+
+/* VARARGS */
+static void
+unavailable(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)printf("SKIPPED: ");
+	va_start(ap, fmt);
+	(void)vprintf(fmt, ap);
+	va_end(ap);
+	(void)putchar('\n');
+	exit(EX_UNAVAILABLE);
+	/* NOTREACHED */
+}
+#endif /* __linux__ */